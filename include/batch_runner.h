@@ -0,0 +1,103 @@
+/**
+ * @file batch_runner.h Runs batches of independent jobs concurrently
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef BATCH_RUNNER_H_
+#define BATCH_RUNNER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include "threadpool.h"
+#include "utils.h"
+
+// Runs the jobs in a batch (such as the reads for each of the IRSs an RTR
+// needs) concurrently, on its own thread pool, and waits for them all to
+// finish.
+//
+// The calling thread runs jobs too, and never waits for a pool thread that
+// hasn't picked up a job, so a batch always completes even if every pool
+// thread is busy with other batches (including ones that the jobs in this
+// batch started).
+class BatchRunner
+{
+public:
+  // Runs jobs on up to num_threads pool threads, plus the calling thread
+  BatchRunner(int num_threads, ExceptionHandler* exception_handler);
+
+  virtual ~BatchRunner();
+
+  // A job, given its index in the batch
+  typedef std::function<void(size_t)> Job;
+
+  // Run job for every index from 0 to num_jobs - 1, with at most
+  // max_parallel jobs running at once, and return once they've all run.
+  // max_parallel includes the calling thread, so 1 runs the batch serially
+  // on it.
+  void run(size_t num_jobs, Job job, size_t max_parallel);
+
+  // A job that's timed, given its index in the batch and a StopWatch that's
+  // running while it runs (which it may pause, e.g. while waiting for I/O)
+  typedef std::function<void(size_t, Utils::StopWatch*)> TimedJob;
+
+  // Run a batch as above, timing each job, and return the longest total time
+  // (in microseconds) that any one thread spent running the batch's jobs.
+  // That's how long the batch took to process, as the threads run their
+  // jobs one after another but alongside each other.
+  unsigned long run_timed(size_t num_jobs, TimedJob job, size_t max_parallel);
+
+private:
+  // The state shared between the threads running a batch. It outlives the
+  // batch, as pool threads may only pick it up after the batch is finished.
+  struct Batch
+  {
+    Batch(size_t num_jobs, TimedJob job, bool timed) :
+      job(job),
+      timed(timed),
+      num_jobs(num_jobs),
+      next_job(0),
+      num_finished(0),
+      max_thread_time(0)
+    {
+    }
+
+    TimedJob job;
+    bool timed;
+    size_t num_jobs;
+    std::atomic<size_t> next_job;
+
+    std::mutex lock;
+    std::condition_variable cond;
+    size_t num_finished;
+
+    // The longest time any thread has spent running jobs so far
+    unsigned long max_thread_time;
+  };
+
+  // Run the batch on the pool threads and the calling thread, and wait for
+  // it to finish
+  void run_batch(std::shared_ptr<Batch> batch, size_t max_parallel);
+
+  // Run jobs from the batch until there are none left
+  static void run_jobs(std::shared_ptr<Batch> batch);
+
+  // Dummy exception handler callback for the thread pool
+  static void inline exception_callback(std::function<void()> callable)
+  {
+  }
+
+  FunctorThreadPool _thread_pool;
+  const size_t _num_threads;
+};
+
+#endif
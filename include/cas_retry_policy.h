@@ -0,0 +1,146 @@
+/**
+ * @file cas_retry_policy.h Backoff and limits for retrying writes to the IMPU
+ * stores that hit contention
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef CAS_RETRY_POLICY_H_
+#define CAS_RETRY_POLICY_H_
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "snmp_counter_table.h"
+#include "snmp_event_accumulator_table.h"
+
+// Decides whether, and when, to retry a CAS write to the IMPU store that
+// failed with DATA_CONTENTION.
+//
+// Each retry of a key waits for a random time up to a limit that doubles with
+// every retry (starting at min_backoff_us and capped at max_backoff_us), so
+// that Homesteads fighting over a key spread their retries out rather than
+// colliding again. A key is retried at most max_retries times, after which
+// the write fails, so a hot key can't tie up a thread indefinitely.
+//
+// It also counts the contention on each table, and keeps track of the most
+// contended keys (approximately, in a fixed amount of memory). These can also
+// be reported in SNMP tables.
+//
+// It is safe to use from multiple threads.
+class CasRetryPolicy
+{
+public:
+  enum Table
+  {
+    IMPU,
+    IMPI_MAPPING,
+    NUM_TABLES
+  };
+
+  CasRetryPolicy(int max_retries,
+                 uint64_t min_backoff_us,
+                 uint64_t max_backoff_us,
+                 size_t num_hot_keys = DEFAULT_HOT_KEYS);
+
+  // Locks held while writing a key (such as KeyLockTable::Locks)
+  typedef std::vector<std::unique_lock<std::mutex>> Locks;
+
+  // Called when a write of this key hits contention. retries is the number of
+  // times the write has been retried so far, and should start at 0.
+  //
+  // Returns true, having backed off and incremented retries, if the write
+  // should be retried, or false if it's been retried enough times already.
+  //
+  // If locks are given, they're released while we back off, so that other
+  // threads needing them aren't held up, and taken again (in the same order)
+  // before we return.
+  bool should_retry(Table table,
+                    const std::string& key,
+                    int& retries,
+                    Locks* locks = nullptr);
+
+  struct Stats
+  {
+    // Writes that hit contention
+    uint64_t contentions;
+
+    // Writes that were retried, and that we gave up on
+    uint64_t retries;
+    uint64_t exhausted;
+
+    // Total time spent backing off
+    uint64_t backoff_us;
+  };
+
+  Stats get_stats(Table table);
+
+  struct HotKey
+  {
+    Table table;
+    std::string key;
+
+    // An upper bound on the number of times writes of this key hit
+    // contention. It may be an overestimate for keys that started being
+    // tracked after others were dropped.
+    uint64_t contentions;
+  };
+
+  // The most contended keys, most contended first
+  std::vector<HotKey> get_hot_keys();
+
+  static const char* table_name(Table table);
+
+  // Also report contention in the given tables, across both tables of the
+  // store:
+  //  - contentions_table counts writes that hit contention
+  //  - exhausted_table counts writes we gave up on
+  //  - backoff_table has the time each retry backed off for
+  //  - hot_key_table has, for each write that hits contention, the number of
+  //    times its key has hit contention, so its high water mark tracks the
+  //    most contended key (which get_hot_keys names)
+  void configure_stats_tables(SNMP::CounterTable* contentions_table,
+                              SNMP::CounterTable* exhausted_table,
+                              SNMP::EventAccumulatorTable* backoff_table,
+                              SNMP::EventAccumulatorTable* hot_key_table);
+
+  static const int DEFAULT_MAX_RETRIES = 10;
+  static const size_t DEFAULT_HOT_KEYS = 32;
+
+private:
+  // How long to back off for before the given retry
+  uint64_t backoff_us(int retries);
+
+  // Count contention on a key, returning the key's count. Must be called
+  // with the lock held.
+  uint64_t record_hot_key(Table table, const std::string& key);
+
+  const int _max_retries;
+  const uint64_t _min_backoff_us;
+  const uint64_t _max_backoff_us;
+  const size_t _num_hot_keys;
+
+  std::mutex _lock;
+  Stats _stats[NUM_TABLES];
+
+  // The tracked keys for each table, and their counts. Once there are
+  // _num_hot_keys keys in total, a new key replaces the least contended one
+  // and inherits its count (the "space saving" algorithm), so keys that are
+  // contended often stay tracked.
+  std::unordered_map<std::string, uint64_t> _hot_keys[NUM_TABLES];
+  size_t _num_tracked;
+
+  SNMP::CounterTable* _contentions_tbl;
+  SNMP::CounterTable* _exhausted_tbl;
+  SNMP::EventAccumulatorTable* _backoff_tbl;
+  SNMP::EventAccumulatorTable* _hot_key_tbl;
+};
+
+#endif
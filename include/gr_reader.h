@@ -0,0 +1,352 @@
+/**
+ * @file gr_reader.h Hedged reads from the IMPU stores at remote sites
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef GR_READER_H_
+#define GR_READER_H_
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "impu_store.h"
+#include "remote_read_stats.h"
+#include "threadpool.h"
+#include "utils.h"
+
+// Create an IOHook that pauses the StopWatch while doing network I/O. Hooks
+// are thread local, so this must be called on the thread doing the I/O.
+Utils::IOHook* create_hook(Utils::StopWatch* stopwatch);
+
+// Reads data that wasn't found locally from the IMPU stores at the remote
+// sites, on a thread pool.
+//
+// The sites are read fastest first, moving on to the next site once the
+// previous one has had its hedging delay (see RemoteReadStats) to answer, or
+// as soon as a read fails. The caller waits out the hedging delays, and
+// only hands a read to the thread pool once it's due. The first site to find
+// the data wins, and we return straight away. Reads that haven't started by
+// then are abandoned, and the answers to reads that have are thrown away.
+//
+// Any kind of data can be read, by passing in how to get it from a store.
+class GrReader
+{
+public:
+  GrReader(FunctorThreadPool& thread_pool,
+           const std::vector<ImpuStore*>& stores,
+           uint64_t max_hedge_delay_us) :
+    _thread_pool(thread_pool),
+    _stores(stores),
+    _stats(stores.size(), max_hedge_delay_us)
+  {
+  }
+
+  // Gets the data from a store
+  template <class T>
+  using Getter = std::function<Store::Status(ImpuStore*, T*&)>;
+
+  // Copies the winning data, so that it can be repaired after it's been
+  // handed over to the caller
+  template <class T>
+  using Copier = std::function<T*(T&)>;
+
+  // Called with the copy, on the thread that read the winning data, after
+  // the caller has been given it. Takes ownership of the copy.
+  template <class T>
+  using Repairer = std::function<void(T*)>;
+
+  // Read the data from the remote stores. Returns OK and sets out if any
+  // store finds the data, or NOT_FOUND (leaving out alone) if none do.
+  //
+  // If repair is set, it's called with a copy of the data found (made by
+  // copy).
+  //
+  // If a StopWatch is provided, it is paused while we wait for the remote
+  // stores, and the time the winning read spent other than on I/O is added
+  // on (or the longest such time, if no store finds the data).
+  //
+  // If absent is given, it's set to whether every store answered NOT_FOUND,
+  // rather than any of them failing.
+  template <class T>
+  Store::Status read(Getter<T> get,
+                     Copier<T> copy,
+                     Repairer<T> repair,
+                     T*& out,
+                     Utils::StopWatch* stopwatch,
+                     bool* absent = nullptr);
+
+  size_t num_sites() const { return _stores.size(); }
+
+  RemoteReadStats& stats() { return _stats; }
+
+private:
+  // The state shared between a read and the threads reading from each
+  // store. It outlives the read, as the threads reading from slower stores
+  // may still be running when it returns.
+  template <class T>
+  struct State
+  {
+    std::mutex lock;
+    std::condition_variable cond;
+
+    // The data from the first store to find it, and the time that store
+    // spent on the read other than I/O
+    T* data = nullptr;
+    unsigned long winner_time = 0L;
+
+    // The longest time any store spent on the read other than I/O, for when
+    // no store finds the data
+    unsigned long max_time = 0L;
+
+    size_t num_finished = 0;
+    size_t num_failed = 0;
+    size_t num_not_found = 0;
+
+    bool won() const { return data != nullptr; }
+  };
+
+  // Read the data from one store. If timed is set, the time spent on the
+  // read other than I/O is recorded in the state.
+  template <class T>
+  static void read_from_store(std::shared_ptr<State<T>> state,
+                              size_t site,
+                              ImpuStore* store,
+                              RemoteReadStats* stats,
+                              Getter<T> get,
+                              Copier<T> copy,
+                              Repairer<T> repair,
+                              bool timed);
+
+  FunctorThreadPool& _thread_pool;
+  std::vector<ImpuStore*> _stores;
+  RemoteReadStats _stats;
+};
+
+template <class T>
+Store::Status GrReader::read(Getter<T> get,
+                             Copier<T> copy,
+                             Repairer<T> repair,
+                             T*& out,
+                             Utils::StopWatch* stopwatch,
+                             bool* absent)
+{
+  if (absent)
+  {
+    *absent = false;
+  }
+
+  if (_stores.empty())
+  {
+    if (absent)
+    {
+      *absent = true;
+    }
+
+    return Store::Status::NOT_FOUND;
+  }
+
+  // Work out when each store is due to be read: once the stores ahead of it
+  // have had their hedging delays to answer in
+  std::vector<size_t> order = _stats.order();
+  std::vector<std::chrono::steady_clock::time_point> start_at;
+  std::chrono::steady_clock::time_point start_time =
+    std::chrono::steady_clock::now();
+  uint64_t start_delay_us = 0;
+
+  for (size_t site : order)
+  {
+    start_at.push_back(start_time + std::chrono::microseconds(start_delay_us));
+    start_delay_us += _stats.hedge_delay_us(site);
+  }
+
+  if (stopwatch)
+  {
+    // Stop the main StopWatch while we wait for the remote reads to complete.
+    // We'll later add on the time we spent processing these, minus I/O time
+    stopwatch->stop();
+  }
+
+  std::shared_ptr<State<T>> state = std::make_shared<State<T>>();
+  RemoteReadStats* stats = &_stats;
+  bool timed = (stopwatch != nullptr);
+  size_t num_started = 0;
+
+  Store::Status status = Store::Status::NOT_FOUND;
+  unsigned long remote_time_to_add = 0L;
+
+  {
+    // We hand each read to the thread pool once it's due, or as soon as all
+    // the reads started so far have failed, waiting here in between. That
+    // way the pool's threads are only used for reads that have started.
+    std::unique_lock<std::mutex> lock(state->lock);
+
+    while ((!state->won()) &&
+           ((num_started < order.size()) ||
+            (state->num_finished < num_started)))
+    {
+      if (num_started == order.size())
+      {
+        state->cond.wait(lock);
+      }
+      else if ((state->num_failed == num_started) ||
+               (std::chrono::steady_clock::now() >= start_at[num_started]))
+      {
+        size_t site = order[num_started];
+        ImpuStore* store = _stores[site];
+        num_started++;
+
+        lock.unlock();
+        _thread_pool.add_work([state, site, store, stats, get, copy, repair, timed]()->void
+        {
+          read_from_store<T>(state,
+                             site,
+                             store,
+                             stats,
+                             get,
+                             copy,
+                             repair,
+                             timed);
+        });
+        lock.lock();
+      }
+      else
+      {
+        state->cond.wait_until(lock, start_at[num_started]);
+      }
+    }
+
+    if (state->won())
+    {
+      out = state->data;
+      status = Store::Status::OK;
+      remote_time_to_add = state->winner_time;
+    }
+    else
+    {
+      // Want to choose whichever request took the longest to add to our
+      // stopwatch time
+      remote_time_to_add = state->max_time;
+
+      if (absent)
+      {
+        *absent = (state->num_not_found == order.size());
+      }
+    }
+  }
+
+  // Another store found the data before the rest were due to be read
+  for (size_t rank = num_started; rank < order.size(); rank++)
+  {
+    _stats.record(order[rank], RemoteReadStats::ABANDONED, 0);
+  }
+
+  // Restart the StopWatch
+  if (stopwatch)
+  {
+    stopwatch->start();
+    stopwatch->add_time(remote_time_to_add);
+  }
+
+  return status;
+}
+
+template <class T>
+void GrReader::read_from_store(std::shared_ptr<State<T>> state,
+                               size_t site,
+                               ImpuStore* store,
+                               RemoteReadStats* stats,
+                               Getter<T> get,
+                               Copier<T> copy,
+                               Repairer<T> repair,
+                               bool timed)
+{
+  // If we're timing the read, we need a StopWatch of our own, started now
+  // so that it doesn't count the time spent waiting for a thread, and an
+  // IOHook so that it will pause when we're doing network I/O
+  Utils::StopWatch stopwatch;
+  Utils::IOHook* hook = nullptr;
+  if (timed)
+  {
+    stopwatch.start();
+    hook = create_hook(&stopwatch);
+  }
+
+  std::chrono::steady_clock::time_point read_start =
+    std::chrono::steady_clock::now();
+  T* data = nullptr;
+  Store::Status status = get(store, data);
+  uint64_t latency_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                          std::chrono::steady_clock::now() - read_start).count();
+  unsigned long time = 0L;
+
+  if (timed)
+  {
+    delete hook;
+    stopwatch.read(time);
+  }
+
+  RemoteReadStats::Outcome outcome;
+  T* repair_data = nullptr;
+
+  {
+    std::lock_guard<std::mutex> lock(state->lock);
+
+    state->max_time = std::max(state->max_time, time);
+
+    if (status != Store::Status::OK)
+    {
+      outcome = RemoteReadStats::FAILED;
+      state->num_failed++;
+
+      if (status == Store::Status::NOT_FOUND)
+      {
+        state->num_not_found++;
+      }
+    }
+    else if (state->won())
+    {
+      outcome = RemoteReadStats::LOST;
+    }
+    else
+    {
+      outcome = RemoteReadStats::WON;
+
+      // The caller owns the data once we've handed it over, so take our own
+      // copy to repair with
+      if (repair)
+      {
+        repair_data = copy(*data);
+      }
+
+      state->data = data;
+      state->winner_time = time;
+      data = nullptr;
+    }
+
+    state->num_finished++;
+    state->cond.notify_all();
+  }
+
+  // We only keep the winning data
+  delete data;
+
+  stats->record(site, outcome, latency_us);
+
+  if (repair_data)
+  {
+    repair(repair_data);
+  }
+}
+
+#endif
@@ -12,6 +12,7 @@
 #define HSS_CACHE_PROCESSOR_H_
 
 #include "hss_cache.h"
+#include "irs_read_coalescer.h"
 #include "threadpool.h"
 #include "ims_subscription.h"
 #include "sas.h"
@@ -37,6 +38,12 @@ public:
                      unsigned int max_queue,
                      SNMP::EventAccumulatorByScopeTable* queue_size_table);
 
+  // Sets the table that requests answered by sharing a read are counted in
+  void configure_stats_tables(SNMP::CounterTable* coalesced_gets_table)
+  {
+    _irs_reads.configure_stats_tables(coalesced_gets_table);
+  }
+
   // Stops the threadpool
   void stop();
 
@@ -78,6 +85,11 @@ public:
   // ---------------------------------------------------------------------------
 
   // Get the IRS for a given impu
+  //
+  // Concurrent requests for the same IMPU share a single read from the cache,
+  // and each is given its own copy of the IRS. A request only joins a read
+  // that started after any IRS write that had made progress before it
+  // arrived, so it never sees an IRS from before a write it could know about.
   virtual void get_implicit_registration_set_for_impu(irs_success_callback success_cb,
                                                       failure_callback failure_cb,
                                                       std::string impu,
@@ -143,7 +155,15 @@ public:
                                     SAS::TrailId trail,
                                     Utils::StopWatch* stopwatch);
 
+  // The number of requests for an IRS that were answered by sharing a read
+  // already in progress for the same IMPU
+  uint64_t get_coalesced_gets() const { return _irs_reads.get_coalesced_gets(); }
+
 private:
+  // Wrap a progress callback so that it notes that IRSs have been written
+  // before calling it
+  progress_callback written_progress_callback(progress_callback progress_cb);
+
   // Dummy exception handler callback for the thread pool
   static void inline exception_callback(std::function<void()> callable)
   {
@@ -154,6 +174,10 @@ private:
 
   // The threadpool on which the requests are run.
   FunctorThreadPool* _thread_pool;
+
+  // The IRS reads in progress, which concurrent requests for the same IMPU
+  // share
+  IrsReadCoalescer _irs_reads;
 };
 
 #endif
@@ -45,6 +45,10 @@ public:
   virtual void delete_associated_impi(const std::string& impi) = 0;
   virtual void set_charging_addresses(const ChargingAddresses& addresses) = 0;
   virtual void set_ttl(int32_t ttl) = 0;
+
+  // Create a copy of this IRS, which can be changed and written
+  // independently of it
+  virtual ImplicitRegistrationSet* clone() const = 0;
 };
 
 #endif
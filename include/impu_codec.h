@@ -0,0 +1,61 @@
+/**
+ * @file impu_codec.h Codecs for compressing IMPU records
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef IMPU_CODEC_H_
+#define IMPU_CODEC_H_
+
+#include <cstdint>
+#include <string>
+
+// A codec that IMPU records can be compressed with. Version 1 records carry
+// the ID of their codec in the header, so each record can use a different
+// codec, and the registry below lets the reader find the right one.
+class ImpuCodec
+{
+public:
+  // The codec IDs stored in the record header. These must never be reused.
+  enum Id
+  {
+    // No compression - cheapest for records too small to compress well
+    RAW = 0,
+
+    // LZ4, as used by version 0 records
+    LZ4 = 1,
+
+    // Deflate (zlib) with a preset dictionary - slower than LZ4, but
+    // compresses large service profiles noticeably better
+    DEFLATE = 2
+  };
+
+  virtual ~ImpuCodec() {}
+
+  virtual const char* name() const = 0;
+
+  // Compress data using the given (loaded) dictionary, appending the result to
+  // compressed.
+  virtual bool compress(const std::string& data,
+                        uint8_t dictionary_id,
+                        std::string& compressed) = 0;
+
+  // Decompress size bytes of compressed data, using the given (loaded)
+  // dictionary, into uncompressed. uncompressed must already be sized to
+  // the expected length, and anything other than exactly that much data is a
+  // failure.
+  virtual bool decompress(const char* compressed,
+                          size_t size,
+                          uint8_t dictionary_id,
+                          std::string& uncompressed) = 0;
+
+  // Returns the codec with the given ID, or nullptr if there isn't one.
+  static ImpuCodec* get(uint8_t id);
+};
+
+#endif
@@ -0,0 +1,31 @@
+/**
+ * @file impu_dictionary.h Training of IMPU compression dictionaries
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef IMPU_DICTIONARY_H_
+#define IMPU_DICTIONARY_H_
+
+#include <string>
+#include <vector>
+
+namespace ImpuDictionary
+{
+  // Train a compression dictionary of at most max_size bytes from a set of
+  // sampled (uncompressed) IMPU records.
+  //
+  // The dictionary is built from the segments of the samples that cover the
+  // most commonly occurring k-mers, counting each k-mer once per sample so
+  // that a single unusually large record can't dominate. The most valuable
+  // segments are placed at the end of the dictionary, closest to the data
+  // being compressed.
+  std::string train(const std::vector<std::string>& samples, size_t max_size);
+}
+
+#endif
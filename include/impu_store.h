@@ -13,9 +13,11 @@
 
 #include "charging_addresses.h"
 #include "reg_state.h"
+#include "shared_profile_cache.h"
 #include "store.h"
 
 #include <algorithm>
+#include <map>
 #include <rapidjson/document.h>
 #include <rapidjson/writer.h>
 #include <lz4.h>
@@ -43,14 +45,223 @@ uint64_t decode_varbyte(const std::string& data, size_t& offset);
 class ImpuStore
 {
 public:
+  // The formats that IMPUs can be written to the store in. Every format can
+  // always be read, so a deployment can be moved onto a newer format once all
+  // of its nodes have been upgraded to understand it.
+  enum class ImpuFormat
+  {
+    // Version 0 - LZ4 compressed JSON
+    V0 = 0,
+
+    // Version 1 - LZ4 compressed binary, with length prefixed fields and front
+    // coded identity lists
+    V1 = 1,
+
+    // Version 2 - as version 1, but with the service profile compressed
+    // separately after the rest of the record, so that reading an IMPU only
+    // decompresses its service profile if it's asked for
+    V2 = 2
+  };
+
+  // Version 1 records carry the ID of the dictionary they were compressed
+  // with in a single byte.
+  static const int MAX_DICTIONARIES = 256;
+
+  // LZ4 only ever refers back 64KB, so any more dictionary than that is wasted.
+  static const size_t MAX_DICTIONARY_LEN = 65536;
+
+  // Policy for picking the codec to compress each version 1 IMPU with, based
+  // on its uncompressed size. This lets a deployment trade CPU for memcached
+  // memory. The default is to LZ4 compress everything, as version 0 does.
+  struct CodecPolicy
+  {
+    CodecPolicy(size_t raw_max_size = 0, size_t deflate_min_size = 0) :
+      raw_max_size(raw_max_size),
+      deflate_min_size(deflate_min_size)
+    {
+    }
+
+    // Records no bigger than this are stored raw, as compressing them costs
+    // more than it saves. 0 to never store records raw.
+    size_t raw_max_size;
+
+    // Records at least this big (typically those with large service
+    // profiles) are compressed with deflate, which is slower but tighter than
+    // LZ4. 0 to never use deflate.
+    size_t deflate_min_size;
+
+    uint8_t select_codec(size_t size) const;
+  };
+
+  // The service profile of a Default IMPU. A profile read from a version 2
+  // record is kept compressed until it's first read, as most users of an IMPU
+  // never look at its service profile. Like the IMPUs that hold them, these
+  // aren't safe to share between threads.
+  //
+  // A profile can also be shared - stored once in the store under a
+  // reference derived from its content, with IMPUs holding just the
+  // reference. ImpuStore resolves the reference when it reads the IMPU.
+  class ServiceProfile
+  {
+  public:
+    ServiceProfile(const std::string& xml = "") :
+      _xml(xml),
+      _inflated(true),
+      _dictionary_id(0),
+      _codec_id(0),
+      _length(0),
+      _resolved(true)
+    {
+    }
+
+    // Create a service profile from compressed data
+    ServiceProfile(const char* compressed,
+                   size_t compressed_len,
+                   uint8_t dictionary_id,
+                   uint8_t codec_id,
+                   size_t length) :
+      _inflated(false),
+      _compressed(compressed, compressed_len),
+      _dictionary_id(dictionary_id),
+      _codec_id(codec_id),
+      _length(length),
+      _resolved(true)
+    {
+    }
+
+    // Create an unresolved reference to a shared service profile
+    static ServiceProfile shared(const std::string& reference)
+    {
+      ServiceProfile service_profile;
+      service_profile._reference = reference;
+      service_profile._resolved = false;
+      return service_profile;
+    }
+
+    // The reference to this profile, if it's shared (empty otherwise)
+    const std::string& reference() const { return _reference; }
+    bool is_shared() const { return !_reference.empty(); }
+
+    // A shared profile is unresolved until ImpuStore has read it from the
+    // store, and reads as empty until then.
+    bool is_resolved() const { return _resolved; }
+
+    // Mark this profile as shared under the given reference, or as not shared
+    // if the reference is empty.
+    void set_reference(const std::string& reference)
+    {
+      _reference = reference;
+    }
+
+    // Get the XML, decompressing it if this is the first time it's been read.
+    // A profile that can't be decompressed reads as empty, but is still
+    // written back out as it was read.
+    const std::string& get() const;
+
+    bool is_inflated() const { return _inflated; }
+
+    // Whether the profile failed to decompress, decompressing it if it hasn't
+    // been already
+    bool is_corrupt() const { return get().empty() && !_compressed.empty(); }
+
+    // Append the service profile section of a version 2 record, compressed
+    // with the given dictionary. A profile that is still held compressed with
+    // that dictionary is copied across without being decompressed. Returns
+    // false if the profile needs recompressing but couldn't be decompressed.
+    bool write_section(std::string& data,
+                       uint8_t dictionary_id,
+                       const CodecPolicy& policy) const;
+
+  private:
+    mutable std::string _xml;
+    mutable bool _inflated;
+    mutable std::string _compressed;
+    uint8_t _dictionary_id;
+    uint8_t _codec_id;
+    size_t _length;
+    std::string _reference;
+    bool _resolved;
+  };
+
+  class ImpiMapping;
+
   class Impu
   {
   private:
-    static thread_local LZ4_stream_t* _thrd_lz4_stream;
-    static thread_local struct preserved_hash_table_entry_t* _thrd_lz4_hash;
+    // Per-thread LZ4 streams primed with each dictionary, indexed by
+    // dictionary ID and created the first time the thread uses the dictionary.
+    static thread_local LZ4_stream_t* _thrd_lz4_streams[MAX_DICTIONARIES];
+    static thread_local struct preserved_hash_table_entry_t* _thrd_lz4_hashes[MAX_DICTIONARIES];
+
+    // Per-thread LZ4 stream that each IMPU is compressed in, after priming it
+    // from the stream for the relevant dictionary.
+    static thread_local LZ4_stream_t* _thrd_lz4_work_stream;
+
+    // Per-thread arena that IMPUs are serialized into before compression, and
+    // decompressed into before decoding. It is reused for each IMPU, so the
+    // steady state encode and decode paths don't allocate.
+    static thread_local std::string _thrd_arena;
+
+    // Free the arena if an unusually large IMPU has grown it.
+    static void release_arena();
 
+    // The built in dictionary (ID 0)
     const static std::string _dict_v0;
 
+    // Parse the header of an IMPU record, returning the format of the
+    // record, the dictionary it was compressed with and the offset of the
+    // varbyte encoded length that follows the header.
+    static bool parse_header(const std::string& data,
+                             ImpuFormat& format,
+                             uint8_t& dictionary_id,
+                             uint8_t& codec_id,
+                             size_t& offset);
+
+    // Decompress the length and compressed data that follow the header of an
+    // IMPU record (starting at offset) into uncompressed, and move offset to
+    // the end of the compressed data.
+    static bool decompress_payload(const std::string& data,
+                                   size_t& offset,
+                                   ImpuFormat format,
+                                   uint8_t dictionary_id,
+                                   uint8_t codec_id,
+                                   std::string& uncompressed);
+
+    // Append the header, uncompressed length and compressed data of a record
+    // to data, picking the codec by the policy, and set payload_start to the
+    // offset of the compressed data.
+    static bool write_record(const std::string& uncompressed,
+                             ImpuFormat format,
+                             uint8_t dictionary_id,
+                             const CodecPolicy& policy,
+                             std::string& data,
+                             size_t& payload_start);
+
+    static Impu* from_data_v0(const std::string& impu,
+                              const std::string& json,
+                              uint64_t cas,
+                              ImpuStore* store);
+
+    static Impu* from_data_v1(const std::string& impu,
+                              const std::string& binary,
+                              uint64_t cas,
+                              ImpuStore* store,
+                              bool with_service_profile);
+
+    // Decode a version 2 record, whose binary record (without its service
+    // profile) has been decompressed into binary and whose service profile
+    // section starts at offset in data.
+    static Impu* from_data_v2(const std::string& impu,
+                              const std::string& data,
+                              size_t offset,
+                              const std::string& binary,
+                              uint8_t dictionary_id,
+                              uint64_t cas,
+                              ImpuStore* store);
+
+    friend class ImpuStore;
+    friend class ImpiMapping;
+
   protected:
     Impu(const std::string impu,
          uint64_t cas,
@@ -69,19 +280,61 @@ public:
 
     virtual bool is_default_impu() = 0;
 
-    virtual Store::Status to_data(std::string& data);
+    // Copy the IMPU, e.g. to hand to another thread
+    virtual Impu* clone() const = 0;
+
+    virtual Store::Status to_data(std::string& data,
+                                  ImpuFormat format = ImpuFormat::V0,
+                                  uint8_t dictionary_id = 0,
+                                  const CodecPolicy& policy = CodecPolicy());
+
+    // Compress data with LZ4, using the given (loaded) dictionary, and append
+    // it to compressed. This doesn't allocate if compressed already has
+    // room for the LZ4 compress bound of the data.
+    static bool compress_data_v0(const std::string& data,
+                                 std::string& compressed,
+                                 uint8_t dictionary_id = 0);
 
-    static void compress_data_v0(const std::string& data,
-                                 char*& buffer,
-                                 int& comp_size);
+    // Decompress an IMPU record of any version into uncompressed, without
+    // decoding it. This doesn't allocate if uncompressed already has room for
+    // the record.
+    static bool decompress_data(const std::string& data,
+                                std::string& uncompressed);
 
     static Impu* from_data(const std::string& impu,
                            std::string& data,
                            uint64_t cas,
                            ImpuStore* store);
 
+    // Decode the version 0 JSON encoding of an IMPU in a single SAX pass,
+    // without building a DOM. This gives the same results as the from_json
+    // functions of DefaultImpu and AssociatedImpu, but returns nullptr
+    // rather than throwing if a Default IMPU has no registration state.
+    static Impu* from_json(const std::string& impu,
+                           const std::string& json,
+                           uint64_t cas,
+                           ImpuStore* store);
+
     virtual void write_json(rapidjson::Writer<rapidjson::StringBuffer>& writer) = 0;
 
+    // Append the binary encoding of this IMPU to data. Version 2 records leave
+    // out the service profile, and write it as a separate section.
+    virtual void write_binary(std::string& data,
+                              bool with_service_profile) = 0;
+
+    // Append the service profile section of a version 2 record. Only Default
+    // IMPUs have a service profile.
+    virtual bool write_service_profile(std::string& data,
+                                       uint8_t dictionary_id,
+                                       const CodecPolicy& policy)
+    {
+      return true;
+    }
+
+    // Whether this IMPU has a service profile that failed to decompress, so
+    // can only be written back out as a version 2 record
+    virtual bool has_corrupt_service_profile() { return false; }
+
     const std::string impu;
     const uint64_t cas;
     const int64_t expiry;
@@ -96,7 +349,7 @@ public:
                 const std::vector<std::string>& impis,
                 RegistrationState registration_state,
                 const ChargingAddresses& charging_addresses,
-                const std::string& service_profile,
+                const ServiceProfile& service_profile,
                 uint64_t cas,
                 int64_t expiry,
                 const ImpuStore* store) :
@@ -111,6 +364,18 @@ public:
 
     virtual void write_json(rapidjson::Writer<rapidjson::StringBuffer>& writer);
 
+    virtual void write_binary(std::string& data,
+                              bool with_service_profile);
+
+    virtual bool write_service_profile(std::string& data,
+                                       uint8_t dictionary_id,
+                                       const CodecPolicy& policy);
+
+    virtual bool has_corrupt_service_profile()
+    {
+      return (!service_profile.is_shared()) && (service_profile.is_corrupt());
+    }
+
     virtual ~DefaultImpu(){}
 
     static Impu* from_json(const std::string& impu,
@@ -118,6 +383,15 @@ public:
                            uint64_t cas,
                            ImpuStore* store);
 
+    // Decode a DefaultImpu from the binary encoding in data, starting at
+    // offset (just after the record type).
+    static Impu* from_binary(const std::string& impu,
+                             const std::string& data,
+                             size_t& offset,
+                             uint64_t cas,
+                             ImpuStore* store,
+                             bool with_service_profile);
+
     bool has_associated_impu(const std::string& impu)
     {
       return std::find(associated_impus.begin(),
@@ -127,11 +401,13 @@ public:
 
     virtual bool is_default_impu(){ return true; }
 
+    virtual Impu* clone() const { return new DefaultImpu(*this); }
+
     RegistrationState registration_state;
     ChargingAddresses charging_addresses;
     std::vector<std::string> associated_impus;
     std::vector<std::string> impis;
-    std::string service_profile;
+    ServiceProfile service_profile;
   };
 
   class AssociatedImpu : public Impu
@@ -151,14 +427,27 @@ public:
 
     virtual void write_json(rapidjson::Writer<rapidjson::StringBuffer>& writer);
 
+    virtual void write_binary(std::string& data,
+                              bool with_service_profile);
+
     virtual bool is_default_impu(){ return false; }
 
+    virtual Impu* clone() const { return new AssociatedImpu(*this); }
+
     const std::string default_impu;
 
     static Impu* from_json(const std::string& impu,
                            rapidjson::Value& json,
                            uint64_t cas,
                            ImpuStore* store);
+
+    // Decode an AssociatedImpu from the binary encoding in data, starting at
+    // offset (just after the record type).
+    static Impu* from_binary(const std::string& impu,
+                             const std::string& data,
+                             size_t& offset,
+                             uint64_t cas,
+                             ImpuStore* store);
   };
 
   class ImpiMapping
@@ -183,6 +472,9 @@ public:
     {
     }
 
+    // Decode an IMPI mapping from either the compressed binary record
+    // written in the binary IMPU formats, or the plain JSON written in
+    // version 0 (and by older nodes).
     static ImpiMapping* from_data(const std::string& impu,
                                   const std::string&,
                                   uint64_t cas);
@@ -193,7 +485,13 @@ public:
 
     virtual void write_json(rapidjson::Writer<rapidjson::StringBuffer>& writer);
 
-    virtual Store::Status to_data(std::string& data);
+    // Encode the mapping. Version 0 writes plain JSON. The binary formats
+    // write a version 1 record (IMPI mappings have no service profile to
+    // split out), compressed in the same way as an IMPU.
+    virtual Store::Status to_data(std::string& data,
+                                  ImpuFormat format = ImpuFormat::V0,
+                                  uint8_t dictionary_id = 0,
+                                  const CodecPolicy& policy = CodecPolicy());
 
     virtual ~ImpiMapping(){
     }
@@ -248,11 +546,57 @@ public:
 
   virtual ~ImpuStore() {};
 
-  ImpuStore(Store* store) : _store(store)
+  ImpuStore(Store* store,
+            ImpuFormat impu_format = ImpuFormat::V0,
+            uint8_t dictionary_id = 0,
+            const CodecPolicy& codec_policy = CodecPolicy(),
+            bool share_service_profiles = false) :
+    _store(store),
+    _impu_format(impu_format),
+    _dictionary_id(dictionary_id),
+    _codec_policy(codec_policy),
+    _share_service_profiles(share_service_profiles),
+    _shared_profiles(MAX_CACHED_SHARED_PROFILES)
   {
 
   }
 
+  // Service profiles shorter than this aren't worth sharing, as the reference
+  // to them would save little.
+  static const size_t MIN_SHARED_PROFILE_LEN = 256;
+
+  // Shared service profiles are always written to the store with at least
+  // this long to live (in seconds), so that they don't need rewriting for
+  // every IMPU that refers to them.
+  static const int SHARED_PROFILE_LEASE = 24 * 60 * 60;
+
+  // The number of shared service profiles each ImpuStore caches in memory.
+  static const size_t MAX_CACHED_SHARED_PROFILES = 10000;
+
+  // The reference for a service profile with the given content
+  static std::string shared_profile_reference(const std::string& xml);
+
+  // Compression dictionaries are loaded once at startup, before any IMPUs are
+  // read or written, and are shared by all ImpuStores. Dictionary 0 is built
+  // in. Others are trained offline from sampled records by
+  // homestead_dict_trainer, and several can be loaded side by side so that
+  // records written with an old dictionary can still be read after moving
+  // to a new one.
+  //
+  // Adds a dictionary, failing if the ID is already in use for a different
+  // dictionary.
+  static bool add_dictionary(uint8_t id, const std::string& dictionary);
+
+  // Returns the dictionary with the given ID, or nullptr if it isn't loaded.
+  static const std::string* get_dictionary(uint8_t id);
+
+  // The name of the file holding the given dictionary in a directory.
+  static std::string dictionary_file(const std::string& directory, uint8_t id);
+
+  // Loads every dictionary file found in the directory. Returns false if any
+  // of them couldn't be loaded.
+  static bool load_dictionaries(const std::string& directory);
+
   // Sets the IMPU in the store without checking the CAS value, overwriting any
   // data already present.
   virtual Store::Status set_impu_without_cas(Impu* impu, SAS::TrailId trail);
@@ -270,17 +614,88 @@ public:
 
   virtual Store::Status delete_impu(Impu* impu, SAS::TrailId trail);
 
+  // Get several IMPUs at once. Each IMPU found is added to out_impus, keyed
+  // by IMPU, and the caller is responsible for deleting them. IMPUs that
+  // aren't found are left out.
+  //
+  // Returns OK if every IMPU was either found or not found, and otherwise the
+  // first other error (though out_impus still holds the IMPUs that were
+  // found).
+  virtual Store::Status get_impus(const std::vector<std::string>& impus,
+                                  std::map<std::string, Impu*>& out_impus,
+                                  SAS::TrailId trail);
+
+  // Set several IMPUs at once, without checking their CAS values. The status
+  // of each write is added to statuses, keyed by IMPU.
+  //
+  // Returns OK if every write succeeded, and otherwise the first error.
+  virtual Store::Status set_impus_without_cas(const std::vector<Impu*>& impus,
+                                              SAS::TrailId trail,
+                                              std::map<std::string, Store::Status>& statuses);
+
+  // Extend the lifetime of several IMPUs whose content hasn't changed other
+  // than their expiry, in the same way as set_impus_without_cas.
+  //
+  // The records carry their own expiry, and the Store interface has no
+  // touch, so they're rewritten in full, but Associated IMPUs with the same
+  // Default IMPU and expiry share a record, so it's only encoded once.
+  virtual Store::Status touch_impus(const std::vector<Impu*>& impus,
+                                    SAS::TrailId trail,
+                                    std::map<std::string, Store::Status>& statuses);
+
+  // Delete several IMPUs at once, in the same way as set_impus_without_cas.
+  virtual Store::Status delete_impus(const std::vector<Impu*>& impus,
+                                     SAS::TrailId trail,
+                                     std::map<std::string, Store::Status>& statuses);
+
   virtual Store::Status set_impi_mapping(ImpiMapping* mapping, SAS::TrailId trail);
 
+  // Attempts to add an ImpiMapping that doesn't already exist in the store.
+  // Fails with DATA_CONTENTION if a mapping is already present.
+  virtual Store::Status add_impi_mapping(ImpiMapping* mapping, SAS::TrailId trail);
+
   // Get the ImpiMapping for this impi.
   // If successful, set the pointer out_mapping to be the retrieved ImpiMapping
   // If not, does not alter mapping
   virtual Store::Status get_impi_mapping(const std::string impi, ImpiMapping*& out_mapping, SAS::TrailId trail);
 
+  // Get the ImpiMappings for several impis at once, in the same way as
+  // get_impus.
+  virtual Store::Status get_impi_mappings(const std::vector<std::string>& impis,
+                                          std::map<std::string, ImpiMapping*>& out_mappings,
+                                          SAS::TrailId trail);
+
   virtual Store::Status delete_impi_mapping(ImpiMapping* mapping, SAS::TrailId trail);
 
 private:
   Store* _store;
+
+  // The format to write IMPUs in
+  ImpuFormat _impu_format;
+
+  // The dictionary to compress version 1 IMPUs with
+  uint8_t _dictionary_id;
+
+  // How to pick the codec to compress version 1 IMPUs with
+  CodecPolicy _codec_policy;
+
+  // Whether to share service profiles between IMPUs, rather than storing a
+  // copy with each Default IMPU. Only binary formats can do this.
+  bool _share_service_profiles;
+
+  // The shared service profiles that this store has read or written
+  SharedProfileCache _shared_profiles;
+
+  // Prepare to write an IMPU. If we share service profiles this makes sure
+  // the IMPU's profile is in the store, and marks it as shared, so it is
+  // written as a reference. Otherwise it marks the profile as not shared.
+  void prepare_service_profile(Impu* impu, SAS::TrailId trail);
+
+  // Resolve the reference to a shared service profile in an IMPU read from
+  // the store. Returns NOT_FOUND if the profile is no longer in the store.
+  Store::Status resolve_service_profile(DefaultImpu* impu, SAS::TrailId trail);
+
+  static std::map<uint8_t, std::string> _dictionaries;
 };
 
 #endif
@@ -0,0 +1,78 @@
+/**
+ * @file irs_cache.h In-memory cache of IRSs read from the IMPU stores
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef IRS_CACHE_H_
+#define IRS_CACHE_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "impu_store.h"
+#include "sharded_ttl_map.h"
+
+// Caches the Default IMPUs read from the IMPU stores, keyed by the IMPU they
+// were read for (which may be one of their associated IMPUs), so that hot
+// subscribers don't need to be read and decoded every time.
+//
+// The cached Default IMPUs are never changed, and are shared by every reader
+// until they are evicted or invalidated. Each is kept for at most the
+// configured TTL, which bounds how stale it can get if it's changed by
+// another node. Writes by this node must invalidate the IMPUs they change.
+//
+// The cache is split into shards, each with its own lock (see
+// ShardedTtlMap), and holds at most max_entries entries across all of them,
+// evicting the least recently used entry in a shard to make space.
+//
+// It is safe to use from multiple threads.
+class IrsCache
+{
+public:
+  typedef std::shared_ptr<const ImpuStore::DefaultImpu> Snapshot;
+
+  IrsCache(size_t max_entries,
+           uint64_t ttl_ms,
+           size_t num_shards = DEFAULT_SHARDS);
+
+  // Look up the Default IMPU cached for this IMPU. Returns nullptr if there
+  // isn't one, in which case ticket is set, and must be passed to add if the
+  // caller reads the IMPU from the store.
+  Snapshot get(const std::string& impu, uint64_t& ticket);
+
+  // Cache a copy of the Default IMPU read for this IMPU. It isn't cached if
+  // the IMPU has been invalidated since get returned the ticket, as it may
+  // have been read before the write that invalidated it.
+  void add(const std::string& impu,
+           const ImpuStore::DefaultImpu* default_impu,
+           uint64_t ticket);
+
+  // Remove these IMPUs from the cache, as they've been written
+  void invalidate(const std::vector<std::string>& impus);
+
+  typedef ShardedTtlMap<Snapshot>::Stats Stats;
+
+  Stats get_stats();
+
+  // Also count the hits, misses and evictions in the given tables
+  void configure_stats_tables(SNMP::CounterTable* hits_table,
+                              SNMP::CounterTable* misses_table,
+                              SNMP::CounterTable* evictions_table)
+  {
+    _map.configure_stats_tables(hits_table, misses_table, evictions_table);
+  }
+
+  static const size_t DEFAULT_SHARDS = 16;
+
+private:
+  ShardedTtlMap<Snapshot> _map;
+};
+
+#endif
@@ -0,0 +1,111 @@
+/**
+ * @file irs_read_coalescer.h Sharing of concurrent reads of the same IRS
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef IRS_READ_COALESCER_H_
+#define IRS_READ_COALESCER_H_
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "implicit_reg_set.h"
+#include "snmp_counter_table.h"
+#include "store.h"
+
+// Lets concurrent requests for the IRS of the same IMPU share a single read
+// from the cache.
+//
+// The first request for an IMPU is given a Read to do, and later requests
+// join it until it completes. A request only joins a read that started after
+// any IRS write that had made progress before it arrived (see irss_written),
+// so it never sees an IRS from before a write it could know about.
+//
+// It is safe to use from multiple threads.
+class IrsReadCoalescer
+{
+public:
+  typedef std::function<void(ImplicitRegistrationSet*)> SuccessCallback;
+  typedef std::function<void(Store::Status)> FailureCallback;
+
+  // A read of the IRS for an IMPU, which answers the requests waiting for it
+  // when it completes. If it's destroyed without completing (e.g. because
+  // reading threw, or the work was dropped), they fail with ERROR.
+  class Read
+  {
+  public:
+    ~Read();
+
+    // Answer the requests waiting for this read. If status is OK, this takes
+    // ownership of irs, and each request is given its own copy of it.
+    void complete(Store::Status status, ImplicitRegistrationSet* irs);
+
+    const std::string& impu() const { return _impu; }
+
+  private:
+    friend class IrsReadCoalescer;
+
+    Read(IrsReadCoalescer* coalescer,
+         const std::string& impu,
+         uint64_t write_generation);
+
+    IrsReadCoalescer* _coalescer;
+    std::string _impu;
+    uint64_t _write_generation;
+    bool _completed;
+
+    // The requests waiting for the read, the first of which is the one that
+    // started it. Protected by the coalescer's lock.
+    std::vector<std::pair<SuccessCallback, FailureCallback>> _waiters;
+  };
+
+  IrsReadCoalescer();
+
+  // Either join the read of the IRS for this IMPU in progress, returning
+  // nullptr, or start a new one, returning the Read for the caller to do.
+  // Either way, one of the callbacks is called once the read completes.
+  std::shared_ptr<Read> join_or_start(const std::string& impu,
+                                      SuccessCallback success_cb,
+                                      FailureCallback failure_cb);
+
+  // Note that IRSs have been written, so the reads in progress may be out of
+  // date and mustn't be joined by any more requests
+  void irss_written();
+
+  // The number of requests that joined a read already in progress
+  uint64_t get_coalesced_gets() const { return _coalesced_gets; }
+
+  // Also count the requests that joined a read in the given table
+  void configure_stats_tables(SNMP::CounterTable* coalesced_gets_table)
+  {
+    _coalesced_gets_tbl = coalesced_gets_table;
+  }
+
+private:
+  // Stop other requests joining a read, and take the requests waiting for it
+  std::vector<std::pair<SuccessCallback, FailureCallback>> finish(Read* read);
+
+  // The reads in progress, by IMPU, and the number of times IRSs have been
+  // written. Both are protected by the lock. A read that's out of date is
+  // replaced here, but still answers the requests already waiting for it.
+  std::mutex _lock;
+  std::map<std::string, Read*> _reads;
+  uint64_t _write_generation;
+
+  std::atomic<uint64_t> _coalesced_gets;
+  SNMP::CounterTable* _coalesced_gets_tbl;
+};
+
+#endif
@@ -0,0 +1,65 @@
+/**
+ * @file key_lock_table.h Striped in-process locks for IMPU store keys
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef KEY_LOCK_TABLE_H_
+#define KEY_LOCK_TABLE_H_
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Locks for the keys in the IMPU stores, so that threads on this node that
+// read, change and write back the same key do so one at a time, rather than
+// racing and having all but one of them hit CAS contention and start again.
+// The CAS still protects against writers on other nodes and sites.
+//
+// There's a fixed number of locks (stripes), and each key is locked by
+// locking the stripe it hashes to, so unrelated keys occasionally wait for
+// each other. Keys are scoped (by the store they're in), so writes of the
+// same key to different stores don't wait for each other.
+//
+// A thread must not lock keys while it already holds any, but may lock
+// several at once, as their stripes are always locked in the same order.
+//
+// It is safe to use from multiple threads.
+class KeyLockTable
+{
+public:
+  KeyLockTable(size_t num_stripes);
+
+  // Released when destroyed
+  typedef std::vector<std::unique_lock<std::mutex>> Locks;
+
+  // Lock these keys in this scope, waiting for any other thread that holds
+  // them
+  Locks lock(const void* scope, const std::vector<std::string>& keys);
+  Locks lock(const void* scope, const std::string& key);
+
+  struct Stats
+  {
+    // Stripes locked, and those that another thread already held
+    uint64_t acquisitions;
+    uint64_t waits;
+  };
+
+  Stats get_stats();
+
+private:
+  size_t stripe_for(const void* scope, const std::string& key);
+
+  std::vector<std::mutex> _stripes;
+
+  std::atomic<uint64_t> _acquisitions;
+  std::atomic<uint64_t> _waits;
+};
+
+#endif
@@ -13,11 +13,23 @@
 
 #include "base_hss_cache.h"
 #include "base_ims_subscription.h"
+#include "batch_runner.h"
+#include "cas_retry_policy.h"
 #include "hss_cache.h"
 #include "impu_store.h"
+#include "gr_reader.h"
+#include "irs_cache.h"
+#include "key_lock_table.h"
+#include "not_found_cache.h"
+#include "reconciler.h"
+#include "replication_queue.h"
+#include "snmp_counter_table.h"
+#include "snmp_event_accumulator_table.h"
 #include "threadpool.h"
 
+#include <atomic>
 #include <map>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -37,6 +49,7 @@ public:
     _cas(default_impu->cas),
     _refreshed(false),
     _existing(true),
+    _fields_changed(false),
     _ims_sub_xml(default_impu->service_profile),
     _ims_sub_xml_set(false),
     _charging_addresses(default_impu->charging_addresses),
@@ -69,8 +82,10 @@ public:
     _cas(0L),
     _refreshed(true),
     _existing(false),
+    _fields_changed(false),
     _ims_sub_xml_set(false),
     _charging_addresses_set(false),
+    _registration_state(RegistrationState::UNKNOWN),
     _registration_state_set(false)
   {
   }
@@ -82,9 +97,10 @@ public:
     return _default_impu;
   }
 
+  // The service profile is only decompressed the first time it's read
   virtual const std::string& get_ims_sub_xml() const override
   {
-    return _ims_sub_xml;
+    return _ims_sub_xml.get();
   }
 
   virtual RegistrationState get_reg_state() const override
@@ -123,6 +139,12 @@ public:
   virtual void set_reg_state(RegistrationState state) override
   {
     _registration_state_set = true;
+
+    if (state != _registration_state)
+    {
+      _fields_changed = true;
+    }
+
     _registration_state = state;
   }
 
@@ -132,6 +154,12 @@ public:
   virtual void set_charging_addresses(const ChargingAddresses& addresses) override
   {
     _charging_addresses_set = true;
+
+    if (!(addresses == _charging_addresses))
+    {
+      _fields_changed = true;
+    }
+
     _charging_addresses = addresses;
   }
 
@@ -141,6 +169,11 @@ public:
     _ttl = ttl;
   }
 
+  virtual ImplicitRegistrationSet* clone() const override
+  {
+    return new MemcachedImplicitRegistrationSet(*this);
+  }
+
   // Functions for MemcachedCache
 
   bool is_existing() const { return _existing; }
@@ -167,6 +200,32 @@ public:
 
   bool is_refreshed() const { return _refreshed; }
 
+  // Whether writing the IRS needs to write its Default IMPU. It doesn't if
+  // the IRS is already in the store, isn't being refreshed, and the service
+  // profile, charging addresses, registration state, associated IMPUs and
+  // IMPIs it holds are all as they were read (even if they've been set).
+  bool needs_default_impu_write() const
+  {
+    return !_existing ||
+           _refreshed ||
+           _fields_changed ||
+           has_changed_impus() ||
+           has_changed_impis();
+  }
+
+  // Whether writing the IRS needs to write any associated IMPUs or IMPI
+  // mappings. It does if any have been added or deleted, or if the IRS is
+  // being refreshed (as the unchanged ones then need their expiry extending).
+  bool needs_associated_impu_writes() const
+  {
+    return _refreshed || has_changed_impus();
+  }
+
+  bool needs_impi_mapping_writes() const
+  {
+    return _refreshed || has_changed_impis();
+  }
+
   void mark_as_refreshed(){ _refreshed = true; }
 
   std::vector<std::string> get_associated_impus() const
@@ -204,6 +263,12 @@ public:
   // Delete all of the IMPIs
   void delete_impis();
 
+  // Fold in the changes to IMPUs and IMPIs made by an older copy of this IRS
+  // that hasn't been written to a remote site yet, so that this copy can be
+  // written in its place. Where both copies have changed the same IMPU or
+  // IMPI, this copy's change wins.
+  void merge_unreplicated(const MemcachedImplicitRegistrationSet& older);
+
   // Enumerate the different states a piece of data (an IMPU or IMPI)
   // can be in.
   enum State
@@ -242,14 +307,17 @@ private:
 
   int32_t _ttl;
 
-  bool _changed;
   bool _refreshed;
   bool _existing;
 
+  // Whether the service profile, charging addresses or registration state
+  // have been set to something other than what was read from the store
+  bool _fields_changed;
+
   Data _impis;
   Data _associated_impus;
 
-  std::string _ims_sub_xml;
+  ImpuStore::ServiceProfile _ims_sub_xml;
   bool _ims_sub_xml_set;
 
   ChargingAddresses _charging_addresses;
@@ -291,25 +359,330 @@ public:
 class MemcachedCache : public BaseHssCache
 {
 public:
+  static const size_t DEFAULT_REPLICATION_QUEUE_LEN = 10000;
+
+  // How the cache reads and writes the stores. The defaults read and write
+  // every store directly, with none of the optional features turned on.
+  struct Options
+  {
+    Options() :
+      replication_writers(0),
+      replication_queue_len(DEFAULT_REPLICATION_QUEUE_LEN),
+      max_hedge_delay_us(0),
+      read_repair(false),
+      irs_cache_size(0),
+      irs_cache_ttl_ms(0),
+      not_found_cache_size(0),
+      not_found_cache_ttl_ms(0),
+      batch_threads(0),
+      batch_write_parallelism(1),
+      max_cas_retries(CasRetryPolicy::DEFAULT_MAX_RETRIES),
+      cas_backoff_min_us(0),
+      cas_backoff_max_us(0),
+      key_lock_stripes(0),
+      reconcile_log_len(0),
+      reconcile_settle_ms(0),
+      reconcile_keys_per_sec(0),
+      irs_cache_hits_table(nullptr),
+      irs_cache_misses_table(nullptr),
+      irs_cache_evictions_table(nullptr),
+      not_found_cache_hits_table(nullptr),
+      not_found_cache_misses_table(nullptr),
+      not_found_cache_evictions_table(nullptr),
+      remote_reads_won_table(nullptr),
+      remote_reads_lost_table(nullptr),
+      remote_reads_failed_table(nullptr),
+      remote_reads_abandoned_table(nullptr),
+      remote_read_latency_table(nullptr),
+      replication_lag_table(nullptr),
+      replication_dropped_table(nullptr),
+      replication_failed_table(nullptr)
+    {}
+
+    // Writes to the remote stores are made by replication_writers threads
+    // per remote site, in the background, with up to replication_queue_len
+    // writes queued for each site. If replication_writers is 0, they're made
+    // synchronously, after the write to the local store.
+    int replication_writers;
+    size_t replication_queue_len;
+
+    // Reads that miss in the local store wait up to max_hedge_delay_us for
+    // each remote store to answer before trying the next one as well. If
+    // it's 0, all of the remote stores are read at once.
+    uint64_t max_hedge_delay_us;
+
+    // If set, data that is only found in a remote store is added to the
+    // local store in the background, so that later reads of it don't need to
+    // go to the remote sites.
+    bool read_repair;
+
+    // If irs_cache_size is non-zero, up to that many IRSs are cached in
+    // memory for up to irs_cache_ttl_ms (see IrsCache).
+    size_t irs_cache_size;
+    uint64_t irs_cache_ttl_ms;
+
+    // If not_found_cache_size is non-zero, up to that many IMPUs that no site
+    // has are remembered for up to not_found_cache_ttl_ms, and not read from
+    // the remote sites again while they are (see NotFoundCache).
+    size_t not_found_cache_size;
+    uint64_t not_found_cache_ttl_ms;
+
+    // If batch_threads is non-zero, the reads for requests that need several
+    // IRSs (such as RTRs) are made on up to that many extra threads at once,
+    // rather than one at a time. So are the writes for requests that write
+    // several IRSs, up to batch_write_parallelism IRSs at once.
+    int batch_threads;
+    size_t batch_write_parallelism;
+
+    // CAS writes that hit contention are retried up to max_cas_retries
+    // times, backing off for a random time between each, of up to
+    // cas_backoff_min_us doubling with each retry to at most
+    // cas_backoff_max_us (see CasRetryPolicy).
+    int max_cas_retries;
+    uint64_t cas_backoff_min_us;
+    uint64_t cas_backoff_max_us;
+
+    // If non-zero, threads on this node that update the same Default IMPU or
+    // IMPI mapping take turns (see KeyLockTable), rather than contending for
+    // it.
+    size_t key_lock_stripes;
+
+    // If reconcile_log_len is non-zero, up to that many of the keys most
+    // recently written to the local store are checked at each remote site
+    // once they've been written for reconcile_settle_ms, at up to
+    // reconcile_keys_per_sec keys a second, and repaired if they've diverged
+    // (see Reconciler).
+    size_t reconcile_log_len;
+    uint64_t reconcile_settle_ms;
+    uint64_t reconcile_keys_per_sec;
+
+    // The tables to count the hits, misses and evictions of the IRS cache
+    // and not found cache in, if they're enabled. Any of them may be null.
+    SNMP::CounterTable* irs_cache_hits_table;
+    SNMP::CounterTable* irs_cache_misses_table;
+    SNMP::CounterTable* irs_cache_evictions_table;
+    SNMP::CounterTable* not_found_cache_hits_table;
+    SNMP::CounterTable* not_found_cache_misses_table;
+    SNMP::CounterTable* not_found_cache_evictions_table;
+
+    // The tables to count the outcomes of reads from the remote sites in,
+    // and to accumulate their latencies in (see RemoteReadStats). Any of
+    // them may be null.
+    SNMP::CounterTable* remote_reads_won_table;
+    SNMP::CounterTable* remote_reads_lost_table;
+    SNMP::CounterTable* remote_reads_failed_table;
+    SNMP::CounterTable* remote_reads_abandoned_table;
+    SNMP::EventAccumulatorTable* remote_read_latency_table;
+
+    // The tables to accumulate the lag of writes replicated in the
+    // background in, and to count those dropped and failed in (see
+    // ReplicationQueue). Any of them may be null.
+    SNMP::EventAccumulatorTable* replication_lag_table;
+    SNMP::CounterTable* replication_dropped_table;
+    SNMP::CounterTable* replication_failed_table;
+  };
+
   MemcachedCache(ImpuStore* local_store,
                  const std::vector<ImpuStore*>& remote_stores,
                  int num_threads,
-                 ExceptionHandler* exception_handler) :
+                 ExceptionHandler* exception_handler,
+                 const Options& options = Options()) :
     BaseHssCache(),
     _local_store(local_store),
     _remote_stores(remote_stores),
     _thread_pool(num_threads,
                  exception_handler,
                  exception_callback,
-                 0)
+                 0),
+    _replication_queue(nullptr),
+    _gr_reader(_thread_pool, remote_stores, options.max_hedge_delay_us),
+    _read_repair(options.read_repair),
+    _irs_cache(nullptr),
+    _not_found_cache(nullptr),
+    _batch_runner(nullptr),
+    _batch_parallelism(options.batch_threads + 1),
+    _batch_write_parallelism(options.batch_write_parallelism),
+    _cas_retry_policy(options.max_cas_retries,
+                      options.cas_backoff_min_us,
+                      options.cas_backoff_max_us),
+    _key_locks(nullptr),
+    _reconciler(nullptr),
+    _planned_writes(0),
+    _executed_writes(0),
+    _retried_writes(0),
+    _skipped_updates(0),
+    _planned_writes_tbl(nullptr),
+    _executed_writes_tbl(nullptr),
+    _retried_writes_tbl(nullptr),
+    _skipped_updates_tbl(nullptr)
   {
     _thread_pool.start();
+
+    _gr_reader.stats().configure_stats_tables(options.remote_reads_won_table,
+                                              options.remote_reads_lost_table,
+                                              options.remote_reads_failed_table,
+                                              options.remote_reads_abandoned_table,
+                                              options.remote_read_latency_table);
+
+    if ((options.replication_writers > 0) && (!remote_stores.empty()))
+    {
+      _replication_queue = new ReplicationQueue(remote_stores,
+                                                options.replication_queue_len,
+                                                options.replication_writers);
+      _replication_queue->configure_stats_tables(options.replication_lag_table,
+                                                 options.replication_dropped_table,
+                                                 options.replication_failed_table);
+      _replication_queue->start();
+    }
+
+    if (options.irs_cache_size > 0)
+    {
+      _irs_cache = new IrsCache(options.irs_cache_size,
+                                options.irs_cache_ttl_ms);
+      _irs_cache->configure_stats_tables(options.irs_cache_hits_table,
+                                         options.irs_cache_misses_table,
+                                         options.irs_cache_evictions_table);
+    }
+
+    if ((options.not_found_cache_size > 0) && (!remote_stores.empty()))
+    {
+      _not_found_cache = new NotFoundCache(options.not_found_cache_size,
+                                           options.not_found_cache_ttl_ms);
+      _not_found_cache->configure_stats_tables(options.not_found_cache_hits_table,
+                                               options.not_found_cache_misses_table,
+                                               options.not_found_cache_evictions_table);
+    }
+
+    if (options.batch_threads > 0)
+    {
+      _batch_runner = new BatchRunner(options.batch_threads,
+                                      exception_handler);
+    }
+
+    if (options.key_lock_stripes > 0)
+    {
+      _key_locks = new KeyLockTable(options.key_lock_stripes);
+    }
+
+    if ((options.reconcile_log_len > 0) && (!remote_stores.empty()))
+    {
+      _reconciler = new Reconciler(local_store,
+                                   remote_stores,
+                                   options.reconcile_log_len,
+                                   options.reconcile_settle_ms,
+                                   options.reconcile_keys_per_sec);
+      _reconciler->start();
+    }
   }
 
   virtual ~MemcachedCache()
   {
+    // Stop replicating first, as the queued writes refer back to us
+    delete _replication_queue;
+    _replication_queue = nullptr;
+    delete _reconciler;
+    _reconciler = nullptr;
     _thread_pool.stop();
     _thread_pool.join();
+    delete _irs_cache;
+    delete _not_found_cache;
+    delete _batch_runner;
+    delete _key_locks;
+  }
+
+  // Statistics for the writes being replicated to each remote site. Empty if
+  // writes to remote sites are made synchronously.
+  std::vector<ReplicationQueue::Stats> get_replication_stats();
+
+  // Statistics for the reads from each remote site
+  std::vector<RemoteReadStats::Stats> get_remote_read_stats();
+
+  // Statistics for the store writes made when writing IRSs to each store
+  struct WriteStats
+  {
+    // The writes that the changes to the IRSs called for
+    uint64_t planned;
+
+    // The writes actually made, less any that weren't needed once we'd read
+    // the store, and not counting retries
+    uint64_t executed;
+
+    // The writes made again after hitting contention
+    uint64_t retried;
+
+    // The updates of Default IMPUs, associated IMPUs or IMPI mappings
+    // skipped, as none of them had changed
+    uint64_t skipped;
+  };
+
+  WriteStats get_write_stats();
+
+  // The store writes made while writing one IRS to a store: the first
+  // attempt at each, and any retries after contention
+  struct WriteCounts
+  {
+    uint64_t executed;
+    uint64_t retried;
+  };
+
+  // Report the writes for each IRS written to a store in the given tables,
+  // as well as in the WriteStats
+  void configure_write_stats_tables(SNMP::EventAccumulatorTable* planned_writes_table,
+                                    SNMP::EventAccumulatorTable* executed_writes_table,
+                                    SNMP::EventAccumulatorTable* retried_writes_table,
+                                    SNMP::CounterTable* skipped_updates_table);
+
+  // Statistics for the in-memory IRS cache. All zero if it's disabled.
+  IrsCache::Stats get_irs_cache_stats();
+
+  // Statistics for the cache of IMPUs that no site has. All zero if it's
+  // disabled.
+  NotFoundCache::Stats get_not_found_cache_stats();
+
+  // Statistics for the CAS writes to each table that hit contention, and the
+  // keys that hit it most
+  CasRetryPolicy::Stats get_contention_stats(CasRetryPolicy::Table table);
+  std::vector<CasRetryPolicy::HotKey> get_contended_keys();
+
+  // Also report contention in the given tables (see
+  // CasRetryPolicy::configure_stats_tables)
+  void configure_contention_stats_tables(SNMP::CounterTable* contentions_table,
+                                         SNMP::CounterTable* exhausted_table,
+                                         SNMP::EventAccumulatorTable* backoff_table,
+                                         SNMP::EventAccumulatorTable* hot_key_table)
+  {
+    _cas_retry_policy.configure_stats_tables(contentions_table,
+                                             exhausted_table,
+                                             backoff_table,
+                                             hot_key_table);
+  }
+
+  // Statistics for the locks on the keys being updated. All zero if they're
+  // disabled.
+  KeyLockTable::Stats get_key_lock_stats();
+
+  // Statistics for the keys checked and repaired at each remote site, and for
+  // the log of keys waiting to be checked. Empty, or all zero, if we aren't
+  // reconciling the remote sites.
+  std::vector<Reconciler::Stats> get_reconciler_stats();
+  Reconciler::LogStats get_reconciler_log_stats();
+
+  // Also report the reconciler's checks in the given tables (see
+  // Reconciler::configure_stats_tables), if we're reconciling the remote sites
+  void configure_reconciler_stats_tables(SNMP::CounterTable* diverged_table,
+                                         SNMP::CounterTable* repaired_table,
+                                         SNMP::CounterTable* repair_failed_table,
+                                         SNMP::CounterTable* errors_table,
+                                         SNMP::CounterTable* dropped_table)
+  {
+    if (_reconciler)
+    {
+      _reconciler->configure_stats_tables(diverged_table,
+                                          repaired_table,
+                                          repair_failed_table,
+                                          errors_table,
+                                          dropped_table);
+    }
   }
 
   // Dummy exception handler callback for the thread pool
@@ -329,6 +702,19 @@ public:
                                                                Utils::StopWatch* stopwatch,
                                                                ImplicitRegistrationSet*& result) override;
 
+  // Get the IRSs for the given IMPIs, reading the IMPI mappings from the
+  // local store in one batch, and then the IRSs they map to as a batch
+  virtual Store::Status get_implicit_registration_sets_for_impis(const std::vector<std::string>& impis,
+                                                                 SAS::TrailId trail,
+                                                                 Utils::StopWatch* stopwatch,
+                                                                 std::vector<ImplicitRegistrationSet*>& result) override;
+
+  // Get the IRSs for the given IMPUs, reading them as a batch
+  virtual Store::Status get_implicit_registration_sets_for_impus(const std::vector<std::string>& impus,
+                                                                 SAS::TrailId trail,
+                                                                 Utils::StopWatch* stopwatch,
+                                                                 std::vector<ImplicitRegistrationSet*>& result) override;
+
   // Save the IRS in the cache
   // Must include updating the impi mapping table if impis have been added
   virtual Store::Status put_implicit_registration_set(ImplicitRegistrationSet* irs,
@@ -374,6 +760,50 @@ private:
   std::vector<ImpuStore*> _remote_stores;
   FunctorThreadPool _thread_pool;
 
+  // Replicates writes to the remote stores, if we don't write to them
+  // synchronously
+  ReplicationQueue* _replication_queue;
+
+  // Reads data that isn't found locally from the remote stores
+  GrReader _gr_reader;
+
+  // Whether to add data found only in a remote store to the local store
+  const bool _read_repair;
+
+  // Caches the IRSs we've read, if enabled
+  IrsCache* _irs_cache;
+
+  // Remembers the IMPUs that no site has, if enabled
+  NotFoundCache* _not_found_cache;
+
+  // Runs the reads for requests that need several IRSs concurrently, if
+  // enabled, with at most _batch_parallelism (including the calling thread)
+  // at once
+  BatchRunner* _batch_runner;
+  const size_t _batch_parallelism;
+
+  // The most IRSs written at once by a request that writes several
+  const size_t _batch_write_parallelism;
+
+  // Decides whether to retry CAS writes that hit contention
+  CasRetryPolicy _cas_retry_policy;
+
+  // Serialises updates of the same key by this node, if enabled
+  KeyLockTable* _key_locks;
+
+  // Repairs the keys we've written at the remote sites, if enabled
+  Reconciler* _reconciler;
+
+  // Counts for the WriteStats, and the tables they're also reported in
+  std::atomic<uint64_t> _planned_writes;
+  std::atomic<uint64_t> _executed_writes;
+  std::atomic<uint64_t> _retried_writes;
+  std::atomic<uint64_t> _skipped_updates;
+  SNMP::EventAccumulatorTable* _planned_writes_tbl;
+  SNMP::EventAccumulatorTable* _executed_writes_tbl;
+  SNMP::EventAccumulatorTable* _retried_writes_tbl;
+  SNMP::CounterTable* _skipped_updates_tbl;
+
   // Get the Impu for this impu, by first checking the local store and then any
   // remote stores if no Impu is found in the local store.
   // If successful, sets the pointer out_impu to be the retrieved Impu.
@@ -392,18 +822,63 @@ private:
                                     SAS::TrailId trail,
                                     Utils::StopWatch* stopwatch);
 
+  // Get the ImpiMapping for this impi from the remote stores only. Returns
+  // NOT_FOUND if none of them have it.
+  Store::Status get_impi_mapping_from_remotes(const std::string& impi,
+                                              ImpuStore::ImpiMapping*& out_mapping,
+                                              SAS::TrailId trail,
+                                              Utils::StopWatch* stopwatch);
+
+  // Run a batch of jobs on the batch runner, with at most max_parallel at
+  // once, or one at a time on this thread if there's no runner. Jobs that run
+  // concurrently can't share the StopWatch, so it's paused while they run
+  // and each is given its own. The longest time any job spent other than on
+  // I/O is then added to it (as for reads from the remote sites).
+  typedef std::function<void(size_t, Utils::StopWatch*)> batch_job;
+
+  void run_batch(size_t num_jobs,
+                 batch_job job,
+                 size_t max_parallel,
+                 Utils::StopWatch* stopwatch);
+
+  // Get the IRS for each distinct IMPU in a batch. Sets irss to the IRSs that
+  // are found, and returns OK, or the first error other than NOT_FOUND.
+  Store::Status get_irss_for_distinct_impus(const std::vector<std::string>& impus,
+                                            SAS::TrailId trail,
+                                            Utils::StopWatch* stopwatch,
+                                            std::map<std::string, ImplicitRegistrationSet*>& irss);
+
   // Per Store IRS methods
 
   typedef std::function<Store::Status(ImpuStore*, Utils::StopWatch*)> store_action;
 
+  // Hands the writes that make up an action to the replication queue
+  typedef std::function<void()> replicate_action;
+
   // Performs the action on each store, calling the progress_cb once the action
-  // has been performed on the local store
+  // has been performed on the local store. If we're replicating in the
+  // background, replicate is called instead of performing the action on the
+  // remote stores.
   // If a StopWatch is provided, it will be paused when performing network I/O
   // for the local store, but not for the remotes.
   Store::Status perform(store_action action,
+                        replicate_action replicate,
                         progress_callback progress_cb,
                         Utils::StopWatch* stopwatch);
 
+  typedef Store::Status (MemcachedCache::*irs_action)(MemcachedImplicitRegistrationSet*,
+                                                       SAS::TrailId,
+                                                       ImpuStore*,
+                                                       Utils::StopWatch*);
+
+  // A replicated write of an IRS
+  class IrsWrite;
+
+  // Queue the action on an IRS to be replicated to the remote stores
+  void replicate_irs(irs_action action,
+                     MemcachedImplicitRegistrationSet* irs,
+                     SAS::TrailId trail);
+
   Store::Status put_irs_action(MemcachedImplicitRegistrationSet* irs,
                                SAS::TrailId trail,
                                ImpuStore* store,
@@ -414,6 +889,40 @@ private:
                                   ImpuStore* store,
                                   Utils::StopWatch* stopwatch);
 
+  // Locks for the IMPIs of a batch of IRSs being written concurrently, so
+  // that IRSs that share an IMPI update its mapping one at a time rather than
+  // contending for it. Not needed if we have key locks, as they cover this.
+  typedef std::map<std::string, std::mutex> ImpiLocks;
+
+  // The IRS actions, for an IRS written as part of a batch
+  typedef Store::Status (MemcachedCache::*batch_irs_action)(MemcachedImplicitRegistrationSet*,
+                                                             SAS::TrailId,
+                                                             ImpuStore*,
+                                                             Utils::StopWatch*,
+                                                             ImpiLocks*);
+
+  Store::Status put_irs(MemcachedImplicitRegistrationSet* irs,
+                        SAS::TrailId trail,
+                        ImpuStore* store,
+                        Utils::StopWatch* stopwatch,
+                        ImpiLocks* impi_locks);
+
+  Store::Status delete_irs(MemcachedImplicitRegistrationSet* irs,
+                           SAS::TrailId trail,
+                           ImpuStore* store,
+                           Utils::StopWatch* stopwatch,
+                           ImpiLocks* impi_locks);
+
+  // Perform the action on each of a batch of IRSs. The IRSs are written
+  // concurrently if we have a batch runner. If writing one to the local store
+  // fails, no more are started, as the request will fail. Returns OK, or the
+  // error from the first IRS that failed.
+  Store::Status perform_irs_batch(const std::vector<MemcachedImplicitRegistrationSet*>& irss,
+                                  batch_irs_action action,
+                                  SAS::TrailId trail,
+                                  ImpuStore* store,
+                                  Utils::StopWatch* stopwatch);
+
   Store::Status delete_irss_action(const std::vector<ImplicitRegistrationSet*>& irss,
                                    SAS::TrailId trail,
                                    ImpuStore* store,
@@ -424,17 +933,39 @@ private:
                                    ImpuStore* store,
                                    Utils::StopWatch* stopwatch);
 
+  // Remove the IMPUs in an IRS that we've written from the IRS cache and
+  // the cache of IMPUs that no site has
+  void invalidate_cached_irs(MemcachedImplicitRegistrationSet* irs);
+
+  // Record the keys for an IRS that we've written to the local store, so
+  // that the reconciler checks them at the remote sites. deleted is whether
+  // the IRS itself (and so its Default IMPU) was deleted.
+  void log_written_irs(MemcachedImplicitRegistrationSet* irs, bool deleted);
+
+  // Record a key that we've written to, or deleted from, the local store.
+  // deleted_expiry is only used for deleted keys (see
+  // Reconciler::key_deleted).
+  void log_written_key(Reconciler::Table table,
+                       const std::string& key,
+                       bool deleted,
+                       int64_t deleted_expiry);
+
   // IRS IMPU handling methods
+  //
+  // The methods that write an IRS's records to a store add the store writes
+  // they make to writes, if it's given.
 
   Store::Status create_irs_impu(MemcachedImplicitRegistrationSet* irs,
                                 SAS::TrailId trail,
                                 ImpuStore* store,
-                                Utils::StopWatch* stopwatch);
+                                Utils::StopWatch* stopwatch,
+                                WriteCounts* writes = nullptr);
 
   Store::Status update_irs_impu(MemcachedImplicitRegistrationSet* irs,
                                 SAS::TrailId trail,
                                 ImpuStore* store,
-                                Utils::StopWatch* stopwatch);
+                                Utils::StopWatch* stopwatch,
+                                WriteCounts* writes = nullptr);
 
   Store::Status delete_irs_impu(MemcachedImplicitRegistrationSet* irs,
                                 SAS::TrailId trail,
@@ -446,14 +977,20 @@ private:
   Store::Status update_irs_associated_impus(MemcachedImplicitRegistrationSet* irs,
                                             SAS::TrailId trail,
                                             ImpuStore* store,
-                                            Utils::StopWatch* stopwatch);
+                                            Utils::StopWatch* stopwatch,
+                                            WriteCounts* writes = nullptr);
 
   // IMPI Mapping Handling
+  //
+  // If impi_locks is given (or, failing that, if we have key locks), the
+  // locks for the IRS's IMPIs are held while their mappings are updated.
 
   Store::Status update_irs_impi_mappings(MemcachedImplicitRegistrationSet* irs,
                                          SAS::TrailId trail,
                                          ImpuStore* store,
-                                         Utils::StopWatch* stopwatch);
+                                         Utils::StopWatch* stopwatch,
+                                         WriteCounts* writes = nullptr,
+                                         ImpiLocks* impi_locks = nullptr);
 };
 
 #endif
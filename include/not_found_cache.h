@@ -0,0 +1,70 @@
+/**
+ * @file not_found_cache.h In-memory cache of IMPUs that no site has
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef NOT_FOUND_CACHE_H_
+#define NOT_FOUND_CACHE_H_
+
+#include <string>
+#include <vector>
+
+#include "sharded_ttl_map.h"
+
+// Remembers the IMPUs that were recently found in neither the local store nor
+// any of the remote stores, so that repeated requests for unknown IMPUs (for
+// example, calls to subscribers that have never registered) don't each read
+// every remote site.
+//
+// Each IMPU is kept for at most the configured TTL, which bounds how long
+// we'll miss an IMPU written at another site. Writes by this node must
+// invalidate the IMPUs they add.
+//
+// The cache is split into shards, each with its own lock (see
+// ShardedTtlMap), and holds at most max_entries entries across all of them.
+// As every entry has the same TTL, the oldest entry in a shard is the one
+// removed to make space.
+//
+// It is safe to use from multiple threads.
+class NotFoundCache
+{
+public:
+  NotFoundCache(size_t max_entries,
+                uint64_t ttl_ms,
+                size_t num_shards = DEFAULT_SHARDS);
+
+  // Whether this IMPU was recently found at no site
+  bool contains(const std::string& impu);
+
+  // Record that this IMPU was found at no site
+  void add(const std::string& impu);
+
+  // Remove these IMPUs from the cache, as they've been written
+  void invalidate(const std::vector<std::string>& impus);
+
+  typedef ShardedTtlMap<bool>::Stats Stats;
+
+  Stats get_stats();
+
+  // Also count the hits, misses and evictions in the given tables
+  void configure_stats_tables(SNMP::CounterTable* hits_table,
+                              SNMP::CounterTable* misses_table,
+                              SNMP::CounterTable* evictions_table)
+  {
+    _map.configure_stats_tables(hits_table, misses_table, evictions_table);
+  }
+
+  static const size_t DEFAULT_SHARDS = 16;
+
+private:
+  // There's nothing to store for each IMPU, so the values are unused
+  ShardedTtlMap<bool> _map;
+};
+
+#endif
@@ -0,0 +1,218 @@
+/**
+ * @file reconciler.h Background repair of the IMPU stores at remote sites
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef RECONCILER_H_
+#define RECONCILER_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "impu_store.h"
+#include "snmp_counter_table.h"
+
+// Repairs the copies of recently written keys in the IMPU stores at remote
+// sites, which may have missed writes (e.g. during a partition, or because
+// the replication queue was full).
+//
+// The keys written to the local store are recorded in a change log, which
+// holds each key once and at most max_log_len keys, dropping the oldest when
+// it's full. Once a key has been in the log for settle_ms (long enough for
+// the write to have been replicated), it's read from the local store and each
+// remote store, and the remote copy is repaired if:
+//  - it's missing, in which case the local copy is added
+//  - it's stale (it expires before the local copy, as every write sets the
+//    expiry, and CAS values aren't comparable between sites, or it expires
+//    at the same time but holds different data, as writes such as PPRs
+//    don't change the expiry), in which case the local copy is CASed over it
+//  - the key was deleted locally but the remote store still has a copy
+//    written before the delete, in which case it's deleted. A copy that
+//    expires later than any copy written before the delete could (e.g. as
+//    another site has registered the subscriber since) is left alone.
+// Keys that can't be checked or repaired at every site (e.g. as the site is
+// unreachable) go back in the log to be tried again later.
+//
+// At most max_keys_per_sec keys are checked a second, on a background thread,
+// so that the reconciler doesn't compete with requests for the stores.
+class Reconciler
+{
+public:
+  enum Table
+  {
+    IMPU,
+    IMPI_MAPPING
+  };
+
+  // Statistics for one remote site
+  struct Stats
+  {
+    // Keys compared with the local store, and those that matched
+    uint64_t checked;
+    uint64_t in_sync;
+
+    // Keys that had diverged: missing from the site, older at the site than
+    // locally (or as old but different), or deleted locally but not at the
+    // site
+    uint64_t missing;
+    uint64_t stale;
+    uint64_t extra;
+
+    // Keys deleted locally that have been written at the site since, and so
+    // were left alone
+    uint64_t rewritten;
+
+    // Diverged keys repaired, and those that couldn't be (including those
+    // written by someone else while we were repairing them)
+    uint64_t repaired;
+    uint64_t repair_failed;
+
+    // Keys that couldn't be read from the site
+    uint64_t errors;
+  };
+
+  // Statistics for the change log
+  struct LogStats
+  {
+    // Keys waiting to be checked
+    uint64_t pending;
+
+    // Keys put back to try again, and keys dropped as the log was full
+    uint64_t retried;
+    uint64_t dropped;
+  };
+
+  Reconciler(ImpuStore* local_store,
+             const std::vector<ImpuStore*>& remote_stores,
+             size_t max_log_len,
+             uint64_t settle_ms,
+             uint64_t max_keys_per_sec);
+
+  // Stops the background thread, if it's still running
+  virtual ~Reconciler();
+
+  void start();
+  void stop();
+
+  // Record that a key has been written to the local store
+  void key_written(Table table, const std::string& key);
+
+  // Record that a key has been deleted from the local store. deleted_expiry
+  // is the latest expiry that a copy written before the delete can have (the
+  // time of the delete plus the TTL the key was last written with).
+  void key_deleted(Table table, const std::string& key, int64_t deleted_expiry);
+
+  // Check and repair the oldest key in the log, if it has settled. Returns
+  // whether there was one. This is what the background thread does, but can
+  // also be called directly.
+  bool reconcile_next();
+
+  size_t num_sites() const { return _remote_stores.size(); }
+
+  Stats get_stats(size_t site);
+  LogStats get_log_stats();
+
+  // Also report the keys checked in the given tables, across all sites:
+  //  - diverged_table counts keys found missing, stale or extra at a site
+  //  - repaired_table and repair_failed_table count the repairs made at a
+  //    site, and those that failed
+  //  - errors_table counts keys that couldn't be read from a site
+  //  - dropped_table counts keys dropped from the log as it was full
+  void configure_stats_tables(SNMP::CounterTable* diverged_table,
+                              SNMP::CounterTable* repaired_table,
+                              SNMP::CounterTable* repair_failed_table,
+                              SNMP::CounterTable* errors_table,
+                              SNMP::CounterTable* dropped_table);
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Entry
+  {
+    Table table;
+    std::string key;
+    bool deleted;
+    int64_t deleted_expiry;
+    Clock::time_point written_at;
+  };
+
+  // What we found at a site, and did about it
+  enum Outcome
+  {
+    IN_SYNC,
+    REWRITTEN,
+    REPAIRED,
+    REPAIR_FAILED,
+    ERROR
+  };
+
+  // Add a key to the back of the log, replacing any earlier entry for it.
+  // Must be called with the lock held.
+  void log_key(const Entry& entry);
+
+  // Report the checks of a key at a site in the stats tables. Must be called
+  // with the lock held.
+  void report_stats(const Stats& delta);
+
+  // The oldest entry in the log, if it has settled. Must be called with the
+  // lock held.
+  bool take_settled(Entry& entry);
+
+  // Check and repair a key at every site. Returns whether that succeeded at
+  // every site.
+  bool reconcile(const Entry& entry);
+
+  Outcome reconcile_impu(const Entry& entry,
+                         ImpuStore::Impu* local,
+                         ImpuStore* store,
+                         Stats& stats);
+
+  Outcome reconcile_impi_mapping(const Entry& entry,
+                                 ImpuStore::ImpiMapping* local,
+                                 ImpuStore* store,
+                                 Stats& stats);
+
+  // The loop run by the background thread
+  void reconciler_loop();
+
+  ImpuStore* _local_store;
+  std::vector<ImpuStore*> _remote_stores;
+  const size_t _max_log_len;
+  const std::chrono::milliseconds _settle_delay;
+  const std::chrono::microseconds _interval;
+
+  // Protects everything below, and is signalled whenever a key is logged or
+  // we're stopping
+  std::mutex _lock;
+  std::condition_variable _cond;
+
+  // Logged keys, oldest first, and an index to them by table and key
+  std::list<Entry> _log;
+  std::unordered_map<std::string, std::list<Entry>::iterator> _logged_keys;
+
+  std::vector<Stats> _stats;
+  LogStats _log_stats;
+
+  SNMP::CounterTable* _diverged_tbl;
+  SNMP::CounterTable* _repaired_tbl;
+  SNMP::CounterTable* _repair_failed_tbl;
+  SNMP::CounterTable* _errors_tbl;
+  SNMP::CounterTable* _dropped_tbl;
+
+  std::thread _thread;
+  bool _stopping;
+};
+
+#endif
@@ -0,0 +1,126 @@
+/**
+ * @file remote_read_stats.h Latency and outcome tracking for reads from
+ * remote sites
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef REMOTE_READ_STATS_H_
+#define REMOTE_READ_STATS_H_
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "snmp_counter_table.h"
+#include "snmp_event_accumulator_table.h"
+
+// Tracks how reads from each remote site turn out, and how long they take.
+//
+// A read that misses locally is sent to the remote sites fastest first, and
+// only sent on to the next fastest site if the previous one hasn't answered
+// within its hedging delay (or has answered without finding anything). The
+// first site to find the data wins, and the others' answers are thrown away.
+// The hedging delay for a site is its smoothed latency plus four times its
+// smoothed deviation (as for TCP retransmission timers), capped at a
+// configured maximum.
+//
+// It is safe to use from multiple threads.
+class RemoteReadStats
+{
+public:
+  enum Outcome
+  {
+    // The site found the data first, and its answer was used
+    WON,
+
+    // The site found the data, but another site had already won
+    LOST,
+
+    // The site didn't find the data, or hit an error
+    FAILED,
+
+    // The read was never sent to the site, as another site had already won
+    ABANDONED
+  };
+
+  // Statistics for one site
+  struct Stats
+  {
+    uint64_t won;
+    uint64_t lost;
+    uint64_t failed;
+    uint64_t abandoned;
+
+    // Smoothed latency, and latency percentiles over the most recent reads,
+    // in microseconds
+    uint64_t smoothed_us;
+    uint64_t p50_us;
+    uint64_t p99_us;
+    uint64_t max_us;
+  };
+
+  // max_hedge_delay_us caps the time we wait for one site before trying the
+  // next. If 0, every site is tried at once.
+  RemoteReadStats(size_t num_sites, uint64_t max_hedge_delay_us);
+
+  // The order in which to try the sites, fastest first. Sites we haven't
+  // read from yet come first, so that we learn how fast they are.
+  std::vector<size_t> order();
+
+  // How long to wait for a read from this site before trying the next one.
+  uint64_t hedge_delay_us(size_t site);
+
+  // Record the outcome of a read from a site. latency_us is ignored for
+  // abandoned reads.
+  void record(size_t site, Outcome outcome, uint64_t latency_us);
+
+  size_t num_sites() const { return _sites.size(); }
+
+  Stats get_stats(size_t site);
+
+  // Also count the outcomes of reads from every site in the given tables,
+  // and accumulate their latencies (in microseconds) in latency_table
+  void configure_stats_tables(SNMP::CounterTable* won_table,
+                              SNMP::CounterTable* lost_table,
+                              SNMP::CounterTable* failed_table,
+                              SNMP::CounterTable* abandoned_table,
+                              SNMP::EventAccumulatorTable* latency_table);
+
+  // The number of recent latencies kept for each site to calculate the
+  // percentiles from
+  static const size_t LATENCY_SAMPLES = 1024;
+
+private:
+  struct Site
+  {
+    Site() : stats(), samples(), next_sample(0), num_samples(0), deviation_us(0) {}
+
+    Stats stats;
+
+    // The most recent latencies, as a ring buffer
+    std::vector<uint64_t> samples;
+    size_t next_sample;
+    size_t num_samples;
+
+    uint64_t deviation_us;
+  };
+
+  const uint64_t _max_hedge_delay_us;
+
+  std::mutex _lock;
+  std::vector<Site> _sites;
+
+  SNMP::CounterTable* _won_tbl;
+  SNMP::CounterTable* _lost_tbl;
+  SNMP::CounterTable* _failed_tbl;
+  SNMP::CounterTable* _abandoned_tbl;
+  SNMP::EventAccumulatorTable* _latency_tbl;
+};
+
+#endif
@@ -0,0 +1,175 @@
+/**
+ * @file replication_queue.h Asynchronous replication of writes to remote sites
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef REPLICATION_QUEUE_H_
+#define REPLICATION_QUEUE_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "impu_store.h"
+#include "snmp_counter_table.h"
+#include "snmp_event_accumulator_table.h"
+
+// Replicates writes to the IMPU stores at remote sites in the background, so
+// that the thread making a write only waits for the local site.
+//
+// Each site has its own bounded queue, and its own writers, so a slow site
+// doesn't hold up the others. Writes are identified by a key (e.g. the
+// default IMPU of the IRS they write). Writes to the same key are applied in
+// the order they were queued and never concurrently, and a write that's
+// queued behind one to the same key that hasn't started yet is coalesced
+// with it, so a busy subscriber doesn't fill the queue.
+class ReplicationQueue
+{
+public:
+  // A write to replicate. Each site is given its own copy.
+  class Write
+  {
+  public:
+    virtual ~Write() {}
+
+    // Apply the write to a remote store.
+    virtual Store::Status apply(ImpuStore* store) = 0;
+
+    // Copy the write, for another site.
+    virtual Write* clone() const = 0;
+
+    // Fold in an older write to the same key that's being replaced by this
+    // one before it was applied. By default the newer write simply
+    // supersedes the older one.
+    virtual void absorb(const Write& older) {}
+  };
+
+  // Statistics for one site
+  struct Stats
+  {
+    // Writes waiting to be applied, and being applied
+    uint64_t queued;
+    uint64_t in_flight;
+
+    // Writes applied successfully, and unsuccessfully
+    uint64_t completed;
+    uint64_t failed;
+
+    // Writes folded into a later write, and writes thrown away because the
+    // queue was full or we were stopping
+    uint64_t coalesced;
+    uint64_t dropped;
+
+    // Time from queueing to completion of the most recently completed write,
+    // and the largest such time seen, in microseconds
+    uint64_t lag_us;
+    uint64_t max_lag_us;
+  };
+
+  // Replicate to the given remote stores, queueing up to max_queue_len
+  // writes for each, with up to writers_per_site applied concurrently.
+  ReplicationQueue(const std::vector<ImpuStore*>& stores,
+                   size_t max_queue_len,
+                   int writers_per_site);
+
+  // Stops the writers, if they're still running
+  virtual ~ReplicationQueue();
+
+  void start();
+
+  // Stop the writers. Writes that are being applied are finished, but
+  // those that are still queued are dropped.
+  void stop();
+
+  // Queue a write to every site. Takes ownership of the write.
+  virtual void replicate(const std::string& key, Write* write);
+
+  // Wait until every queued write has been applied (or dropped).
+  void wait_until_idle();
+
+  size_t num_sites() const { return _sites.size(); }
+
+  Stats get_stats(size_t site);
+
+  // Also accumulate the lag of each completed write (in microseconds) in
+  // lag_table, and count the writes dropped and failed at every site in
+  // dropped_table and failed_table. Any of them may be null. Must be called
+  // before the queue is used.
+  void configure_stats_tables(SNMP::EventAccumulatorTable* lag_table,
+                              SNMP::CounterTable* dropped_table,
+                              SNMP::CounterTable* failed_table)
+  {
+    _lag_tbl = lag_table;
+    _dropped_tbl = dropped_table;
+    _failed_tbl = failed_table;
+  }
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Queued
+  {
+    std::string key;
+    std::unique_ptr<Write> write;
+    Clock::time_point queued_at;
+  };
+
+  struct Site
+  {
+    Site(ImpuStore* store) : store(store), stats() {}
+
+    ImpuStore* store;
+
+    // Protects everything below, and is signalled whenever a write is
+    // queued or finishes
+    std::mutex lock;
+    std::condition_variable cond;
+
+    // Queued writes, oldest first, and an index to them by key
+    std::list<Queued> queue;
+    std::unordered_map<std::string, std::list<Queued>::iterator> queued_keys;
+
+    // Keys with writes being applied
+    std::unordered_set<std::string> in_flight_keys;
+
+    std::vector<std::thread> writers;
+
+    Stats stats;
+  };
+
+  // Queue a write to a site
+  void replicate_to_site(Site* site, const std::string& key, Write* write);
+
+  // The loop run by each writer thread
+  void writer_loop(Site* site);
+
+  // The oldest queued write whose key isn't in flight. Must be called with
+  // the site's lock held.
+  static std::list<Queued>::iterator next_write(Site* site);
+
+  const size_t _max_queue_len;
+  const int _writers_per_site;
+  std::vector<std::unique_ptr<Site>> _sites;
+  std::atomic<bool> _stopping;
+  bool _started;
+
+  SNMP::EventAccumulatorTable* _lag_tbl;
+  SNMP::CounterTable* _dropped_tbl;
+  SNMP::CounterTable* _failed_tbl;
+};
+
+#endif
@@ -0,0 +1,310 @@
+/**
+ * @file sharded_ttl_map.h Sharded in-memory map with a TTL on its entries
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef SHARDED_TTL_MAP_H_
+#define SHARDED_TTL_MAP_H_
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "snmp_counter_table.h"
+
+// A map from strings (such as IMPUs) to values, for the in-memory caches,
+// in which each entry is kept for at most the configured TTL.
+//
+// The map is split into shards, each with its own lock, and holds at most
+// max_entries entries across all of them. When a shard is full, an entry is
+// removed to make space: either the least recently used, or the oldest.
+//
+// Each shard counts the invalidations made in it, so that a value read from
+// elsewhere after a lookup missed isn't added if the key may have been
+// written (and invalidated) since it was read.
+//
+// It is safe to use from multiple threads.
+template <class V>
+class ShardedTtlMap
+{
+public:
+  enum Eviction
+  {
+    LEAST_RECENTLY_USED,
+    OLDEST
+  };
+
+  ShardedTtlMap(size_t max_entries,
+                uint64_t ttl_ms,
+                size_t num_shards,
+                Eviction eviction) :
+    _max_entries_per_shard(std::max((max_entries + num_shards - 1) / num_shards,
+                                    (size_t)1)),
+    _ttl(ttl_ms),
+    _eviction(eviction),
+    _shards(num_shards),
+    _hits_tbl(nullptr),
+    _misses_tbl(nullptr),
+    _evictions_tbl(nullptr)
+  {
+  }
+
+  // Whether a value is no longer usable, even though it hasn't reached the
+  // TTL
+  typedef std::function<bool(const V&)> Stale;
+
+  // Look up the value for this key. Returns true and sets value if there's
+  // an entry that hasn't expired (and that stale, if given, doesn't reject).
+  // Otherwise returns false and sets ticket, which must be passed to add if
+  // the caller reads the value from elsewhere.
+  bool get(const std::string& key,
+           V& value,
+           uint64_t& ticket,
+           Stale stale = nullptr);
+
+  // Add the value for this key, replacing any that's there. It isn't added
+  // if the key may have been invalidated since get returned the ticket.
+  void add(const std::string& key, const V& value, uint64_t ticket);
+
+  // Add the value for this key, replacing any that's there
+  void add(const std::string& key, const V& value);
+
+  // Remove these keys, as they've been written
+  void invalidate(const std::vector<std::string>& keys);
+
+  struct Stats
+  {
+    uint64_t hits;
+    uint64_t misses;
+
+    // Entries removed to make space for others
+    uint64_t evictions;
+
+    // Entries removed because they'd expired or been written
+    uint64_t expiries;
+    uint64_t invalidations;
+
+    uint64_t entries;
+  };
+
+  Stats get_stats();
+
+  // Also count the hits, misses and evictions in the given tables. Any of
+  // them may be null.
+  void configure_stats_tables(SNMP::CounterTable* hits_table,
+                              SNMP::CounterTable* misses_table,
+                              SNMP::CounterTable* evictions_table)
+  {
+    _hits_tbl = hits_table;
+    _misses_tbl = misses_table;
+    _evictions_tbl = evictions_table;
+  }
+
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Entry
+  {
+    V value;
+    Clock::time_point expires;
+    std::list<std::string>::iterator order_it;
+  };
+
+  struct Shard
+  {
+    Shard() : generation(0), stats() {}
+
+    std::mutex lock;
+    std::unordered_map<std::string, Entry> entries;
+
+    // The keys, in the order they're to be evicted in, the next to go last
+    std::list<std::string> order;
+
+    // Bumped on every invalidation
+    uint64_t generation;
+
+    Stats stats;
+  };
+
+  Shard& shard_for(const std::string& key)
+  {
+    return _shards[std::hash<std::string>()(key) % _shards.size()];
+  }
+
+  // Add an entry. The shard must be locked.
+  void add_locked(Shard& shard, const std::string& key, const V& value);
+
+  // Remove an entry. The shard must be locked.
+  static void remove(Shard& shard,
+                     typename std::unordered_map<std::string, Entry>::iterator it)
+  {
+    shard.order.erase(it->second.order_it);
+    shard.entries.erase(it);
+  }
+
+  const size_t _max_entries_per_shard;
+  const std::chrono::milliseconds _ttl;
+  const Eviction _eviction;
+  std::vector<Shard> _shards;
+
+  SNMP::CounterTable* _hits_tbl;
+  SNMP::CounterTable* _misses_tbl;
+  SNMP::CounterTable* _evictions_tbl;
+};
+
+template <class V>
+bool ShardedTtlMap<V>::get(const std::string& key,
+                           V& value,
+                           uint64_t& ticket,
+                           Stale stale)
+{
+  Shard& shard = shard_for(key);
+  std::lock_guard<std::mutex> lock(shard.lock);
+
+  typename std::unordered_map<std::string, Entry>::iterator it =
+    shard.entries.find(key);
+
+  if (it != shard.entries.end())
+  {
+    if ((it->second.expires <= Clock::now()) ||
+        ((stale) && (stale(it->second.value))))
+    {
+      remove(shard, it);
+      shard.stats.expiries++;
+    }
+    else
+    {
+      if (_eviction == LEAST_RECENTLY_USED)
+      {
+        shard.order.splice(shard.order.begin(), shard.order, it->second.order_it);
+      }
+
+      shard.stats.hits++;
+
+      if (_hits_tbl)
+      {
+        _hits_tbl->increment();
+      }
+
+      value = it->second.value;
+      return true;
+    }
+  }
+
+  shard.stats.misses++;
+
+  if (_misses_tbl)
+  {
+    _misses_tbl->increment();
+  }
+
+  ticket = shard.generation;
+  return false;
+}
+
+template <class V>
+void ShardedTtlMap<V>::add(const std::string& key,
+                           const V& value,
+                           uint64_t ticket)
+{
+  Shard& shard = shard_for(key);
+  std::lock_guard<std::mutex> lock(shard.lock);
+
+  if (ticket == shard.generation)
+  {
+    add_locked(shard, key, value);
+  }
+}
+
+template <class V>
+void ShardedTtlMap<V>::add(const std::string& key, const V& value)
+{
+  Shard& shard = shard_for(key);
+  std::lock_guard<std::mutex> lock(shard.lock);
+  add_locked(shard, key, value);
+}
+
+template <class V>
+void ShardedTtlMap<V>::add_locked(Shard& shard,
+                                  const std::string& key,
+                                  const V& value)
+{
+  typename std::unordered_map<std::string, Entry>::iterator it =
+    shard.entries.find(key);
+
+  if (it != shard.entries.end())
+  {
+    // Another reader got here first
+    remove(shard, it);
+  }
+  else if (shard.entries.size() >= _max_entries_per_shard)
+  {
+    remove(shard, shard.entries.find(shard.order.back()));
+    shard.stats.evictions++;
+
+    if (_evictions_tbl)
+    {
+      _evictions_tbl->increment();
+    }
+  }
+
+  shard.order.push_front(key);
+
+  Entry& entry = shard.entries[key];
+  entry.value = value;
+  entry.expires = Clock::now() + _ttl;
+  entry.order_it = shard.order.begin();
+}
+
+template <class V>
+void ShardedTtlMap<V>::invalidate(const std::vector<std::string>& keys)
+{
+  for (const std::string& key : keys)
+  {
+    Shard& shard = shard_for(key);
+    std::lock_guard<std::mutex> lock(shard.lock);
+
+    shard.generation++;
+
+    typename std::unordered_map<std::string, Entry>::iterator it =
+      shard.entries.find(key);
+
+    if (it != shard.entries.end())
+    {
+      remove(shard, it);
+      shard.stats.invalidations++;
+    }
+  }
+}
+
+template <class V>
+typename ShardedTtlMap<V>::Stats ShardedTtlMap<V>::get_stats()
+{
+  Stats stats = Stats();
+
+  for (Shard& shard : _shards)
+  {
+    std::lock_guard<std::mutex> lock(shard.lock);
+    stats.hits += shard.stats.hits;
+    stats.misses += shard.stats.misses;
+    stats.evictions += shard.stats.evictions;
+    stats.expiries += shard.stats.expiries;
+    stats.invalidations += shard.stats.invalidations;
+    stats.entries += shard.entries.size();
+  }
+
+  return stats;
+}
+
+#endif
@@ -0,0 +1,75 @@
+/**
+ * @file shared_profile_cache.h In-process cache of shared service profiles
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef SHARED_PROFILE_CACHE_H_
+#define SHARED_PROFILE_CACHE_H_
+
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// A cache of the shared service profiles that IMPUs in a store refer to,
+// keyed by their reference. Alongside each profile it records how long the
+// profile is known to be held in the store for, so that writing an IMPU
+// only needs to write its profile when that lease wouldn't outlive the IMPU.
+//
+// Shared profiles are content addressed, so an entry can never be stale. The
+// cache just holds the most recently used profiles, up to a maximum number.
+// It is safe to use from multiple threads.
+class SharedProfileCache
+{
+public:
+  SharedProfileCache(size_t max_entries) : _max_entries(max_entries) {}
+
+  // Get the profile with the given reference, as it is held in the store.
+  // Returns false if it isn't cached.
+  bool get(const std::string& reference, std::string& profile);
+
+  // Add a profile to the cache, recording that it's held in the store until
+  // at least lease_expiry (0 if that isn't known).
+  void put(const std::string& reference,
+           const std::string& profile,
+           int64_t lease_expiry);
+
+  // Returns the time until which the profile is known to be held in the
+  // store, or 0 if it isn't known.
+  int64_t lease_expiry(const std::string& reference);
+
+  // Forget a profile, e.g. because it's turned out to be missing from the
+  // store.
+  void remove(const std::string& reference);
+
+  size_t size();
+
+private:
+  struct Entry
+  {
+    std::string profile;
+    int64_t lease_expiry;
+    std::list<std::string>::iterator lru_position;
+  };
+
+  // Mark an entry as the most recently used. Must be called with the lock
+  // held.
+  void touch(Entry& entry);
+
+  const size_t _max_entries;
+
+  std::mutex _lock;
+  std::unordered_map<std::string, Entry> _entries;
+
+  // References, most recently used first
+  std::list<std::string> _lru;
+};
+
+#endif
@@ -9,6 +9,9 @@ homestead:
 homestead_test:
 	${MAKE} -C ${HOMESTEAD_DIR} test
 
+homestead_bench:
+	${MAKE} -C ${HOMESTEAD_DIR} bench
+
 homestead_full_test:
 	${MAKE} -C ${HOMESTEAD_DIR} full_test
 
@@ -17,4 +20,4 @@ homestead_clean:
 
 homestead_distclean: homestead_clean
 
-.PHONY: homestead homestead_test homestead_clean homestead_distclean
+.PHONY: homestead homestead_test homestead_bench homestead_clean homestead_distclean
@@ -42,7 +42,6 @@ Store::Status BaseHssCache::get_implicit_registration_sets_for_impus(const std::
     if (inner_status == Store::Status::OK)
     {
       result.push_back(irs);
-      break;
     }
     // LCOV_EXCL_START
     // Not hittable in UTs
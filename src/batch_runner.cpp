@@ -0,0 +1,109 @@
+/**
+ * @file batch_runner.cpp Runs batches of independent jobs concurrently
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "batch_runner.h"
+
+#include <algorithm>
+
+BatchRunner::BatchRunner(int num_threads,
+                         ExceptionHandler* exception_handler) :
+  _thread_pool(num_threads, exception_handler, exception_callback, 0),
+  _num_threads(num_threads)
+{
+  _thread_pool.start();
+}
+
+BatchRunner::~BatchRunner()
+{
+  _thread_pool.stop();
+  _thread_pool.join();
+}
+
+void BatchRunner::run(size_t num_jobs, Job job, size_t max_parallel)
+{
+  run_batch(std::make_shared<Batch>(num_jobs,
+                                    [job](size_t index, Utils::StopWatch*)
+                                    {
+                                      job(index);
+                                    },
+                                    false),
+            max_parallel);
+}
+
+unsigned long BatchRunner::run_timed(size_t num_jobs,
+                                     TimedJob job,
+                                     size_t max_parallel)
+{
+  std::shared_ptr<Batch> batch = std::make_shared<Batch>(num_jobs, job, true);
+  run_batch(batch, max_parallel);
+
+  // Every thread records its time before the last of its jobs is counted as
+  // finished, so this is complete
+  std::lock_guard<std::mutex> lock(batch->lock);
+  return batch->max_thread_time;
+}
+
+void BatchRunner::run_batch(std::shared_ptr<Batch> batch, size_t max_parallel)
+{
+  // The calling thread is one of the parallel threads, and there's no point
+  // asking for more helpers than there are jobs for them
+  size_t num_helpers = std::min(std::min(max_parallel, batch->num_jobs),
+                                _num_threads + 1);
+  num_helpers = (num_helpers > 0) ? num_helpers - 1 : 0;
+
+  for (size_t ii = 0; ii < num_helpers; ii++)
+  {
+    _thread_pool.add_work([batch]()->void { run_jobs(batch); });
+  }
+
+  run_jobs(batch);
+
+  // Wait for the jobs the pool threads picked up
+  std::unique_lock<std::mutex> lock(batch->lock);
+  batch->cond.wait(lock, [&batch]() {
+    return batch->num_finished == batch->num_jobs;
+  });
+}
+
+void BatchRunner::run_jobs(std::shared_ptr<Batch> batch)
+{
+  size_t index;
+
+  // The total time this thread has spent running the batch's jobs
+  unsigned long thread_time = 0;
+
+  while ((index = batch->next_job++) < batch->num_jobs)
+  {
+    if (batch->timed)
+    {
+      Utils::StopWatch job_stopwatch;
+      job_stopwatch.start();
+      batch->job(index, &job_stopwatch);
+
+      unsigned long job_time = 0;
+      job_stopwatch.read(job_time);
+      thread_time += job_time;
+    }
+    else
+    {
+      batch->job(index, nullptr);
+    }
+
+    std::lock_guard<std::mutex> lock(batch->lock);
+    batch->max_thread_time = std::max(batch->max_thread_time, thread_time);
+    batch->num_finished++;
+
+    if (batch->num_finished == batch->num_jobs)
+    {
+      batch->cond.notify_all();
+    }
+  }
+}
@@ -0,0 +1,254 @@
+/**
+ * @file cas_retry_policy.cpp Backoff and limits for retrying writes to the
+ * IMPU stores that hit contention
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "cas_retry_policy.h"
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <thread>
+
+#include "log.h"
+
+const int CasRetryPolicy::DEFAULT_MAX_RETRIES;
+const size_t CasRetryPolicy::DEFAULT_HOT_KEYS;
+
+CasRetryPolicy::CasRetryPolicy(int max_retries,
+                               uint64_t min_backoff_us,
+                               uint64_t max_backoff_us,
+                               size_t num_hot_keys) :
+  _max_retries(max_retries),
+  _min_backoff_us(min_backoff_us),
+  _max_backoff_us(std::max(min_backoff_us, max_backoff_us)),
+  _num_hot_keys(num_hot_keys),
+  _stats(),
+  _num_tracked(0),
+  _contentions_tbl(nullptr),
+  _exhausted_tbl(nullptr),
+  _backoff_tbl(nullptr),
+  _hot_key_tbl(nullptr)
+{
+}
+
+void CasRetryPolicy::configure_stats_tables(SNMP::CounterTable* contentions_table,
+                                            SNMP::CounterTable* exhausted_table,
+                                            SNMP::EventAccumulatorTable* backoff_table,
+                                            SNMP::EventAccumulatorTable* hot_key_table)
+{
+  _contentions_tbl = contentions_table;
+  _exhausted_tbl = exhausted_table;
+  _backoff_tbl = backoff_table;
+  _hot_key_tbl = hot_key_table;
+}
+
+const char* CasRetryPolicy::table_name(Table table)
+{
+  switch (table)
+  {
+  case IMPU:
+    return "impu";
+
+  case IMPI_MAPPING:
+    return "impi_mapping";
+
+  default:
+    return "unknown"; // LCOV_EXCL_LINE
+  }
+}
+
+uint64_t CasRetryPolicy::backoff_us(int retries)
+{
+  if (_max_backoff_us == 0)
+  {
+    return 0;
+  }
+
+  // The limit doubles with each retry, so stop doubling once it's reached the
+  // cap (which also keeps the shift in range)
+  uint64_t limit = _min_backoff_us;
+
+  for (int ii = 0; (ii < retries) && (limit < _max_backoff_us); ii++)
+  {
+    limit = std::max(limit * 2, (uint64_t)1);
+  }
+
+  limit = std::min(limit, _max_backoff_us);
+
+  // Wait for a random time up to the limit ("full jitter")
+  thread_local std::mt19937_64 rng(std::random_device{}());
+  std::uniform_int_distribution<uint64_t> jitter(0, limit);
+
+  return jitter(rng);
+}
+
+bool CasRetryPolicy::should_retry(Table table,
+                                  const std::string& key,
+                                  int& retries,
+                                  Locks* locks)
+{
+  bool retry = (retries < _max_retries);
+  uint64_t backoff = retry ? backoff_us(retries) : 0;
+  uint64_t key_contentions;
+
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    Stats& stats = _stats[table];
+    stats.contentions++;
+
+    if (retry)
+    {
+      stats.retries++;
+      stats.backoff_us += backoff;
+    }
+    else
+    {
+      stats.exhausted++;
+    }
+
+    key_contentions = record_hot_key(table, key);
+  }
+
+  if (_contentions_tbl)
+  {
+    _contentions_tbl->increment();
+
+    if (retry)
+    {
+      _backoff_tbl->accumulate(backoff);
+    }
+    else
+    {
+      _exhausted_tbl->increment();
+    }
+
+    _hot_key_tbl->accumulate(key_contentions);
+  }
+
+  if (!retry)
+  {
+    TRC_WARNING("Giving up writing %s %s after %d retries due to contention",
+                table_name(table),
+                key.c_str(),
+                retries);
+    return false;
+  }
+
+  TRC_DEBUG("Contention writing %s %s, retrying in %lu us",
+            table_name(table),
+            key.c_str(),
+            backoff);
+
+  if (backoff > 0)
+  {
+    if (locks)
+    {
+      for (std::unique_lock<std::mutex>& lock : *locks)
+      {
+        lock.unlock();
+      }
+    }
+
+    std::this_thread::sleep_for(std::chrono::microseconds(backoff));
+
+    if (locks)
+    {
+      for (std::unique_lock<std::mutex>& lock : *locks)
+      {
+        lock.lock();
+      }
+    }
+  }
+
+  retries++;
+  return true;
+}
+
+uint64_t CasRetryPolicy::record_hot_key(Table table, const std::string& key)
+{
+  if (_num_hot_keys == 0)
+  {
+    return 0;
+  }
+
+  std::unordered_map<std::string, uint64_t>::iterator it =
+    _hot_keys[table].find(key);
+
+  if (it != _hot_keys[table].end())
+  {
+    return ++it->second;
+  }
+
+  uint64_t count = 0;
+
+  if (_num_tracked < _num_hot_keys)
+  {
+    _num_tracked++;
+  }
+  else
+  {
+    // Replace the least contended key. This is only done on the contention
+    // path and the number of keys is small, so just search for it.
+    Table min_table = IMPU;
+    std::unordered_map<std::string, uint64_t>::iterator min_it;
+    bool found = false;
+
+    for (int t = 0; t < NUM_TABLES; t++)
+    {
+      for (std::unordered_map<std::string, uint64_t>::iterator jt = _hot_keys[t].begin();
+           jt != _hot_keys[t].end();
+           ++jt)
+      {
+        if ((!found) || (jt->second < min_it->second))
+        {
+          min_table = (Table)t;
+          min_it = jt;
+          found = true;
+        }
+      }
+    }
+
+    count = min_it->second;
+    _hot_keys[min_table].erase(min_it);
+  }
+
+  _hot_keys[table][key] = count + 1;
+  return count + 1;
+}
+
+CasRetryPolicy::Stats CasRetryPolicy::get_stats(Table table)
+{
+  std::lock_guard<std::mutex> lock(_lock);
+  return _stats[table];
+}
+
+std::vector<CasRetryPolicy::HotKey> CasRetryPolicy::get_hot_keys()
+{
+  std::vector<HotKey> hot_keys;
+
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+
+    for (int t = 0; t < NUM_TABLES; t++)
+    {
+      for (const std::pair<const std::string, uint64_t>& entry : _hot_keys[t])
+      {
+        hot_keys.push_back({ (Table)t, entry.first, entry.second });
+      }
+    }
+  }
+
+  std::stable_sort(hot_keys.begin(), hot_keys.end(), [](const HotKey& a, const HotKey& b) {
+    return a.contentions > b.contentions;
+  });
+
+  return hot_keys;
+}
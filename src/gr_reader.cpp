@@ -0,0 +1,36 @@
+/**
+ * @file gr_reader.cpp Hedged reads from the IMPU stores at remote sites
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "gr_reader.h"
+
+#include "log.h"
+
+using std::placeholders::_1;
+
+// LCOV_EXCL_START
+static void pause_stopwatch(Utils::StopWatch* stopwatch, const std::string& reason)
+{
+  TRC_DEBUG("Pausing stopwatch due to %s", reason.c_str());
+  stopwatch->stop();
+}
+
+static void resume_stopwatch(Utils::StopWatch* stopwatch, const std::string& reason)
+{
+  TRC_DEBUG("Resuming stopwatch due to %s", reason.c_str());
+  stopwatch->start();
+}
+// LCOV_EXCL_STOP
+
+Utils::IOHook* create_hook(Utils::StopWatch* stopwatch)
+{
+  return new Utils::IOHook(std::bind(pause_stopwatch, stopwatch, _1),
+                           std::bind(resume_stopwatch, stopwatch, _1));
+}
@@ -11,9 +11,10 @@
 
 #include "hss_cache_processor.h"
 
-// HSS Cache Processor is just plumbing - placing things on a FunctorThreadPool,
-// calling the callbacks when they complete. All of the interesting business
-// logic is delegated to the underlying HSS Cache, which is separately tested.
+// HSS Cache Processor is just plumbing - placing things on a FunctorThreadPool
+// and calling the callbacks when they complete. All of the interesting
+// business logic is delegated to the underlying HSS Cache and the
+// IrsReadCoalescer, which are separately tested.
 //
 // LCOV_EXCL_START
 
@@ -57,6 +58,17 @@ void HssCacheProcessor::wait_stopped()
   }
 }
 
+progress_callback HssCacheProcessor::written_progress_callback(progress_callback progress_cb)
+{
+  return [this, progress_cb]()->void
+  {
+    // The caller may answer its request once this is called, so any request
+    // that follows mustn't share a read made before the write
+    _irs_reads.irss_written();
+    progress_cb();
+  };
+}
+
 ImplicitRegistrationSet* HssCacheProcessor::create_implicit_registration_set()
 {
   return _cache->create_implicit_registration_set();
@@ -68,24 +80,26 @@ void HssCacheProcessor::get_implicit_registration_set_for_impu(irs_success_callb
                                                                 SAS::TrailId trail,
                                                                 Utils::StopWatch* stopwatch)
 {
+  std::shared_ptr<IrsReadCoalescer::Read> read =
+    _irs_reads.join_or_start(impu, success_cb, failure_cb);
+
+  if (!read)
+  {
+    // We've joined a read that's already in progress
+    return;
+  }
+
   // Create a work item that can run on the thread pool, capturing required
-  // variables to complete the work
-  std::function<void()> work = [this, impu, trail, success_cb, failure_cb, stopwatch]()->void
+  // variables to complete the work. If the work is never done, or throws,
+  // destroying the read fails the requests waiting for it.
+  std::function<void()> work = [this, trail, read, stopwatch]()->void
   {
     ImplicitRegistrationSet* result = NULL;
-    Store::Status rc = _cache->get_implicit_registration_set_for_impu(impu,
+    Store::Status rc = _cache->get_implicit_registration_set_for_impu(read->impu(),
                                                                       trail,
                                                                       stopwatch,
                                                                       result);
-
-    if (rc == Store::Status::OK)
-    {
-      success_cb(result);
-    }
-    else
-    {
-      failure_cb(rc);
-    }
+    read->complete(rc, result);
   };
 
   // Add the work to the pool
@@ -163,7 +177,8 @@ void HssCacheProcessor::put_implicit_registration_set(void_success_cb success_cb
   // variables to complete the work
   std::function<void()> work = [this, irs, trail, success_cb, progress_cb, failure_cb, stopwatch]()->void
   {
-    Store::Status rc = _cache->put_implicit_registration_set(irs, progress_cb, trail, stopwatch);
+    Store::Status rc = _cache->put_implicit_registration_set(irs, written_progress_callback(progress_cb), trail, stopwatch);
+    _irs_reads.irss_written();
 
     if (rc == Store::Status::OK)
     {
@@ -190,7 +205,8 @@ void HssCacheProcessor::delete_implicit_registration_set(void_success_cb success
   // variables to complete the work
   std::function<void()> work = [this, irs, trail, success_cb, progress_cb, failure_cb, stopwatch]()->void
   {
-    Store::Status rc = _cache->delete_implicit_registration_set(irs, progress_cb, trail, stopwatch);
+    Store::Status rc = _cache->delete_implicit_registration_set(irs, written_progress_callback(progress_cb), trail, stopwatch);
+    _irs_reads.irss_written();
 
     if (rc == Store::Status::OK)
     {
@@ -217,7 +233,8 @@ void HssCacheProcessor::delete_implicit_registration_sets(void_success_cb succes
   // variables to complete the work
   std::function<void()> work = [this, irss, trail, success_cb, progress_cb, failure_cb, stopwatch]()->void
   {
-    Store::Status rc = _cache->delete_implicit_registration_sets(irss, progress_cb, trail, stopwatch);
+    Store::Status rc = _cache->delete_implicit_registration_sets(irss, written_progress_callback(progress_cb), trail, stopwatch);
+    _irs_reads.irss_written();
 
     if (rc == Store::Status::OK)
     {
@@ -271,7 +288,8 @@ void HssCacheProcessor::put_ims_subscription(void_success_cb success_cb,
   // variables to complete the work
   std::function<void()> work = [this, subscription, trail, success_cb, progress_cb, failure_cb, stopwatch]()->void
   {
-    Store::Status rc = _cache->put_ims_subscription(subscription, progress_cb, trail, stopwatch);
+    Store::Status rc = _cache->put_ims_subscription(subscription, written_progress_callback(progress_cb), trail, stopwatch);
+    _irs_reads.irss_written();
 
     if (rc == Store::Status::OK)
     {
@@ -0,0 +1,260 @@
+/**
+ * @file impu_codec.cpp Codecs for compressing IMPU records
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "impu_codec.h"
+
+#include <cstring>
+#include <zlib.h>
+
+#include "impu_store.h"
+#include "log.h"
+
+// Deflate is only chosen where we're prepared to spend CPU to save memory, so
+// use its best compression.
+static const int DEFLATE_LEVEL = Z_BEST_COMPRESSION;
+
+// We use raw deflate, as the record header already identifies the codec and
+// the length, so zlib's own header and checksum would be wasted bytes. Raw
+// deflate still supports preset dictionaries (the last 32KB are used).
+static const int DEFLATE_WINDOW_BITS = -15;
+static const int DEFLATE_MEM_LEVEL = 8;
+
+class RawImpuCodec : public ImpuCodec
+{
+public:
+  const char* name() const { return "raw"; }
+
+  bool compress(const std::string& data,
+                uint8_t dictionary_id,
+                std::string& compressed)
+  {
+    compressed.append(data);
+    return true;
+  }
+
+  bool decompress(const char* compressed,
+                  size_t size,
+                  uint8_t dictionary_id,
+                  std::string& uncompressed)
+  {
+    if (size != uncompressed.size())
+    {
+      TRC_WARNING("Raw IMPU data is %lu bytes, expected %lu",
+                  size, uncompressed.size());
+      return false;
+    }
+
+    memcpy(&uncompressed[0], compressed, size);
+    return true;
+  }
+};
+
+class Lz4ImpuCodec : public ImpuCodec
+{
+public:
+  const char* name() const { return "lz4"; }
+
+  bool compress(const std::string& data,
+                uint8_t dictionary_id,
+                std::string& compressed)
+  {
+    return ImpuStore::Impu::compress_data_v0(data, compressed, dictionary_id);
+  }
+
+  bool decompress(const char* compressed,
+                  size_t size,
+                  uint8_t dictionary_id,
+                  std::string& uncompressed)
+  {
+    const std::string* dictionary = ImpuStore::get_dictionary(dictionary_id);
+
+    int rc = LZ4_decompress_safe_usingDict(compressed,
+                                           &uncompressed[0],
+                                           size,
+                                           uncompressed.size(),
+                                           dictionary->c_str(),
+                                           dictionary->size());
+
+    if (rc <= 0 || (size_t)rc != uncompressed.size())
+    {
+      TRC_WARNING("Failed to decompress LZ4 IMPU data - read %d/%lu",
+                  rc, uncompressed.size());
+      return false;
+    }
+
+    return true;
+  }
+};
+
+class DeflateImpuCodec : public ImpuCodec
+{
+public:
+  const char* name() const { return "deflate"; }
+
+  bool compress(const std::string& data,
+                uint8_t dictionary_id,
+                std::string& compressed)
+  {
+    const std::string* dictionary = ImpuStore::get_dictionary(dictionary_id);
+    z_stream* stream = get_deflate_stream();
+
+    if ((stream == nullptr) ||
+        (deflateReset(stream) != Z_OK) ||
+        (deflateSetDictionary(stream,
+                              (const Bytef*)dictionary->data(),
+                              dictionary->size()) != Z_OK))
+    {
+      // LCOV_EXCL_START - only fails on memory exhaustion
+      TRC_WARNING("Failed to prepare deflate stream");
+      return false;
+      // LCOV_EXCL_STOP
+    }
+
+    // deflateBound gives the largest possible output, so a single call to
+    // deflate always completes.
+    size_t offset = compressed.size();
+    compressed.resize(offset + deflateBound(stream, data.size()));
+
+    stream->next_in = (Bytef*)data.data();
+    stream->avail_in = data.size();
+    stream->next_out = (Bytef*)&compressed[offset];
+    stream->avail_out = compressed.size() - offset;
+
+    int rc = deflate(stream, Z_FINISH);
+    compressed.resize(offset + stream->total_out);
+
+    if (rc != Z_STREAM_END)
+    {
+      // LCOV_EXCL_START
+      TRC_WARNING("Failed to deflate IMPU data: %d", rc);
+      compressed.resize(offset);
+      return false;
+      // LCOV_EXCL_STOP
+    }
+
+    return true;
+  }
+
+  bool decompress(const char* compressed,
+                  size_t size,
+                  uint8_t dictionary_id,
+                  std::string& uncompressed)
+  {
+    const std::string* dictionary = ImpuStore::get_dictionary(dictionary_id);
+    z_stream* stream = get_inflate_stream();
+
+    if ((stream == nullptr) ||
+        (inflateReset(stream) != Z_OK) ||
+        (inflateSetDictionary(stream,
+                              (const Bytef*)dictionary->data(),
+                              dictionary->size()) != Z_OK))
+    {
+      // LCOV_EXCL_START - only fails on memory exhaustion
+      TRC_WARNING("Failed to prepare inflate stream");
+      return false;
+      // LCOV_EXCL_STOP
+    }
+
+    stream->next_in = (Bytef*)compressed;
+    stream->avail_in = size;
+    stream->next_out = (Bytef*)&uncompressed[0];
+    stream->avail_out = uncompressed.size();
+
+    int rc = inflate(stream, Z_FINISH);
+
+    if ((rc != Z_STREAM_END) ||
+        (stream->total_out != uncompressed.size()) ||
+        (stream->avail_in != 0))
+    {
+      TRC_WARNING("Failed to inflate IMPU data: %d - read %lu/%lu",
+                  rc, stream->total_out, uncompressed.size());
+      return false;
+    }
+
+    return true;
+  }
+
+private:
+  // Setting up a deflate stream allocates a few hundred KB, so each thread
+  // keeps one of each for its lifetime and resets it between records.
+  static thread_local z_stream* _thrd_deflate_stream;
+  static thread_local z_stream* _thrd_inflate_stream;
+
+  static z_stream* get_deflate_stream()
+  {
+    if (_thrd_deflate_stream == nullptr)
+    {
+      z_stream* stream = new z_stream();
+
+      if (deflateInit2(stream,
+                       DEFLATE_LEVEL,
+                       Z_DEFLATED,
+                       DEFLATE_WINDOW_BITS,
+                       DEFLATE_MEM_LEVEL,
+                       Z_DEFAULT_STRATEGY) != Z_OK)
+      {
+        // LCOV_EXCL_START
+        delete stream;
+        return nullptr;
+        // LCOV_EXCL_STOP
+      }
+
+      _thrd_deflate_stream = stream;
+    }
+
+    return _thrd_deflate_stream;
+  }
+
+  static z_stream* get_inflate_stream()
+  {
+    if (_thrd_inflate_stream == nullptr)
+    {
+      z_stream* stream = new z_stream();
+
+      if (inflateInit2(stream, DEFLATE_WINDOW_BITS) != Z_OK)
+      {
+        // LCOV_EXCL_START
+        delete stream;
+        return nullptr;
+        // LCOV_EXCL_STOP
+      }
+
+      _thrd_inflate_stream = stream;
+    }
+
+    return _thrd_inflate_stream;
+  }
+};
+
+thread_local z_stream* DeflateImpuCodec::_thrd_deflate_stream;
+thread_local z_stream* DeflateImpuCodec::_thrd_inflate_stream;
+
+static RawImpuCodec raw_codec;
+static Lz4ImpuCodec lz4_codec;
+static DeflateImpuCodec deflate_codec;
+
+// The codec registry, indexed by codec ID
+static ImpuCodec* const CODECS[] =
+{
+  &raw_codec,
+  &lz4_codec,
+  &deflate_codec
+};
+
+ImpuCodec* ImpuCodec::get(uint8_t id)
+{
+  if (id >= sizeof(CODECS) / sizeof(CODECS[0]))
+  {
+    return nullptr;
+  }
+
+  return CODECS[id];
+}
@@ -0,0 +1,128 @@
+/**
+ * @file impu_dictionary.cpp Training of IMPU compression dictionaries
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "impu_dictionary.h"
+
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "log.h"
+
+// The length of the k-mers that segments are scored on. LZ4 needs a match of
+// at least 4 bytes, and 8 bytes lets us pack a k-mer into an integer.
+static const size_t KMER_LEN = 8;
+
+// The length of the segments that the dictionary is built from
+static const size_t SEGMENT_LEN = 64;
+
+static uint64_t kmer_at(const std::string& sample, size_t pos)
+{
+  uint64_t kmer;
+  memcpy(&kmer, sample.data() + pos, KMER_LEN);
+  return kmer;
+}
+
+std::string ImpuDictionary::train(const std::vector<std::string>& samples,
+                                  size_t max_size)
+{
+  // Count the number of samples that each k-mer appears in.
+  std::unordered_map<uint64_t, uint32_t> counts;
+
+  for (const std::string& sample : samples)
+  {
+    std::unordered_set<uint64_t> seen;
+
+    for (size_t pos = 0; pos + KMER_LEN <= sample.size(); pos++)
+    {
+      if (seen.insert(kmer_at(sample, pos)).second)
+      {
+        counts[kmer_at(sample, pos)]++;
+      }
+    }
+  }
+
+  TRC_DEBUG("Training dictionary from %lu samples with %lu distinct k-mers",
+            samples.size(), counts.size());
+
+  std::string dictionary;
+
+  while (dictionary.size() < max_size)
+  {
+    // Find the segment with the highest score - the sum of the counts of the
+    // k-mers it contains. We slide a window over each sample, so that each
+    // pass is linear in the total size of the samples.
+    uint64_t best_score = 0;
+    const std::string* best_sample = nullptr;
+    size_t best_pos = 0;
+    size_t best_len = 0;
+
+    for (const std::string& sample : samples)
+    {
+      if (sample.size() < KMER_LEN)
+      {
+        continue;
+      }
+
+      size_t segment_len = std::min(SEGMENT_LEN, sample.size());
+      size_t kmers = segment_len - KMER_LEN + 1;
+      uint64_t score = 0;
+
+      for (size_t ii = 0; ii < kmers; ii++)
+      {
+        score += counts[kmer_at(sample, ii)];
+      }
+
+      for (size_t pos = 0; ; pos++)
+      {
+        if (score > best_score)
+        {
+          best_score = score;
+          best_sample = &sample;
+          best_pos = pos;
+          best_len = segment_len;
+        }
+
+        if (pos + segment_len >= sample.size())
+        {
+          break;
+        }
+
+        score -= counts[kmer_at(sample, pos)];
+        score += counts[kmer_at(sample, pos + kmers)];
+      }
+    }
+
+    if (best_score == 0)
+    {
+      // Every k-mer that appears in the samples is already covered.
+      break;
+    }
+
+    std::string segment = best_sample->substr(best_pos,
+                                              std::min(best_len,
+                                                       max_size - dictionary.size()));
+
+    // The k-mers in this segment are now in the dictionary, so are worth
+    // nothing to later segments.
+    for (size_t pos = best_pos; pos + KMER_LEN <= best_pos + best_len; pos++)
+    {
+      counts[kmer_at(*best_sample, pos)] = 0;
+    }
+
+    dictionary.insert(0, segment);
+  }
+
+  TRC_DEBUG("Trained dictionary of %lu bytes", dictionary.size());
+
+  return dictionary;
+}
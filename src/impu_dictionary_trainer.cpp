@@ -0,0 +1,261 @@
+/**
+ * @file impu_dictionary_trainer.cpp Offline tool for training IMPU compression
+ * dictionaries
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <getopt.h>
+#include <sys/socket.h>
+#include <fstream>
+#include <iostream>
+#include <random>
+
+#include "astaire_resolver.h"
+#include "dnscachedresolver.h"
+#include "impu_dictionary.h"
+#include "impu_store.h"
+#include "log.h"
+#include "memcachedstore.h"
+
+// Reads a list of IMPUs (one per line) from stdin, samples records for them
+// from the IMPU store, and writes out a dictionary trained on the samples.
+//
+// The dictionary should be installed on every node under a new ID (see
+// ImpuStore::dictionary_file), and only once every node has it should the
+// --impu-store-dictionary option be changed to start writing with it.
+
+struct options
+{
+  std::string impu_store;
+  std::string dns_server;
+  std::string dictionary_dir;
+  std::string output;
+  int samples;
+  int size;
+};
+
+enum OptionTypes
+{
+  IMPU_STORE = 128,
+  DNS_SERVER,
+  DICTIONARIES,
+  OUTPUT,
+  SAMPLES,
+  SIZE,
+  HELP,
+};
+
+const static struct option long_opt[] =
+{
+  {"impu-store",   required_argument, NULL, IMPU_STORE},
+  {"dns-server",   required_argument, NULL, DNS_SERVER},
+  {"dictionaries", required_argument, NULL, DICTIONARIES},
+  {"output",       required_argument, NULL, OUTPUT},
+  {"samples",      required_argument, NULL, SAMPLES},
+  {"size",         required_argument, NULL, SIZE},
+  {"help",         no_argument,       NULL, HELP},
+  {NULL,           0,                 NULL, 0},
+};
+
+void usage(void)
+{
+  puts("Usage: homestead_dict_trainer --output <file> [options] < impus\n"
+       "\n"
+       "Options:\n"
+       "\n"
+       "     --impu-store <domain>[:<port>]\n"
+       "                            Location of the IMPU store (default: 127.0.0.1)\n"
+       "     --dns-server <address> DNS server to resolve the IMPU store with\n"
+       "                            (default: 127.0.0.1)\n"
+       "     --dictionaries <directory>\n"
+       "                            Directory holding the dictionaries already in\n"
+       "                            use, needed to read records written with them\n"
+       "     --output <file>        File to write the trained dictionary to\n"
+       "     --samples N            Number of records to sample (default: 1000)\n"
+       "     --size N               Maximum dictionary size in bytes (default: 16384)\n"
+       "     --help                 Show this help screen\n");
+}
+
+int init_options(int argc, char** argv, struct options& options)
+{
+  int opt;
+  int long_opt_ind;
+
+  while ((opt = getopt_long(argc, argv, "", long_opt, &long_opt_ind)) != -1)
+  {
+    switch (opt)
+    {
+    case IMPU_STORE:
+      options.impu_store = std::string(optarg);
+      break;
+
+    case DNS_SERVER:
+      options.dns_server = std::string(optarg);
+      break;
+
+    case DICTIONARIES:
+      options.dictionary_dir = std::string(optarg);
+      break;
+
+    case OUTPUT:
+      options.output = std::string(optarg);
+      break;
+
+    case SAMPLES:
+      options.samples = atoi(optarg);
+      break;
+
+    case SIZE:
+      options.size = atoi(optarg);
+      break;
+
+    default:
+      usage();
+      return -1;
+    }
+  }
+
+  if (options.output.empty())
+  {
+    fprintf(stderr, "An output file must be specified\n");
+    usage();
+    return -1;
+  }
+
+  if ((options.samples <= 0) ||
+      (options.size <= 0) ||
+      ((size_t)options.size > ImpuStore::MAX_DICTIONARY_LEN))
+  {
+    fprintf(stderr,
+            "Sample count must be positive, and size must be between 1 and %lu\n",
+            ImpuStore::MAX_DICTIONARY_LEN);
+    return -1;
+  }
+
+  return 0;
+}
+
+int main(int argc, char** argv)
+{
+  struct options options;
+  options.impu_store = "127.0.0.1";
+  options.dns_server = "127.0.0.1";
+  options.samples = 1000;
+  options.size = 16384;
+
+  if (init_options(argc, argv, options) != 0)
+  {
+    return 1;
+  }
+
+  if ((!options.dictionary_dir.empty()) &&
+      (!ImpuStore::load_dictionaries(options.dictionary_dir)))
+  {
+    fprintf(stderr, "Failed to load dictionaries from %s\n",
+            options.dictionary_dir.c_str());
+    return 1;
+  }
+
+  // Reservoir sample the IMPUs, so that every IMPU is equally likely to be
+  // picked however many we're given.
+  std::vector<std::string> impus;
+  std::mt19937 rng(std::random_device{}());
+  std::string line;
+  uint64_t seen = 0;
+
+  while (std::getline(std::cin, line))
+  {
+    if (line.empty())
+    {
+      continue;
+    }
+
+    seen++;
+
+    if (impus.size() < (size_t)options.samples)
+    {
+      impus.push_back(line);
+    }
+    else
+    {
+      uint64_t slot = std::uniform_int_distribution<uint64_t>(0, seen - 1)(rng);
+
+      if (slot < (uint64_t)options.samples)
+      {
+        impus[slot] = line;
+      }
+    }
+  }
+
+  fprintf(stderr, "Sampling %lu of %lu IMPUs\n", impus.size(), seen);
+
+  DnsCachedResolver* dns_resolver =
+    new DnsCachedResolver({ options.dns_server }, 200, "/etc/clearwater/dns.json");
+  AstaireResolver* astaire_resolver = new AstaireResolver(dns_resolver,
+                                                          AF_INET,
+                                                          30);
+  Store* store = (Store*)new TopologyNeutralMemcachedStore(options.impu_store,
+                                                           astaire_resolver,
+                                                           false,
+                                                           nullptr);
+
+  std::vector<std::string> samples;
+
+  for (const std::string& impu : impus)
+  {
+    std::string data;
+    uint64_t cas;
+
+    if (store->get_data("impu", impu, data, cas, 0, false) != Store::Status::OK)
+    {
+      continue;
+    }
+
+    std::string uncompressed;
+
+    if (ImpuStore::Impu::decompress_data(data, uncompressed))
+    {
+      samples.push_back(uncompressed);
+    }
+  }
+
+  fprintf(stderr, "Read %lu records\n", samples.size());
+
+  int rc = 0;
+
+  if (samples.empty())
+  {
+    fprintf(stderr, "No records to train on\n");
+    rc = 1;
+  }
+  else
+  {
+    std::string dictionary = ImpuDictionary::train(samples, options.size);
+    std::ofstream file(options.output.c_str(),
+                       std::ios::out | std::ios::binary | std::ios::trunc);
+    file.write(dictionary.data(), dictionary.size());
+
+    if (!file)
+    {
+      fprintf(stderr, "Failed to write dictionary to %s\n", options.output.c_str());
+      rc = 1;
+    }
+    else
+    {
+      fprintf(stderr, "Wrote %lu byte dictionary to %s\n",
+              dictionary.size(), options.output.c_str());
+    }
+  }
+
+  delete store;
+  delete astaire_resolver;
+  delete dns_resolver;
+
+  return rc;
+}
@@ -12,10 +12,18 @@
 #include "impu_store.h"
 
 #include <climits>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <openssl/sha.h>
+#include <sstream>
 
+#include "impu_codec.h"
 #include "json_parse_utils.h"
 #include "log.h"
 
+#include <rapidjson/reader.h>
+
 const std::string ImpuStore::Impu::_dict_v0 =
   "{\"registration_state\":true,\"service_profile\":\"<IMSSubscription>"
   "<PrivateID></PrivateID><ServiceProfile><PublicIdentity><Identity>"
@@ -28,8 +36,12 @@ const std::string ImpuStore::Impu::_dict_v0 =
   "<SessionCase></SessionCase>\",\"expiry\":,\"assoc_impu\":[\"],\"impis\":[],"
   "\"ecfs\":[],\"ccfs\":[]}\"default_impu\":\"";
 
-thread_local LZ4_stream_t* ImpuStore::Impu::_thrd_lz4_stream;
-thread_local struct preserved_hash_table_entry_t* ImpuStore::Impu::_thrd_lz4_hash;
+thread_local LZ4_stream_t* ImpuStore::Impu::_thrd_lz4_streams[ImpuStore::MAX_DICTIONARIES];
+thread_local struct preserved_hash_table_entry_t* ImpuStore::Impu::_thrd_lz4_hashes[ImpuStore::MAX_DICTIONARIES];
+thread_local LZ4_stream_t* ImpuStore::Impu::_thrd_lz4_work_stream;
+thread_local std::string ImpuStore::Impu::_thrd_arena;
+
+std::map<uint8_t, std::string> ImpuStore::_dictionaries;
 
 // General
 static const char * const JSON_EXPIRY = "expiry";
@@ -48,13 +60,45 @@ static const char * const JSON_ECFS = "ecfs";
 // IMPI -> Default IMPU
 static const char * const JSON_DEFAULT_IMPUS = "default_impus";
 
+// Records written in version 1 onwards start with the same 0 byte as version 0
+// records, followed by a 0 byte marking an extended header, then the version,
+// the ID of the dictionary the record was compressed with and the ID of the
+// codec it was compressed with. A version 0 record never has a 0 in its second
+// byte, as that holds the varbyte encoded length of the (non-empty) JSON.
+static const char EXTENDED_HEADER = 0;
+static const char VERSION_1 = 1;
+
+// Version 2 records are laid out as version 1 records, except that the
+// compressed length of the binary record follows its uncompressed length, and
+// the service profile of a Default IMPU is left out of the binary record. It
+// follows the binary record instead, as [codec][varbyte length][compressed
+// service profile], compressed with the same dictionary as the rest of the
+// record. An empty service profile has no section.
+static const char VERSION_2 = 2;
+
+// Record types in the version 1 binary encoding
+static const char RECORD_DEFAULT_IMPU = 'D';
+static const char RECORD_ASSOCIATED_IMPU = 'A';
+
+// A Default IMPU whose service profile is shared. It's encoded as a Default
+// IMPU, with the reference to the shared profile in place of the profile.
+static const char RECORD_SHARED_DEFAULT_IMPU = 'S';
+
+// An IMPI mapping, stored as its expiry followed by its Default IMPUs.
+static const char RECORD_IMPI_MAPPING = 'M';
+
 // The default acceleration (1) is sufficient for us and gives best
 // compression.
 static const int ACCELERATION = 1;
 
-// The maximum buffer size to use for IMPU compression
-// 128 KB
-static const int MAX_BUFFER_LEN = 131072;
+// The largest arena a thread keeps between IMPUs. Anything bigger is only
+// needed for unusually large records, so is freed once they're done with.
+// 64 KB
+static const size_t MAX_ARENA_LEN = 65536;
+
+// The expiry to write a record with to have the store remove it straight
+// away (a negative expiry, as 0 means the record never expires).
+static const int EXPIRE_IMMEDIATELY = -1;
 
 void encode_varbyte(uint64_t uncomp_size, std::string& data)
 {
@@ -116,379 +160,1635 @@ uint64_t decode_varbyte(const std::string& data, size_t& offset)
   return length;
 }
 
-ImpuStore::Impu* ImpuStore::Impu::from_data(const std::string& impu,
-                                            std::string& data,
-                                            unsigned long cas,
-                                            ImpuStore* store)
+// Append an unsigned number to a binary record, in the same 7 bits per byte
+// format as encode_varbyte. Unlike encode_varbyte, this always writes at least
+// one byte, so can also be used for values of 0.
+static void write_uint(uint64_t value, std::string& data)
 {
-  if (data.size() == 0)
+  do
   {
-    // Invalid data
-    return nullptr;
+    char byte = value & 0x7f;
+    value = value >> 7;
+
+    if (value > 0)
+    {
+      byte |= 0x80;
+    }
+
+    data.push_back(byte);
+  } while (value != 0);
+}
+
+// Append a length prefixed string to a binary record
+static void write_string(const std::string& value, std::string& data)
+{
+  write_uint(value.size(), data);
+  data.append(value);
+}
+
+// Append a list of strings to a binary record. The list is front coded - each
+// entry is stored as the length of the prefix it shares with the previous
+// entry, followed by the length prefixed remainder. The order of the list is
+// preserved.
+template<class T>
+static void write_string_list(const T& values, std::string& data)
+{
+  static const std::string NO_PREVIOUS;
+  const std::string* previous = &NO_PREVIOUS;
+
+  write_uint(values.size(), data);
+
+  for (const std::string& value : values)
+  {
+    size_t max_shared = std::min(previous->size(), value.size());
+    size_t shared = 0;
+
+    while ((shared < max_shared) && ((*previous)[shared] == value[shared]))
+    {
+      shared++;
+    }
+
+    write_uint(shared, data);
+    write_uint(value.size() - shared, data);
+    data.append(value, shared, std::string::npos);
+
+    previous = &value;
   }
+}
 
-  // Version is stored in character 0.
-  if (data[0] == 0)
+// The read_* functions below decode fields written by the write_* functions
+// above, starting at offset, and advance offset past the field. They return
+// false, without altering the output, if the field runs off the end of the data
+// or is otherwise corrupt.
+static bool read_byte(const std::string& data, size_t& offset, char& value)
+{
+  if (offset >= data.size())
   {
-    // Version 0 - LZ4 compression
-    // Data is stored as [version][length][zlib4 compressed JSON]
-    size_t offset = 1;
+    return false;
+  }
+
+  value = data[offset++];
+  return true;
+}
 
-    // Size of uncompressed data
-    uint64_t length_long = decode_varbyte(data, offset);
+static bool read_uint(const std::string& data, size_t& offset, uint64_t& value)
+{
+  uint64_t result = 0;
+  size_t pos = offset;
 
-    if (length_long == 0)
+  // A 64 bit number never takes more than 10 bytes
+  for (int shift = 0; shift < 64; shift += 7)
+  {
+    if (pos >= data.size())
     {
-      // Data is corrupt
-      return nullptr;
+      return false;
+    }
+
+    char byte = data[pos++];
+    result |= ((uint64_t)(byte & 0x7f)) << shift;
+
+    if ((byte & 0x80) == 0)
+    {
+      value = result;
+      offset = pos;
+      return true;
     }
+  }
+
+  return false;
+}
+
+static bool read_string(const std::string& data, size_t& offset, std::string& value)
+{
+  uint64_t length;
+  size_t pos = offset;
 
-    int length = (int) length_long;
-    const char* compressed = data.c_str() + offset;
-    int compressed_size = data.size() - offset;
-    char* json = new char[length + 1];
-    json[length] = '\0';
+  if (!read_uint(data, pos, length) || (length > data.size() - pos))
+  {
+    return false;
+  }
+
+  value.assign(data, pos, length);
+  offset = pos + length;
+  return true;
+}
 
-    TRC_DEBUG("Decompressing %llu bytes of data into %llu bytes",
-              compressed_size,
-              length);
+template<class T>
+static bool read_string_list(const std::string& data, size_t& offset, T& values)
+{
+  uint64_t count;
+  size_t pos = offset;
 
-    int rc = LZ4_decompress_safe_usingDict(compressed,
-                                           json,
-                                           compressed_size,
-                                           length,
-                                           _dict_v0.c_str(),
-                                           _dict_v0.size());
+  // Each entry takes at least two bytes, which lets us reject a corrupt count
+  // before we start building the list.
+  if (!read_uint(data, pos, count) || (count > (data.size() - pos) / 2))
+  {
+    return false;
+  }
 
+  T result;
 
-    if (rc == 0 || rc != length)
+  for (uint64_t ii = 0; ii < count; ii++)
+  {
+    uint64_t shared;
+    uint64_t suffix;
+
+    if (!read_uint(data, pos, shared) ||
+        !read_uint(data, pos, suffix) ||
+        (suffix > data.size() - pos) ||
+        (result.empty() && (shared > 0)) ||
+        (!result.empty() && (shared > result.back().size())))
     {
-      TRC_WARNING("Failed to decompress LZ4 IMPU data - read %d/%d",
-                  rc, length);
+      return false;
+    }
 
-      delete[] json;
+    std::string value;
+    value.reserve(shared + suffix);
 
-      return nullptr;
+    if (shared > 0)
+    {
+      value.append(result.back(), 0, shared);
     }
-    else
+
+    value.append(data, pos, suffix);
+    pos += suffix;
+
+    result.push_back(std::move(value));
+  }
+
+  values.swap(result);
+  offset = pos;
+  return true;
+}
+
+// SAX handler for the version 0 JSON encodings of IMPUs and IMPI mappings.
+// It picks out the members of the root object that the records are built from
+// as the JSON is read, so no DOM is built, and skips everything else. It
+// matches the DOM based from_json functions member for member - where a
+// member is repeated, only the first occurrence is used, a member of the wrong
+// type is treated as absent, and only the string entries of arrays are kept.
+class JsonRecordHandler :
+  public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, JsonRecordHandler>
+{
+public:
+  JsonRecordHandler() :
+    is_object(false),
+    has_default_impu(false),
+    has_registration_state(false),
+    registration_state(false),
+    expiry(0L),
+    _depth(0),
+    _member(Member::NONE),
+    _in_array(false),
+    _seen(0)
+  {
+  }
+
+  bool StartObject()
+  {
+    if (_depth == 0)
     {
-      rapidjson::Document doc;
-      doc.Parse<0>(json);
+      is_object = true;
+    }
 
-      if (doc.HasParseError())
-      {
-        TRC_WARNING("Failed to parse IMPU as JSON %s - Error: %s",
-                    json,
-                    rapidjson::GetParseError_En(doc.GetParseError()));
-        delete[] json;
-        return nullptr;
-      }
-      else if (!doc.IsObject())
-      {
-        TRC_WARNING("IMPU JSON didn't represent object - %s",
-                    json);
-        delete[] json;
-        return nullptr;
-      }
-      else
+    _depth++;
+    return true;
+  }
+
+  bool EndObject(rapidjson::SizeType member_count)
+  {
+    return end_container();
+  }
+
+  bool StartArray()
+  {
+    if (_depth == 0)
+    {
+      // Not an object - stop parsing now, rather than reading the rest of it
+      return false;
+    }
+
+    if (_depth == 1)
+    {
+      _in_array = true;
+    }
+
+    _depth++;
+    return true;
+  }
+
+  bool EndArray(rapidjson::SizeType element_count)
+  {
+    return end_container();
+  }
+
+  bool Key(const char* str, rapidjson::SizeType length, bool copy)
+  {
+    if (_depth == 1)
+    {
+      _member = lookup(str, length);
+
+      if (_member != Member::NONE)
       {
-        // Successfully parsed the JSON, so we can reclaim the memory
-        delete[] json;
+        // Only the first occurrence of a member is used
+        unsigned bit = 1 << (int)_member;
 
-        if (doc.HasMember(JSON_DEFAULT_IMPU))
+        if (_seen & bit)
         {
-          return ImpuStore::AssociatedImpu::from_json(impu, doc, cas, store);
+          _member = Member::NONE;
         }
         else
         {
-          return ImpuStore::DefaultImpu::from_json(impu, doc, cas, store);
+          _seen |= bit;
+
+          if (_member == Member::DEFAULT_IMPU)
+          {
+            has_default_impu = true;
+          }
         }
       }
     }
+
+    return true;
   }
-  else
+
+  bool String(const char* str, rapidjson::SizeType length, bool copy)
   {
-    TRC_WARNING("Unknown IMPU version: %u", data[0]);
+    if (_depth == 1)
+    {
+      if (_member == Member::SERVICE_PROFILE)
+      {
+        service_profile.assign(str, length);
+      }
+      else if (_member == Member::DEFAULT_IMPU)
+      {
+        default_impu.assign(str, length);
+      }
+    }
+    else if ((_depth == 2) && _in_array)
+    {
+      switch (_member)
+      {
+      case Member::ASSOCIATED_IMPUS:
+        associated_impus.emplace_back(str, length);
+        break;
 
-    return nullptr;
+      case Member::IMPIS:
+        impis.emplace_back(str, length);
+        break;
+
+      case Member::CCFS:
+        ccfs.emplace_back(str, length);
+        break;
+
+      case Member::ECFS:
+        ecfs.emplace_back(str, length);
+        break;
+
+      case Member::DEFAULT_IMPUS:
+        default_impus.emplace_back(str, length);
+        break;
+
+      default:
+        break;
+      }
+    }
+
+    return scalar();
+  }
+
+  bool Bool(bool b)
+  {
+    if ((_depth == 1) && (_member == Member::REGISTRATION_STATE))
+    {
+      has_registration_state = true;
+      registration_state = b;
+    }
+
+    return scalar();
+  }
+
+  bool Int(int i) { return integer(i); }
+  bool Uint(unsigned u) { return integer(u); }
+  bool Int64(int64_t i) { return integer(i); }
+
+  bool Uint64(uint64_t u)
+  {
+    // Too big to be an expiry
+    return (u <= (uint64_t)LLONG_MAX) ? integer((int64_t)u) : scalar();
+  }
+
+  // Any other value (null or a double) just needs skipping
+  bool Default() { return scalar(); }
+
+  bool is_object;
+  bool has_default_impu;
+  bool has_registration_state;
+  bool registration_state;
+  int64_t expiry;
+  std::string default_impu;
+  std::string service_profile;
+  std::vector<std::string> associated_impus;
+  std::vector<std::string> impis;
+  std::deque<std::string> ccfs;
+  std::deque<std::string> ecfs;
+  std::vector<std::string> default_impus;
+
+private:
+  enum class Member
+  {
+    NONE,
+    EXPIRY,
+    DEFAULT_IMPU,
+    ASSOCIATED_IMPUS,
+    SERVICE_PROFILE,
+    REGISTRATION_STATE,
+    IMPIS,
+    CCFS,
+    ECFS,
+    DEFAULT_IMPUS
+  };
+
+  static Member lookup(const char* str, rapidjson::SizeType length)
+  {
+    static const struct
+    {
+      const char* name;
+      Member member;
+    } MEMBERS[] =
+    {
+      {JSON_EXPIRY, Member::EXPIRY},
+      {JSON_DEFAULT_IMPU, Member::DEFAULT_IMPU},
+      {JSON_ASSOCIATED_IMPUS, Member::ASSOCIATED_IMPUS},
+      {JSON_SERVICE_PROFILE, Member::SERVICE_PROFILE},
+      {JSON_REGISTRATION_STATE, Member::REGISTRATION_STATE},
+      {JSON_IMPIS, Member::IMPIS},
+      {JSON_CCFS, Member::CCFS},
+      {JSON_ECFS, Member::ECFS},
+      {JSON_DEFAULT_IMPUS, Member::DEFAULT_IMPUS},
+    };
+
+    for (const auto& entry : MEMBERS)
+    {
+      if ((strlen(entry.name) == length) &&
+          (memcmp(entry.name, str, length) == 0))
+      {
+        return entry.member;
+      }
+    }
+
+    return Member::NONE;
+  }
+
+  bool integer(int64_t value)
+  {
+    if ((_depth == 1) && (_member == Member::EXPIRY))
+    {
+      expiry = value;
+    }
+
+    return scalar();
+  }
+
+  // Called after each scalar value. A scalar at the root means the JSON isn't
+  // an object, so parsing stops.
+  bool scalar()
+  {
+    if (_depth == 1)
+    {
+      _member = Member::NONE;
+    }
+
+    return (_depth != 0);
+  }
+
+  bool end_container()
+  {
+    _depth--;
+
+    if (_depth == 1)
+    {
+      _member = Member::NONE;
+      _in_array = false;
+    }
+
+    return true;
+  }
+
+  int _depth;
+  Member _member;
+  bool _in_array;
+  unsigned _seen;
+};
+
+// Parse JSON with the given handler, returning false (and logging) if it isn't
+// a valid JSON object.
+static bool parse_json_object(const std::string& json,
+                              JsonRecordHandler& handler,
+                              const char* type)
+{
+  rapidjson::Reader reader;
+  rapidjson::StringStream stream(json.c_str());
+  reader.Parse<0>(stream, handler);
+
+  if ((reader.HasParseError()) &&
+      (reader.GetParseErrorCode() != rapidjson::kParseErrorTermination))
+  {
+    TRC_WARNING("Failed to parse %s as JSON %s - Error: %s",
+                type,
+                json.c_str(),
+                rapidjson::GetParseError_En(reader.GetParseErrorCode()));
+    return false;
   }
+  else if (!handler.is_object)
+  {
+    TRC_WARNING("%s JSON didn't represent object - %s",
+                type,
+                json.c_str());
+    return false;
+  }
+
+  return true;
 }
 
-ImpuStore::Impu* ImpuStore::AssociatedImpu::from_json(std::string const& impu,
-                                                      rapidjson::Value& json,
-                                                      unsigned long cas,
-                                                      ImpuStore* store)
+// Read the service profile section of a version 2 record, which starts at
+// offset and runs to the end of the record. The service profile is left
+// compressed.
+static bool read_service_profile_section(const std::string& data,
+                                         size_t offset,
+                                         uint8_t dictionary_id,
+                                         ImpuStore::ServiceProfile& service_profile)
 {
-  std::string default_impu;
-  int64_t expiry = 0L;
+  if (offset == data.size())
+  {
+    // No section, so the service profile is empty
+    service_profile = ImpuStore::ServiceProfile();
+    return true;
+  }
 
-  JSON_SAFE_GET_STRING_MEMBER(json, JSON_DEFAULT_IMPU, default_impu);
-  JSON_SAFE_GET_INT_64_MEMBER(json, JSON_EXPIRY, expiry);
+  uint8_t codec_id = (uint8_t)data[offset++];
 
-  return new AssociatedImpu(impu, default_impu, cas, expiry, store);
+  if (ImpuCodec::get(codec_id) == nullptr)
+  {
+    TRC_WARNING("Service profile compressed with unknown codec: %u", codec_id);
+    return false;
+  }
+
+  uint64_t length_long = decode_varbyte(data, offset);
+
+  if ((length_long == 0) || (offset >= data.size()))
+  {
+    TRC_WARNING("Service profile section is corrupt");
+    return false;
+  }
+
+  service_profile = ImpuStore::ServiceProfile(data.c_str() + offset,
+                                              data.size() - offset,
+                                              dictionary_id,
+                                              codec_id,
+                                              length_long);
+  return true;
 }
 
-ImpuStore::Impu* ImpuStore::DefaultImpu::from_json(std::string const& impu,
-                                                   rapidjson::Value& json,
-                                                   unsigned long cas,
-                                                   ImpuStore* store)
+bool ImpuStore::Impu::parse_header(const std::string& data,
+                                   ImpuFormat& format,
+                                   uint8_t& dictionary_id,
+                                   uint8_t& codec_id,
+                                   size_t& offset)
 {
-  std::vector<std::string> assoc_impus;
-  std::vector<std::string> impis;
-  std::deque<std::string> ccfs;
-  std::deque<std::string> ecfs;
-  std::string service_profile;
-  int64_t expiry = 0L;
+  if (data.size() == 0)
+  {
+    // Invalid data
+    return false;
+  }
 
-  bool state;
+  // Version is stored in character 0.
+  if (data[0] != 0)
+  {
+    TRC_WARNING("Unknown IMPU version: %u", data[0]);
+    return false;
+  }
 
-  JSON_GET_BOOL_MEMBER(json, JSON_REGISTRATION_STATE, state);
+  // Records written in newer versions carry an extended header, marked by a
+  // 0 in character 1, the actual version in character 2, the ID of the
+  // dictionary the record was compressed with in character 3 and the ID of
+  // the codec it was compressed with in character 4.
+  if ((data.size() > 2) && (data[1] == EXTENDED_HEADER))
+  {
+    if ((data[2] != VERSION_1) && (data[2] != VERSION_2))
+    {
+      TRC_WARNING("Unknown IMPU extended version: %u", data[2]);
+      return false;
+    }
 
-  RegistrationState reg_state = state ?
-    RegistrationState::REGISTERED :
-    RegistrationState::UNREGISTERED;
+    if (data.size() < 5)
+    {
+      TRC_WARNING("IMPU extended header is truncated");
+      return false;
+    }
 
-  JSON_SAFE_GET_INT_64_MEMBER(json, JSON_EXPIRY, expiry);
-  JSON_SAFE_GET_STRING_MEMBER(json, JSON_SERVICE_PROFILE, service_profile);
+    format = (data[2] == VERSION_2) ? ImpuFormat::V2 : ImpuFormat::V1;
+    dictionary_id = (uint8_t)data[3];
+    codec_id = (uint8_t)data[4];
+    offset = 5;
+  }
+  else
+  {
+    // Version 0 records are always LZ4 compressed with the built in
+    // dictionary.
+    format = ImpuFormat::V0;
+    dictionary_id = 0;
+    codec_id = ImpuCodec::LZ4;
+    offset = 1;
+  }
 
-  extract_json_string_array(json, JSON_ASSOCIATED_IMPUS, assoc_impus);
-  extract_json_string_array(json, JSON_IMPIS, impis);
-  extract_json_string_array(json, JSON_CCFS, ccfs);
-  extract_json_string_array(json, JSON_ECFS, ecfs);
+  return true;
+}
 
-  ChargingAddresses charging_addresses = ChargingAddresses(ccfs, ecfs);
+bool ImpuStore::Impu::decompress_data(const std::string& data,
+                                      std::string& uncompressed)
+{
+  ImpuFormat format;
+  uint8_t dictionary_id;
+  uint8_t codec_id;
+  size_t offset;
+
+  if (!parse_header(data, format, dictionary_id, codec_id, offset) ||
+      !decompress_payload(data,
+                          offset,
+                          format,
+                          dictionary_id,
+                          codec_id,
+                          uncompressed))
+  {
+    return false;
+  }
 
-  return new DefaultImpu(impu,
-                         assoc_impus,
-                         impis,
-                         reg_state,
-                         charging_addresses,
-                         service_profile,
-                         cas,
-                         expiry,
-                         store);
+  if ((format == ImpuFormat::V2) && (offset < data.size()))
+  {
+    // Follow the binary record with the service profile, so the result
+    // holds all of the record's content.
+    ServiceProfile service_profile;
+
+    if (!read_service_profile_section(data,
+                                      offset,
+                                      dictionary_id,
+                                      service_profile) ||
+        service_profile.get().empty())
+    {
+      return false;
+    }
+
+    uncompressed.append(service_profile.get());
+  }
+
+  return true;
+}
+
+ImpuStore::Impu* ImpuStore::Impu::from_data(const std::string& impu,
+                                            std::string& data,
+                                            unsigned long cas,
+                                            ImpuStore* store)
+{
+  ImpuFormat format;
+  uint8_t dictionary_id;
+  uint8_t codec_id;
+  size_t offset;
+  Impu* result = nullptr;
+
+  // Decompress into this thread's arena, so the only allocations are for the
+  // decoded IMPU itself.
+  std::string& uncompressed = _thrd_arena;
+
+  if (parse_header(data, format, dictionary_id, codec_id, offset) &&
+      decompress_payload(data,
+                         offset,
+                         format,
+                         dictionary_id,
+                         codec_id,
+                         uncompressed))
+  {
+    if (format == ImpuFormat::V2)
+    {
+      result = from_data_v2(impu,
+                            data,
+                            offset,
+                            uncompressed,
+                            dictionary_id,
+                            cas,
+                            store);
+    }
+    else if (format == ImpuFormat::V1)
+    {
+      result = from_data_v1(impu, uncompressed, cas, store, true);
+    }
+    else
+    {
+      result = from_data_v0(impu, uncompressed, cas, store);
+    }
+  }
+
+  release_arena();
+
+  return result;
+}
+
+void ImpuStore::Impu::release_arena()
+{
+  if (_thrd_arena.capacity() > MAX_ARENA_LEN)
+  {
+    std::string().swap(_thrd_arena);
+  }
+}
+
+bool ImpuStore::Impu::decompress_payload(const std::string& data,
+                                         size_t& offset,
+                                         ImpuFormat format,
+                                         uint8_t dictionary_id,
+                                         uint8_t codec_id,
+                                         std::string& uncompressed)
+{
+  ImpuCodec* codec = ImpuCodec::get(codec_id);
+
+  if (codec == nullptr)
+  {
+    TRC_WARNING("IMPU compressed with unknown codec: %u", codec_id);
+    return false;
+  }
+
+  if (get_dictionary(dictionary_id) == nullptr)
+  {
+    // This node hasn't been given the dictionary that the record was written
+    // with - treat the record as unreadable.
+    TRC_WARNING("IMPU compressed with unknown dictionary: %u", dictionary_id);
+    return false;
+  }
+
+  // Size of uncompressed data
+  uint64_t length_long = decode_varbyte(data, offset);
+
+  if (length_long == 0)
+  {
+    // Data is corrupt
+    return false;
+  }
+
+  // Version 2 records give the size of the compressed data, as the service
+  // profile section follows it. In earlier versions it runs to the end of
+  // the record.
+  size_t compressed_size = data.size() - offset;
+
+  if (format == ImpuFormat::V2)
+  {
+    uint64_t compressed_long = decode_varbyte(data, offset);
+
+    if ((compressed_long == 0) || (compressed_long > data.size() - offset))
+    {
+      TRC_WARNING("IMPU has invalid compressed length: %llu", compressed_long);
+      return false;
+    }
+
+    compressed_size = compressed_long;
+  }
+
+  const char* compressed = data.c_str() + offset;
+  offset += compressed_size;
+  uncompressed.resize(length_long);
+
+  TRC_DEBUG("Decompressing %lu bytes of %s data into %llu bytes",
+            compressed_size,
+            codec->name(),
+            length_long);
+
+  return codec->decompress(compressed,
+                           compressed_size,
+                           dictionary_id,
+                           uncompressed);
+}
+
+ImpuStore::Impu* ImpuStore::Impu::from_data_v0(const std::string& impu,
+                                               const std::string& json,
+                                               unsigned long cas,
+                                               ImpuStore* store)
+{
+  // Version 0 - LZ4 compression
+  // Data is stored as [version][length][zlib4 compressed JSON]
+  return from_json(impu, json, cas, store);
+}
+
+ImpuStore::Impu* ImpuStore::Impu::from_json(const std::string& impu,
+                                            const std::string& json,
+                                            uint64_t cas,
+                                            ImpuStore* store)
+{
+  JsonRecordHandler handler;
+
+  if (!parse_json_object(json, handler, "IMPU"))
+  {
+    return nullptr;
+  }
+  else if (handler.has_default_impu)
+  {
+    return new AssociatedImpu(impu,
+                              handler.default_impu,
+                              cas,
+                              handler.expiry,
+                              store);
+  }
+  else if (!handler.has_registration_state)
+  {
+    TRC_WARNING("IMPU JSON for %s has no valid registration state - %s",
+                impu.c_str(),
+                json.c_str());
+    return nullptr;
+  }
+  else
+  {
+    RegistrationState reg_state = handler.registration_state ?
+      RegistrationState::REGISTERED :
+      RegistrationState::UNREGISTERED;
+
+    ChargingAddresses charging_addresses = ChargingAddresses(handler.ccfs,
+                                                             handler.ecfs);
+
+    return new DefaultImpu(impu,
+                           handler.associated_impus,
+                           handler.impis,
+                           reg_state,
+                           charging_addresses,
+                           handler.service_profile,
+                           cas,
+                           handler.expiry,
+                           store);
+  }
+}
+
+ImpuStore::Impu* ImpuStore::Impu::from_data_v1(const std::string& impu,
+                                               const std::string& binary,
+                                               unsigned long cas,
+                                               ImpuStore* store,
+                                               bool with_service_profile)
+{
+  // Version 1 - compressed binary record
+  // Data is stored as [0][0][version][dictionary][codec][length][compressed
+  // binary], and the binary record is decoded in a single pass, with no
+  // intermediate DOM.
+  size_t offset = 0;
+  char type;
+  Impu* result = nullptr;
+
+  if (!read_byte(binary, offset, type))
+  {
+    TRC_WARNING("Binary IMPU record for %s is empty", impu.c_str());
+  }
+  else if (type == RECORD_DEFAULT_IMPU)
+  {
+    result = ImpuStore::DefaultImpu::from_binary(impu,
+                                                 binary,
+                                                 offset,
+                                                 cas,
+                                                 store,
+                                                 with_service_profile);
+  }
+  else if (type == RECORD_SHARED_DEFAULT_IMPU)
+  {
+    // The reference is read as if it were the service profile, then turned
+    // into a reference for ImpuStore to resolve.
+    result = ImpuStore::DefaultImpu::from_binary(impu,
+                                                 binary,
+                                                 offset,
+                                                 cas,
+                                                 store,
+                                                 true);
+
+    if (result != nullptr)
+    {
+      ServiceProfile& service_profile = ((DefaultImpu*)result)->service_profile;
+      service_profile = ServiceProfile::shared(service_profile.get());
+    }
+  }
+  else if (type == RECORD_ASSOCIATED_IMPU)
+  {
+    result = ImpuStore::AssociatedImpu::from_binary(impu, binary, offset, cas, store);
+  }
+  else
+  {
+    TRC_WARNING("Unknown binary IMPU record type for %s: %u",
+                impu.c_str(), type);
+  }
+
+  if ((result != nullptr) && (offset != binary.size()))
+  {
+    TRC_WARNING("Binary IMPU record for %s has %lu trailing bytes",
+                impu.c_str(), binary.size() - offset);
+    delete result; result = nullptr;
+  }
+
+  return result;
+}
+
+ImpuStore::Impu* ImpuStore::Impu::from_data_v2(const std::string& impu,
+                                               const std::string& data,
+                                               size_t offset,
+                                               const std::string& binary,
+                                               uint8_t dictionary_id,
+                                               unsigned long cas,
+                                               ImpuStore* store)
+{
+  // Version 2 - compressed binary, with a separately compressed service
+  // profile
+  // Data is stored as [0][0][version][dictionary][codec][length][compressed
+  // length][compressed binary][service profile section]. The service profile
+  // is only decompressed if it's read.
+  Impu* result = from_data_v1(impu, binary, cas, store, false);
+
+  if (result == nullptr)
+  {
+    return nullptr;
+  }
+
+  if (result->is_default_impu() &&
+      !((DefaultImpu*)result)->service_profile.is_shared())
+  {
+    DefaultImpu* default_impu = (DefaultImpu*)result;
+
+    if (!read_service_profile_section(data,
+                                      offset,
+                                      dictionary_id,
+                                      default_impu->service_profile))
+    {
+      TRC_WARNING("Failed to read service profile section for %s",
+                  impu.c_str());
+      delete result; result = nullptr;
+    }
+  }
+  else if (offset != data.size())
+  {
+    TRC_WARNING("IMPU record for %s has %lu trailing bytes",
+                impu.c_str(), data.size() - offset);
+    delete result; result = nullptr;
+  }
+
+  return result;
+}
+
+ImpuStore::Impu* ImpuStore::AssociatedImpu::from_json(std::string const& impu,
+                                                      rapidjson::Value& json,
+                                                      unsigned long cas,
+                                                      ImpuStore* store)
+{
+  std::string default_impu;
+  int64_t expiry = 0L;
+
+  JSON_SAFE_GET_STRING_MEMBER(json, JSON_DEFAULT_IMPU, default_impu);
+  JSON_SAFE_GET_INT_64_MEMBER(json, JSON_EXPIRY, expiry);
+
+  return new AssociatedImpu(impu, default_impu, cas, expiry, store);
+}
+
+ImpuStore::Impu* ImpuStore::DefaultImpu::from_json(std::string const& impu,
+                                                   rapidjson::Value& json,
+                                                   unsigned long cas,
+                                                   ImpuStore* store)
+{
+  std::vector<std::string> assoc_impus;
+  std::vector<std::string> impis;
+  std::deque<std::string> ccfs;
+  std::deque<std::string> ecfs;
+  std::string service_profile;
+  int64_t expiry = 0L;
+
+  bool state;
+
+  JSON_GET_BOOL_MEMBER(json, JSON_REGISTRATION_STATE, state);
+
+  RegistrationState reg_state = state ?
+    RegistrationState::REGISTERED :
+    RegistrationState::UNREGISTERED;
+
+  JSON_SAFE_GET_INT_64_MEMBER(json, JSON_EXPIRY, expiry);
+  JSON_SAFE_GET_STRING_MEMBER(json, JSON_SERVICE_PROFILE, service_profile);
+
+  extract_json_string_array(json, JSON_ASSOCIATED_IMPUS, assoc_impus);
+  extract_json_string_array(json, JSON_IMPIS, impis);
+  extract_json_string_array(json, JSON_CCFS, ccfs);
+  extract_json_string_array(json, JSON_ECFS, ecfs);
+
+  ChargingAddresses charging_addresses = ChargingAddresses(ccfs, ecfs);
+
+  return new DefaultImpu(impu,
+                         assoc_impus,
+                         impis,
+                         reg_state,
+                         charging_addresses,
+                         service_profile,
+                         cas,
+                         expiry,
+                         store);
+}
+
+ImpuStore::Impu* ImpuStore::AssociatedImpu::from_binary(const std::string& impu,
+                                                        const std::string& data,
+                                                        size_t& offset,
+                                                        unsigned long cas,
+                                                        ImpuStore* store)
+{
+  uint64_t expiry;
+  std::string default_impu;
+
+  if (!read_uint(data, offset, expiry) ||
+      !read_string(data, offset, default_impu))
+  {
+    TRC_WARNING("Failed to decode binary Associated IMPU record for %s",
+                impu.c_str());
+    return nullptr;
+  }
+
+  return new AssociatedImpu(impu, default_impu, cas, (int64_t)expiry, store);
+}
+
+ImpuStore::Impu* ImpuStore::DefaultImpu::from_binary(const std::string& impu,
+                                                     const std::string& data,
+                                                     size_t& offset,
+                                                     unsigned long cas,
+                                                     ImpuStore* store,
+                                                     bool with_service_profile)
+{
+  char state;
+  uint64_t expiry;
+  std::string service_profile;
+  std::vector<std::string> assoc_impus;
+  std::vector<std::string> impis;
+  std::deque<std::string> ecfs;
+  std::deque<std::string> ccfs;
+
+  // The fields are read in the order they are written by write_binary
+  if (!read_byte(data, offset, state) ||
+      !read_uint(data, offset, expiry) ||
+      (with_service_profile &&
+       !read_string(data, offset, service_profile)) ||
+      !read_string_list(data, offset, assoc_impus) ||
+      !read_string_list(data, offset, impis) ||
+      !read_string_list(data, offset, ecfs) ||
+      !read_string_list(data, offset, ccfs))
+  {
+    TRC_WARNING("Failed to decode binary Default IMPU record for %s",
+                impu.c_str());
+    return nullptr;
+  }
+
+  RegistrationState reg_state = state ?
+    RegistrationState::REGISTERED :
+    RegistrationState::UNREGISTERED;
+
+  ChargingAddresses charging_addresses = ChargingAddresses(ccfs, ecfs);
+
+  return new DefaultImpu(impu,
+                         assoc_impus,
+                         impis,
+                         reg_state,
+                         charging_addresses,
+                         service_profile,
+                         cas,
+                         (int64_t)expiry,
+                         store);
+}
+
+bool ImpuStore::Impu::compress_data_v0(const std::string& data,
+                                       std::string& compressed,
+                                       uint8_t dictionary_id)
+{
+  // LZ4 tells us the most space the compressed data can take, so we make
+  // that much room up front and compress in a single pass.
+  int bound = LZ4_compressBound(data.size());
+
+  // LCOV_EXCL_START
+  // This only happens for data too big for LZ4, which isn't hittable in the
+  // UTs
+  if (bound <= 0)
+  {
+    TRC_WARNING("Failed to compress %lu bytes of data - too big for LZ4",
+                data.size());
+    return false;
+  }
+  // LCOV_EXCL_STOP
+
+  // Check we have a LZ4 stream with this dictionary pre-prepared. The caller
+  // must only ask for a dictionary that has been loaded.
+  if (_thrd_lz4_streams[dictionary_id] == NULL)
+  {
+    const std::string* dictionary = get_dictionary(dictionary_id);
+    _thrd_lz4_streams[dictionary_id] = LZ4_createStream();
+    LZ4_loadDict(_thrd_lz4_streams[dictionary_id],
+                 dictionary->c_str(),
+                 dictionary->size());
+    LZ4_stream_preserve(_thrd_lz4_streams[dictionary_id],
+                        &_thrd_lz4_hashes[dictionary_id]);
+  }
+
+  // Compress the data using LZ4, in this thread's working stream, reset and
+  // primed with the dictionary.
+  if (_thrd_lz4_work_stream == NULL)
+  {
+    _thrd_lz4_work_stream = LZ4_createStream();
+  }
+  else
+  {
+    LZ4_resetStream(_thrd_lz4_work_stream);
+  }
+
+  LZ4_stream_restore_preserved(_thrd_lz4_work_stream,
+                               _thrd_lz4_streams[dictionary_id],
+                               _thrd_lz4_hashes[dictionary_id]);
+
+  size_t offset = compressed.size();
+  compressed.resize(offset + bound);
+
+  int comp_size = LZ4_compress_fast_continue(_thrd_lz4_work_stream,
+                                             data.c_str(),
+                                             &compressed[offset],
+                                             data.size(),
+                                             bound,
+                                             ACCELERATION);
+
+  // LCOV_EXCL_START
+  // LZ4 can't fail to compress into a buffer of the compress bound
+  if (comp_size <= 0)
+  {
+    TRC_WARNING("Failed to compress %lu bytes of data", data.size());
+    compressed.resize(offset);
+    return false;
+  }
+  // LCOV_EXCL_STOP
+
+  compressed.resize(offset + comp_size);
+
+  return true;
+}
+
+uint8_t ImpuStore::CodecPolicy::select_codec(size_t size) const
+{
+  if (size <= raw_max_size)
+  {
+    return ImpuCodec::RAW;
+  }
+  else if ((deflate_min_size != 0) && (size >= deflate_min_size))
+  {
+    return ImpuCodec::DEFLATE;
+  }
+  else
+  {
+    return ImpuCodec::LZ4;
+  }
+}
+
+bool ImpuStore::Impu::write_record(const std::string& uncompressed,
+                                   ImpuFormat format,
+                                   uint8_t dictionary_id,
+                                   const CodecPolicy& policy,
+                                   std::string& data,
+                                   size_t& payload_start)
+{
+  unsigned int uncomp_size = uncompressed.size();
+
+  // Version 0 records are always LZ4 compressed with the built in dictionary.
+  // Later versions pick a codec based on their size.
+  uint8_t codec_id = ImpuCodec::LZ4;
+
+  if (format != ImpuFormat::V0)
+  {
+    codec_id = policy.select_codec(uncomp_size);
+  }
+  else
+  {
+    dictionary_id = 0;
+  }
+
+  size_t header_start = data.size();
+
+  // Version
+  data.push_back((char) 0);
+
+  if (format != ImpuFormat::V0)
+  {
+    data.push_back(EXTENDED_HEADER);
+    data.push_back((format == ImpuFormat::V2) ? VERSION_2 : VERSION_1);
+    data.push_back((char)dictionary_id);
+    data.push_back((char)codec_id);
+  }
+
+  // Length of the uncompressed data
+  encode_varbyte(uncomp_size, data);
+
+  // Add the compressed data to the buffer
+  payload_start = data.size();
+
+  if (!ImpuCodec::get(codec_id)->compress(uncompressed, dictionary_id, data))
+  {
+    // LCOV_EXCL_START
+    // This only happens when we fail to compress some data,
+    // which isn't hittable in the UTs
+    data.resize(header_start);
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  // Records that don't shrink are better stored raw, as they're then cheaper
+  // to read too.
+  if ((format != ImpuFormat::V0) &&
+      (codec_id != ImpuCodec::RAW) &&
+      (data.size() - payload_start >= uncomp_size))
+  {
+    TRC_DEBUG("Compression didn't shrink record, storing it raw");
+    codec_id = ImpuCodec::RAW;
+    data[header_start + 4] = (char)codec_id;
+    data.resize(payload_start);
+    data.append(uncompressed);
+  }
+
+  TRC_DEBUG("Compressed %u bytes to %lu bytes (codec %u)",
+            uncomp_size, data.size() - payload_start, codec_id);
+
+  return true;
+}
+
+Store::Status ImpuStore::Impu::to_data(std::string& data,
+                                       ImpuFormat format,
+                                       uint8_t dictionary_id,
+                                       const CodecPolicy& policy)
+{
+  // We get the JSON (version 0) or binary (version 1 and 2) representing the
+  // IMPU, compress it, and then build a buffer to return.
+  // The buffer contains a version header, the uncompressed size
+  // (an array of 7 bits, with bit 0x80 set if there is more
+  // to come), and the compressed data.
+  //
+  // The uncompressed record is built in a per-thread arena, and compressed
+  // straight into data, so once the arena has grown to fit the thread's
+  // records (and if the caller reuses data) this doesn't allocate.
+  if ((format != ImpuFormat::V2) && (has_corrupt_service_profile()))
+  {
+    // Older formats hold the service profile itself, which we no longer have
+    TRC_WARNING("Can't write IMPU %s, as its service profile is corrupt",
+                impu.c_str());
+    return Store::Status::ERROR;
+  }
+
+  std::string& uncompressed = _thrd_arena;
+  uncompressed.clear();
+
+  if (format != ImpuFormat::V0)
+  {
+    TRC_DEBUG("Determining binary record for %s", impu.c_str());
+    write_binary(uncompressed, (format == ImpuFormat::V1));
+  }
+  else
+  {
+    TRC_DEBUG("Determining JSON for %s", impu.c_str());
+
+    // Gather the JSON. The writer and its buffer are kept for the life of
+    // the thread, for the same reason as the arena.
+    thread_local rapidjson::StringBuffer json_buffer;
+    thread_local rapidjson::Writer<rapidjson::StringBuffer> writer(json_buffer);
+    json_buffer.Clear();
+    writer.Reset(json_buffer);
+
+    writer.StartObject();
+    write_json(writer);
+    writer.EndObject();
+    uncompressed.assign(json_buffer.GetString(), json_buffer.GetSize());
+  }
+
+  TRC_DEBUG("Wrote IMPU %s: %lu bytes", impu.c_str(), uncompressed.size());
+
+  size_t header_start = data.size();
+  size_t payload_start;
+
+  if (!write_record(uncompressed, format, dictionary_id, policy, data, payload_start))
+  {
+    // LCOV_EXCL_START
+    // This only happens when we fail to compress some data,
+    // which isn't hittable in the UTs
+    release_arena();
+    return Store::Status::ERROR;
+    // LCOV_EXCL_STOP
+  }
+
+  TRC_DEBUG("Compressed IMPU %s to %lu bytes",
+            impu.c_str(), data.size() - payload_start);
+
+  if (format == ImpuFormat::V2)
+  {
+    // The compressed length goes in front of the compressed data, so that
+    // readers can find the service profile section that follows it. The
+    // length is short enough to not need an allocation.
+    std::string compressed_length;
+    encode_varbyte(data.size() - payload_start, compressed_length);
+    data.insert(payload_start, compressed_length);
+
+    if (!write_service_profile(data, dictionary_id, policy))
+    {
+      // The profile is corrupt and needs recompressing, or (as above) we
+      // failed to compress it
+      data.resize(header_start);
+      release_arena();
+      return Store::Status::ERROR;
+    }
+  }
+
+  release_arena();
+
+  return Store::Status::OK;
+}
+
+// Both the JSON and binary records store the registration state as a boolean
+// (registered or not).
+static bool is_registered(RegistrationState registration_state)
+{
+  bool state;
+
+  if (registration_state == RegistrationState::REGISTERED)
+  {
+    state = true;
+  }
+  else if (registration_state == RegistrationState::UNREGISTERED)
+  {
+    state = false;
+  }
+  else
+  {
+    TRC_WARNING("Unexpected registration state: %u",
+                registration_state);
+    state = false;
+  }
+
+  return state;
+}
+
+void ImpuStore::DefaultImpu::write_json(rapidjson::Writer<rapidjson::StringBuffer>& writer)
+{
+  writer.String(JSON_REGISTRATION_STATE);
+
+  bool state = is_registered(registration_state);
+
+  writer.Bool(state);
+  writer.String(JSON_SERVICE_PROFILE);
+  writer.String(service_profile.get().c_str());
+  writer.String(JSON_EXPIRY);
+  writer.Int64(expiry);
+
+  write_json_string_array(writer, JSON_ASSOCIATED_IMPUS, associated_impus);
+  write_json_string_array(writer, JSON_IMPIS, impis);
+  write_json_string_array(writer, JSON_ECFS, charging_addresses.ecfs);
+  write_json_string_array(writer, JSON_CCFS, charging_addresses.ccfs);
+}
+
+void ImpuStore::AssociatedImpu::write_json(rapidjson::Writer<rapidjson::StringBuffer>& writer)
+{
+  writer.String(JSON_DEFAULT_IMPU);
+  writer.String(default_impu.c_str());
+  writer.String(JSON_EXPIRY);
+  writer.Int64(expiry);
+}
+
+void ImpuStore::DefaultImpu::write_binary(std::string& data,
+                                          bool with_service_profile)
+{
+  // The fields are written in the order from_binary expects to read them
+  if (service_profile.is_shared())
+  {
+    data.push_back(RECORD_SHARED_DEFAULT_IMPU);
+  }
+  else
+  {
+    data.push_back(RECORD_DEFAULT_IMPU);
+  }
+
+  data.push_back(is_registered(registration_state) ? 1 : 0);
+  write_uint((uint64_t)expiry, data);
+
+  if (service_profile.is_shared())
+  {
+    write_string(service_profile.reference(), data);
+  }
+  else if (with_service_profile)
+  {
+    write_string(service_profile.get(), data);
+  }
+
+  write_string_list(associated_impus, data);
+  write_string_list(impis, data);
+  write_string_list(charging_addresses.ecfs, data);
+  write_string_list(charging_addresses.ccfs, data);
+}
+
+void ImpuStore::AssociatedImpu::write_binary(std::string& data,
+                                             bool with_service_profile)
+{
+  data.push_back(RECORD_ASSOCIATED_IMPU);
+  write_uint((uint64_t)expiry, data);
+  write_string(default_impu, data);
+}
+
+bool ImpuStore::DefaultImpu::write_service_profile(std::string& data,
+                                                   uint8_t dictionary_id,
+                                                   const CodecPolicy& policy)
+{
+  // A shared profile is already in the record, as a reference
+  if (service_profile.is_shared())
+  {
+    return true;
+  }
+
+  return service_profile.write_section(data, dictionary_id, policy);
+}
+
+const std::string& ImpuStore::ServiceProfile::get() const
+{
+  if (!_inflated)
+  {
+    _inflated = true;
+    _xml.resize(_length);
+
+    ImpuCodec* codec = ImpuCodec::get(_codec_id);
+
+    TRC_DEBUG("Decompressing %lu bytes of service profile into %lu bytes",
+              _compressed.size(),
+              _length);
+
+    if ((codec == nullptr) ||
+        !codec->decompress(_compressed.data(),
+                           _compressed.size(),
+                           _dictionary_id,
+                           _xml))
+    {
+      // Keep the compressed profile, so that it's written back out as it was
+      // read rather than being lost
+      TRC_WARNING("Failed to decompress service profile");
+      _xml.clear();
+    }
+  }
+
+  return _xml;
 }
 
-void ImpuStore::Impu::compress_data_v0(const std::string& data,
-                                       char*& buffer,
-                                       int& comp_size)
+bool ImpuStore::ServiceProfile::write_section(std::string& data,
+                                              uint8_t dictionary_id,
+                                              const CodecPolicy& policy) const
 {
-  unsigned int uncomp_size = data.size();
-
-  // Check we have a LZ4 stream with the V0 dict pre-prepared.
-  if (_thrd_lz4_stream == NULL)
+  if (!_compressed.empty() && (_dictionary_id == dictionary_id))
   {
-    _thrd_lz4_stream = LZ4_createStream();
-    LZ4_loadDict(_thrd_lz4_stream, _dict_v0.c_str(), _dict_v0.size());
-    LZ4_stream_preserve(_thrd_lz4_stream, &_thrd_lz4_hash);
+    // We still have the section this profile was read from, so can copy it
+    // straight across
+    data.push_back((char)_codec_id);
+    encode_varbyte(_length, data);
+    data.append(_compressed);
+    return true;
   }
 
-  // Compress the data using LZ4
-  LZ4_stream_t* stream = LZ4_createStream();
+  const std::string& xml = get();
 
-  size_t buffer_length = 2048; // 2KB
-  buffer = (char*) malloc(buffer_length);
-
-  do
+  if (xml.empty())
   {
-    LZ4_stream_restore_preserved(stream, _thrd_lz4_stream, _thrd_lz4_hash);
-    comp_size = LZ4_compress_fast_continue(stream,
-                                           data.c_str(),
-                                           buffer,
-                                           uncomp_size,
-                                           buffer_length,
-                                           ACCELERATION);
-
-    if (comp_size <= 0)
+    if (!_compressed.empty())
     {
-      // Compression failed - retry with a bigger buffer.
-      // Buffer size is the only reason it can fail. We stop
-      // the buffer growing beyond reason.
-      int new_buffer_length = buffer_length * 2;
+      // We couldn't decompress the profile, so can't recompress it with a
+      // different dictionary. Fail the write rather than drop the profile.
+      TRC_WARNING("Can't rewrite service profile that failed to decompress");
+      return false;
+    }
 
-      // LCOV_EXCL_START
-      if (new_buffer_length > MAX_BUFFER_LEN)
-      {
-        TRC_WARNING("Failed to attempt to compress %lu bytes of data - won't "
-                    "fit into %lu bytes, proposed new buffer of %lu bytes "
-                    "exceeds maximum of %lu bytes",
-                    uncomp_size, buffer_length,
-                    new_buffer_length, MAX_BUFFER_LEN);
-        break;
-      }
-      // LCOV_EXCL_STOP
+    return true;
+  }
 
-      buffer_length = new_buffer_length;
+  uint8_t codec_id = policy.select_codec(xml.size());
+  size_t section_start = data.size();
+  data.push_back((char)codec_id);
+  encode_varbyte(xml.size(), data);
+  size_t payload_start = data.size();
 
-      buffer = (char*) realloc((void*)buffer, buffer_length);
-      LZ4_resetStream(stream);
-    }
-  } while(comp_size == 0);
+  if (!ImpuCodec::get(codec_id)->compress(xml, dictionary_id, data))
+  {
+    // LCOV_EXCL_START
+    data.resize(section_start);
+    return false;
+    // LCOV_EXCL_STOP
+  }
+
+  // As with the rest of the record, store the profile raw if compressing it
+  // doesn't shrink it
+  if ((codec_id != ImpuCodec::RAW) &&
+      (data.size() - payload_start >= xml.size()))
+  {
+    data[section_start] = (char)ImpuCodec::RAW;
+    data.resize(payload_start);
+    data.append(xml);
+  }
 
-  LZ4_freeStream(stream);
+  return true;
 }
 
-Store::Status ImpuStore::Impu::to_data(std::string& data)
+ImpuStore::ImpiMapping* ImpuStore::ImpiMapping::from_data(const std::string& impi,
+                                                          const std::string& data,
+                                                          unsigned long cas)
 {
-  // We get the JSON representing the IMPU, compress it using
-  // lz4, and then build a buffer to return.
-  // The buffer contains a version (0), the uncompressed size
-  // (an array of 7 bits, with bit 0x80 set if there is more
-  // to come), and the compressed data.
-
-  unsigned int uncomp_size;
-  int comp_size;
-  char* buffer; // Buffer for compressed data
-
-  // Scope the JSON string so we don't have to keep it in
-  // memory too long
+  if (data.empty() || (data[0] != 0))
   {
-    TRC_DEBUG("Determining JSON for %s", impu.c_str());
+    // Mappings written in version 0 are a plain JSON dictionary, as the
+    // mappings are small enough that it isn't worth compressing their JSON.
+    JsonRecordHandler handler;
 
-    std::string json;
+    if (!parse_json_object(data, handler, "IMPI mapping"))
+    {
+      return nullptr;
+    }
+
+    return new ImpiMapping(impi,
+                           handler.default_impus,
+                           cas,
+                           handler.expiry);
+  }
 
+  // Binary mappings are stored in the same way as version 1 IMPUs -
+  // [0][0][version][dictionary][codec][length][compressed binary]
+  ImpuFormat format;
+  uint8_t dictionary_id;
+  uint8_t codec_id;
+  size_t offset;
+  ImpiMapping* result = nullptr;
+  std::string& binary = Impu::_thrd_arena;
+
+  if (!Impu::parse_header(data, format, dictionary_id, codec_id, offset) ||
+      (format != ImpuFormat::V1))
+  {
+    TRC_WARNING("Unknown IMPI mapping version for %s", impi.c_str());
+  }
+  else if (Impu::decompress_payload(data,
+                                    offset,
+                                    format,
+                                    dictionary_id,
+                                    codec_id,
+                                    binary))
+  {
+    size_t pos = 0;
+    char type;
+    uint64_t expiry;
+    std::vector<std::string> default_impus;
+
+    if (read_byte(binary, pos, type) &&
+        (type == RECORD_IMPI_MAPPING) &&
+        read_uint(binary, pos, expiry) &&
+        read_string_list(binary, pos, default_impus) &&
+        (pos == binary.size()))
     {
-      // Gather the JSON
-      rapidjson::StringBuffer buffer;
-      rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
-      writer.StartObject();
-      write_json(writer);
-      writer.EndObject();
-      json = buffer.GetString();
+      result = new ImpiMapping(impi, default_impus, cas, (int64_t)expiry);
     }
+    else
+    {
+      TRC_WARNING("Binary IMPI mapping for %s is corrupt", impi.c_str());
+    }
+  }
 
-    uncomp_size = json.size();
+  Impu::release_arena();
 
-    TRC_DEBUG("Wrote IMPU %s to JSON: %lu bytes", impu.c_str(), uncomp_size);
+  return result;
+}
+
+Store::Status ImpuStore::ImpiMapping::to_data(std::string& data,
+                                              ImpuFormat format,
+                                              uint8_t dictionary_id,
+                                              const CodecPolicy& policy)
+{
+  data.clear();
 
-    compress_data_v0(json, buffer, comp_size);
+  if (format == ImpuFormat::V0)
+  {
+    // Gather the JSON - as per from_data we don't compress version 0 IMPI
+    // Mappings
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    writer.StartObject();
+    write_json(writer);
+    writer.EndObject();
+    data = buffer.GetString();
+
+    return Store::Status::OK;
   }
 
+  // The binary record is much smaller than the JSON, as it leaves out the
+  // field names and front codes the Default IMPUs, which typically share
+  // most of their prefix. It's built in the IMPU arena, so this doesn't
+  // allocate once the arena has grown.
+  std::string& binary = Impu::_thrd_arena;
+  binary.clear();
+  binary.push_back(RECORD_IMPI_MAPPING);
+  write_uint(_expiry, binary);
+  write_string_list(_default_impus, binary);
+
+  size_t payload_start;
+  bool written = Impu::write_record(binary,
+                                    ImpuFormat::V1,
+                                    dictionary_id,
+                                    policy,
+                                    data,
+                                    payload_start);
+  Impu::release_arena();
+
   // LCOV_EXCL_START
-  // This only happens when we fail to compress some data,
-  // which isn't hittable in the UTs
-  if (comp_size == 0)
+  // This only happens when we fail to compress some data, which isn't
+  // hittable in the UTs
+  if (!written)
   {
-    free(buffer);
-
     return Store::Status::ERROR;
   }
   // LCOV_EXCL_STOP
 
-  // Start creating the buffer to return
+  TRC_DEBUG("Wrote IMPI mapping %s: %lu bytes", impi.c_str(), data.size());
 
-  // Work out the number of bits set in json
-  unsigned int uncomp_size_bits = 0;
-  unsigned int v = uncomp_size;
+  return Store::Status::OK;
+}
 
-  while (v >>= 1) {
-        uncomp_size_bits++;
+bool ImpuStore::add_dictionary(uint8_t id, const std::string& dictionary)
+{
+  if (id == 0)
+  {
+    TRC_ERROR("IMPU dictionary 0 is built in and can't be replaced");
+    return false;
   }
 
-  // Work out the number of bytes we need. 7 bits per byte.
-  // We add 6 to fix rounding errors as (7 + 6) / 7 => 1 and
-  // (8 + 6) / 7 => 2
-  int uncomp_size_len = (uncomp_size_bits + 6) / 7;
-
-  data.reserve(1 + uncomp_size_len + comp_size);
-
-  // Version
-  data.push_back((char) 0);
+  if (dictionary.empty() || dictionary.size() > MAX_DICTIONARY_LEN)
+  {
+    TRC_ERROR("IMPU dictionary %u has invalid length %lu (maximum %lu)",
+              id, dictionary.size(), MAX_DICTIONARY_LEN);
+    return false;
+  }
 
-  // Length of the uncompressed data
-  encode_varbyte(uncomp_size, data);
+  std::map<uint8_t, std::string>::iterator it = _dictionaries.find(id);
 
-  // Add the compressed data to the buffer
-  data.append(buffer, comp_size);
+  if (it != _dictionaries.end())
+  {
+    // Threads may have already primed LZ4 streams with the old dictionary, so
+    // a dictionary ID can never be reused for different contents.
+    if (it->second != dictionary)
+    {
+      TRC_ERROR("IMPU dictionary %u is already loaded with different contents",
+                id);
+      return false;
+    }
 
-  // Finally, we can free the compressed data
-  free(buffer);
+    return true;
+  }
 
-  return Store::Status::OK;
+  TRC_STATUS("Loaded IMPU dictionary %u (%lu bytes)", id, dictionary.size());
+  _dictionaries[id] = dictionary;
+  return true;
 }
 
-void ImpuStore::DefaultImpu::write_json(rapidjson::Writer<rapidjson::StringBuffer>& writer)
+const std::string* ImpuStore::get_dictionary(uint8_t id)
 {
-  writer.String(JSON_REGISTRATION_STATE);
-
-  bool state;
-
-  if (registration_state == RegistrationState::REGISTERED)
-  {
-    state = true;
-  }
-  else if (registration_state == RegistrationState::UNREGISTERED)
-  {
-    state = false;
-  }
-  else
+  if (id == 0)
   {
-    TRC_WARNING("Unexpected registration state: %u",
-                registration_state);
-    state = false;
+    return &Impu::_dict_v0;
   }
 
-  writer.Bool(state);
-  writer.String(JSON_SERVICE_PROFILE);
-  writer.String(service_profile.c_str());
-  writer.String(JSON_EXPIRY);
-  writer.Int64(expiry);
+  std::map<uint8_t, std::string>::const_iterator it = _dictionaries.find(id);
 
-  write_json_string_array(writer, JSON_ASSOCIATED_IMPUS, associated_impus);
-  write_json_string_array(writer, JSON_IMPIS, impis);
-  write_json_string_array(writer, JSON_ECFS, charging_addresses.ecfs);
-  write_json_string_array(writer, JSON_CCFS, charging_addresses.ccfs);
+  return (it != _dictionaries.end()) ? &it->second : nullptr;
 }
 
-void ImpuStore::AssociatedImpu::write_json(rapidjson::Writer<rapidjson::StringBuffer>& writer)
+std::string ImpuStore::dictionary_file(const std::string& directory,
+                                       uint8_t id)
 {
-  writer.String(JSON_DEFAULT_IMPU);
-  writer.String(default_impu.c_str());
-  writer.String(JSON_EXPIRY);
-  writer.Int64(expiry);
+  return directory + "/impu_" + std::to_string(id) + ".dict";
 }
 
-ImpuStore::ImpiMapping* ImpuStore::ImpiMapping::from_data(const std::string& impi,
-                                                          const std::string& data,
-                                                          unsigned long cas)
+bool ImpuStore::load_dictionaries(const std::string& directory)
 {
-  // Unlike IMPUs, we don't compress IMPI mappings, we just store a JSON
-  // dictionary, as the overhead of compression is likely to be worse than
-  // the size of the data
-
-  rapidjson::Document doc;
-  doc.Parse<0>(data.c_str());
+  bool success = true;
 
-  if (doc.HasParseError())
-  {
-    TRC_WARNING("Failed to parse IMPU as JSON %s - Error: %s",
-                data.c_str(),
-                rapidjson::GetParseError_En(doc.GetParseError()));
-    return nullptr;
-  }
-  else if (!doc.IsObject())
-  {
-    TRC_WARNING("IMPU JSON didn't represent object - %s",
-                data.c_str());
-    return nullptr;
-  }
-  else
+  for (int id = 1; id < MAX_DICTIONARIES; id++)
   {
-    return ImpuStore::ImpiMapping::from_json(impi, doc, cas);
-  }
-}
+    std::string filename = dictionary_file(directory, id);
+    std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary);
 
-Store::Status ImpuStore::ImpiMapping::to_data(std::string& data)
-{
-  // Gather the JSON - as per from_data we don't compress IMPI Mappings
-  rapidjson::StringBuffer buffer;
-  rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
-  writer.StartObject();
-  write_json(writer);
-  writer.EndObject();
-  data = buffer.GetString();
+    if (!file.is_open())
+    {
+      // Dictionary IDs needn't be contiguous - old dictionaries are removed
+      // once no records can still be using them.
+      continue;
+    }
 
-  return Store::Status::OK;
+    std::stringstream contents;
+    contents << file.rdbuf();
+
+    if (!add_dictionary(id, contents.str()))
+    {
+      TRC_ERROR("Failed to load IMPU dictionary from %s", filename.c_str());
+      success = false;
+    }
+  }
+
+  return success;
 }
 
 Store::Status ImpuStore::get_impu(const std::string& impu,
@@ -519,19 +1819,194 @@ Store::Status ImpuStore::get_impu(const std::string& impu,
     }
     else
     {
-      out_impu = temp_impu;
+      if ((temp_impu->is_default_impu()) &&
+          (!((DefaultImpu*)temp_impu)->service_profile.is_resolved()))
+      {
+        status = resolve_service_profile((DefaultImpu*)temp_impu, trail);
+
+        if (status == Store::Status::NOT_FOUND)
+        {
+          // The IMPU is no use without its service profile. Expire it, so
+          // that it's treated like an IMPU that's expired, and is rebuilt
+          // from the HSS. This is a CAS write of what we read, so that we
+          // don't remove an IMPU someone else has rewritten since.
+          TRC_WARNING("Expiring IMPU %s, as its shared service profile is "
+                      "missing", impu.c_str());
+          Store::Status expire_status = _store->set_data("impu",
+                                                         impu,
+                                                         data,
+                                                         cas,
+                                                         EXPIRE_IMMEDIATELY,
+                                                         trail,
+                                                         false);
+
+          if (expire_status != Store::Status::OK)
+          {
+            TRC_DEBUG("Failed to expire IMPU %s: %u",
+                      impu.c_str(), expire_status);
+          }
+        }
+      }
+
+      if (status == Store::Status::OK)
+      {
+        out_impu = temp_impu;
+      }
+      else
+      {
+        delete temp_impu;
+      }
     }
   }
 
   return status;
 }
 
+Store::Status ImpuStore::resolve_service_profile(DefaultImpu* impu,
+                                                 SAS::TrailId trail)
+{
+  const std::string reference = impu->service_profile.reference();
+  std::string data;
+
+  if (!_shared_profiles.get(reference, data))
+  {
+    uint64_t cas;
+    Store::Status status = _store->get_data("service_profile",
+                                            reference,
+                                            data,
+                                            cas,
+                                            trail,
+                                            false);
+
+    if (status != Store::Status::OK)
+    {
+      TRC_DEBUG("Failed to get shared service profile %s: %u",
+                reference.c_str(), status);
+      return status;
+    }
+
+    // We don't know how long the profile has left to live, so the next IMPU
+    // we write that refers to it will rewrite it.
+    _shared_profiles.put(reference, data, 0);
+  }
+
+  // Shared profiles are stored as [dictionary][service profile section]
+  ServiceProfile service_profile;
+
+  if ((data.size() < 2) ||
+      (get_dictionary((uint8_t)data[0]) == nullptr) ||
+      (!read_service_profile_section(data,
+                                     1,
+                                     (uint8_t)data[0],
+                                     service_profile)))
+  {
+    TRC_WARNING("Shared service profile %s is unreadable", reference.c_str());
+    _shared_profiles.remove(reference);
+    return Store::Status::NOT_FOUND;
+  }
+
+  service_profile.set_reference(reference);
+  impu->service_profile = service_profile;
+
+  return Store::Status::OK;
+}
+
+void ImpuStore::prepare_service_profile(Impu* impu, SAS::TrailId trail)
+{
+  if (!impu->is_default_impu())
+  {
+    return;
+  }
+
+  ServiceProfile& service_profile = ((DefaultImpu*)impu)->service_profile;
+
+  if ((!_share_service_profiles) || (_impu_format == ImpuFormat::V0))
+  {
+    // Write the profile in the IMPU
+    service_profile.set_reference("");
+    return;
+  }
+
+  std::string reference = service_profile.reference();
+
+  if (reference.empty())
+  {
+    const std::string& xml = service_profile.get();
+
+    if (xml.size() < MIN_SHARED_PROFILE_LEN)
+    {
+      return;
+    }
+
+    reference = shared_profile_reference(xml);
+  }
+
+  // Shared profiles have no reference count, as there's no way to keep one
+  // consistent across sites. Instead, the profile is written to each store
+  // with a lease that outlives every IMPU in that store that refers to it,
+  // extending the lease whenever an IMPU would outlive it. If the profile is
+  // lost anyway (e.g. evicted), readers treat its IMPUs as expired.
+  int64_t now = time(0);
+
+  if (_shared_profiles.lease_expiry(reference) < impu->expiry)
+  {
+    int64_t lease_expiry = std::max(impu->expiry, now + SHARED_PROFILE_LEASE);
+
+    std::string data;
+    data.push_back((char)_dictionary_id);
+
+    Store::Status status = Store::Status::ERROR;
+
+    if (service_profile.write_section(data, _dictionary_id, _codec_policy))
+    {
+      status = _store->set_data_without_cas("service_profile",
+                                            reference,
+                                            data,
+                                            lease_expiry - now,
+                                            trail,
+                                            false);
+    }
+
+    if (status != Store::Status::OK)
+    {
+      TRC_WARNING("Failed to store shared service profile %s, writing IMPU %s "
+                  "with its own copy", reference.c_str(), impu->impu.c_str());
+      service_profile.set_reference("");
+      return;
+    }
+
+    _shared_profiles.put(reference, data, lease_expiry);
+  }
+
+  service_profile.set_reference(reference);
+}
+
+std::string ImpuStore::shared_profile_reference(const std::string& xml)
+{
+  static const char HEX[] = "0123456789abcdef";
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+
+  SHA256((const unsigned char*)xml.data(), xml.size(), digest);
+
+  std::string reference;
+  reference.reserve(SHA256_DIGEST_LENGTH * 2);
+
+  for (unsigned char byte : digest)
+  {
+    reference.push_back(HEX[byte >> 4]);
+    reference.push_back(HEX[byte & 0xf]);
+  }
+
+  return reference;
+}
+
 Store::Status ImpuStore::set_impu_without_cas(ImpuStore::Impu* impu,
                                               SAS::TrailId trail)
 {
   std::string data;
 
-  Store::Status status = impu->to_data(data);
+  prepare_service_profile(impu, trail);
+  Store::Status status = impu->to_data(data, _impu_format, _dictionary_id, _codec_policy);
 
   if (status == Store::Status::OK)
   {
@@ -553,7 +2028,8 @@ Store::Status ImpuStore::add_impu(ImpuStore::Impu* impu,
 {
   std::string data;
 
-  Store::Status status = impu->to_data(data);
+  prepare_service_profile(impu, trail);
+  Store::Status status = impu->to_data(data, _impu_format, _dictionary_id, _codec_policy);
 
   if (status == Store::Status::OK)
   {
@@ -581,7 +2057,8 @@ Store::Status ImpuStore::set_impu(ImpuStore::Impu* impu,
 
   std::string data;
 
-  Store::Status status = impu->to_data(data);
+  prepare_service_profile(impu, trail);
+  Store::Status status = impu->to_data(data, _impu_format, _dictionary_id, _codec_policy);
 
   if (status == Store::Status::OK)
   {
@@ -602,12 +2079,145 @@ Store::Status ImpuStore::set_impu(ImpuStore::Impu* impu,
   return status;
 }
 
+// The Store interface only reads one key at a time, so for now batches are
+// read a key at a time too. Callers that read in batches will then pick up a
+// multi-get by just changing these functions, once the Store offers one.
+Store::Status ImpuStore::get_impus(const std::vector<std::string>& impus,
+                                   std::map<std::string, ImpuStore::Impu*>& out_impus,
+                                   SAS::TrailId trail)
+{
+  Store::Status status = Store::Status::OK;
+
+  for (const std::string& impu : impus)
+  {
+    if (out_impus.find(impu) != out_impus.end())
+    {
+      // Duplicate
+      continue;
+    }
+
+    ImpuStore::Impu* out_impu = nullptr;
+    Store::Status inner_status = get_impu(impu, out_impu, trail);
+
+    if (inner_status == Store::Status::OK)
+    {
+      out_impus[impu] = out_impu;
+    }
+    else if ((inner_status != Store::Status::NOT_FOUND) &&
+             (status == Store::Status::OK))
+    {
+      status = inner_status;
+    }
+  }
+
+  return status;
+}
+
 Store::Status ImpuStore::delete_impu(ImpuStore::Impu* impu,
                                      SAS::TrailId trail)
 {
   return _store->delete_data("impu", impu->impu, trail);
 }
 
+// As for reads, the Store interface only writes one key at a time, so for now
+// batches are written a key at a time, collecting the status of each.
+static Store::Status write_impus(const std::vector<ImpuStore::Impu*>& impus,
+                                 std::map<std::string, Store::Status>& statuses,
+                                 std::function<Store::Status(ImpuStore::Impu*)> write)
+{
+  Store::Status status = Store::Status::OK;
+
+  for (ImpuStore::Impu* impu : impus)
+  {
+    Store::Status inner_status = write(impu);
+    statuses[impu->impu] = inner_status;
+
+    if ((inner_status != Store::Status::OK) &&
+        (status == Store::Status::OK))
+    {
+      status = inner_status;
+    }
+  }
+
+  return status;
+}
+
+Store::Status ImpuStore::set_impus_without_cas(const std::vector<ImpuStore::Impu*>& impus,
+                                               SAS::TrailId trail,
+                                               std::map<std::string, Store::Status>& statuses)
+{
+  return write_impus(impus,
+                     statuses,
+                     [this, trail](ImpuStore::Impu* impu)
+                     {
+                       return set_impu_without_cas(impu, trail);
+                     });
+}
+
+Store::Status ImpuStore::touch_impus(const std::vector<ImpuStore::Impu*>& impus,
+                                     SAS::TrailId trail,
+                                     std::map<std::string, Store::Status>& statuses)
+{
+  // An Associated IMPU's record holds its Default IMPU and expiry, but not
+  // the IMPU itself, so the Associated IMPUs of an IRS that are extended
+  // together all have the same record. Only encode it once.
+  std::string data;
+  ImpuStore::AssociatedImpu* encoded = nullptr;
+  int now = time(0);
+
+  return write_impus(impus,
+                     statuses,
+                     [this, trail, now, &data, &encoded](ImpuStore::Impu* impu)
+                     {
+                       if (impu->is_default_impu())
+                       {
+                         return set_impu_without_cas(impu, trail);
+                       }
+
+                       ImpuStore::AssociatedImpu* assoc_impu =
+                         (ImpuStore::AssociatedImpu*)impu;
+
+                       if ((encoded == nullptr) ||
+                           (encoded->default_impu != assoc_impu->default_impu) ||
+                           (encoded->expiry != assoc_impu->expiry))
+                       {
+                         data.clear();
+                         encoded = nullptr;
+
+                         Store::Status status = assoc_impu->to_data(data,
+                                                                    _impu_format,
+                                                                    _dictionary_id,
+                                                                    _codec_policy);
+
+                         if (status != Store::Status::OK)
+                         {
+                           return status; // LCOV_EXCL_LINE
+                         }
+
+                         encoded = assoc_impu;
+                       }
+
+                       return _store->set_data_without_cas("impu",
+                                                           impu->impu,
+                                                           data,
+                                                           impu->expiry - now,
+                                                           trail,
+                                                           false);
+                     });
+}
+
+Store::Status ImpuStore::delete_impus(const std::vector<ImpuStore::Impu*>& impus,
+                                      SAS::TrailId trail,
+                                      std::map<std::string, Store::Status>& statuses)
+{
+  return write_impus(impus,
+                     statuses,
+                     [this, trail](ImpuStore::Impu* impu)
+                     {
+                       return delete_impu(impu, trail);
+                     });
+}
+
 Store::Status ImpuStore::get_impi_mapping(const std::string impi,
                                           ImpuStore::ImpiMapping*& out_mapping,
                                           SAS::TrailId trail)
@@ -615,12 +2225,17 @@ Store::Status ImpuStore::get_impi_mapping(const std::string impi,
   std::string data;
   uint64_t cas;
 
+  // The format only affects how the data is logged. We can't know it until
+  // we've read the mapping, so assume it was written by this node.
+  Store::Format data_format = (_impu_format == ImpuFormat::V0) ?
+                                Store::Format::JSON : Store::Format::HEX;
+
   Store::Status status = _store->get_data("impi_mapping",
                                           impi,
                                           data,
                                           cas,
                                           trail,
-                                          Store::Format::JSON);
+                                          data_format);
 
   if (status == Store::Status::OK)
   {
@@ -644,12 +2259,46 @@ Store::Status ImpuStore::get_impi_mapping(const std::string impi,
   return status;
 }
 
+Store::Status ImpuStore::get_impi_mappings(const std::vector<std::string>& impis,
+                                           std::map<std::string, ImpuStore::ImpiMapping*>& out_mappings,
+                                           SAS::TrailId trail)
+{
+  Store::Status status = Store::Status::OK;
+
+  for (const std::string& impi : impis)
+  {
+    if (out_mappings.find(impi) != out_mappings.end())
+    {
+      // Duplicate
+      continue;
+    }
+
+    ImpuStore::ImpiMapping* out_mapping = nullptr;
+    Store::Status inner_status = get_impi_mapping(impi, out_mapping, trail);
+
+    if (inner_status == Store::Status::OK)
+    {
+      out_mappings[impi] = out_mapping;
+    }
+    else if ((inner_status != Store::Status::NOT_FOUND) &&
+             (status == Store::Status::OK))
+    {
+      status = inner_status;
+    }
+  }
+
+  return status;
+}
+
 Store::Status ImpuStore::set_impi_mapping(ImpiMapping* mapping,
                                           SAS::TrailId trail)
 {
   std::string data;
 
-  Store::Status status = mapping->to_data(data);
+  Store::Status status = mapping->to_data(data,
+                                          _impu_format,
+                                          _dictionary_id,
+                                          _codec_policy);
 
   if (status == Store::Status::OK)
   {
@@ -661,7 +2310,37 @@ Store::Status ImpuStore::set_impi_mapping(ImpiMapping* mapping,
                               mapping->cas,
                               mapping->get_expiry() - now,
                               trail,
-                              Store::Format::JSON);
+                              (_impu_format == ImpuFormat::V0) ?
+                                Store::Format::JSON : Store::Format::HEX);
+  }
+
+  return status;
+}
+
+Store::Status ImpuStore::add_impi_mapping(ImpiMapping* mapping,
+                                          SAS::TrailId trail)
+{
+  std::string data;
+
+  Store::Status status = mapping->to_data(data,
+                                          _impu_format,
+                                          _dictionary_id,
+                                          _codec_policy);
+
+  if (status == Store::Status::OK)
+  {
+    int now = time(0);
+
+    // Set the data with a CAS of 0, which will fail if there's data already
+    // present
+    status = _store->set_data("impi_mapping",
+                              mapping->impi,
+                              data,
+                              0,
+                              mapping->get_expiry() - now,
+                              trail,
+                              (_impu_format == ImpuFormat::V0) ?
+                                Store::Format::JSON : Store::Format::HEX);
   }
 
   return status;
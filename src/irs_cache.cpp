@@ -0,0 +1,61 @@
+/**
+ * @file irs_cache.cpp In-memory cache of IRSs read from the IMPU stores
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <ctime>
+
+#include "irs_cache.h"
+
+const size_t IrsCache::DEFAULT_SHARDS;
+
+IrsCache::IrsCache(size_t max_entries,
+                   uint64_t ttl_ms,
+                   size_t num_shards) :
+  _map(max_entries,
+       ttl_ms,
+       num_shards,
+       ShardedTtlMap<Snapshot>::LEAST_RECENTLY_USED)
+{
+}
+
+IrsCache::Snapshot IrsCache::get(const std::string& impu, uint64_t& ticket)
+{
+  Snapshot snapshot;
+
+  // The IRS may have expired in the store before we'd have refreshed it
+  if (_map.get(impu,
+               snapshot,
+               ticket,
+               [](const Snapshot& cached) { return cached->expiry <= time(0); }))
+  {
+    return snapshot;
+  }
+
+  return nullptr;
+}
+
+void IrsCache::add(const std::string& impu,
+                   const ImpuStore::DefaultImpu* default_impu,
+                   uint64_t ticket)
+{
+  // Take the copy before locking the shard
+  Snapshot snapshot((ImpuStore::DefaultImpu*)default_impu->clone());
+  _map.add(impu, snapshot, ticket);
+}
+
+void IrsCache::invalidate(const std::vector<std::string>& impus)
+{
+  _map.invalidate(impus);
+}
+
+IrsCache::Stats IrsCache::get_stats()
+{
+  return _map.get_stats();
+}
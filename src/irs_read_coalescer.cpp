@@ -0,0 +1,118 @@
+/**
+ * @file irs_read_coalescer.cpp Sharing of concurrent reads of the same IRS
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "irs_read_coalescer.h"
+#include "log.h"
+
+IrsReadCoalescer::Read::Read(IrsReadCoalescer* coalescer,
+                             const std::string& impu,
+                             uint64_t write_generation) :
+  _coalescer(coalescer),
+  _impu(impu),
+  _write_generation(write_generation),
+  _completed(false)
+{
+}
+
+IrsReadCoalescer::Read::~Read()
+{
+  if (!_completed)
+  {
+    TRC_DEBUG("Read of IRS for IMPU %s didn't complete", _impu.c_str());
+    complete(Store::Status::ERROR, nullptr);
+  }
+}
+
+void IrsReadCoalescer::Read::complete(Store::Status status,
+                                      ImplicitRegistrationSet* irs)
+{
+  _completed = true;
+
+  std::vector<std::pair<SuccessCallback, FailureCallback>> waiters =
+    _coalescer->finish(this);
+
+  for (size_t ii = 0; ii < waiters.size(); ii++)
+  {
+    if (status == Store::Status::OK)
+    {
+      // Each request takes ownership of the IRS it's given, so all but the
+      // last are given copies
+      waiters[ii].first((ii + 1 < waiters.size()) ? irs->clone() : irs);
+    }
+    else
+    {
+      waiters[ii].second(status);
+    }
+  }
+}
+
+IrsReadCoalescer::IrsReadCoalescer() :
+  _write_generation(0),
+  _coalesced_gets(0),
+  _coalesced_gets_tbl(nullptr)
+{
+}
+
+std::shared_ptr<IrsReadCoalescer::Read>
+  IrsReadCoalescer::join_or_start(const std::string& impu,
+                                  SuccessCallback success_cb,
+                                  FailureCallback failure_cb)
+{
+  std::lock_guard<std::mutex> lock(_lock);
+  std::map<std::string, Read*>::iterator it = _reads.find(impu);
+
+  if ((it != _reads.end()) &&
+      (it->second->_write_generation == _write_generation))
+  {
+    // There's already a read of this IMPU in progress that we can share
+    TRC_DEBUG("Sharing read of IRS for IMPU: %s", impu.c_str());
+    it->second->_waiters.push_back(std::make_pair(success_cb, failure_cb));
+    _coalesced_gets++;
+
+    if (_coalesced_gets_tbl)
+    {
+      _coalesced_gets_tbl->increment();
+    }
+
+    return nullptr;
+  }
+
+  // Any read that's out of date is replaced, but will still answer the
+  // requests already waiting for it
+  std::shared_ptr<Read> read(new Read(this, impu, _write_generation));
+  read->_waiters.push_back(std::make_pair(success_cb, failure_cb));
+  _reads[impu] = read.get();
+
+  return read;
+}
+
+void IrsReadCoalescer::irss_written()
+{
+  std::lock_guard<std::mutex> lock(_lock);
+  _write_generation++;
+}
+
+std::vector<std::pair<IrsReadCoalescer::SuccessCallback,
+                      IrsReadCoalescer::FailureCallback>>
+  IrsReadCoalescer::finish(Read* read)
+{
+  std::lock_guard<std::mutex> lock(_lock);
+  std::map<std::string, Read*>::iterator it = _reads.find(read->_impu);
+
+  if ((it != _reads.end()) && (it->second == read))
+  {
+    _reads.erase(it);
+  }
+
+  std::vector<std::pair<SuccessCallback, FailureCallback>> waiters;
+  waiters.swap(read->_waiters);
+  return waiters;
+}
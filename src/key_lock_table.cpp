@@ -0,0 +1,80 @@
+/**
+ * @file key_lock_table.cpp Striped in-process locks for IMPU store keys
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "key_lock_table.h"
+
+#include <algorithm>
+#include <functional>
+
+KeyLockTable::KeyLockTable(size_t num_stripes) :
+  _stripes(std::max(num_stripes, (size_t)1)),
+  _acquisitions(0),
+  _waits(0)
+{
+}
+
+size_t KeyLockTable::stripe_for(const void* scope, const std::string& key)
+{
+  size_t hash = std::hash<std::string>()(key);
+
+  // Combine in the scope (as boost::hash_combine does)
+  hash ^= std::hash<const void*>()(scope) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+
+  return hash % _stripes.size();
+}
+
+KeyLockTable::Locks KeyLockTable::lock(const void* scope,
+                                       const std::vector<std::string>& keys)
+{
+  // Lock each stripe once, in order, so that threads locking several keys
+  // can't deadlock
+  std::vector<size_t> stripes;
+
+  for (const std::string& key : keys)
+  {
+    stripes.push_back(stripe_for(scope, key));
+  }
+
+  std::sort(stripes.begin(), stripes.end());
+  stripes.erase(std::unique(stripes.begin(), stripes.end()), stripes.end());
+
+  Locks locks;
+
+  for (size_t stripe : stripes)
+  {
+    std::unique_lock<std::mutex> lock(_stripes[stripe], std::try_to_lock);
+
+    if (!lock.owns_lock())
+    {
+      _waits++;
+      lock.lock();
+    }
+
+    _acquisitions++;
+    locks.push_back(std::move(lock));
+  }
+
+  return locks;
+}
+
+KeyLockTable::Locks KeyLockTable::lock(const void* scope,
+                                       const std::string& key)
+{
+  return lock(scope, std::vector<std::string>(1, key));
+}
+
+KeyLockTable::Stats KeyLockTable::get_stats()
+{
+  Stats stats;
+  stats.acquisitions = _acquisitions;
+  stats.waits = _waits;
+  return stats;
+}
@@ -55,6 +55,28 @@ struct options
   int http_threads;
   std::string cassandra;
   std::vector<std::string> impu_stores;
+  ImpuStore::ImpuFormat impu_store_format;
+  std::string impu_store_dictionaries;
+  int impu_store_dictionary;
+  ImpuStore::CodecPolicy impu_store_codec_policy;
+  bool impu_store_shared_profiles;
+  int gr_replication_writers;
+  int gr_replication_queue;
+  int gr_read_hedge_max_delay_ms;
+  bool gr_read_repair;
+  int gr_reconcile_log;
+  int gr_reconcile_delay_ms;
+  int gr_reconcile_rate;
+  int irs_cache_size;
+  int irs_cache_ttl_ms;
+  int not_found_cache_size;
+  int not_found_cache_ttl_ms;
+  int irs_batch_threads;
+  int irs_batch_write_parallelism;
+  int cas_max_retries;
+  int cas_backoff_min_us;
+  int cas_backoff_max_us;
+  int key_lock_stripes;
   std::string local_site_name;
   std::string dest_realm;
   std::string dest_host;
@@ -125,6 +147,29 @@ enum OptionTypes
   REG_MAX_EXPIRES,
   CASSANDRA_THREADS,
   RAM_RECORD_EVERYTHING,
+  IMPU_STORE_FORMAT,
+  IMPU_STORE_DICTIONARIES,
+  IMPU_STORE_DICTIONARY,
+  IMPU_STORE_RAW_MAX,
+  IMPU_STORE_DEFLATE_MIN,
+  IMPU_STORE_SHARED_PROFILES,
+  GR_REPLICATION_WRITERS,
+  GR_REPLICATION_QUEUE,
+  GR_READ_HEDGE_MAX_DELAY,
+  GR_READ_REPAIR,
+  GR_RECONCILE_LOG,
+  GR_RECONCILE_DELAY,
+  GR_RECONCILE_RATE,
+  IRS_CACHE_SIZE,
+  IRS_CACHE_TTL,
+  NOT_FOUND_CACHE_SIZE,
+  NOT_FOUND_CACHE_TTL,
+  IRS_BATCH_THREADS,
+  IRS_BATCH_WRITE_PARALLELISM,
+  CAS_MAX_RETRIES,
+  CAS_BACKOFF_MIN,
+  CAS_BACKOFF_MAX,
+  KEY_LOCK_STRIPES,
 };
 
 const static struct option long_opt[] =
@@ -140,6 +185,29 @@ const static struct option long_opt[] =
   {"cassandra",                   required_argument, NULL, 'S'},
   {"local-site-name",             required_argument, NULL, LOCAL_SITE_NAME},
   {"impu-stores",                 required_argument, NULL, 'M'},
+  {"impu-store-format",           required_argument, NULL, IMPU_STORE_FORMAT},
+  {"impu-store-dictionaries",     required_argument, NULL, IMPU_STORE_DICTIONARIES},
+  {"impu-store-dictionary",       required_argument, NULL, IMPU_STORE_DICTIONARY},
+  {"impu-store-raw-max",          required_argument, NULL, IMPU_STORE_RAW_MAX},
+  {"impu-store-deflate-min",      required_argument, NULL, IMPU_STORE_DEFLATE_MIN},
+  {"impu-store-shared-profiles",  no_argument,       NULL, IMPU_STORE_SHARED_PROFILES},
+  {"gr-replication-writers",      required_argument, NULL, GR_REPLICATION_WRITERS},
+  {"gr-replication-queue",        required_argument, NULL, GR_REPLICATION_QUEUE},
+  {"gr-read-hedge-max-delay",     required_argument, NULL, GR_READ_HEDGE_MAX_DELAY},
+  {"gr-read-repair",              no_argument,       NULL, GR_READ_REPAIR},
+  {"gr-reconcile-log",            required_argument, NULL, GR_RECONCILE_LOG},
+  {"gr-reconcile-delay",          required_argument, NULL, GR_RECONCILE_DELAY},
+  {"gr-reconcile-rate",           required_argument, NULL, GR_RECONCILE_RATE},
+  {"irs-cache-size",              required_argument, NULL, IRS_CACHE_SIZE},
+  {"irs-cache-ttl",               required_argument, NULL, IRS_CACHE_TTL},
+  {"not-found-cache-size",        required_argument, NULL, NOT_FOUND_CACHE_SIZE},
+  {"not-found-cache-ttl",         required_argument, NULL, NOT_FOUND_CACHE_TTL},
+  {"irs-batch-threads",           required_argument, NULL, IRS_BATCH_THREADS},
+  {"irs-batch-write-parallelism", required_argument, NULL, IRS_BATCH_WRITE_PARALLELISM},
+  {"cas-max-retries",             required_argument, NULL, CAS_MAX_RETRIES},
+  {"cas-backoff-min",             required_argument, NULL, CAS_BACKOFF_MIN},
+  {"cas-backoff-max",             required_argument, NULL, CAS_BACKOFF_MAX},
+  {"key-lock-stripes",            required_argument, NULL, KEY_LOCK_STRIPES},
   {"dest-realm",                  required_argument, NULL, 'D'},
   {"dest-host",                   required_argument, NULL, 'd'},
   {"hss-peer",                    required_argument, NULL, FORCE_HSS_PEER},
@@ -201,6 +269,103 @@ void usage(void)
        "                            be the local site. Remote sites for\n"
        "                            geo-redundant storage are optional.\n "
        "                            (If not provided, localhost is used.)\n"
+       "     --impu-store-format N  Format to write IMPUs to the IMPU store in (default: 0)\n"
+       "                            IMPI mappings are written as plain JSON in\n"
+       "                            format 0, and compressed binary otherwise\n"
+       "                            0 - compressed JSON, readable by all versions\n"
+       "                            1 - compressed binary, only set this once every\n"
+       "                                node in every site can read it\n"
+       "                            2 - compressed binary, with the service profile\n"
+       "                                compressed separately so it's only\n"
+       "                                decompressed when needed. Only set this\n"
+       "                                once every node in every site can read it\n"
+       "     --impu-store-dictionaries <directory>\n"
+       "                            Directory to load trained IMPU compression\n"
+       "                            dictionaries from (default: built in only)\n"
+       "     --impu-store-dictionary N\n"
+       "                            ID of the dictionary to compress IMPUs with,\n"
+       "                            requires --impu-store-format=1 or 2 (default: 0,\n"
+       "                            the built in dictionary). Only set this once\n"
+       "                            every node in every site has the dictionary\n"
+       "     --impu-store-raw-max N Store IMPUs of up to N bytes uncompressed, as\n"
+       "                            they don't compress well (default: 0, never).\n"
+       "                            Requires --impu-store-format=1 or 2\n"
+       "     --impu-store-deflate-min N\n"
+       "                            Compress IMPUs of at least N bytes with deflate\n"
+       "                            rather than LZ4, using more CPU to save memory\n"
+       "                            (default: 0, never). Requires\n"
+       "                            --impu-store-format=1 or 2\n"
+       "     --impu-store-shared-profiles\n"
+       "                            Store each distinct service profile once, and\n"
+       "                            have IMPUs refer to it, rather than storing a\n"
+       "                            copy with every IMPU. Requires\n"
+       "                            --impu-store-format=1 or 2. Only set this once\n"
+       "                            every node in every site can read it\n"
+       "     --gr-replication-writers N\n"
+       "                            Number of writes to each remote IMPU store\n"
+       "                            to make at once, in the background. 0 to make\n"
+       "                            them synchronously, after each local write\n"
+       "                            (default: 0)\n"
+       "     --gr-replication-queue N\n"
+       "                            Maximum number of writes to queue for each\n"
+       "                            remote IMPU store. Further writes are dropped\n"
+       "                            (default: 10000)\n"
+       "     --gr-read-hedge-max-delay <milliseconds>\n"
+       "                            When an IMPU isn't found locally, it's read\n"
+       "                            from the fastest remote IMPU store first, and\n"
+       "                            from the next fastest if that one hasn't\n"
+       "                            answered within its usual latency, up to this\n"
+       "                            limit. 0 to read from all of them at once\n"
+       "                            (default: 0)\n"
+       "     --gr-read-repair       Add IMPUs and IMPI mappings that are only found\n"
+       "                            in a remote IMPU store to the local store, so\n"
+       "                            later reads of them stay local\n"
+       "     --gr-reconcile-log N   Remember up to N of the IMPUs and IMPIs most\n"
+       "                            recently written locally, and check them in\n"
+       "                            the background at each remote IMPU store,\n"
+       "                            repairing any that are missing or out of\n"
+       "                            date. 0 to disable (default: 0)\n"
+       "     --gr-reconcile-delay <milliseconds>\n"
+       "                            How long after a write to check it, to give\n"
+       "                            it time to be replicated (default: 10000)\n"
+       "     --gr-reconcile-rate N  Check at most N IMPUs and IMPIs a second\n"
+       "                            (default: 100)\n"
+       "     --irs-cache-size N     Cache up to N IRSs in memory, so that repeated\n"
+       "                            reads of them don't need to go to the IMPU\n"
+       "                            store. 0 to disable the cache (default: 0)\n"
+       "     --irs-cache-ttl <milliseconds>\n"
+       "                            How long an IRS may be cached for, and so how\n"
+       "                            long a change to it made by another Homestead\n"
+       "                            can take to be seen (default: 1000)\n"
+       "     --not-found-cache-size N\n"
+       "                            Remember up to N IMPUs that weren't found in\n"
+       "                            any IMPU store, so that repeated requests for\n"
+       "                            them don't read the remote IMPU stores. 0 to\n"
+       "                            disable the cache (default: 0)\n"
+       "     --not-found-cache-ttl <milliseconds>\n"
+       "                            How long an IMPU is remembered as not found,\n"
+       "                            and so how long an IMPU added by another site\n"
+       "                            can take to be seen (default: 500)\n"
+       "     --irs-batch-threads N  Read the IRSs for requests that need several of\n"
+       "                            them (such as RTRs) on up to N extra threads at\n"
+       "                            once. 0 to read them one at a time (default: 0)\n"
+       "     --irs-batch-write-parallelism N\n"
+       "                            Write up to N of the IRSs for requests that\n"
+       "                            write several of them (such as RTRs and PPRs)\n"
+       "                            at once, if --irs-batch-threads is set\n"
+       "                            (default: 4)\n"
+       "     --cas-max-retries N    Retry writes to the IMPU store that conflict\n"
+       "                            with another Homestead's up to N times before\n"
+       "                            failing the request (default: 10)\n"
+       "     --cas-backoff-min <microseconds>\n"
+       "     --cas-backoff-max <microseconds>\n"
+       "                            Wait for a random time before each retry, of\n"
+       "                            up to the minimum, doubling with each retry\n"
+       "                            up to the maximum (defaults: 200, 20000)\n"
+       "     --key-lock-stripes N   Have threads that update the same IMPU or IMPI\n"
+       "                            in the IMPU store take turns, using N locks,\n"
+       "                            rather than conflicting with each other. 0 to\n"
+       "                            disable (default: 0)\n"
        " -D, --dest-realm <name>    Set Destination-Realm on Cx messages\n"
        " -d, --dest-host <name>     Set Destination-Host on Cx messages\n"
        "     --hss-peer <name>      IP address of HSS to connect to (rather than resolving Destination-Realm/Destination-Host)\n"
@@ -362,6 +527,163 @@ int init_options(int argc, char**argv, struct options& options)
       }
       break;
 
+    case IMPU_STORE_FORMAT:
+      {
+        int format = atoi(optarg);
+
+        if ((format != (int)ImpuStore::ImpuFormat::V0) &&
+            (format != (int)ImpuStore::ImpuFormat::V1) &&
+            (format != (int)ImpuStore::ImpuFormat::V2))
+        {
+          TRC_ERROR("Invalid --impu-store-format option %s", optarg);
+          return -1;
+        }
+
+        TRC_INFO("IMPU store format: %d", format);
+        options.impu_store_format = (ImpuStore::ImpuFormat)format;
+      }
+      break;
+
+    case IMPU_STORE_DICTIONARIES:
+      TRC_INFO("IMPU store dictionaries: %s", optarg);
+      options.impu_store_dictionaries = std::string(optarg);
+      break;
+
+    case IMPU_STORE_DICTIONARY:
+      {
+        int dictionary = atoi(optarg);
+
+        if ((dictionary < 0) || (dictionary >= ImpuStore::MAX_DICTIONARIES))
+        {
+          TRC_ERROR("Invalid --impu-store-dictionary option %s", optarg);
+          return -1;
+        }
+
+        TRC_INFO("IMPU store dictionary: %d", dictionary);
+        options.impu_store_dictionary = dictionary;
+      }
+      break;
+
+    case IMPU_STORE_RAW_MAX:
+      {
+        int raw_max = atoi(optarg);
+
+        if (raw_max < 0)
+        {
+          TRC_ERROR("Invalid --impu-store-raw-max option %s", optarg);
+          return -1;
+        }
+
+        TRC_INFO("IMPU store raw maximum size: %d", raw_max);
+        options.impu_store_codec_policy.raw_max_size = raw_max;
+      }
+      break;
+
+    case IMPU_STORE_DEFLATE_MIN:
+      {
+        int deflate_min = atoi(optarg);
+
+        if (deflate_min < 0)
+        {
+          TRC_ERROR("Invalid --impu-store-deflate-min option %s", optarg);
+          return -1;
+        }
+
+        TRC_INFO("IMPU store deflate minimum size: %d", deflate_min);
+        options.impu_store_codec_policy.deflate_min_size = deflate_min;
+      }
+      break;
+
+    case IMPU_STORE_SHARED_PROFILES:
+      TRC_INFO("IMPU store sharing service profiles");
+      options.impu_store_shared_profiles = true;
+      break;
+
+    case GR_REPLICATION_WRITERS:
+      TRC_INFO("GR replication writers: %s", optarg);
+      options.gr_replication_writers = atoi(optarg);
+      break;
+
+    case GR_REPLICATION_QUEUE:
+      TRC_INFO("GR replication queue: %s", optarg);
+      options.gr_replication_queue = atoi(optarg);
+      break;
+
+    case GR_READ_HEDGE_MAX_DELAY:
+      TRC_INFO("GR read hedge max delay: %s", optarg);
+      options.gr_read_hedge_max_delay_ms = atoi(optarg);
+      break;
+
+    case GR_READ_REPAIR:
+      TRC_INFO("GR read repair enabled");
+      options.gr_read_repair = true;
+      break;
+
+    case GR_RECONCILE_LOG:
+      TRC_INFO("GR reconcile log: %s", optarg);
+      options.gr_reconcile_log = atoi(optarg);
+      break;
+
+    case GR_RECONCILE_DELAY:
+      TRC_INFO("GR reconcile delay: %s", optarg);
+      options.gr_reconcile_delay_ms = atoi(optarg);
+      break;
+
+    case GR_RECONCILE_RATE:
+      TRC_INFO("GR reconcile rate: %s", optarg);
+      options.gr_reconcile_rate = atoi(optarg);
+      break;
+
+    case IRS_CACHE_SIZE:
+      TRC_INFO("IRS cache size: %s", optarg);
+      options.irs_cache_size = atoi(optarg);
+      break;
+
+    case IRS_CACHE_TTL:
+      TRC_INFO("IRS cache TTL: %s", optarg);
+      options.irs_cache_ttl_ms = atoi(optarg);
+      break;
+
+    case NOT_FOUND_CACHE_SIZE:
+      TRC_INFO("Not found cache size: %s", optarg);
+      options.not_found_cache_size = atoi(optarg);
+      break;
+
+    case NOT_FOUND_CACHE_TTL:
+      TRC_INFO("Not found cache TTL: %s", optarg);
+      options.not_found_cache_ttl_ms = atoi(optarg);
+      break;
+
+    case IRS_BATCH_THREADS:
+      TRC_INFO("IRS batch threads: %s", optarg);
+      options.irs_batch_threads = atoi(optarg);
+      break;
+
+    case IRS_BATCH_WRITE_PARALLELISM:
+      TRC_INFO("IRS batch write parallelism: %s", optarg);
+      options.irs_batch_write_parallelism = atoi(optarg);
+      break;
+
+    case CAS_MAX_RETRIES:
+      TRC_INFO("CAS max retries: %s", optarg);
+      options.cas_max_retries = atoi(optarg);
+      break;
+
+    case CAS_BACKOFF_MIN:
+      TRC_INFO("CAS backoff min: %s", optarg);
+      options.cas_backoff_min_us = atoi(optarg);
+      break;
+
+    case CAS_BACKOFF_MAX:
+      TRC_INFO("CAS backoff max: %s", optarg);
+      options.cas_backoff_max_us = atoi(optarg);
+      break;
+
+    case KEY_LOCK_STRIPES:
+      TRC_INFO("Key lock stripes: %s", optarg);
+      options.key_lock_stripes = atoi(optarg);
+      break;
+
     case 'D':
       TRC_INFO("Destination realm: %s", optarg);
       options.dest_realm = std::string(optarg);
@@ -627,7 +949,8 @@ void create_memcached_cache(HssCacheProcessor*& cache_processor,
                             std::string& impu_store_location,
                             int af,
                             int threads,
-                            ExceptionHandler* exception_handler)
+                            ExceptionHandler* exception_handler,
+                            MemcachedCache::Options cache_options)
 {
   astaire_comm_monitor = new CommunicationMonitor(new Alarm(alarm_manager,
                                                             "homestead",
@@ -655,7 +978,11 @@ void create_memcached_cache(HssCacheProcessor*& cache_processor,
                                                                       astaire_resolver,
                                                                       false,
                                                                       astaire_comm_monitor);
-    local_impu_store = new ImpuStore(local_impu_data_store);
+    local_impu_store = new ImpuStore(local_impu_data_store,
+                                     options.impu_store_format,
+                                     options.impu_store_dictionary,
+                                     options.impu_store_codec_policy,
+                                     options.impu_store_shared_profiles);
 
     for (std::vector<std::string>::iterator it = remote_impu_stores_locations.begin();
            it != remote_impu_stores_locations.end();
@@ -667,13 +994,37 @@ void create_memcached_cache(HssCacheProcessor*& cache_processor,
                                                                            true,
                                                                            remote_astaire_comm_monitor);
       remote_impu_data_stores.push_back(remote_data_store);
-      remote_impu_stores.push_back(new ImpuStore(remote_data_store));
+      remote_impu_stores.push_back(new ImpuStore(remote_data_store,
+                                                 options.impu_store_format,
+                                                 options.impu_store_dictionary,
+                                                 options.impu_store_codec_policy,
+                                                 options.impu_store_shared_profiles));
     }
 
+    // The statistics tables are already set, so fill in the rest
+    cache_options.replication_writers = options.gr_replication_writers;
+    cache_options.replication_queue_len = options.gr_replication_queue;
+    cache_options.max_hedge_delay_us = options.gr_read_hedge_max_delay_ms * 1000;
+    cache_options.read_repair = options.gr_read_repair;
+    cache_options.irs_cache_size = options.irs_cache_size;
+    cache_options.irs_cache_ttl_ms = options.irs_cache_ttl_ms;
+    cache_options.not_found_cache_size = options.not_found_cache_size;
+    cache_options.not_found_cache_ttl_ms = options.not_found_cache_ttl_ms;
+    cache_options.batch_threads = options.irs_batch_threads;
+    cache_options.batch_write_parallelism = options.irs_batch_write_parallelism;
+    cache_options.max_cas_retries = options.cas_max_retries;
+    cache_options.cas_backoff_min_us = options.cas_backoff_min_us;
+    cache_options.cas_backoff_max_us = options.cas_backoff_max_us;
+    cache_options.key_lock_stripes = options.key_lock_stripes;
+    cache_options.reconcile_log_len = options.gr_reconcile_log;
+    cache_options.reconcile_settle_ms = options.gr_reconcile_delay_ms;
+    cache_options.reconcile_keys_per_sec = options.gr_reconcile_rate;
+
     memcached_cache = new MemcachedCache(local_impu_store,
                                          remote_impu_stores,
                                          threads * remote_impu_stores_locations.size(),
-                                         exception_handler);
+                                         exception_handler,
+                                         cache_options);
     cache_processor = new HssCacheProcessor(memcached_cache);
   }
   else
@@ -703,6 +1054,28 @@ int main(int argc, char**argv)
   options.http_port = 8888;
   options.http_threads = 1;
   options.cache_threads = 50;
+  options.impu_store_format = ImpuStore::ImpuFormat::V0;
+  options.impu_store_dictionaries = "";
+  options.impu_store_dictionary = 0;
+  options.impu_store_codec_policy = ImpuStore::CodecPolicy();
+  options.impu_store_shared_profiles = false;
+  options.gr_replication_writers = 0;
+  options.gr_replication_queue = MemcachedCache::DEFAULT_REPLICATION_QUEUE_LEN;
+  options.gr_read_hedge_max_delay_ms = 0;
+  options.gr_read_repair = false;
+  options.gr_reconcile_log = 0;
+  options.gr_reconcile_delay_ms = 10000;
+  options.gr_reconcile_rate = 100;
+  options.irs_cache_size = 0;
+  options.irs_cache_ttl_ms = 1000;
+  options.not_found_cache_size = 0;
+  options.not_found_cache_ttl_ms = 500;
+  options.irs_batch_threads = 0;
+  options.irs_batch_write_parallelism = 4;
+  options.cas_max_retries = CasRetryPolicy::DEFAULT_MAX_RETRIES;
+  options.cas_backoff_min_us = 200;
+  options.cas_backoff_max_us = 20000;
+  options.key_lock_stripes = 0;
   options.cassandra_threads = 10;
   options.cassandra = "";
   options.dest_realm = "";
@@ -784,6 +1157,108 @@ int main(int argc, char**argv)
     return 1;
   }
 
+  // Load the IMPU compression dictionaries before anything can use them.
+  if ((options.impu_store_dictionaries != "") &&
+      (!ImpuStore::load_dictionaries(options.impu_store_dictionaries)))
+  {
+    TRC_ERROR("Failed to load IMPU store dictionaries from %s",
+              options.impu_store_dictionaries.c_str());
+    return 1;
+  }
+
+  if (options.impu_store_dictionary != 0)
+  {
+    if (options.impu_store_format == ImpuStore::ImpuFormat::V0)
+    {
+      TRC_ERROR("--impu-store-dictionary requires --impu-store-format=1 or 2");
+      return 1;
+    }
+
+    if (ImpuStore::get_dictionary(options.impu_store_dictionary) == nullptr)
+    {
+      TRC_ERROR("IMPU store dictionary %d is not loaded",
+                options.impu_store_dictionary);
+      return 1;
+    }
+  }
+
+  if (((options.impu_store_codec_policy.raw_max_size != 0) ||
+       (options.impu_store_codec_policy.deflate_min_size != 0)) &&
+      (options.impu_store_format == ImpuStore::ImpuFormat::V0))
+  {
+    TRC_ERROR("--impu-store-raw-max and --impu-store-deflate-min require "
+              "--impu-store-format=1 or 2");
+    return 1;
+  }
+
+  if ((options.impu_store_shared_profiles) &&
+      (options.impu_store_format == ImpuStore::ImpuFormat::V0))
+  {
+    TRC_ERROR("--impu-store-shared-profiles requires --impu-store-format=1 or 2");
+    return 1;
+  }
+
+  if ((options.gr_replication_writers < 0) || (options.gr_replication_queue <= 0))
+  {
+    TRC_ERROR("--gr-replication-writers must not be negative, and "
+              "--gr-replication-queue must be positive");
+    return 1;
+  }
+
+  if (options.gr_read_hedge_max_delay_ms < 0)
+  {
+    TRC_ERROR("--gr-read-hedge-max-delay must not be negative");
+    return 1;
+  }
+
+  if ((options.gr_reconcile_log < 0) ||
+      (options.gr_reconcile_delay_ms < 0) ||
+      (options.gr_reconcile_rate <= 0))
+  {
+    TRC_ERROR("--gr-reconcile-log and --gr-reconcile-delay must not be "
+              "negative, and --gr-reconcile-rate must be positive");
+    return 1;
+  }
+
+  if ((options.irs_cache_size < 0) || (options.irs_cache_ttl_ms < 0))
+  {
+    TRC_ERROR("--irs-cache-size and --irs-cache-ttl must not be negative");
+    return 1;
+  }
+
+  if ((options.not_found_cache_size < 0) || (options.not_found_cache_ttl_ms < 0))
+  {
+    TRC_ERROR("--not-found-cache-size and --not-found-cache-ttl must not be negative");
+    return 1;
+  }
+
+  if (options.irs_batch_threads < 0)
+  {
+    TRC_ERROR("--irs-batch-threads must not be negative");
+    return 1;
+  }
+
+  if (options.irs_batch_write_parallelism < 1)
+  {
+    TRC_ERROR("--irs-batch-write-parallelism must be at least 1");
+    return 1;
+  }
+
+  if ((options.cas_max_retries < 0) ||
+      (options.cas_backoff_min_us < 0) ||
+      (options.cas_backoff_max_us < options.cas_backoff_min_us))
+  {
+    TRC_ERROR("--cas-max-retries and --cas-backoff-min must not be negative, "
+              "and --cas-backoff-max must be at least --cas-backoff-min");
+    return 1;
+  }
+
+  if (options.key_lock_stripes < 0)
+  {
+    TRC_ERROR("--key-lock-stripes must not be negative");
+    return 1;
+  }
+
   if (options.pidfile != "")
   {
     int rc = Utils::lock_and_write_pidfile(options.pidfile);
@@ -839,6 +1314,90 @@ int main(int argc, char**argv)
   SNMP::EventAccumulatorByScopeTable* cache_queue_size_table =
     SNMP::EventAccumulatorByScopeTable::create("cache_queue_size",
                                                ".1.2.826.0.1.1578918.9.5.16");
+  SNMP::EventAccumulatorTable* irs_planned_writes_table =
+    SNMP::EventAccumulatorTable::create("H_irs_planned_writes",
+                                        ".1.2.826.0.1.1578918.9.5.17");
+  SNMP::EventAccumulatorTable* irs_executed_writes_table =
+    SNMP::EventAccumulatorTable::create("H_irs_executed_writes",
+                                        ".1.2.826.0.1.1578918.9.5.18");
+  SNMP::EventAccumulatorTable* irs_retried_writes_table =
+    SNMP::EventAccumulatorTable::create("H_irs_retried_writes",
+                                        ".1.2.826.0.1.1578918.9.5.19");
+  SNMP::CounterTable* irs_skipped_updates_table =
+    SNMP::CounterTable::create("H_irs_skipped_updates",
+                               ".1.2.826.0.1.1578918.9.5.20");
+  SNMP::CounterTable* cas_contentions_table =
+    SNMP::CounterTable::create("H_cas_contentions",
+                               ".1.2.826.0.1.1578918.9.5.21");
+  SNMP::CounterTable* cas_exhausted_table =
+    SNMP::CounterTable::create("H_cas_retries_exhausted",
+                               ".1.2.826.0.1.1578918.9.5.22");
+  SNMP::EventAccumulatorTable* cas_backoff_table =
+    SNMP::EventAccumulatorTable::create("H_cas_backoff_us",
+                                        ".1.2.826.0.1.1578918.9.5.23");
+  SNMP::EventAccumulatorTable* cas_contended_key_table =
+    SNMP::EventAccumulatorTable::create("H_cas_contended_key_count",
+                                        ".1.2.826.0.1.1578918.9.5.24");
+  SNMP::CounterTable* irs_coalesced_gets_table =
+    SNMP::CounterTable::create("H_irs_coalesced_gets",
+                               ".1.2.826.0.1.1578918.9.5.25");
+  SNMP::CounterTable* gr_reconcile_diverged_table =
+    SNMP::CounterTable::create("H_gr_reconcile_diverged",
+                               ".1.2.826.0.1.1578918.9.5.26");
+  SNMP::CounterTable* gr_reconcile_repaired_table =
+    SNMP::CounterTable::create("H_gr_reconcile_repaired",
+                               ".1.2.826.0.1.1578918.9.5.27");
+  SNMP::CounterTable* gr_reconcile_repair_failed_table =
+    SNMP::CounterTable::create("H_gr_reconcile_repair_failed",
+                               ".1.2.826.0.1.1578918.9.5.28");
+  SNMP::CounterTable* gr_reconcile_errors_table =
+    SNMP::CounterTable::create("H_gr_reconcile_errors",
+                               ".1.2.826.0.1.1578918.9.5.29");
+  SNMP::CounterTable* gr_reconcile_dropped_table =
+    SNMP::CounterTable::create("H_gr_reconcile_dropped",
+                               ".1.2.826.0.1.1578918.9.5.30");
+  SNMP::CounterTable* irs_cache_hits_table =
+    SNMP::CounterTable::create("H_irs_cache_hits",
+                               ".1.2.826.0.1.1578918.9.5.31");
+  SNMP::CounterTable* irs_cache_misses_table =
+    SNMP::CounterTable::create("H_irs_cache_misses",
+                               ".1.2.826.0.1.1578918.9.5.32");
+  SNMP::CounterTable* irs_cache_evictions_table =
+    SNMP::CounterTable::create("H_irs_cache_evictions",
+                               ".1.2.826.0.1.1578918.9.5.33");
+  SNMP::CounterTable* not_found_cache_hits_table =
+    SNMP::CounterTable::create("H_not_found_cache_hits",
+                               ".1.2.826.0.1.1578918.9.5.34");
+  SNMP::CounterTable* not_found_cache_misses_table =
+    SNMP::CounterTable::create("H_not_found_cache_misses",
+                               ".1.2.826.0.1.1578918.9.5.35");
+  SNMP::CounterTable* not_found_cache_evictions_table =
+    SNMP::CounterTable::create("H_not_found_cache_evictions",
+                               ".1.2.826.0.1.1578918.9.5.36");
+  SNMP::CounterTable* gr_remote_reads_won_table =
+    SNMP::CounterTable::create("H_gr_remote_reads_won",
+                               ".1.2.826.0.1.1578918.9.5.37");
+  SNMP::CounterTable* gr_remote_reads_lost_table =
+    SNMP::CounterTable::create("H_gr_remote_reads_lost",
+                               ".1.2.826.0.1.1578918.9.5.38");
+  SNMP::CounterTable* gr_remote_reads_failed_table =
+    SNMP::CounterTable::create("H_gr_remote_reads_failed",
+                               ".1.2.826.0.1.1578918.9.5.39");
+  SNMP::CounterTable* gr_remote_reads_abandoned_table =
+    SNMP::CounterTable::create("H_gr_remote_reads_abandoned",
+                               ".1.2.826.0.1.1578918.9.5.40");
+  SNMP::EventAccumulatorTable* gr_remote_read_latency_table =
+    SNMP::EventAccumulatorTable::create("H_gr_remote_read_latency_us",
+                                        ".1.2.826.0.1.1578918.9.5.41");
+  SNMP::EventAccumulatorTable* gr_replication_lag_table =
+    SNMP::EventAccumulatorTable::create("H_gr_replication_lag_us",
+                                        ".1.2.826.0.1.1578918.9.5.42");
+  SNMP::CounterTable* gr_replication_dropped_table =
+    SNMP::CounterTable::create("H_gr_replication_dropped",
+                               ".1.2.826.0.1.1578918.9.5.43");
+  SNMP::CounterTable* gr_replication_failed_table =
+    SNMP::CounterTable::create("H_gr_replication_failed",
+                               ".1.2.826.0.1.1578918.9.5.44");
 
   // Must happen after all SNMP tables have been registered.
   init_snmp_handler_threads("homestead");
@@ -896,6 +1455,24 @@ int main(int argc, char**argv)
   CommunicationMonitor* remote_astaire_comm_monitor = nullptr;
   HssCacheProcessor* cache_processor;
 
+  // The tables for the cache to report to. The rest of its options are
+  // filled in from the command line options.
+  MemcachedCache::Options cache_options;
+  cache_options.irs_cache_hits_table = irs_cache_hits_table;
+  cache_options.irs_cache_misses_table = irs_cache_misses_table;
+  cache_options.irs_cache_evictions_table = irs_cache_evictions_table;
+  cache_options.not_found_cache_hits_table = not_found_cache_hits_table;
+  cache_options.not_found_cache_misses_table = not_found_cache_misses_table;
+  cache_options.not_found_cache_evictions_table = not_found_cache_evictions_table;
+  cache_options.remote_reads_won_table = gr_remote_reads_won_table;
+  cache_options.remote_reads_lost_table = gr_remote_reads_lost_table;
+  cache_options.remote_reads_failed_table = gr_remote_reads_failed_table;
+  cache_options.remote_reads_abandoned_table = gr_remote_reads_abandoned_table;
+  cache_options.remote_read_latency_table = gr_remote_read_latency_table;
+  cache_options.replication_lag_table = gr_replication_lag_table;
+  cache_options.replication_dropped_table = gr_replication_dropped_table;
+  cache_options.replication_failed_table = gr_replication_failed_table;
+
   create_memcached_cache(cache_processor,
                          options,
                          dns_resolver,
@@ -912,7 +1489,24 @@ int main(int argc, char**argv)
                          impu_store_location,
                          af,
                          options.cache_threads,
-                         exception_handler);
+                         exception_handler,
+                         cache_options);
+
+  memcached_cache->configure_write_stats_tables(irs_planned_writes_table,
+                                                irs_executed_writes_table,
+                                                irs_retried_writes_table,
+                                                irs_skipped_updates_table);
+  memcached_cache->configure_contention_stats_tables(cas_contentions_table,
+                                                     cas_exhausted_table,
+                                                     cas_backoff_table,
+                                                     cas_contended_key_table);
+  memcached_cache->configure_reconciler_stats_tables(gr_reconcile_diverged_table,
+                                                     gr_reconcile_repaired_table,
+                                                     gr_reconcile_repair_failed_table,
+                                                     gr_reconcile_errors_table,
+                                                     gr_reconcile_dropped_table);
+
+  cache_processor->configure_stats_tables(irs_coalesced_gets_table);
 
   HssCacheTask::configure_cache(cache_processor);
   bool started = cache_processor->start_threads(options.cache_threads,
@@ -1262,7 +1856,37 @@ int main(int argc, char**argv)
   delete exception_handler; exception_handler = NULL;
 
   delete cache_processor; cache_processor = NULL;
+  delete irs_coalesced_gets_table; irs_coalesced_gets_table = nullptr;
   delete memcached_cache; memcached_cache = nullptr;
+
+  // The cache reports to these until it's deleted
+  delete irs_planned_writes_table; irs_planned_writes_table = nullptr;
+  delete irs_executed_writes_table; irs_executed_writes_table = nullptr;
+  delete irs_retried_writes_table; irs_retried_writes_table = nullptr;
+  delete irs_skipped_updates_table; irs_skipped_updates_table = nullptr;
+  delete cas_contentions_table; cas_contentions_table = nullptr;
+  delete cas_exhausted_table; cas_exhausted_table = nullptr;
+  delete cas_backoff_table; cas_backoff_table = nullptr;
+  delete cas_contended_key_table; cas_contended_key_table = nullptr;
+  delete gr_reconcile_diverged_table; gr_reconcile_diverged_table = nullptr;
+  delete gr_reconcile_repaired_table; gr_reconcile_repaired_table = nullptr;
+  delete gr_reconcile_repair_failed_table; gr_reconcile_repair_failed_table = nullptr;
+  delete gr_reconcile_errors_table; gr_reconcile_errors_table = nullptr;
+  delete gr_reconcile_dropped_table; gr_reconcile_dropped_table = nullptr;
+  delete irs_cache_hits_table; irs_cache_hits_table = nullptr;
+  delete irs_cache_misses_table; irs_cache_misses_table = nullptr;
+  delete irs_cache_evictions_table; irs_cache_evictions_table = nullptr;
+  delete not_found_cache_hits_table; not_found_cache_hits_table = nullptr;
+  delete not_found_cache_misses_table; not_found_cache_misses_table = nullptr;
+  delete not_found_cache_evictions_table; not_found_cache_evictions_table = nullptr;
+  delete gr_remote_reads_won_table; gr_remote_reads_won_table = nullptr;
+  delete gr_remote_reads_lost_table; gr_remote_reads_lost_table = nullptr;
+  delete gr_remote_reads_failed_table; gr_remote_reads_failed_table = nullptr;
+  delete gr_remote_reads_abandoned_table; gr_remote_reads_abandoned_table = nullptr;
+  delete gr_remote_read_latency_table; gr_remote_read_latency_table = nullptr;
+  delete gr_replication_lag_table; gr_replication_lag_table = nullptr;
+  delete gr_replication_dropped_table; gr_replication_dropped_table = nullptr;
+  delete gr_replication_failed_table; gr_replication_failed_table = nullptr;
   delete load_monitor; load_monitor = NULL;
 
   delete sas_service; sas_service = NULL;
@@ -10,8 +10,8 @@
  */
 
 #include "memcached_cache.h"
+#include <set>
 #include <string>
-#include <future>
 #include "homestead_xml_utils.h"
 #include "log.h"
 #include "utils.h"
@@ -19,28 +19,6 @@
 using std::placeholders::_1;
 using std::placeholders::_2;
 
-typedef std::tuple<Store::Status, ImpuStore::Impu*, unsigned long> impu_result_t;
-
-// LCOV_EXCL_START
-static void pause_stopwatch(Utils::StopWatch* stopwatch, const std::string& reason)
-{
-  TRC_DEBUG("Pausing stopwatch due to %s", reason.c_str());
-  stopwatch->stop();
-}
-
-static void resume_stopwatch(Utils::StopWatch* stopwatch, const std::string& reason)
-{
-  TRC_DEBUG("Resuming stopwatch due to %s", reason.c_str());
-  stopwatch->start();
-}
-// LCOV_EXCL_STOP
-
-Utils::IOHook* create_hook(Utils::StopWatch* stopwatch)
-{
-  return new Utils::IOHook(std::bind(pause_stopwatch, stopwatch, _1),
-                           std::bind(resume_stopwatch, stopwatch, _1));
-}
-
 ImpuStore::DefaultImpu* MemcachedImplicitRegistrationSet::create_impu(uint64_t cas,
                                                                       const ImpuStore* store)
 {
@@ -54,7 +32,7 @@ ImpuStore::DefaultImpu* MemcachedImplicitRegistrationSet::create_impu(uint64_t c
                                     impis,
                                     _registration_state,
                                     _charging_addresses,
-                                    get_ims_sub_xml(),
+                                    _ims_sub_xml,
                                     cas,
                                     _ttl + now,
                                     store);
@@ -132,6 +110,12 @@ void MemcachedImplicitRegistrationSet::set_ims_sub_xml(const std::string& xml)
             _default_impu.c_str(),
             xml.c_str());
   _ims_sub_xml_set = true;
+
+  if (xml != _ims_sub_xml.get())
+  {
+    _fields_changed = true;
+  }
+
   _ims_sub_xml = xml;
 
   std::string default_impu;
@@ -263,6 +247,76 @@ void MemcachedImplicitRegistrationSet::delete_impis()
   delete_tracked(_impis);
 }
 
+// Copy the added and deleted elements of an older data set into the newer
+// one, unless the newer one has changed them again. An element the newer one
+// has as unchanged (e.g. because it read the older one's write back from the
+// local store) still needs the older one's change writing to the remote site.
+void merge_unreplicated_data(MemcachedImplicitRegistrationSet::Data& data,
+                             const MemcachedImplicitRegistrationSet::Data& older)
+{
+  for (const std::pair<const std::string, MemcachedImplicitRegistrationSet::State>& entry : older)
+  {
+    if (entry.second != MemcachedImplicitRegistrationSet::State::UNCHANGED)
+    {
+      MemcachedImplicitRegistrationSet::Data::iterator it = data.find(entry.first);
+
+      if ((it == data.end()) ||
+          (it->second == MemcachedImplicitRegistrationSet::State::UNCHANGED))
+      {
+        data[entry.first] = entry.second;
+      }
+    }
+  }
+}
+
+void MemcachedImplicitRegistrationSet::merge_unreplicated(const MemcachedImplicitRegistrationSet& older)
+{
+  merge_unreplicated_data(_impis, older._impis);
+  merge_unreplicated_data(_associated_impus, older._associated_impus);
+
+  // If the older copy refreshed the IRS, the refresh still needs writing
+  if (older._refreshed)
+  {
+    _refreshed = true;
+  }
+
+  // Likewise if it created the IRS, or changed the Default IMPU's fields, as
+  // the remote site won't have them even if we haven't changed them since
+  if ((!older._existing) || (older._fields_changed))
+  {
+    _fields_changed = true;
+  }
+}
+
+// Add an IMPU or IMPI mapping found in a remote store to the local store, for
+// the rest of its lifetime. It's only added if the local store doesn't have
+// it, so we never overwrite a newer write to the local store.
+static void repair_impu(ImpuStore* local_store,
+                        ImpuStore::Impu* impu,
+                        SAS::TrailId trail)
+{
+  if (impu->expiry > time(0))
+  {
+    Store::Status status = local_store->add_impu(impu, trail);
+    TRC_DEBUG("Added remote IMPU %s to the local store with result %d",
+              impu->impu.c_str(),
+              status);
+  }
+}
+
+static void repair_impi_mapping(ImpuStore* local_store,
+                                ImpuStore::ImpiMapping* mapping,
+                                SAS::TrailId trail)
+{
+  if (mapping->get_expiry() > time(0))
+  {
+    Store::Status status = local_store->add_impi_mapping(mapping, trail);
+    TRC_DEBUG("Added remote IMPI mapping for %s to the local store with result %d",
+              mapping->impi.c_str(),
+              status);
+  }
+}
+
 // Helper function to get the details of an IMPU.
 // Note this doesn't sort out associated versus default impus.
 //
@@ -273,10 +327,16 @@ void MemcachedImplicitRegistrationSet::delete_impis()
 //  - if we get any errors other than NOT_FOUND, immediately give up and return
 //    the error
 //  - if we get NOT_FOUND from the local store:
-//    - try all remote stores in parallel
-//    - if we get a result from a remote store, use that
+//    - if the IMPU was recently found at no site, give up without reading the
+//      remote stores
+//    - read the remote stores with the GrReader, which uses the first result
+//      it gets from a remote store
+//    - if every remote store returns NOT_FOUND, remember that no site has
+//      the IMPU
 //    - if we get any other error, just ignore it (since we've already
 //      established that the local store returned NOT_FOUND)
+//    - if we're doing read repair, the IMPU is then added to the local store
+//      on the thread that read it
 Store::Status MemcachedCache::get_impu_for_impu_gr(const std::string& impu,
                                                    ImpuStore::Impu*& out_impu,
                                                    SAS::TrailId trail,
@@ -298,99 +358,46 @@ Store::Status MemcachedCache::get_impu_for_impu_gr(const std::string& impu,
     delete hook; hook = nullptr;
   }
 
-  if (status == Store::Status::NOT_FOUND)
+  if ((status == Store::Status::NOT_FOUND) &&
+      (_not_found_cache) &&
+      (_not_found_cache->contains(impu)))
+  {
+    TRC_DEBUG("IMPU: %s was recently found at no site", impu.c_str());
+  }
+  else if (status == Store::Status::NOT_FOUND)
   {
     // If we successfully connect to the local store but fail to find an Impu,
     // try the remote stores
-    std::vector<std::promise<impu_result_t>*> promises;
+    GrReader::Repairer<ImpuStore::Impu> repair = nullptr;
 
-    for (ImpuStore* remote_store : _remote_stores)
+    if (_read_repair)
     {
-      std::promise<impu_result_t>* promise = new std::promise<impu_result_t>();
-      promises.push_back(promise);
-
-      // If we have a stopwatch, we need to time how long each of the parallel
-      // remote requests takes, so we need to create and start a StopWatch for
-      // each one.
-      Utils::StopWatch* remote_stopwatch = nullptr;
-      if (stopwatch)
-      {
-        remote_stopwatch = new Utils::StopWatch();
-        remote_stopwatch->start();
-      }
-
-      _thread_pool.add_work([promise, remote_store, impu, trail, remote_stopwatch]()->void
+      ImpuStore* local_store = _local_store;
+      repair = [local_store, trail](ImpuStore::Impu* copy)
       {
-        // If we created a StopWatch, we now need to create an IOHook so that it
-        // will pause when we're doing network I/O
-        // These Hooks are thread_local, which is why this is done here (on the
-        // thread we'll use for the remote read)
-        Utils::IOHook* remote_hook = nullptr;
-        if (remote_stopwatch)
-        {
-          remote_hook = create_hook(remote_stopwatch);
-        }
-
-        ImpuStore::Impu* remote_data = nullptr;
-        Store::Status remote_status = remote_store->get_impu(impu, remote_data, trail);
-        unsigned long remote_time = 0L;
-
-        if (remote_stopwatch)
-        {
-          delete remote_hook;
-          remote_stopwatch->read(remote_time);
-          delete remote_stopwatch;
-        }
-
-        promise->set_value(impu_result_t(remote_status, remote_data, remote_time));
-      });
+        repair_impu(local_store, copy, trail);
+        delete copy;
+      };
     }
 
-    if (stopwatch)
-    {
-      // Stop the main StopWatch while we wait for the remote reads to complete.
-      // We'll later add on the time we spent processing these, minus I/O time
-      stopwatch->stop();
-    }
+    bool absent = false;
 
-    unsigned long remote_time_to_add = 0L;
-
-    for (std::promise<impu_result_t>* promise : promises)
+    if (_gr_reader.read<ImpuStore::Impu>(
+          [impu, trail](ImpuStore* store, ImpuStore::Impu*& data)
+          {
+            return store->get_impu(impu, data, trail);
+          },
+          [](ImpuStore::Impu& data) { return data.clone(); },
+          repair,
+          out_impu,
+          stopwatch,
+          &absent) == Store::Status::OK)
     {
-      std::future<impu_result_t> future = promise->get_future();
-      impu_result_t result = future.get();
-
-      // Want to choose whichever request took the longest to add to our stopwatch time
-      unsigned long remote_time = std::get<2>(result);
-      if (remote_time > remote_time_to_add)
-      {
-        remote_time_to_add = remote_time;
-      }
-
-      if ((status != Store::Status::OK) && (std::get<0>(result) == Store::Status::OK))
-      {
-        // If we've not yet set the impu, use the one from this remote if it succeeded
-        out_impu = std::get<1>(result);
-        status = Store::Status::OK;
-      }
-      else
-      {
-        ImpuStore::Impu* discard = std::get<1>(result);
-
-        if (discard)
-        {
-          delete discard;
-        }
-      }
-
-      delete promise;
+      status = Store::Status::OK;
     }
-
-    // Restart the StopWatch
-    if (stopwatch)
+    else if ((absent) && (_not_found_cache))
     {
-      stopwatch->start();
-      stopwatch->add_time(remote_time_to_add);
+      _not_found_cache->add(impu);
     }
   }
 
@@ -421,11 +428,13 @@ Store::Status MemcachedCache::get_impus_for_impi(const std::string& impi,
 //  - if we get any errors other than NOT_FOUND, immediately give up and return
 //    the error
 //  - if we get NOT_FOUND from the local store:
-//    - try each remote store in turn
+//    - read the remote stores with the GrReader, in the same way as for IMPUs
 //    - if we get OK from a remote store, we've found a mapping so return OK
-//    - if we get any other error, try the next remote store but don't set the
-//      return value to that error (since we've already established that the
-//      local store returned NOT_FOUND)
+//    - if we get any other error, don't set the return value to that error
+//      (since we've already established that the local store returned
+//      NOT_FOUND)
+//    - if we're doing read repair and a remote store has the mapping, add it
+//      to the local store on the thread that read it
 //
 // On success, out_mapping is set the to retrieved mapping.
 // On failure, out_mapping is unchanged.
@@ -444,27 +453,316 @@ Store::Status MemcachedCache::get_impi_mapping_gr(const std::string& impi,
 
   Store::Status status = _local_store->get_impi_mapping(impi, out_mapping, trail);
 
+  if (hook)
+  {
+    delete hook; hook = nullptr;
+  }
+
   if (status == Store::Status::NOT_FOUND)
   {
     // If we successfully connect to the local store but fail to find an
     // ImpiMapping, try the remote stores
-    for (ImpuStore* remote_store : _remote_stores)
+    status = get_impi_mapping_from_remotes(impi, out_mapping, trail, stopwatch);
+  }
+
+  return status;
+}
+
+Store::Status MemcachedCache::get_impi_mapping_from_remotes(const std::string& impi,
+                                                            ImpuStore::ImpiMapping*& out_mapping,
+                                                            SAS::TrailId trail,
+                                                            Utils::StopWatch* stopwatch)
+{
+  GrReader::Repairer<ImpuStore::ImpiMapping> repair = nullptr;
+
+  if (_read_repair)
+  {
+    ImpuStore* local_store = _local_store;
+    repair = [local_store, trail](ImpuStore::ImpiMapping* copy)
+    {
+      repair_impi_mapping(local_store, copy, trail);
+      delete copy;
+    };
+  }
+
+  return _gr_reader.read<ImpuStore::ImpiMapping>(
+    [impi, trail](ImpuStore* store, ImpuStore::ImpiMapping*& data)
+    {
+      return store->get_impi_mapping(impi, data, trail);
+    },
+    [](ImpuStore::ImpiMapping& data)
     {
-      Store::Status remote_status = remote_store->get_impi_mapping(impi, out_mapping, trail);
+      return new ImpuStore::ImpiMapping(data.impi,
+                                        data.get_default_impus(),
+                                        0L,
+                                        data.get_expiry());
+    },
+    repair,
+    out_mapping,
+    stopwatch);
+}
 
-      if (remote_status == Store::Status::OK)
+// Add the IRSs for these IMPUs to result, in order, skipping any that
+// weren't found. The IRSs are taken from irss, and moved to taken, so that an
+// IMPU that's asked for again (here or in a later call) gets a copy.
+static void take_irss(const std::vector<std::string>& impus,
+                      std::map<std::string, ImplicitRegistrationSet*>& irss,
+                      std::map<std::string, ImplicitRegistrationSet*>& taken,
+                      std::vector<ImplicitRegistrationSet*>& result)
+{
+  for (const std::string& impu : impus)
+  {
+    std::map<std::string, ImplicitRegistrationSet*>::iterator it = irss.find(impu);
+
+    if (it != irss.end())
+    {
+      result.push_back(it->second);
+      taken[impu] = it->second;
+      irss.erase(it);
+    }
+    else
+    {
+      it = taken.find(impu);
+
+      if (it != taken.end())
       {
-        status = remote_status;
-        break;
+        result.push_back(it->second->clone());
       }
     }
   }
+}
+
+static void delete_irss(std::map<std::string, ImplicitRegistrationSet*>& irss)
+{
+  for (std::pair<const std::string, ImplicitRegistrationSet*>& entry : irss)
+  {
+    delete entry.second;
+  }
+
+  irss.clear();
+}
+
+void MemcachedCache::run_batch(size_t num_jobs,
+                               batch_job job,
+                               size_t max_parallel,
+                               Utils::StopWatch* stopwatch)
+{
+  if ((_batch_runner) && (num_jobs > 1) && (max_parallel > 1))
+  {
+    if (!stopwatch)
+    {
+      _batch_runner->run(num_jobs,
+                         [&job](size_t index) { job(index, nullptr); },
+                         max_parallel);
+      return;
+    }
+
+    // Stop the main StopWatch while the jobs run, and add on the longest
+    // time any thread spent running them, other than on I/O. A thread may
+    // run several jobs one after another, so that's the time the batch took.
+    stopwatch->stop();
+    unsigned long batch_time = _batch_runner->run_timed(num_jobs,
+                                                        job,
+                                                        max_parallel);
+    stopwatch->start();
+    stopwatch->add_time(batch_time);
+  }
+  else
+  {
+    for (size_t ii = 0; ii < num_jobs; ii++)
+    {
+      job(ii, stopwatch);
+    }
+  }
+}
+
+Store::Status MemcachedCache::get_irss_for_distinct_impus(const std::vector<std::string>& impus,
+                                                          SAS::TrailId trail,
+                                                          Utils::StopWatch* stopwatch,
+                                                          std::map<std::string, ImplicitRegistrationSet*>& irss)
+{
+  std::vector<std::string> distinct;
+  std::set<std::string> seen;
+
+  for (const std::string& impu : impus)
+  {
+    if (seen.insert(impu).second)
+    {
+      distinct.push_back(impu);
+    }
+  }
+
+  std::vector<ImplicitRegistrationSet*> found(distinct.size(), nullptr);
+  std::vector<Store::Status> statuses(distinct.size(), Store::Status::OK);
+
+  run_batch(distinct.size(),
+            [this, &distinct, &found, &statuses, trail](size_t index,
+                                                       Utils::StopWatch* stopwatch)
+            {
+              statuses[index] =
+                get_implicit_registration_set_for_impu(distinct[index],
+                                                       trail,
+                                                       stopwatch,
+                                                       found[index]);
+            },
+            _batch_parallelism,
+            stopwatch);
+
+  Store::Status status = Store::Status::OK;
+
+  for (size_t ii = 0; ii < distinct.size(); ii++)
+  {
+    if (statuses[ii] == Store::Status::OK)
+    {
+      irss[distinct[ii]] = found[ii];
+    }
+    // LCOV_EXCL_START
+    // Not hittable in UTs
+    else if ((statuses[ii] != Store::Status::NOT_FOUND) &&
+             (status == Store::Status::OK))
+    {
+      status = statuses[ii];
+    }
+    // LCOV_EXCL_STOP
+  }
+
+  return status;
+}
+
+// Get the IRSs for several IMPUs. This gives the same results as the
+// BaseHssCache version, but reads each distinct IMPU once, as a batch.
+Store::Status MemcachedCache::get_implicit_registration_sets_for_impus(const std::vector<std::string>& impus,
+                                                                       SAS::TrailId trail,
+                                                                       Utils::StopWatch* stopwatch,
+                                                                       std::vector<ImplicitRegistrationSet*>& result)
+{
+  std::map<std::string, ImplicitRegistrationSet*> irss;
+  Store::Status status = get_irss_for_distinct_impus(impus, trail, stopwatch, irss);
+
+  if (status == Store::Status::OK)
+  {
+    std::map<std::string, ImplicitRegistrationSet*> taken;
+    take_irss(impus, irss, taken, result);
+  }
+
+  delete_irss(irss);
+
+  return status;
+}
+
+// Get the IRSs for several IMPIs. This gives the same results as the
+// BaseHssCache version, but looks up all of the IMPI mappings first (in one
+// batch from the local store, and then as a batch from the remote stores for
+// those it doesn't find), and then reads all of the IRSs they map to as a
+// batch.
+Store::Status MemcachedCache::get_implicit_registration_sets_for_impis(const std::vector<std::string>& impis,
+                                                                       SAS::TrailId trail,
+                                                                       Utils::StopWatch* stopwatch,
+                                                                       std::vector<ImplicitRegistrationSet*>& result)
+{
+  Utils::IOHook* hook = nullptr;
+
+  if (stopwatch)
+  {
+    hook = create_hook(stopwatch);
+  }
+
+  std::map<std::string, ImpuStore::ImpiMapping*> mappings;
+  Store::Status status = _local_store->get_impi_mappings(impis, mappings, trail);
 
   if (hook)
   {
     delete hook;
   }
 
+  if (status == Store::Status::OK)
+  {
+    std::vector<std::string> missing;
+    std::set<std::string> seen;
+
+    for (const std::string& impi : impis)
+    {
+      if ((mappings.find(impi) == mappings.end()) && (seen.insert(impi).second))
+      {
+        missing.push_back(impi);
+      }
+    }
+
+    std::vector<ImpuStore::ImpiMapping*> found(missing.size(), nullptr);
+    std::vector<Store::Status> statuses(missing.size(), Store::Status::OK);
+
+    run_batch(missing.size(),
+              [this, &missing, &found, &statuses, trail](size_t index,
+                                                        Utils::StopWatch* stopwatch)
+              {
+                statuses[index] = get_impi_mapping_from_remotes(missing[index],
+                                                                found[index],
+                                                                trail,
+                                                                stopwatch);
+              },
+              _batch_parallelism,
+              stopwatch);
+
+    for (size_t ii = 0; ii < missing.size(); ii++)
+    {
+      if (statuses[ii] == Store::Status::OK)
+      {
+        mappings[missing[ii]] = found[ii];
+      }
+      // LCOV_EXCL_START
+      // Not hittable in UTs
+      else if ((statuses[ii] != Store::Status::NOT_FOUND) &&
+               (status == Store::Status::OK))
+      {
+        status = statuses[ii];
+      }
+      // LCOV_EXCL_STOP
+    }
+  }
+
+  std::map<std::string, ImplicitRegistrationSet*> irss;
+
+  if (status == Store::Status::OK)
+  {
+    std::vector<std::string> impus;
+
+    for (const std::string& impi : impis)
+    {
+      std::map<std::string, ImpuStore::ImpiMapping*>::iterator it = mappings.find(impi);
+
+      if (it != mappings.end())
+      {
+        std::vector<std::string> default_impus = it->second->get_default_impus();
+        impus.insert(impus.end(), default_impus.begin(), default_impus.end());
+      }
+    }
+
+    status = get_irss_for_distinct_impus(impus, trail, stopwatch, irss);
+  }
+
+  if (status == Store::Status::OK)
+  {
+    // Each IMPI gets the IRSs it maps to, in order
+    std::map<std::string, ImplicitRegistrationSet*> taken;
+
+    for (const std::string& impi : impis)
+    {
+      std::map<std::string, ImpuStore::ImpiMapping*>::iterator it = mappings.find(impi);
+
+      if (it != mappings.end())
+      {
+        take_irss(it->second->get_default_impus(), irss, taken, result);
+      }
+    }
+  }
+
+  delete_irss(irss);
+
+  for (std::pair<const std::string, ImpuStore::ImpiMapping*>& entry : mappings)
+  {
+    delete entry.second;
+  }
+
   return status;
 }
 
@@ -473,6 +771,21 @@ Store::Status MemcachedCache::get_implicit_registration_set_for_impu(const std::
                                                      Utils::StopWatch* stopwatch,
                                                      ImplicitRegistrationSet*& result)
 {
+  uint64_t ticket = 0;
+
+  if (_irs_cache)
+  {
+    IrsCache::Snapshot snapshot = _irs_cache->get(impu, ticket);
+
+    if (snapshot)
+    {
+      TRC_DEBUG("Found IRS for IMPU: %s in the IRS cache", impu.c_str());
+
+      // The IRS copies what it needs, so doesn't change the snapshot
+      result = new MemcachedImplicitRegistrationSet((ImpuStore::DefaultImpu*)snapshot.get());
+      return Store::Status::OK;
+    }
+  }
 
   ImpuStore::Impu* data = nullptr;
   Store::Status status = get_impu_for_impu_gr(impu, data, trail, stopwatch);
@@ -519,6 +832,12 @@ Store::Status MemcachedCache::get_implicit_registration_set_for_impu(const std::
   if (status == Store::Status::OK)
   {
     result = new MemcachedImplicitRegistrationSet((ImpuStore::DefaultImpu*) data);
+
+    if (_irs_cache)
+    {
+      _irs_cache->add(impu, (ImpuStore::DefaultImpu*)data, ticket);
+    }
+
     delete data;
   }
 
@@ -526,31 +845,213 @@ Store::Status MemcachedCache::get_implicit_registration_set_for_impu(const std::
 }
 
 Store::Status MemcachedCache::perform(MemcachedCache::store_action action,
+                                      MemcachedCache::replicate_action replicate,
                                       progress_callback progress_cb,
                                       Utils::StopWatch* stopwatch)
 {
-   Store::Status status = action(_local_store, stopwatch);
+   Store::Status status = action(_local_store, stopwatch);
+
+   if (status == Store::Status::OK)
+   {
+     // If the local store update succeeded, call the progress callback
+     progress_cb();
+
+     if (_replication_queue != nullptr)
+     {
+       // Leave the remote stores to the replication queue, so that we don't
+       // wait for the remote sites
+       replicate();
+     }
+     else
+     {
+       // Now perform the action to all the remote stores, but don't update
+       // the status (as we've already claimed success)
+       for (ImpuStore* remote_store : _remote_stores)
+       {
+         Store::Status inner_status = action(remote_store, nullptr);
+         if (inner_status != Store::Status::OK)
+         {
+           // Nothing we can do, but log the error
+           TRC_DEBUG("Failed to perform operation to remote store with error %d",
+                     inner_status);
+         }
+       }
+     }
+   }
+
+   return status;
+}
+
+// A write of an IRS to a remote store. It holds its own copy of the IRS, as
+// the caller's is deleted once the write to the local store has completed.
+// Writes of an IRS are keyed by its default IMPU, so the writes of a busy
+// subscriber are coalesced.
+class MemcachedCache::IrsWrite : public ReplicationQueue::Write
+{
+public:
+  IrsWrite(MemcachedCache* cache,
+           irs_action action,
+           const MemcachedImplicitRegistrationSet& irs,
+           SAS::TrailId trail) :
+    _cache(cache),
+    _action(action),
+    _irs(irs),
+    _trail(trail)
+  {
+  }
+
+  virtual Store::Status apply(ImpuStore* store) override
+  {
+    return (_cache->*_action)(&_irs, _trail, store, nullptr);
+  }
+
+  virtual ReplicationQueue::Write* clone() const override
+  {
+    return new IrsWrite(*this);
+  }
+
+  // An older write may have added or removed IMPUs or IMPIs that this write
+  // doesn't know about (as the local store already reflects them), so they
+  // need carrying over. Otherwise, this write is at least as up to date.
+  virtual void absorb(const ReplicationQueue::Write& older) override
+  {
+    _irs.merge_unreplicated(((const IrsWrite&)older)._irs);
+  }
+
+private:
+  MemcachedCache* _cache;
+  irs_action _action;
+  MemcachedImplicitRegistrationSet _irs;
+  SAS::TrailId _trail;
+};
+
+void MemcachedCache::replicate_irs(irs_action action,
+                                   MemcachedImplicitRegistrationSet* irs,
+                                   SAS::TrailId trail)
+{
+  _replication_queue->replicate(irs->get_default_impu(),
+                                new IrsWrite(this, action, *irs, trail));
+}
+
+std::vector<RemoteReadStats::Stats> MemcachedCache::get_remote_read_stats()
+{
+  std::vector<RemoteReadStats::Stats> stats;
+
+  for (size_t site = 0; site < _gr_reader.num_sites(); site++)
+  {
+    stats.push_back(_gr_reader.stats().get_stats(site));
+  }
+
+  return stats;
+}
+
+IrsCache::Stats MemcachedCache::get_irs_cache_stats()
+{
+  IrsCache::Stats stats = IrsCache::Stats();
+
+  if (_irs_cache)
+  {
+    stats = _irs_cache->get_stats();
+  }
+
+  return stats;
+}
+
+NotFoundCache::Stats MemcachedCache::get_not_found_cache_stats()
+{
+  NotFoundCache::Stats stats = NotFoundCache::Stats();
+
+  if (_not_found_cache)
+  {
+    stats = _not_found_cache->get_stats();
+  }
+
+  return stats;
+}
+
+CasRetryPolicy::Stats MemcachedCache::get_contention_stats(CasRetryPolicy::Table table)
+{
+  return _cas_retry_policy.get_stats(table);
+}
+
+std::vector<CasRetryPolicy::HotKey> MemcachedCache::get_contended_keys()
+{
+  return _cas_retry_policy.get_hot_keys();
+}
+
+std::vector<Reconciler::Stats> MemcachedCache::get_reconciler_stats()
+{
+  std::vector<Reconciler::Stats> stats;
+
+  if (_reconciler)
+  {
+    for (size_t site = 0; site < _reconciler->num_sites(); site++)
+    {
+      stats.push_back(_reconciler->get_stats(site));
+    }
+  }
+
+  return stats;
+}
+
+Reconciler::LogStats MemcachedCache::get_reconciler_log_stats()
+{
+  Reconciler::LogStats stats = Reconciler::LogStats();
+
+  if (_reconciler)
+  {
+    stats = _reconciler->get_log_stats();
+  }
+
+  return stats;
+}
+
+KeyLockTable::Stats MemcachedCache::get_key_lock_stats()
+{
+  KeyLockTable::Stats stats = KeyLockTable::Stats();
+
+  if (_key_locks)
+  {
+    stats = _key_locks->get_stats();
+  }
+
+  return stats;
+}
+
+MemcachedCache::WriteStats MemcachedCache::get_write_stats()
+{
+  WriteStats stats;
+  stats.planned = _planned_writes;
+  stats.executed = _executed_writes;
+  stats.retried = _retried_writes;
+  stats.skipped = _skipped_updates;
+  return stats;
+}
+
+void MemcachedCache::configure_write_stats_tables(SNMP::EventAccumulatorTable* planned_writes_table,
+                                                  SNMP::EventAccumulatorTable* executed_writes_table,
+                                                  SNMP::EventAccumulatorTable* retried_writes_table,
+                                                  SNMP::CounterTable* skipped_updates_table)
+{
+  _planned_writes_tbl = planned_writes_table;
+  _executed_writes_tbl = executed_writes_table;
+  _retried_writes_tbl = retried_writes_table;
+  _skipped_updates_tbl = skipped_updates_table;
+}
 
-   if (status == Store::Status::OK)
-   {
-     // If the local store update succeeded, call the progress callback
-     progress_cb();
+std::vector<ReplicationQueue::Stats> MemcachedCache::get_replication_stats()
+{
+  std::vector<ReplicationQueue::Stats> stats;
 
-     // Now perform the action to all the remote stores, but don't update the
-     // status (as we've already claimed success)
-     for (ImpuStore* remote_store : _remote_stores)
-     {
-       Store::Status inner_status = action(remote_store, nullptr);
-       if (inner_status != Store::Status::OK)
-       {
-         // Nothing we can do, but log the error
-         TRC_DEBUG("Failed to perform operation to remote store with error %d",
-                   inner_status);
-       }
-     }
-   }
+  if (_replication_queue != nullptr)
+  {
+    for (size_t site = 0; site < _replication_queue->num_sites(); site++)
+    {
+      stats.push_back(_replication_queue->get_stats(site));
+    }
+  }
 
-   return status;
+  return stats;
 }
 
 Store::Status MemcachedCache::put_implicit_registration_set(ImplicitRegistrationSet* irs,
@@ -566,7 +1067,13 @@ Store::Status MemcachedCache::put_implicit_registration_set(ImplicitRegistration
   {
     store_action action =
       std::bind(&MemcachedCache::put_irs_action, this, mirs, trail, _1, _2);
-    status = perform(action, progress_cb, stopwatch);
+    replicate_action replicate =
+      std::bind(&MemcachedCache::replicate_irs,
+                this,
+                &MemcachedCache::put_irs_action,
+                mirs,
+                trail);
+    status = perform(action, replicate, progress_cb, stopwatch);
   }
   else
   {
@@ -578,13 +1085,122 @@ Store::Status MemcachedCache::put_implicit_registration_set(ImplicitRegistration
   return status;
 }
 
+// Count the store writes made while writing an IRS, if we're counting them.
+// Writes made after retries of a key are counted as retries.
+static void count_writes(MemcachedCache::WriteCounts* writes,
+                         int retries,
+                         uint64_t count = 1)
+{
+  if (writes)
+  {
+    if (retries > 0)
+    {
+      writes->retried += count;
+    }
+    else
+    {
+      writes->executed += count;
+    }
+  }
+}
+
+// Take an ImpiMapping (or other data) read as part of a batch, or read it again if
+// this isn't our first attempt with it (as we've hit contention since).
+template <class T>
+static Store::Status take_prefetched(std::map<std::string, T*>& prefetched,
+                                     const std::string& key,
+                                     bool& first_attempt,
+                                     T*& out,
+                                     std::function<Store::Status(T*&)> reread)
+{
+  Store::Status status = Store::Status::NOT_FOUND;
+  typename std::map<std::string, T*>::iterator it = prefetched.find(key);
+
+  if (it != prefetched.end())
+  {
+    out = it->second;
+    prefetched.erase(it);
+    status = Store::Status::OK;
+  }
+  else if (!first_attempt)
+  {
+    status = reread(out);
+  }
+
+  first_attempt = false;
+  return status;
+}
+
+static Store::Status take_impi_mapping(ImpuStore* store,
+                                       const std::string& impi,
+                                       std::map<std::string, ImpuStore::ImpiMapping*>& prefetched,
+                                       bool& first_attempt,
+                                       ImpuStore::ImpiMapping*& out_mapping,
+                                       SAS::TrailId trail)
+{
+  return take_prefetched<ImpuStore::ImpiMapping>(
+    prefetched,
+    impi,
+    first_attempt,
+    out_mapping,
+    [store, &impi, trail](ImpuStore::ImpiMapping*& mapping)
+    {
+      return store->get_impi_mapping(impi, mapping, trail);
+    });
+}
+
 Store::Status MemcachedCache::update_irs_impi_mappings(MemcachedImplicitRegistrationSet* irs,
                                                        SAS::TrailId trail,
                                                        ImpuStore* store,
-                                                       Utils::StopWatch* stopwatch)
+                                                       Utils::StopWatch* stopwatch,
+                                                       WriteCounts* writes,
+                                                       ImpiLocks* impi_locks)
 {
   Store::Status status = Store::Status::OK;
 
+  // Set if we gave up on any mapping due to contention, as each mapping
+  // overwrites status
+  Store::Status contention_status = Store::Status::OK;
+
+  // Other IRSs in our batch, or other threads, may share our IMPIs, so hold
+  // their locks while we update them. They're taken in order (as the set is
+  // sorted), so IRSs sharing several IMPIs can't deadlock. They're released
+  // while we back off after contention, and taken again in the same order.
+  KeyLockTable::Locks held_locks;
+
+  if ((impi_locks) || (_key_locks))
+  {
+    std::set<std::string> impis;
+
+    for (MemcachedImplicitRegistrationSet::State state :
+           { MemcachedImplicitRegistrationSet::State::ADDED,
+             MemcachedImplicitRegistrationSet::State::UNCHANGED,
+             MemcachedImplicitRegistrationSet::State::DELETED })
+    {
+      std::vector<std::string> state_impis = irs->impis(state);
+      impis.insert(state_impis.begin(), state_impis.end());
+    }
+
+    if (impi_locks)
+    {
+      for (const std::string& impi : impis)
+      {
+        ImpiLocks::iterator it = impi_locks->find(impi);
+
+        if (it != impi_locks->end())
+        {
+          held_locks.emplace_back(it->second);
+        }
+      }
+    }
+    else
+    {
+      held_locks = _key_locks->lock(store,
+                                    std::vector<std::string>(impis.begin(),
+                                                             impis.end()));
+    }
+  }
+
   // Create an IOHook to pause the stopwatch when performing network I/O
   Utils::IOHook* hook = nullptr;
   if (stopwatch)
@@ -595,15 +1211,40 @@ Store::Status MemcachedCache::update_irs_impi_mappings(MemcachedImplicitRegistra
   // Updating the mappings needs to be CASed, as each of the IMPIs maps
   // to an array, which may be mutated by multiple Homesteads simultaneously
 
+  // Read the existing mappings we need in one batch. If we hit contention,
+  // we reread the mapping on its own.
+  std::vector<std::string> existing_impis =
+    irs->impis(MemcachedImplicitRegistrationSet::State::DELETED);
+
+  if (irs->is_refreshed())
+  {
+    std::vector<std::string> unchanged_impis =
+      irs->impis(MemcachedImplicitRegistrationSet::State::UNCHANGED);
+    existing_impis.insert(existing_impis.end(),
+                          unchanged_impis.begin(),
+                          unchanged_impis.end());
+  }
+
+  std::map<std::string, ImpuStore::ImpiMapping*> prefetched;
+  store->get_impi_mappings(existing_impis, prefetched, trail);
+
   // Remove old IMPI mappings
   for (const std::string& impi : irs->impis(MemcachedImplicitRegistrationSet::State::DELETED))
   {
+    bool first_attempt = true;
+    int retries = 0;
+
     do
     {
+      // If the mapping no longer has our IMPU (or has gone), there's nothing
+      // to write, so don't carry over the result of a previous attempt
+      status = Store::Status::OK;
+
       // We use a separate Status as failing to find an ImpiMapping shouldn't
       // affect our overall Status
       ImpuStore::ImpiMapping* mapping = nullptr;
-      Store::Status inner_status = store->get_impi_mapping(impi, mapping, trail);
+      Store::Status inner_status =
+        take_impi_mapping(store, impi, prefetched, first_attempt, mapping, trail);
 
       if (inner_status == Store::Status::OK)
       {
@@ -613,10 +1254,12 @@ Store::Status MemcachedCache::update_irs_impi_mappings(MemcachedImplicitRegistra
 
           if (mapping->is_empty())
           {
+            count_writes(writes, retries);
             status = store->delete_impi_mapping(mapping, trail);
           }
           else
           {
+            count_writes(writes, retries);
             status = store->set_impi_mapping(mapping, trail);
           }
         }
@@ -624,7 +1267,16 @@ Store::Status MemcachedCache::update_irs_impi_mappings(MemcachedImplicitRegistra
 
       delete mapping;
 
-    } while(status == Store::Status::DATA_CONTENTION);
+    } while ((status == Store::Status::DATA_CONTENTION) &&
+             (_cas_retry_policy.should_retry(CasRetryPolicy::IMPI_MAPPING,
+                                             impi,
+                                             retries,
+                                             &held_locks)));
+
+    if (status == Store::Status::DATA_CONTENTION)
+    {
+      contention_status = status;
+    }
   }
 
   // Refresh unchanged IMPIs if the IRS is being refreshed
@@ -632,12 +1284,16 @@ Store::Status MemcachedCache::update_irs_impi_mappings(MemcachedImplicitRegistra
   {
     for (const std::string& impi : irs->impis(MemcachedImplicitRegistrationSet::State::UNCHANGED))
     {
+      bool first_attempt = true;
+      int retries = 0;
+
       do
       {
         // We use a separate Status as failing to find an ImpiMapping shouldn't
         // affect our overall Status
         ImpuStore::ImpiMapping* mapping = nullptr;
-        Store::Status inner_status = store->get_impi_mapping(impi, mapping, trail);
+        Store::Status inner_status =
+          take_impi_mapping(store, impi, prefetched, first_attempt, mapping, trail);
 
         if (inner_status == Store::Status::OK)
         {
@@ -659,10 +1315,20 @@ Store::Status MemcachedCache::update_irs_impi_mappings(MemcachedImplicitRegistra
           mapping = new ImpuStore::ImpiMapping(impi, irs->get_default_impu(), irs->get_ttl() + now);
         }
 
+        count_writes(writes, retries);
         status = store->set_impi_mapping(mapping, trail);
 
         delete mapping;
-      } while(status == Store::Status::DATA_CONTENTION);
+      } while ((status == Store::Status::DATA_CONTENTION) &&
+               (_cas_retry_policy.should_retry(CasRetryPolicy::IMPI_MAPPING,
+                                               impi,
+                                               retries,
+                                               &held_locks)));
+
+      if (status == Store::Status::DATA_CONTENTION)
+      {
+        contention_status = status;
+      }
     }
   }
 
@@ -678,9 +1344,11 @@ Store::Status MemcachedCache::update_irs_impi_mappings(MemcachedImplicitRegistra
     ImpuStore::ImpiMapping* mapping = new ImpuStore::ImpiMapping(impi,
                                                                  irs->get_default_impu(),
                                                                  expiry);
+    int retries = 0;
 
     do
     {
+      count_writes(writes, retries);
       status = store->set_impi_mapping(mapping, trail);
 
       if (status == Store::Status::DATA_CONTENTION)
@@ -722,23 +1390,44 @@ Store::Status MemcachedCache::update_irs_impi_mappings(MemcachedImplicitRegistra
           status = inner_status;
         }
       }
-    } while(status == Store::Status::DATA_CONTENTION);
+    } while ((status == Store::Status::DATA_CONTENTION) &&
+             (_cas_retry_policy.should_retry(CasRetryPolicy::IMPI_MAPPING,
+                                             impi,
+                                             retries,
+                                             &held_locks)));
+
+    if (status == Store::Status::DATA_CONTENTION)
+    {
+      contention_status = status;
+    }
 
     delete mapping;
   }
 
+  // Free any mappings we read but didn't need
+  for (std::pair<const std::string, ImpuStore::ImpiMapping*>& entry : prefetched)
+  {
+    delete entry.second;
+  }
+
   if (hook)
   {
     delete hook;
   }
 
+  if (contention_status != Store::Status::OK)
+  {
+    status = contention_status;
+  }
+
   return status;
 }
 
 Store::Status MemcachedCache::update_irs_associated_impus(MemcachedImplicitRegistrationSet* irs,
                                                           SAS::TrailId trail,
                                                           ImpuStore* store,
-                                                          Utils::StopWatch* stopwatch)
+                                                          Utils::StopWatch* stopwatch,
+                                                          WriteCounts* writes)
 {
   Store::Status status = Store::Status::OK;
 
@@ -749,59 +1438,93 @@ Store::Status MemcachedCache::update_irs_associated_impus(MemcachedImplicitRegis
     hook = create_hook(stopwatch);
   }
 
-  // Remove old associated IMPUs
-  for (const std::string& associated_impu : irs->impus(MemcachedImplicitRegistrationSet::State::DELETED))
+  // Read the associated IMPUs we're removing in one batch, and remove those
+  // that still belong to this IRS in another
+  std::map<std::string, ImpuStore::Impu*> existing;
+  store->get_impus(irs->impus(MemcachedImplicitRegistrationSet::State::DELETED),
+                   existing,
+                   trail);
+
+  std::vector<ImpuStore::Impu*> stale_impus;
+
+  for (std::pair<const std::string, ImpuStore::Impu*>& entry : existing)
   {
-    do
+    ImpuStore::Impu* mapping = entry.second;
+
+    if (!mapping->is_default_impu())
     {
-      ImpuStore::Impu* mapping = nullptr;
-      store->get_impu(associated_impu, mapping, trail);
+      ImpuStore::AssociatedImpu* assoc_mapping = (ImpuStore::AssociatedImpu*)mapping;
 
-      if (mapping && !mapping->is_default_impu())
+      if (assoc_mapping->default_impu == irs->get_default_impu())
       {
-        ImpuStore::AssociatedImpu* assoc_mapping = (ImpuStore::AssociatedImpu*)mapping;
-
-        if (assoc_mapping->default_impu == irs->get_default_impu())
-        {
-          status = store->delete_impu(mapping, trail);
-        }
+        stale_impus.push_back(mapping);
       }
+    }
+  }
 
-      delete mapping;
-    } while(status == Store::Status::DATA_CONTENTION);
+  std::map<std::string, Store::Status> statuses;
+
+  if (!stale_impus.empty())
+  {
+    count_writes(writes, 0, stale_impus.size());
+    status = store->delete_impus(stale_impus, trail, statuses);
   }
 
-  // Refresh unchanged associated IMPUs if the IRS is being refreshed
+  int64_t expiry = time(0) + irs->get_ttl();
+  std::vector<ImpuStore::Impu*> refreshed_impus;
+  std::vector<ImpuStore::Impu*> new_impus;
+
+  // If the IRS is being refreshed, only the expiry of the unchanged
+  // associated IMPUs has changed, so just extend their lifetime
   if (irs->is_refreshed())
   {
     for (const std::string& associated_impu : irs->impus(MemcachedImplicitRegistrationSet::State::UNCHANGED))
     {
-      int64_t expiry = time(0) + irs->get_ttl();
-      ImpuStore::AssociatedImpu* impu = new ImpuStore::AssociatedImpu(associated_impu,
-                                                                      irs->get_default_impu(),
-                                                                      0L,
-                                                                      expiry,
-                                                                      store);
+      refreshed_impus.push_back(new ImpuStore::AssociatedImpu(associated_impu,
+                                                              irs->get_default_impu(),
+                                                              0L,
+                                                              expiry,
+                                                              store));
+    }
 
-      store->set_impu_without_cas(impu, trail);
-      delete impu;
+    if (!refreshed_impus.empty())
+    {
+      count_writes(writes, 0, refreshed_impus.size());
+      store->touch_impus(refreshed_impus, trail, statuses);
     }
   }
 
-  // Add new associated IMPUs
+  // Add the new associated IMPUs in one batch
   for (const std::string& associated_impu : irs->impus(MemcachedImplicitRegistrationSet::State::ADDED))
   {
-    int64_t expiry = time(0) + irs->get_ttl();
-    ImpuStore::AssociatedImpu* impu = new ImpuStore::AssociatedImpu(associated_impu,
-                                                                    irs->get_default_impu(),
-                                                                    0L,
-                                                                    expiry,
-                                                                    store);
+    new_impus.push_back(new ImpuStore::AssociatedImpu(associated_impu,
+                                                      irs->get_default_impu(),
+                                                      0L,
+                                                      expiry,
+                                                      store));
+  }
+
+  if (!new_impus.empty())
+  {
+    count_writes(writes, 0, new_impus.size());
+    store->set_impus_without_cas(new_impus, trail, statuses);
+  }
+
+  for (ImpuStore::Impu* impu : refreshed_impus)
+  {
+    delete impu;
+  }
 
-    store->set_impu_without_cas(impu, trail);
+  for (ImpuStore::Impu* impu : new_impus)
+  {
     delete impu;
   }
 
+  for (std::pair<const std::string, ImpuStore::Impu*>& entry : existing)
+  {
+    delete entry.second;
+  }
+
   if (hook)
   {
     delete hook;
@@ -847,7 +1570,8 @@ Store::Status MemcachedCache::update_irs_associated_impus(MemcachedImplicitRegis
 Store::Status MemcachedCache::create_irs_impu(MemcachedImplicitRegistrationSet* irs,
                                               SAS::TrailId trail,
                                               ImpuStore* store,
-                                              Utils::StopWatch* stopwatch)
+                                              Utils::StopWatch* stopwatch,
+                                              WriteCounts* writes)
 {
   ImpuStore::DefaultImpu* impu = irs->get_impu();
 
@@ -860,6 +1584,8 @@ Store::Status MemcachedCache::create_irs_impu(MemcachedImplicitRegistrationSet*
     hook = create_hook(stopwatch);
   }
 
+  count_writes(writes, 0);
+
   if (impu->registration_state == RegistrationState::REGISTERED)
   {
     TRC_DEBUG("Storing REGISTERED IMPU %s without checking CAS value",
@@ -896,10 +1622,14 @@ Store::Status perform_irs_impu_action(irs_impu_action action,
                                       MemcachedImplicitRegistrationSet* irs,
                                       SAS::TrailId trail,
                                       ImpuStore* store,
-                                      Utils::StopWatch* stopwatch)
+                                      Utils::StopWatch* stopwatch,
+                                      CasRetryPolicy* retry_policy,
+                                      KeyLockTable::Locks* locks,
+                                      MemcachedCache::WriteCounts* writes = nullptr)
 {
   Store::Status status = Store::Status::OK;
   ImpuStore::DefaultImpu* impu = irs->get_impu_for_store(store);
+  int retries = 0;
 
   // Create an IOHook to pause the stopwatch when performing network I/O
   Utils::IOHook* hook = nullptr;
@@ -918,6 +1648,7 @@ Store::Status perform_irs_impu_action(irs_impu_action action,
       // re-read in the mainline case. We can also hit this case if we got the
       // IRS from a remote store, and we are now writing back to that remote
       // store. This is tautological equivalent.
+      count_writes(writes, retries);
       status = (store->*action)(impu, trail);
     }
     else
@@ -944,6 +1675,7 @@ Store::Status perform_irs_impu_action(irs_impu_action action,
            // Nothing in the store representing this IMPU - just create
            // a new one
            impu = irs->get_impu();
+           count_writes(writes, retries);
            status = (store->*action)(impu, trail);
          }
       }
@@ -954,6 +1686,7 @@ Store::Status perform_irs_impu_action(irs_impu_action action,
         // Merge details from the store into our IRS.
         irs->update_from_impu_from_store(default_impu);
         impu = irs->get_impu_from_impu(default_impu);
+        count_writes(writes, retries);
         status = (store->*action)(impu, trail);
       }
       else if (irs->is_refreshed())
@@ -962,6 +1695,7 @@ Store::Status perform_irs_impu_action(irs_impu_action action,
         // This is safe to do because we've just hit a window of conflicts
         // and we know our data is better.
         impu = irs->get_impu_from_impu(mapped_impu);
+        count_writes(writes, retries);
         status = (store->*action)(impu, trail);
       }
       else
@@ -976,7 +1710,11 @@ Store::Status perform_irs_impu_action(irs_impu_action action,
     }
     delete impu; impu = nullptr;
 
-  } while(status == Store::Status::DATA_CONTENTION);
+  } while ((status == Store::Status::DATA_CONTENTION) &&
+           (retry_policy->should_retry(CasRetryPolicy::IMPU,
+                                       irs->get_default_impu(),
+                                       retries,
+                                       locks)));
 
   if (hook)
   {
@@ -989,13 +1727,25 @@ Store::Status perform_irs_impu_action(irs_impu_action action,
 Store::Status MemcachedCache::update_irs_impu(MemcachedImplicitRegistrationSet* irs,
                                               SAS::TrailId trail,
                                               ImpuStore* store,
-                                              Utils::StopWatch* stopwatch)
+                                              Utils::StopWatch* stopwatch,
+                                              WriteCounts* writes)
 {
+  // Hold the Default IMPU's lock while we read, merge and write it back
+  KeyLockTable::Locks locks;
+
+  if (_key_locks)
+  {
+    locks = _key_locks->lock(store, irs->get_default_impu());
+  }
+
   return perform_irs_impu_action(&ImpuStore::set_impu,
                                  irs,
                                  trail,
                                  store,
-                                 stopwatch);
+                                 stopwatch,
+                                 &_cas_retry_policy,
+                                 &locks,
+                                 writes);
 }
 
 Store::Status MemcachedCache::delete_irs_impu(MemcachedImplicitRegistrationSet* irs,
@@ -1003,41 +1753,213 @@ Store::Status MemcachedCache::delete_irs_impu(MemcachedImplicitRegistrationSet*
                                               ImpuStore* store,
                                               Utils::StopWatch* stopwatch)
 {
+  KeyLockTable::Locks locks;
+
+  if (_key_locks)
+  {
+    locks = _key_locks->lock(store, irs->get_default_impu());
+  }
+
   // If we are deleting an MIRS, we are refreshing it.
   irs->mark_as_refreshed();
   return perform_irs_impu_action(&ImpuStore::delete_impu,
                                  irs,
                                  trail,
                                  store,
-                                 stopwatch);
+                                 stopwatch,
+                                 &_cas_retry_policy,
+                                 &locks);
+}
+
+// The IRS may be cached under its Default IMPU or any of its associated
+// IMPUs, including any it no longer has. This is called once the write has
+// been made, so that the IRS can't be cached again from a read made before
+// it.
+//
+// Any of its IMPUs that we'd found at no site must be read again too.
+void MemcachedCache::invalidate_cached_irs(MemcachedImplicitRegistrationSet* irs)
+{
+  if ((_irs_cache) || (_not_found_cache))
+  {
+    std::vector<std::string> impus = { irs->get_default_impu() };
+
+    for (MemcachedImplicitRegistrationSet::State state :
+           { MemcachedImplicitRegistrationSet::State::ADDED,
+             MemcachedImplicitRegistrationSet::State::UNCHANGED,
+             MemcachedImplicitRegistrationSet::State::DELETED })
+    {
+      std::vector<std::string> state_impus = irs->impus(state);
+      impus.insert(impus.end(), state_impus.begin(), state_impus.end());
+    }
+
+    if (_irs_cache)
+    {
+      _irs_cache->invalidate(impus);
+    }
+
+    if (_not_found_cache)
+    {
+      _not_found_cache->invalidate(impus);
+    }
+  }
+}
+
+void MemcachedCache::log_written_irs(MemcachedImplicitRegistrationSet* irs,
+                                     bool deleted)
+{
+  if (!_reconciler)
+  {
+    return;
+  }
+
+  // Any copy of a key we've deleted that was written before now expires by
+  // the time the IRS would have
+  int64_t deleted_expiry = time(0) + irs->get_ttl();
+
+  log_written_key(Reconciler::IMPU, irs->get_default_impu(), deleted, deleted_expiry);
+
+  // The associated IMPUs and IMPI mappings we've removed may have been
+  // deleted (though mappings shared with other IRSs won't have been)
+  for (MemcachedImplicitRegistrationSet::State state :
+         { MemcachedImplicitRegistrationSet::State::ADDED,
+           MemcachedImplicitRegistrationSet::State::UNCHANGED,
+           MemcachedImplicitRegistrationSet::State::DELETED })
+  {
+    bool removed = (state == MemcachedImplicitRegistrationSet::State::DELETED);
+
+    for (const std::string& impu : irs->impus(state))
+    {
+      log_written_key(Reconciler::IMPU, impu, removed, deleted_expiry);
+    }
+
+    for (const std::string& impi : irs->impis(state))
+    {
+      log_written_key(Reconciler::IMPI_MAPPING, impi, removed, deleted_expiry);
+    }
+  }
+}
+
+void MemcachedCache::log_written_key(Reconciler::Table table,
+                                     const std::string& key,
+                                     bool deleted,
+                                     int64_t deleted_expiry)
+{
+  if (deleted)
+  {
+    _reconciler->key_deleted(table, key, deleted_expiry);
+  }
+  else
+  {
+    _reconciler->key_written(table, key);
+  }
 }
 
 Store::Status MemcachedCache::put_irs_action(MemcachedImplicitRegistrationSet* irs,
                                              SAS::TrailId trail,
                                              ImpuStore* store,
                                              Utils::StopWatch* stopwatch)
+{
+  return put_irs(irs, trail, store, stopwatch, nullptr);
+}
+
+Store::Status MemcachedCache::put_irs(MemcachedImplicitRegistrationSet* irs,
+                                      SAS::TrailId trail,
+                                      ImpuStore* store,
+                                      Utils::StopWatch* stopwatch,
+                                      ImpiLocks* impi_locks)
 {
   // We have three operations to perform here, and can't guarantee
   // perfect consistency, but we should eventually get consistency
-  Store::Status status;
+  Store::Status status = Store::Status::OK;
 
-  if (irs->is_existing())
+  // The Default IMPU holds everything the IRS tracks changes to, so needs
+  // writing unless nothing has changed. Whether the associated IMPUs and IMPI
+  // mappings do is only known once it's been written, as that can pick up
+  // changes from the store.
+  uint64_t planned = 0;
+  WriteCounts writes = { 0, 0 };
+  uint64_t skipped = 0;
+
+  if (!irs->needs_default_impu_write())
   {
-    status = update_irs_impu(irs, trail, store, stopwatch);
+    // Nothing was set to a new value, so the associated IMPUs and IMPI
+    // mappings won't need writing either
+    TRC_DEBUG("IRS for %s is unchanged, so not writing it",
+              irs->get_default_impu().c_str());
+    skipped++;
   }
   else
   {
-    status = create_irs_impu(irs, trail, store, stopwatch);
+    planned++;
+
+    if (irs->is_existing())
+    {
+      status = update_irs_impu(irs, trail, store, stopwatch, &writes);
+    }
+    else
+    {
+      status = create_irs_impu(irs, trail, store, stopwatch, &writes);
+    }
   }
 
   if (status == Store::Status::OK)
   {
-    update_irs_associated_impus(irs, trail, store, stopwatch);
+    if (irs->needs_associated_impu_writes())
+    {
+      planned += irs->impus(MemcachedImplicitRegistrationSet::State::ADDED).size() +
+                 irs->impus(MemcachedImplicitRegistrationSet::State::DELETED).size();
+
+      if (irs->is_refreshed())
+      {
+        planned += irs->impus(MemcachedImplicitRegistrationSet::State::UNCHANGED).size();
+      }
+
+      update_irs_associated_impus(irs, trail, store, stopwatch, &writes);
+    }
+    else
+    {
+      skipped++;
+    }
+
+    if (irs->needs_impi_mapping_writes())
+    {
+      planned += irs->impis(MemcachedImplicitRegistrationSet::State::ADDED).size() +
+                 irs->impis(MemcachedImplicitRegistrationSet::State::DELETED).size();
+
+      if (irs->is_refreshed())
+      {
+        planned += irs->impis(MemcachedImplicitRegistrationSet::State::UNCHANGED).size();
+      }
+
+      update_irs_impi_mappings(irs, trail, store, stopwatch, &writes, impi_locks);
+    }
+    else
+    {
+      skipped++;
+    }
+  }
+
+  _planned_writes += planned;
+  _executed_writes += writes.executed;
+  _retried_writes += writes.retried;
+  _skipped_updates += skipped;
+
+  if (_planned_writes_tbl)
+  {
+    _planned_writes_tbl->accumulate(planned);
+    _executed_writes_tbl->accumulate(writes.executed);
+    _retried_writes_tbl->accumulate(writes.retried);
+
+    for (uint64_t ii = 0; ii < skipped; ii++)
+    {
+      _skipped_updates_tbl->increment();
+    }
   }
 
-  if (status == Store::Status::OK)
+  if (store == _local_store)
   {
-    update_irs_impi_mappings(irs, trail, store, stopwatch);
+    invalidate_cached_irs(irs);
+    log_written_irs(irs, false);
   }
 
   return status;
@@ -1047,6 +1969,15 @@ Store::Status MemcachedCache::delete_irs_action(MemcachedImplicitRegistrationSet
                                                 SAS::TrailId trail,
                                                 ImpuStore* store,
                                                 Utils::StopWatch* stopwatch)
+{
+  return delete_irs(irs, trail, store, stopwatch, nullptr);
+}
+
+Store::Status MemcachedCache::delete_irs(MemcachedImplicitRegistrationSet* irs,
+                                         SAS::TrailId trail,
+                                         ImpuStore* store,
+                                         Utils::StopWatch* stopwatch,
+                                         ImpiLocks* impi_locks)
 {
   Store::Status status = delete_irs_impu(irs, trail, store, stopwatch);
 
@@ -1061,7 +1992,13 @@ Store::Status MemcachedCache::delete_irs_action(MemcachedImplicitRegistrationSet
   {
     // And similar with the IMPIs
     irs->delete_impis();
-    status = update_irs_impi_mappings(irs, trail, store, stopwatch);
+    status = update_irs_impi_mappings(irs, trail, store, stopwatch, nullptr, impi_locks);
+  }
+
+  if (store == _local_store)
+  {
+    invalidate_cached_irs(irs);
+    log_written_irs(irs, true);
   }
 
   return status;
@@ -1080,7 +2017,13 @@ Store::Status MemcachedCache::delete_implicit_registration_set(ImplicitRegistrat
   {
     store_action action =
       std::bind(&MemcachedCache::delete_irs_action, this, mirs, trail, _1, _2);
-    status = perform(action, progress_cb, stopwatch);
+    replicate_action replicate =
+      std::bind(&MemcachedCache::replicate_irs,
+                this,
+                &MemcachedCache::delete_irs_action,
+                mirs,
+                trail);
+    status = perform(action, replicate, progress_cb, stopwatch);
   }
   else
   {
@@ -1102,27 +2045,110 @@ Store::Status MemcachedCache::delete_implicit_registration_sets(const std::vecto
 {
   store_action action =
     std::bind(&MemcachedCache::delete_irss_action, this, irss, trail, _1, _2);
-  Store::Status status = perform(action, progress_cb, stopwatch);
+
+  // Each IRS is replicated separately, so that it can be coalesced with
+  // other writes to it
+  replicate_action replicate = [this, &irss, trail]()
+  {
+    for (ImplicitRegistrationSet* irs : irss)
+    {
+      MemcachedImplicitRegistrationSet* mirs = (MemcachedImplicitRegistrationSet*)irs;
+      if (mirs->is_existing())
+      {
+        replicate_irs(&MemcachedCache::delete_irs_action, mirs, trail);
+      }
+    }
+  };
+
+  Store::Status status = perform(action, replicate, progress_cb, stopwatch);
   return status;
 }
 
+Store::Status MemcachedCache::perform_irs_batch(const std::vector<MemcachedImplicitRegistrationSet*>& irss,
+                                                batch_irs_action action,
+                                                SAS::TrailId trail,
+                                                ImpuStore* store,
+                                                Utils::StopWatch* stopwatch)
+{
+  // Create every IRS's IMPI locks up front, so that the map isn't changed
+  // while the IRSs are written. If we have key locks, the IRSs use those
+  // instead.
+  ImpiLocks impi_locks;
+  ImpiLocks* batch_impi_locks = nullptr;
+
+  if (!_key_locks)
+  {
+    batch_impi_locks = &impi_locks;
+
+    for (MemcachedImplicitRegistrationSet* irs : irss)
+    {
+      for (MemcachedImplicitRegistrationSet::State state :
+             { MemcachedImplicitRegistrationSet::State::ADDED,
+               MemcachedImplicitRegistrationSet::State::UNCHANGED,
+               MemcachedImplicitRegistrationSet::State::DELETED })
+      {
+        for (const std::string& impi : irs->impis(state))
+        {
+          impi_locks[impi];
+        }
+      }
+    }
+  }
+
+  // Failures to write to the remote stores don't fail the request, so we
+  // carry on with the rest of the batch after them
+  bool fail_fast = (store == _local_store);
+  std::atomic<bool> failed(false);
+  std::vector<Store::Status> statuses(irss.size(), Store::Status::OK);
+
+  run_batch(irss.size(),
+            [this, &irss, action, trail, store, batch_impi_locks, fail_fast, &failed, &statuses]
+              (size_t index, Utils::StopWatch* stopwatch)
+            {
+              if (failed)
+              {
+                return;
+              }
+
+              statuses[index] =
+                (this->*action)(irss[index], trail, store, stopwatch, batch_impi_locks);
+
+              if ((statuses[index] != Store::Status::OK) && (fail_fast))
+              {
+                failed = true;
+              }
+            },
+            _batch_write_parallelism,
+            stopwatch);
+
+  for (Store::Status status : statuses)
+  {
+    if (status != Store::Status::OK)
+    {
+      return status;
+    }
+  }
+
+  return Store::Status::OK;
+}
+
 Store::Status MemcachedCache::delete_irss_action(const std::vector<ImplicitRegistrationSet*>& irss,
                                                  SAS::TrailId trail,
                                                  ImpuStore* store,
                                                  Utils::StopWatch* stopwatch)
 {
-  Store::Status status = Store::Status::OK;
+  std::vector<MemcachedImplicitRegistrationSet*> existing;
 
   for (ImplicitRegistrationSet* irs : irss)
   {
     MemcachedImplicitRegistrationSet* mirs = (MemcachedImplicitRegistrationSet*)irs;
     if (mirs->is_existing())
     {
-      status = delete_irs_action(mirs, trail, store, stopwatch);
+      existing.push_back(mirs);
     }
   }
 
-  return status;
+  return perform_irs_batch(existing, &MemcachedCache::delete_irs, trail, store, stopwatch);
 }
 
 Store::Status MemcachedCache::get_ims_subscription(const std::string& impi,
@@ -1158,7 +2184,20 @@ Store::Status MemcachedCache::put_ims_subscription(ImsSubscription* subscription
 {
   store_action action =
     std::bind(&MemcachedCache::put_ims_sub_action, this, subscription, trail, _1, _2);
-  Store::Status status = perform(action, progress_cb, stopwatch);
+
+  replicate_action replicate = [this, subscription, trail]()
+  {
+    BaseImsSubscription* mis = (BaseImsSubscription*)subscription;
+
+    for (BaseImsSubscription::Irs::value_type& irs : mis->get_irs())
+    {
+      replicate_irs(&MemcachedCache::put_irs_action,
+                    (MemcachedImplicitRegistrationSet*)irs.second,
+                    trail);
+    }
+  };
+
+  Store::Status status = perform(action, replicate, progress_cb, stopwatch);
   return status;
 }
 
@@ -1167,15 +2206,13 @@ Store::Status MemcachedCache::put_ims_sub_action(ImsSubscription* subscription,
                                                  ImpuStore* store,
                                                  Utils::StopWatch* stopwatch)
 {
-  Store::Status status = Store::Status::OK;
-
   BaseImsSubscription* mis = (BaseImsSubscription*)subscription;
+  std::vector<MemcachedImplicitRegistrationSet*> irss;
 
   for (BaseImsSubscription::Irs::value_type& irs : mis->get_irs())
   {
-    MemcachedImplicitRegistrationSet* mirs = (MemcachedImplicitRegistrationSet*)irs.second;
-    put_irs_action(mirs, trail, store, stopwatch);
+    irss.push_back((MemcachedImplicitRegistrationSet*)irs.second);
   }
 
-  return status;
+  return perform_irs_batch(irss, &MemcachedCache::put_irs, trail, store, stopwatch);
 }
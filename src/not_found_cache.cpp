@@ -0,0 +1,43 @@
+/**
+ * @file not_found_cache.cpp In-memory cache of IMPUs that no site has
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "not_found_cache.h"
+
+const size_t NotFoundCache::DEFAULT_SHARDS;
+
+NotFoundCache::NotFoundCache(size_t max_entries,
+                             uint64_t ttl_ms,
+                             size_t num_shards) :
+  _map(max_entries, ttl_ms, num_shards, ShardedTtlMap<bool>::OLDEST)
+{
+}
+
+bool NotFoundCache::contains(const std::string& impu)
+{
+  bool value;
+  uint64_t ticket;
+  return _map.get(impu, value, ticket);
+}
+
+void NotFoundCache::add(const std::string& impu)
+{
+  _map.add(impu, true);
+}
+
+void NotFoundCache::invalidate(const std::vector<std::string>& impus)
+{
+  _map.invalidate(impus);
+}
+
+NotFoundCache::Stats NotFoundCache::get_stats()
+{
+  return _map.get_stats();
+}
@@ -0,0 +1,517 @@
+/**
+ * @file reconciler.cpp Background repair of the IMPU stores at remote sites
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "reconciler.h"
+
+#include <algorithm>
+#include <iterator>
+
+#include "log.h"
+
+Reconciler::Reconciler(ImpuStore* local_store,
+                       const std::vector<ImpuStore*>& remote_stores,
+                       size_t max_log_len,
+                       uint64_t settle_ms,
+                       uint64_t max_keys_per_sec) :
+  _local_store(local_store),
+  _remote_stores(remote_stores),
+  _max_log_len(max_log_len),
+  _settle_delay(settle_ms),
+  _interval((max_keys_per_sec > 0) ? (1000000 / max_keys_per_sec) : 0),
+  _stats(remote_stores.size(), Stats()),
+  _log_stats(),
+  _diverged_tbl(nullptr),
+  _repaired_tbl(nullptr),
+  _repair_failed_tbl(nullptr),
+  _errors_tbl(nullptr),
+  _dropped_tbl(nullptr),
+  _stopping(false)
+{
+}
+
+Reconciler::~Reconciler()
+{
+  stop();
+}
+
+void Reconciler::start()
+{
+  if (!_thread.joinable())
+  {
+    _thread = std::thread(&Reconciler::reconciler_loop, this);
+  }
+}
+
+void Reconciler::stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    _stopping = true;
+    _cond.notify_all();
+  }
+
+  if (_thread.joinable())
+  {
+    _thread.join();
+  }
+}
+
+void Reconciler::key_written(Table table, const std::string& key)
+{
+  std::lock_guard<std::mutex> lock(_lock);
+  log_key({ table, key, false, 0, Clock::now() });
+  _cond.notify_all();
+}
+
+void Reconciler::key_deleted(Table table,
+                             const std::string& key,
+                             int64_t deleted_expiry)
+{
+  std::lock_guard<std::mutex> lock(_lock);
+  log_key({ table, key, true, deleted_expiry, Clock::now() });
+  _cond.notify_all();
+}
+
+void Reconciler::log_key(const Entry& entry)
+{
+  std::string index = std::to_string(entry.table) + ":" + entry.key;
+  std::unordered_map<std::string, std::list<Entry>::iterator>::iterator it =
+    _logged_keys.find(index);
+
+  if (it != _logged_keys.end())
+  {
+    // Only the latest write to a key matters
+    _log.erase(it->second);
+    _logged_keys.erase(it);
+  }
+  else if (_log.size() >= _max_log_len)
+  {
+    _log_stats.dropped++;
+
+    if (_dropped_tbl)
+    {
+      _dropped_tbl->increment();
+    }
+
+    if (_max_log_len == 0)
+    {
+      return;
+    }
+
+    const Entry& oldest = _log.front();
+    _logged_keys.erase(std::to_string(oldest.table) + ":" + oldest.key);
+    _log.pop_front();
+  }
+
+  _log.push_back(entry);
+  _logged_keys[index] = std::prev(_log.end());
+}
+
+bool Reconciler::take_settled(Entry& entry)
+{
+  if ((_log.empty()) ||
+      (_log.front().written_at + _settle_delay > Clock::now()))
+  {
+    return false;
+  }
+
+  entry = _log.front();
+  _logged_keys.erase(std::to_string(entry.table) + ":" + entry.key);
+  _log.pop_front();
+  return true;
+}
+
+bool Reconciler::reconcile_next()
+{
+  Entry entry;
+
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+
+    if (!take_settled(entry))
+    {
+      return false;
+    }
+  }
+
+  if (!reconcile(entry))
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+
+    // Try again later, unless the key has been written again since, in which
+    // case it's already back in the log
+    if (_logged_keys.find(std::to_string(entry.table) + ":" + entry.key) ==
+        _logged_keys.end())
+    {
+      entry.written_at = Clock::now();
+      log_key(entry);
+      _log_stats.retried++;
+    }
+  }
+
+  return true;
+}
+
+bool Reconciler::reconcile(const Entry& entry)
+{
+  ImpuStore::Impu* local_impu = nullptr;
+  ImpuStore::ImpiMapping* local_mapping = nullptr;
+  Store::Status status;
+
+  if (entry.table == IMPU)
+  {
+    status = _local_store->get_impu(entry.key, local_impu, 0L);
+  }
+  else
+  {
+    status = _local_store->get_impi_mapping(entry.key, local_mapping, 0L);
+  }
+
+  if ((status != Store::Status::OK) && (status != Store::Status::NOT_FOUND))
+  {
+    TRC_DEBUG("Failed to read %s from the local store to reconcile it",
+              entry.key.c_str());
+    return false;
+  }
+
+  bool all_ok = true;
+
+  for (size_t site = 0; site < _remote_stores.size(); site++)
+  {
+    Stats delta = Stats();
+    Outcome outcome;
+
+    if (entry.table == IMPU)
+    {
+      outcome = reconcile_impu(entry, local_impu, _remote_stores[site], delta);
+    }
+    else
+    {
+      outcome = reconcile_impi_mapping(entry, local_mapping, _remote_stores[site], delta);
+    }
+
+    switch (outcome)
+    {
+    case IN_SYNC:
+      delta.in_sync++;
+      break;
+
+    case REWRITTEN:
+      delta.rewritten++;
+      break;
+
+    case REPAIRED:
+      delta.repaired++;
+      break;
+
+    case REPAIR_FAILED:
+      delta.repair_failed++;
+      all_ok = false;
+      break;
+
+    case ERROR:
+      delta.errors++;
+      all_ok = false;
+      break;
+    }
+
+    if (outcome != ERROR)
+    {
+      delta.checked++;
+    }
+
+    std::lock_guard<std::mutex> lock(_lock);
+    report_stats(delta);
+    Stats& stats = _stats[site];
+    stats.checked += delta.checked;
+    stats.in_sync += delta.in_sync;
+    stats.missing += delta.missing;
+    stats.stale += delta.stale;
+    stats.extra += delta.extra;
+    stats.rewritten += delta.rewritten;
+    stats.repaired += delta.repaired;
+    stats.repair_failed += delta.repair_failed;
+    stats.errors += delta.errors;
+  }
+
+  delete local_impu;
+  delete local_mapping;
+
+  return all_ok;
+}
+
+void Reconciler::report_stats(const Stats& delta)
+{
+  if (!_diverged_tbl)
+  {
+    return;
+  }
+
+  if (delta.missing + delta.stale + delta.extra > 0)
+  {
+    _diverged_tbl->increment();
+  }
+
+  if (delta.repaired > 0)
+  {
+    _repaired_tbl->increment();
+  }
+
+  if (delta.repair_failed > 0)
+  {
+    _repair_failed_tbl->increment();
+  }
+
+  if (delta.errors > 0)
+  {
+    _errors_tbl->increment();
+  }
+}
+
+// Copy an IMPU, to CAS it over the copy in another store
+static ImpuStore::Impu* copy_with_cas(ImpuStore::Impu* impu,
+                                      uint64_t cas,
+                                      const ImpuStore* store)
+{
+  if (impu->is_default_impu())
+  {
+    ImpuStore::DefaultImpu* default_impu = (ImpuStore::DefaultImpu*)impu;
+    return new ImpuStore::DefaultImpu(default_impu->impu,
+                                      default_impu->associated_impus,
+                                      default_impu->impis,
+                                      default_impu->registration_state,
+                                      default_impu->charging_addresses,
+                                      default_impu->service_profile,
+                                      cas,
+                                      default_impu->expiry,
+                                      store);
+  }
+  else
+  {
+    ImpuStore::AssociatedImpu* assoc_impu = (ImpuStore::AssociatedImpu*)impu;
+    return new ImpuStore::AssociatedImpu(assoc_impu->impu,
+                                         assoc_impu->default_impu,
+                                         cas,
+                                         assoc_impu->expiry,
+                                         store);
+  }
+}
+
+// Whether two copies of an IMPU hold the same data, other than their expiry
+// and CAS. A write that doesn't extend the expiry (e.g. a PPR) only changes
+// the content.
+static bool same_content(ImpuStore::Impu* local, ImpuStore::Impu* remote)
+{
+  if (local->is_default_impu() != remote->is_default_impu())
+  {
+    return false;
+  }
+
+  if (local->is_default_impu())
+  {
+    ImpuStore::DefaultImpu* local_default = (ImpuStore::DefaultImpu*)local;
+    ImpuStore::DefaultImpu* remote_default = (ImpuStore::DefaultImpu*)remote;
+    return ((local_default->registration_state == remote_default->registration_state) &&
+            (local_default->charging_addresses == remote_default->charging_addresses) &&
+            (local_default->associated_impus == remote_default->associated_impus) &&
+            (local_default->impis == remote_default->impis) &&
+            (local_default->service_profile.get() == remote_default->service_profile.get()));
+  }
+  else
+  {
+    return (((ImpuStore::AssociatedImpu*)local)->default_impu ==
+            ((ImpuStore::AssociatedImpu*)remote)->default_impu);
+  }
+}
+
+// Whether two copies of an IMPI mapping map to the same Default IMPUs, in any
+// order
+static bool same_content(ImpuStore::ImpiMapping* local,
+                         ImpuStore::ImpiMapping* remote)
+{
+  std::vector<std::string> local_impus = local->get_default_impus();
+  std::vector<std::string> remote_impus = remote->get_default_impus();
+  std::sort(local_impus.begin(), local_impus.end());
+  std::sort(remote_impus.begin(), remote_impus.end());
+  return (local_impus == remote_impus);
+}
+
+Reconciler::Outcome Reconciler::reconcile_impu(const Entry& entry,
+                                               ImpuStore::Impu* local,
+                                               ImpuStore* store,
+                                               Stats& stats)
+{
+  ImpuStore::Impu* remote = nullptr;
+  Store::Status status = store->get_impu(entry.key, remote, 0L);
+
+  if ((status != Store::Status::OK) && (status != Store::Status::NOT_FOUND))
+  {
+    return ERROR;
+  }
+
+  Outcome outcome = IN_SYNC;
+
+  if ((local) && (!remote))
+  {
+    stats.missing++;
+    status = store->add_impu(local, 0L);
+    outcome = (status == Store::Status::OK) ? REPAIRED : REPAIR_FAILED;
+  }
+  else if ((local) &&
+           ((remote->expiry < local->expiry) ||
+            ((remote->expiry == local->expiry) && (!same_content(local, remote)))))
+  {
+    stats.stale++;
+    ImpuStore::Impu* repair = copy_with_cas(local, remote->cas, store);
+    status = store->set_impu(repair, 0L);
+    delete repair;
+    outcome = (status == Store::Status::OK) ? REPAIRED : REPAIR_FAILED;
+  }
+  else if ((!local) && (remote) && (entry.deleted) &&
+           (remote->expiry > entry.deleted_expiry))
+  {
+    // The remote copy must have been written after we deleted the key, so
+    // mustn't be deleted
+    outcome = REWRITTEN;
+  }
+  else if ((!local) && (remote) && (entry.deleted))
+  {
+    stats.extra++;
+    status = store->delete_impu(remote, 0L);
+    outcome = ((status == Store::Status::OK) || (status == Store::Status::NOT_FOUND)) ?
+                REPAIRED : REPAIR_FAILED;
+  }
+
+  if ((outcome != IN_SYNC) && (outcome != REWRITTEN))
+  {
+    TRC_DEBUG("Repaired IMPU %s at a remote site with result %d",
+              entry.key.c_str(),
+              status);
+  }
+
+  delete remote;
+  return outcome;
+}
+
+Reconciler::Outcome Reconciler::reconcile_impi_mapping(const Entry& entry,
+                                                       ImpuStore::ImpiMapping* local,
+                                                       ImpuStore* store,
+                                                       Stats& stats)
+{
+  ImpuStore::ImpiMapping* remote = nullptr;
+  Store::Status status = store->get_impi_mapping(entry.key, remote, 0L);
+
+  if ((status != Store::Status::OK) && (status != Store::Status::NOT_FOUND))
+  {
+    return ERROR;
+  }
+
+  Outcome outcome = IN_SYNC;
+
+  if ((local) && (!remote))
+  {
+    stats.missing++;
+    status = store->add_impi_mapping(local, 0L);
+    outcome = (status == Store::Status::OK) ? REPAIRED : REPAIR_FAILED;
+  }
+  else if ((local) &&
+           ((remote->get_expiry() < local->get_expiry()) ||
+            ((remote->get_expiry() == local->get_expiry()) &&
+             (!same_content(local, remote)))))
+  {
+    stats.stale++;
+    ImpuStore::ImpiMapping repair(local->impi,
+                                  local->get_default_impus(),
+                                  remote->cas,
+                                  local->get_expiry());
+    status = store->set_impi_mapping(&repair, 0L);
+    outcome = (status == Store::Status::OK) ? REPAIRED : REPAIR_FAILED;
+  }
+  else if ((!local) && (remote) && (entry.deleted) &&
+           (remote->get_expiry() > entry.deleted_expiry))
+  {
+    outcome = REWRITTEN;
+  }
+  else if ((!local) && (remote) && (entry.deleted))
+  {
+    stats.extra++;
+    status = store->delete_impi_mapping(remote, 0L);
+    outcome = ((status == Store::Status::OK) || (status == Store::Status::NOT_FOUND)) ?
+                REPAIRED : REPAIR_FAILED;
+  }
+
+  if ((outcome != IN_SYNC) && (outcome != REWRITTEN))
+  {
+    TRC_DEBUG("Repaired IMPI mapping for %s at a remote site with result %d",
+              entry.key.c_str(),
+              status);
+  }
+
+  delete remote;
+  return outcome;
+}
+
+void Reconciler::reconciler_loop()
+{
+  std::unique_lock<std::mutex> lock(_lock);
+
+  while (!_stopping)
+  {
+    if (_log.empty())
+    {
+      _cond.wait(lock);
+      continue;
+    }
+
+    Clock::time_point settled_at = _log.front().written_at + _settle_delay;
+
+    if (settled_at > Clock::now())
+    {
+      _cond.wait_until(lock, settled_at);
+      continue;
+    }
+
+    lock.unlock();
+    reconcile_next();
+    lock.lock();
+
+    // Pace ourselves, but stop straight away if asked to
+    _cond.wait_for(lock, _interval, [this]() { return _stopping; });
+  }
+}
+
+Reconciler::Stats Reconciler::get_stats(size_t site)
+{
+  std::lock_guard<std::mutex> lock(_lock);
+  return _stats[site];
+}
+
+void Reconciler::configure_stats_tables(SNMP::CounterTable* diverged_table,
+                                        SNMP::CounterTable* repaired_table,
+                                        SNMP::CounterTable* repair_failed_table,
+                                        SNMP::CounterTable* errors_table,
+                                        SNMP::CounterTable* dropped_table)
+{
+  std::lock_guard<std::mutex> lock(_lock);
+  _diverged_tbl = diverged_table;
+  _repaired_tbl = repaired_table;
+  _repair_failed_tbl = repair_failed_table;
+  _errors_tbl = errors_table;
+  _dropped_tbl = dropped_table;
+}
+
+Reconciler::LogStats Reconciler::get_log_stats()
+{
+  std::lock_guard<std::mutex> lock(_lock);
+  LogStats stats = _log_stats;
+  stats.pending = _log.size();
+  return stats;
+}
@@ -0,0 +1,164 @@
+/**
+ * @file remote_read_stats.cpp Latency and outcome tracking for reads from
+ * remote sites
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "remote_read_stats.h"
+
+#include <algorithm>
+
+const size_t RemoteReadStats::LATENCY_SAMPLES;
+
+RemoteReadStats::RemoteReadStats(size_t num_sites,
+                                 uint64_t max_hedge_delay_us) :
+  _max_hedge_delay_us(max_hedge_delay_us),
+  _sites(num_sites),
+  _won_tbl(nullptr),
+  _lost_tbl(nullptr),
+  _failed_tbl(nullptr),
+  _abandoned_tbl(nullptr),
+  _latency_tbl(nullptr)
+{
+}
+
+void RemoteReadStats::configure_stats_tables(SNMP::CounterTable* won_table,
+                                             SNMP::CounterTable* lost_table,
+                                             SNMP::CounterTable* failed_table,
+                                             SNMP::CounterTable* abandoned_table,
+                                             SNMP::EventAccumulatorTable* latency_table)
+{
+  std::lock_guard<std::mutex> lock(_lock);
+  _won_tbl = won_table;
+  _lost_tbl = lost_table;
+  _failed_tbl = failed_table;
+  _abandoned_tbl = abandoned_table;
+  _latency_tbl = latency_table;
+}
+
+// Count an event in a table, if there is one
+static void increment(SNMP::CounterTable* table)
+{
+  if (table)
+  {
+    table->increment();
+  }
+}
+
+std::vector<size_t> RemoteReadStats::order()
+{
+  std::vector<size_t> sites;
+
+  for (size_t site = 0; site < _sites.size(); site++)
+  {
+    sites.push_back(site);
+  }
+
+  std::lock_guard<std::mutex> lock(_lock);
+
+  // A stable sort, so sites we know nothing about are tried in the order
+  // they were configured
+  std::stable_sort(sites.begin(), sites.end(), [this](size_t a, size_t b) {
+    return _sites[a].stats.smoothed_us < _sites[b].stats.smoothed_us;
+  });
+
+  return sites;
+}
+
+uint64_t RemoteReadStats::hedge_delay_us(size_t site)
+{
+  std::lock_guard<std::mutex> lock(_lock);
+  const Site& s = _sites[site];
+
+  if (s.num_samples == 0)
+  {
+    // We've no idea how long this site takes, so don't hold the next one up
+    return 0;
+  }
+
+  return std::min(s.stats.smoothed_us + 4 * s.deviation_us, _max_hedge_delay_us);
+}
+
+void RemoteReadStats::record(size_t site, Outcome outcome, uint64_t latency_us)
+{
+  std::lock_guard<std::mutex> lock(_lock);
+  Site& s = _sites[site];
+
+  switch (outcome)
+  {
+  case WON:
+    s.stats.won++;
+    increment(_won_tbl);
+    break;
+
+  case LOST:
+    s.stats.lost++;
+    increment(_lost_tbl);
+    break;
+
+  case FAILED:
+    s.stats.failed++;
+    increment(_failed_tbl);
+    break;
+
+  case ABANDONED:
+    s.stats.abandoned++;
+    increment(_abandoned_tbl);
+    return;
+  }
+
+  if (_latency_tbl)
+  {
+    _latency_tbl->accumulate(latency_us);
+  }
+
+  if (s.num_samples == 0)
+  {
+    s.samples.resize(LATENCY_SAMPLES);
+    s.stats.smoothed_us = latency_us;
+    s.deviation_us = latency_us / 2;
+  }
+  else
+  {
+    // Smooth the latency and its deviation with gains of 1/8 and 1/4 (as
+    // RFC 6298 does for round trip times)
+    uint64_t error = (latency_us > s.stats.smoothed_us) ?
+                       latency_us - s.stats.smoothed_us :
+                       s.stats.smoothed_us - latency_us;
+    s.deviation_us = (3 * s.deviation_us + error) / 4;
+    s.stats.smoothed_us = (7 * s.stats.smoothed_us + latency_us) / 8;
+  }
+
+  s.samples[s.next_sample] = latency_us;
+  s.next_sample = (s.next_sample + 1) % LATENCY_SAMPLES;
+  s.num_samples = std::min(s.num_samples + 1, LATENCY_SAMPLES);
+}
+
+RemoteReadStats::Stats RemoteReadStats::get_stats(size_t site)
+{
+  std::vector<uint64_t> samples;
+  Stats stats;
+
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    const Site& s = _sites[site];
+    stats = s.stats;
+    samples.assign(s.samples.begin(), s.samples.begin() + s.num_samples);
+  }
+
+  if (!samples.empty())
+  {
+    std::sort(samples.begin(), samples.end());
+    stats.p50_us = samples[(samples.size() - 1) * 50 / 100];
+    stats.p99_us = samples[(samples.size() - 1) * 99 / 100];
+    stats.max_us = samples.back();
+  }
+
+  return stats;
+}
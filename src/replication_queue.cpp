@@ -0,0 +1,249 @@
+/**
+ * @file replication_queue.cpp Asynchronous replication of writes to remote
+ * sites
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "replication_queue.h"
+
+#include "log.h"
+
+ReplicationQueue::ReplicationQueue(const std::vector<ImpuStore*>& stores,
+                                   size_t max_queue_len,
+                                   int writers_per_site) :
+  _max_queue_len(max_queue_len),
+  _writers_per_site(writers_per_site),
+  _stopping(false),
+  _started(false),
+  _lag_tbl(nullptr),
+  _dropped_tbl(nullptr),
+  _failed_tbl(nullptr)
+{
+  for (ImpuStore* store : stores)
+  {
+    _sites.emplace_back(new Site(store));
+  }
+}
+
+ReplicationQueue::~ReplicationQueue()
+{
+  stop();
+}
+
+void ReplicationQueue::start()
+{
+  if (_started)
+  {
+    return;
+  }
+
+  _started = true;
+
+  for (std::unique_ptr<Site>& site : _sites)
+  {
+    for (int ii = 0; ii < _writers_per_site; ii++)
+    {
+      site->writers.emplace_back(&ReplicationQueue::writer_loop, this, site.get());
+    }
+  }
+}
+
+void ReplicationQueue::stop()
+{
+  _stopping = true;
+
+  for (std::unique_ptr<Site>& site : _sites)
+  {
+    {
+      std::lock_guard<std::mutex> lock(site->lock);
+
+      if (!site->queue.empty())
+      {
+        TRC_WARNING("Dropping %lu queued writes to a remote site on shutdown",
+                    site->queue.size());
+        site->stats.dropped += site->queue.size();
+
+        if (_dropped_tbl)
+        {
+          for (size_t ii = 0; ii < site->queue.size(); ii++)
+          {
+            _dropped_tbl->increment();
+          }
+        }
+
+        site->stats.queued = 0;
+        site->queue.clear();
+        site->queued_keys.clear();
+      }
+
+      site->cond.notify_all();
+    }
+
+    for (std::thread& writer : site->writers)
+    {
+      writer.join();
+    }
+
+    site->writers.clear();
+  }
+}
+
+void ReplicationQueue::replicate(const std::string& key, Write* write)
+{
+  // Every site but the last gets a copy of the write
+  for (size_t ii = 0; ii < _sites.size(); ii++)
+  {
+    Write* site_write = (ii + 1 < _sites.size()) ? write->clone() : write;
+    replicate_to_site(_sites[ii].get(), key, site_write);
+  }
+
+  if (_sites.empty())
+  {
+    delete write;
+  }
+}
+
+void ReplicationQueue::replicate_to_site(Site* site,
+                                         const std::string& key,
+                                         Write* write)
+{
+  std::unique_ptr<Write> owned(write);
+  std::lock_guard<std::mutex> lock(site->lock);
+
+  std::unordered_map<std::string, std::list<Queued>::iterator>::iterator it =
+    site->queued_keys.find(key);
+
+  if (it != site->queued_keys.end())
+  {
+    // There's already a write to this key waiting, so replace it with this
+    // one. The replacement keeps the older write's place in the queue and
+    // its queue time, so the lag we report is that of the oldest change.
+    TRC_DEBUG("Coalescing replicated write to %s", key.c_str());
+    owned->absorb(*(it->second->write));
+    it->second->write = std::move(owned);
+    site->stats.coalesced++;
+  }
+  else if (_stopping || (site->queue.size() >= _max_queue_len))
+  {
+    // The site isn't keeping up (or we're shutting down). Dropping the write
+    // leaves the site out of date until the subscriber is next written, but
+    // is better than letting the backlog grow without limit.
+    TRC_WARNING("Replication queue full, dropping write to %s", key.c_str());
+    site->stats.dropped++;
+
+    if (_dropped_tbl)
+    {
+      _dropped_tbl->increment();
+    }
+  }
+  else
+  {
+    site->queue.push_back(Queued{key, std::move(owned), Clock::now()});
+    site->queued_keys[key] = std::prev(site->queue.end());
+    site->stats.queued++;
+    site->cond.notify_one();
+  }
+}
+
+std::list<ReplicationQueue::Queued>::iterator ReplicationQueue::next_write(Site* site)
+{
+  std::list<Queued>::iterator it = site->queue.begin();
+
+  while ((it != site->queue.end()) &&
+         (site->in_flight_keys.find(it->key) != site->in_flight_keys.end()))
+  {
+    ++it;
+  }
+
+  return it;
+}
+
+void ReplicationQueue::writer_loop(Site* site)
+{
+  std::unique_lock<std::mutex> lock(site->lock);
+
+  while (true)
+  {
+    std::list<Queued>::iterator next;
+    site->cond.wait(lock, [this, site, &next]() {
+      next = next_write(site);
+      return _stopping || (next != site->queue.end());
+    });
+
+    if (_stopping)
+    {
+      break;
+    }
+
+    // Take the write off the queue, and apply it without the lock held
+    Queued queued = std::move(*next);
+    site->queued_keys.erase(queued.key);
+    site->queue.erase(next);
+    site->in_flight_keys.insert(queued.key);
+    site->stats.queued--;
+    site->stats.in_flight++;
+
+    lock.unlock();
+    Store::Status status = queued.write->apply(site->store);
+    uint64_t lag_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                        Clock::now() - queued.queued_at).count();
+    queued.write.reset();
+    lock.lock();
+
+    site->in_flight_keys.erase(queued.key);
+    site->stats.in_flight--;
+
+    if (status == Store::Status::OK)
+    {
+      site->stats.completed++;
+    }
+    else
+    {
+      // Nothing we can do, but log the error
+      TRC_DEBUG("Failed to replicate write to %s with error %d",
+                queued.key.c_str(),
+                status);
+      site->stats.failed++;
+
+      if (_failed_tbl)
+      {
+        _failed_tbl->increment();
+      }
+    }
+
+    if (_lag_tbl)
+    {
+      _lag_tbl->accumulate(lag_us);
+    }
+
+    site->stats.lag_us = lag_us;
+    site->stats.max_lag_us = std::max(site->stats.max_lag_us, lag_us);
+
+    // Wake anyone waiting for us to finish - another writer may be waiting
+    // for this key, or someone waiting for the queue to be idle.
+    site->cond.notify_all();
+  }
+}
+
+void ReplicationQueue::wait_until_idle()
+{
+  for (std::unique_ptr<Site>& site : _sites)
+  {
+    std::unique_lock<std::mutex> lock(site->lock);
+    site->cond.wait(lock, [&site]() {
+      return site->queue.empty() && site->in_flight_keys.empty();
+    });
+  }
+}
+
+ReplicationQueue::Stats ReplicationQueue::get_stats(size_t site)
+{
+  std::lock_guard<std::mutex> lock(_sites[site]->lock);
+  return _sites[site]->stats;
+}
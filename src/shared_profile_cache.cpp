@@ -0,0 +1,103 @@
+/**
+ * @file shared_profile_cache.cpp In-process cache of shared service profiles
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "shared_profile_cache.h"
+
+#include <algorithm>
+
+bool SharedProfileCache::get(const std::string& reference,
+                             std::string& profile)
+{
+  std::lock_guard<std::mutex> lock(_lock);
+
+  auto it = _entries.find(reference);
+
+  if (it == _entries.end())
+  {
+    return false;
+  }
+
+  touch(it->second);
+  profile = it->second.profile;
+
+  return true;
+}
+
+void SharedProfileCache::put(const std::string& reference,
+                             const std::string& profile,
+                             int64_t lease_expiry)
+{
+  std::lock_guard<std::mutex> lock(_lock);
+
+  auto it = _entries.find(reference);
+
+  if (it != _entries.end())
+  {
+    // The profile itself can't have changed, as it's identified by its
+    // content, but we may now know it's stored for longer.
+    it->second.profile = profile;
+    it->second.lease_expiry = std::max(it->second.lease_expiry, lease_expiry);
+    touch(it->second);
+    return;
+  }
+
+  if (_max_entries == 0)
+  {
+    return;
+  }
+
+  if (_entries.size() >= _max_entries)
+  {
+    // Evict the least recently used profile
+    _entries.erase(_lru.back());
+    _lru.pop_back();
+  }
+
+  _lru.push_front(reference);
+
+  Entry& entry = _entries[reference];
+  entry.profile = profile;
+  entry.lease_expiry = lease_expiry;
+  entry.lru_position = _lru.begin();
+}
+
+int64_t SharedProfileCache::lease_expiry(const std::string& reference)
+{
+  std::lock_guard<std::mutex> lock(_lock);
+
+  auto it = _entries.find(reference);
+
+  return (it != _entries.end()) ? it->second.lease_expiry : 0;
+}
+
+void SharedProfileCache::remove(const std::string& reference)
+{
+  std::lock_guard<std::mutex> lock(_lock);
+
+  auto it = _entries.find(reference);
+
+  if (it != _entries.end())
+  {
+    _lru.erase(it->second.lru_position);
+    _entries.erase(it);
+  }
+}
+
+size_t SharedProfileCache::size()
+{
+  std::lock_guard<std::mutex> lock(_lock);
+  return _entries.size();
+}
+
+void SharedProfileCache::touch(Entry& entry)
+{
+  _lru.splice(_lru.begin(), _lru, entry.lru_position);
+}
@@ -0,0 +1,81 @@
+/**
+ * @file allocation_counter.cpp Counts heap allocations made by a thread
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <cstdlib>
+#include <new>
+
+#include "allocation_counter.hpp"
+
+static thread_local bool counting = false;
+static thread_local int allocations = 0;
+
+AllocationCounter::AllocationCounter()
+{
+  allocations = 0;
+  counting = true;
+}
+
+AllocationCounter::~AllocationCounter()
+{
+  counting = false;
+}
+
+int AllocationCounter::count() const
+{
+  return allocations;
+}
+
+static void* counted_alloc(std::size_t size)
+{
+  if (counting)
+  {
+    allocations++;
+  }
+
+  void* ptr = malloc(size == 0 ? 1 : size);
+
+  if (ptr == nullptr)
+  {
+    throw std::bad_alloc();
+  }
+
+  return ptr;
+}
+
+void* operator new(std::size_t size)
+{
+  return counted_alloc(size);
+}
+
+void* operator new[](std::size_t size)
+{
+  return counted_alloc(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+  free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+  free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+  free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept
+{
+  free(ptr);
+}
@@ -0,0 +1,29 @@
+/**
+ * @file allocation_counter.hpp Counts heap allocations made by a thread
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef ALLOCATION_COUNTER_HPP__
+#define ALLOCATION_COUNTER_HPP__
+
+// Counts the calls to operator new made by the current thread while it
+// exists, so that tests can check that code doesn't allocate.
+//
+// This works by replacing the global operator new for the UT binary, which
+// counts when an AllocationCounter is active and otherwise just calls malloc.
+class AllocationCounter
+{
+public:
+  AllocationCounter();
+  ~AllocationCounter();
+
+  int count() const;
+};
+
+#endif
@@ -0,0 +1,123 @@
+/**
+ * @file batch_runner_test.cpp UT for running batches of jobs concurrently
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "batch_runner.h"
+#include "test_utils.hpp"
+#include "gtest/gtest.h"
+
+class BatchRunnerTest : public ::testing::Test
+{
+};
+
+TEST_F(BatchRunnerTest, RunsEveryJob)
+{
+  BatchRunner runner(4, nullptr);
+  std::vector<int> runs(100, 0);
+
+  runner.run(runs.size(), [&runs](size_t index) { runs[index]++; }, 5);
+
+  for (int run : runs)
+  {
+    EXPECT_EQ(1, run);
+  }
+}
+
+TEST_F(BatchRunnerTest, RunsJobsConcurrently)
+{
+  BatchRunner runner(2, nullptr);
+  std::mutex lock;
+  std::condition_variable cond;
+  size_t running = 0;
+  size_t max_running = 0;
+
+  // Each job waits for the others, so this only finishes if all three run at
+  // once
+  runner.run(3,
+             [&](size_t index)
+             {
+               std::unique_lock<std::mutex> l(lock);
+               running++;
+               max_running = std::max(max_running, running);
+               cond.notify_all();
+               cond.wait(l, [&]() { return max_running == 3; });
+               running--;
+             },
+             3);
+
+  EXPECT_EQ(3u, max_running);
+}
+
+TEST_F(BatchRunnerTest, RunsSeriallyOnCallingThread)
+{
+  BatchRunner runner(4, nullptr);
+  std::thread::id caller = std::this_thread::get_id();
+  size_t on_caller = 0;
+
+  runner.run(10,
+             [&](size_t index)
+             {
+               if (std::this_thread::get_id() == caller)
+               {
+                 on_caller++;
+               }
+             },
+             1);
+
+  EXPECT_EQ(10u, on_caller);
+}
+
+TEST_F(BatchRunnerTest, NestedBatches)
+{
+  // The inner batches complete even though the pool threads are all running
+  // jobs from the outer one
+  BatchRunner runner(1, nullptr);
+  std::mutex lock;
+  size_t runs = 0;
+
+  runner.run(2,
+             [&](size_t outer)
+             {
+               runner.run(5,
+                          [&](size_t inner)
+                          {
+                            std::lock_guard<std::mutex> l(lock);
+                            runs++;
+                          },
+                          2);
+             },
+             2);
+
+  EXPECT_EQ(10u, runs);
+}
+
+TEST_F(BatchRunnerTest, TimesBusiestThread)
+{
+  BatchRunner runner(1, nullptr);
+
+  // Four 10ms jobs on at most two threads, so one of them runs at least two
+  // of the jobs one after the other, and its total is the batch's time
+  unsigned long time_us =
+    runner.run_timed(4,
+                     [](size_t index, Utils::StopWatch* stopwatch)
+                     {
+                       EXPECT_NE(nullptr, stopwatch);
+                       std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                     },
+                     2);
+
+  EXPECT_GE(time_us, 20000u);
+}
@@ -0,0 +1,188 @@
+/**
+ * @file cas_retry_policy_test.cpp UT for retrying writes that hit contention
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <atomic>
+#include <future>
+#include <thread>
+
+#include "cas_retry_policy.h"
+#include "test_utils.hpp"
+#include "fakelogger.h"
+#include "gtest/gtest.h"
+
+static const std::string IMPU = "sip:impu@example.com";
+static const std::string IMPI = "impi@example.com";
+static const std::string IMPI_2 = "impi2@example.com";
+static const std::string IMPI_3 = "impi3@example.com";
+
+class CasRetryPolicyTest : public ::testing::Test
+{
+};
+
+// Tables that remember what they're told, so tests can check it
+class CountingCounterTable : public SNMP::CounterTable
+{
+public:
+  void increment() { count++; }
+  uint64_t count = 0;
+};
+
+class RecordingAccumulatorTable : public SNMP::EventAccumulatorTable
+{
+public:
+  void accumulate(uint32_t sample) { samples.push_back(sample); }
+  std::vector<uint32_t> samples;
+};
+
+TEST_F(CasRetryPolicyTest, RetriesUpToLimit)
+{
+  CasRetryPolicy policy(2, 0, 0);
+  int retries = 0;
+
+  EXPECT_TRUE(policy.should_retry(CasRetryPolicy::IMPU, IMPU, retries));
+  EXPECT_TRUE(policy.should_retry(CasRetryPolicy::IMPU, IMPU, retries));
+  EXPECT_EQ(2, retries);
+  EXPECT_FALSE(policy.should_retry(CasRetryPolicy::IMPU, IMPU, retries));
+
+  CasRetryPolicy::Stats stats = policy.get_stats(CasRetryPolicy::IMPU);
+  EXPECT_EQ(3u, stats.contentions);
+  EXPECT_EQ(2u, stats.retries);
+  EXPECT_EQ(1u, stats.exhausted);
+  EXPECT_EQ(0u, stats.backoff_us);
+
+  EXPECT_EQ(0u, policy.get_stats(CasRetryPolicy::IMPI_MAPPING).contentions);
+}
+
+TEST_F(CasRetryPolicyTest, BackoffIsCapped)
+{
+  CasRetryPolicy policy(20, 1, 8);
+  int retries = 0;
+
+  for (int ii = 0; ii < 20; ii++)
+  {
+    EXPECT_TRUE(policy.should_retry(CasRetryPolicy::IMPI_MAPPING, IMPI, retries));
+  }
+
+  // The first retry waits at most 1us, the next 2us, then 4us, and the rest
+  // at most 8us
+  EXPECT_LE(policy.get_stats(CasRetryPolicy::IMPI_MAPPING).backoff_us,
+            1u + 2u + 4u + (17u * 8u));
+}
+
+TEST_F(CasRetryPolicyTest, HotKeys)
+{
+  // Track at most two keys
+  CasRetryPolicy policy(10, 0, 0, 2);
+
+  for (int ii = 0; ii < 3; ii++)
+  {
+    int retries = 0;
+    policy.should_retry(CasRetryPolicy::IMPI_MAPPING, IMPI, retries);
+  }
+
+  int retries = 0;
+  policy.should_retry(CasRetryPolicy::IMPU, IMPU, retries);
+
+  std::vector<CasRetryPolicy::HotKey> hot_keys = policy.get_hot_keys();
+  ASSERT_EQ(2u, hot_keys.size());
+  EXPECT_EQ(CasRetryPolicy::IMPI_MAPPING, hot_keys[0].table);
+  EXPECT_EQ(IMPI, hot_keys[0].key);
+  EXPECT_EQ(3u, hot_keys[0].contentions);
+  EXPECT_EQ(IMPU, hot_keys[1].key);
+
+  // A new key replaces the least contended, taking over its count
+  retries = 0;
+  policy.should_retry(CasRetryPolicy::IMPI_MAPPING, IMPI_2, retries);
+
+  hot_keys = policy.get_hot_keys();
+  ASSERT_EQ(2u, hot_keys.size());
+  EXPECT_EQ(IMPI, hot_keys[0].key);
+  EXPECT_EQ(IMPI_2, hot_keys[1].key);
+  EXPECT_EQ(2u, hot_keys[1].contentions);
+
+  // So a key contended often enough displaces it in turn
+  for (int ii = 0; ii < 5; ii++)
+  {
+    retries = 0;
+    policy.should_retry(CasRetryPolicy::IMPI_MAPPING, IMPI_3, retries);
+  }
+
+  hot_keys = policy.get_hot_keys();
+  ASSERT_EQ(2u, hot_keys.size());
+  EXPECT_EQ(IMPI_3, hot_keys[0].key);
+  EXPECT_EQ(IMPI, hot_keys[1].key);
+}
+
+TEST_F(CasRetryPolicyTest, ReportsToStatsTables)
+{
+  CasRetryPolicy policy(1, 0, 0);
+  CountingCounterTable contentions;
+  CountingCounterTable exhausted;
+  RecordingAccumulatorTable backoff;
+  RecordingAccumulatorTable hot_keys;
+  policy.configure_stats_tables(&contentions, &exhausted, &backoff, &hot_keys);
+
+  int retries = 0;
+  EXPECT_TRUE(policy.should_retry(CasRetryPolicy::IMPU, IMPU, retries));
+  EXPECT_FALSE(policy.should_retry(CasRetryPolicy::IMPU, IMPU, retries));
+
+  retries = 0;
+  EXPECT_TRUE(policy.should_retry(CasRetryPolicy::IMPI_MAPPING, IMPI, retries));
+
+  EXPECT_EQ(3u, contentions.count);
+  EXPECT_EQ(1u, exhausted.count);
+  EXPECT_EQ(std::vector<uint32_t>({ 0, 0 }), backoff.samples);
+
+  // Each contention reports how contended its key has been
+  EXPECT_EQ(std::vector<uint32_t>({ 1, 2, 1 }), hot_keys.samples);
+}
+
+TEST_F(CasRetryPolicyTest, ReleasesLocksWhileBackingOff)
+{
+  // The backoff is random, so may occasionally be too short for another
+  // thread to take the lock during it, and we try a few times
+  CasRetryPolicy policy(1, 20000, 20000);
+  std::mutex key_lock;
+  bool taken_while_backing_off = false;
+
+  for (int attempt = 0; (attempt < 10) && (!taken_while_backing_off); attempt++)
+  {
+    std::promise<void> locked;
+    std::atomic<bool> retrying(false);
+    bool held_after_retry = false;
+
+    std::thread writer([&]()
+    {
+      CasRetryPolicy::Locks locks;
+      locks.emplace_back(key_lock);
+      locked.set_value();
+
+      int retries = 0;
+      retrying = true;
+      policy.should_retry(CasRetryPolicy::IMPU, IMPU, retries, &locks);
+      retrying = false;
+      held_after_retry = locks[0].owns_lock();
+    });
+
+    // Take the lock as soon as the writer lets it go. Unless it does so
+    // while backing off, that's only once it's finished.
+    locked.get_future().wait();
+    key_lock.lock();
+    taken_while_backing_off = retrying;
+    key_lock.unlock();
+
+    // The writer has the lock again by the time it retries
+    writer.join();
+    EXPECT_TRUE(held_after_retry);
+  }
+
+  EXPECT_TRUE(taken_while_backing_off);
+}
@@ -90,6 +90,11 @@ class FakeImplicitRegistrationSet : public ImplicitRegistrationSet
     _ttl = ttl;
   }
 
+  virtual ImplicitRegistrationSet* clone() const override
+  {
+    return new FakeImplicitRegistrationSet(*this);
+  }
+
 private:
   std::string _default_impu;
   std::string _ims_sub_xml;
@@ -0,0 +1,548 @@
+/**
+ * @file impu_codec_bench.cpp Micro-benchmarks for the IMPU store encodings
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <getopt.h>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include "allocation_counter.hpp"
+#include "impu_codec.h"
+#include "impu_store.h"
+
+// Measures encoding and decoding IMPUs and IMPI mappings in each of the IMPU
+// store formats and codecs, over synthetic subscriber corpora ranging from a
+// single IMPU with a small service profile to implicit registration sets of
+// 10000 IMPUs.
+//
+// For each benchmark this reports the time and heap allocations per
+// operation, the bytes produced (or consumed) per operation and, where the
+// operation compresses, the compression ratio. The results are written as a
+// single JSON document, so that they can be compared between releases.
+//
+// Build it with "make bench", which also runs it.
+
+struct options
+{
+  std::string output;
+  std::string filter;
+  int min_time_ms;
+};
+
+enum OptionTypes
+{
+  OUTPUT = 128,
+  FILTER,
+  MIN_TIME,
+  HELP,
+};
+
+const static struct option long_opt[] =
+{
+  {"output",   required_argument, NULL, OUTPUT},
+  {"filter",   required_argument, NULL, FILTER},
+  {"min-time", required_argument, NULL, MIN_TIME},
+  {"help",     no_argument,       NULL, HELP},
+  {NULL,       0,                 NULL, 0},
+};
+
+void usage(void)
+{
+  puts("Usage: homestead_codec_bench [options]\n"
+       "\n"
+       "Options:\n"
+       "\n"
+       "     --output <file>        File to write the JSON results to (default:\n"
+       "                            stdout)\n"
+       "     --filter <string>      Only run benchmarks whose name contains this\n"
+       "     --min-time N           Minimum time to run each benchmark for, in\n"
+       "                            milliseconds (default: 200)\n"
+       "     --help                 Show this help screen\n");
+}
+
+int init_options(int argc, char** argv, struct options& options)
+{
+  int opt;
+  int long_opt_ind;
+
+  while ((opt = getopt_long(argc, argv, "", long_opt, &long_opt_ind)) != -1)
+  {
+    switch (opt)
+    {
+    case OUTPUT:
+      options.output = std::string(optarg);
+      break;
+
+    case FILTER:
+      options.filter = std::string(optarg);
+      break;
+
+    case MIN_TIME:
+      options.min_time_ms = atoi(optarg);
+      break;
+
+    default:
+      usage();
+      return -1;
+    }
+  }
+
+  if (options.min_time_ms <= 0)
+  {
+    fprintf(stderr, "The minimum time must be positive\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+// The expiry given to every record. It's only ever encoded, so needn't be in
+// the future.
+static const int64_t EXPIRY = 1500000000;
+
+static const ChargingAddresses CHARGING_ADDRESSES =
+  ChargingAddresses({ "ccf1.example.com", "ccf2.example.com" },
+                    { "ecf1.example.com" });
+
+static std::string impu_name(int index)
+{
+  return "sip:+1650555" + std::to_string(1000000 + index) + "@ims.example.com";
+}
+
+static std::string impi_name(int index)
+{
+  return "+1650555" + std::to_string(1000000 + index) + "@ims.example.com";
+}
+
+// A service profile with the given number of initial filter criteria. Real
+// profiles are typically a handful of iFCs, but some run to many kilobytes.
+static std::string service_profile(int ifcs)
+{
+  std::string xml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+                    "<IMSSubscription><PrivateID>" + impi_name(0) +
+                    "</PrivateID><ServiceProfile><PublicIdentity><Identity>" +
+                    impu_name(0) + "</Identity></PublicIdentity>";
+
+  for (int ii = 0; ii < ifcs; ii++)
+  {
+    xml += "<InitialFilterCriteria><Priority>" + std::to_string(ii) +
+           "</Priority><TriggerPoint><ConditionTypeCNF>0</ConditionTypeCNF>"
+           "<SPT><ConditionNegated>0</ConditionNegated><Group>0</Group>"
+           "<Method>INVITE</Method></SPT></TriggerPoint><ApplicationServer>"
+           "<ServerName>sip:as" + std::to_string(ii) +
+           ".example.com:5060;transport=tcp</ServerName><DefaultHandling>0"
+           "</DefaultHandling></ApplicationServer></InitialFilterCriteria>";
+  }
+
+  xml += "</ServiceProfile></IMSSubscription>";
+  return xml;
+}
+
+// A subscriber corpus - a record to encode and decode
+struct Corpus
+{
+  std::string name;
+  ImpuStore::Impu* impu;
+  ImpuStore::ImpiMapping* mapping;
+};
+
+static ImpuStore::Impu* default_impu(int associated_impus, int impis, int ifcs)
+{
+  std::vector<std::string> assoc;
+  std::vector<std::string> impi_list;
+
+  for (int ii = 0; ii < associated_impus; ii++)
+  {
+    assoc.push_back(impu_name(ii + 1));
+  }
+
+  for (int ii = 0; ii < impis; ii++)
+  {
+    impi_list.push_back(impi_name(ii));
+  }
+
+  return new ImpuStore::DefaultImpu(impu_name(0),
+                                    assoc,
+                                    impi_list,
+                                    RegistrationState::REGISTERED,
+                                    CHARGING_ADDRESSES,
+                                    service_profile(ifcs),
+                                    0L,
+                                    EXPIRY,
+                                    nullptr);
+}
+
+static ImpuStore::ImpiMapping* impi_mapping(int default_impus)
+{
+  std::vector<std::string> impus;
+
+  for (int ii = 0; ii < default_impus; ii++)
+  {
+    impus.push_back(impu_name(ii));
+  }
+
+  return new ImpuStore::ImpiMapping(impi_name(0), impus, 0L, EXPIRY);
+}
+
+static std::vector<Corpus> build_corpora()
+{
+  return {
+    { "small_profile", default_impu(1, 1, 2), nullptr },
+    { "large_profile", default_impu(1, 1, 100), nullptr },
+    { "associated_impu",
+      new ImpuStore::AssociatedImpu(impu_name(1), impu_name(0), 0L, EXPIRY, nullptr),
+      nullptr },
+    { "irs_10", default_impu(10, 1, 5), nullptr },
+    { "irs_100", default_impu(100, 1, 5), nullptr },
+    { "irs_1000", default_impu(1000, 1, 5), nullptr },
+    { "irs_10000", default_impu(10000, 1, 5), nullptr },
+    { "impis_100", default_impu(1, 100, 5), nullptr },
+    { "impis_1000", default_impu(1, 1000, 5), nullptr },
+    { "mapping_1", nullptr, impi_mapping(1) },
+    { "mapping_100", nullptr, impi_mapping(100) },
+  };
+}
+
+// The ways records can be written, each as a format and the policy that
+// forces the codec.
+struct Encoding
+{
+  std::string name;
+  ImpuStore::ImpuFormat format;
+  ImpuStore::CodecPolicy policy;
+};
+
+static const std::vector<Encoding> ENCODINGS = {
+  { "v0_lz4", ImpuStore::ImpuFormat::V0, ImpuStore::CodecPolicy() },
+  { "v1_raw", ImpuStore::ImpuFormat::V1,
+    ImpuStore::CodecPolicy(std::numeric_limits<size_t>::max(), 0) },
+  { "v1_lz4", ImpuStore::ImpuFormat::V1, ImpuStore::CodecPolicy() },
+  { "v1_deflate", ImpuStore::ImpuFormat::V1, ImpuStore::CodecPolicy(0, 1) },
+  { "v2_raw", ImpuStore::ImpuFormat::V2,
+    ImpuStore::CodecPolicy(std::numeric_limits<size_t>::max(), 0) },
+  { "v2_lz4", ImpuStore::ImpuFormat::V2, ImpuStore::CodecPolicy() },
+  { "v2_deflate", ImpuStore::ImpuFormat::V2, ImpuStore::CodecPolicy(0, 1) },
+};
+
+// Runs benchmarks and collects their results
+class Bench
+{
+public:
+  Bench(const options& options) :
+    _filter(options.filter),
+    _min_time(std::chrono::milliseconds(options.min_time_ms)),
+    _writer(_buffer)
+  {
+    _writer.StartObject();
+    _writer.String("min_time_ms");
+    _writer.Int(options.min_time_ms);
+    _writer.String("benchmarks");
+    _writer.StartArray();
+  }
+
+  // Run op repeatedly, doubling the number of runs until they take at least
+  // the minimum time, and record the result. bytes is the size of the data
+  // each op produces or consumes, and uncompressed the size of that data
+  // before compression (0 if the op doesn't compress).
+  void run(const std::string& name,
+           size_t bytes,
+           size_t uncompressed,
+           const std::function<bool()>& op)
+  {
+    if (name.find(_filter) == std::string::npos)
+    {
+      return;
+    }
+
+    // Warm up, so that the per-thread arenas and streams are in place, as
+    // they would be in a running homestead.
+    if (!op())
+    {
+      fprintf(stderr, "Benchmark %s failed\n", name.c_str());
+      _failed = true;
+      return;
+    }
+
+    uint64_t ops = 1;
+    uint64_t total_ops;
+    int allocations;
+    std::chrono::steady_clock::duration elapsed;
+
+    do
+    {
+      AllocationCounter counter;
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+      for (uint64_t ii = 0; ii < ops; ii++)
+      {
+        op();
+      }
+
+      elapsed = std::chrono::steady_clock::now() - start;
+      allocations = counter.count();
+      total_ops = ops;
+      ops *= 2;
+    } while (elapsed < _min_time);
+
+    double ns_per_op =
+      (double)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() /
+      total_ops;
+
+    _writer.StartObject();
+    _writer.String("name");
+    _writer.String(name.c_str());
+    _writer.String("ops");
+    _writer.Uint64(total_ops);
+    _writer.String("ns_per_op");
+    _writer.Double(ns_per_op);
+    _writer.String("bytes_per_op");
+    _writer.Uint64(bytes);
+    _writer.String("allocs_per_op");
+    _writer.Double((double)allocations / total_ops);
+
+    if (uncompressed != 0)
+    {
+      _writer.String("compression_ratio");
+      _writer.Double((double)uncompressed / bytes);
+    }
+
+    _writer.EndObject();
+
+    fprintf(stderr, "%-40s %12.0f ns/op %10lu bytes/op %8.2f allocs/op\n",
+            name.c_str(), ns_per_op, bytes, (double)allocations / total_ops);
+  }
+
+  // Finish the results, returning whether every benchmark succeeded.
+  bool finish(std::string& results)
+  {
+    _writer.EndArray();
+    _writer.EndObject();
+    results = _buffer.GetString();
+    return !_failed;
+  }
+
+private:
+  std::string _filter;
+  std::chrono::steady_clock::duration _min_time;
+  rapidjson::StringBuffer _buffer;
+  rapidjson::Writer<rapidjson::StringBuffer> _writer;
+  bool _failed = false;
+};
+
+static void bench_varbyte(Bench& bench)
+{
+  static const std::vector<uint64_t> VALUES = { 1, 127, 128, 16383, 16384, 1 << 24 };
+  std::string data;
+  data.reserve(64);
+
+  for (uint64_t value : VALUES)
+  {
+    data.clear();
+    encode_varbyte(value, data);
+    std::string encoded = data;
+
+    bench.run("varbyte/encode/" + std::to_string(value),
+              encoded.size(),
+              0,
+              [&]() {
+                data.clear();
+                encode_varbyte(value, data);
+                return true;
+              });
+
+    bench.run("varbyte/decode/" + std::to_string(value),
+              encoded.size(),
+              0,
+              [&]() {
+                size_t offset = 0;
+                return decode_varbyte(encoded, offset) == value;
+              });
+  }
+}
+
+static void bench_impu(Bench& bench, const Corpus& corpus)
+{
+  for (const Encoding& encoding : ENCODINGS)
+  {
+    std::string prefix = "impu/" + corpus.name + "/" + encoding.name;
+    std::string record;
+
+    if (corpus.impu->to_data(record, encoding.format, 0, encoding.policy) !=
+        Store::Status::OK)
+    {
+      fprintf(stderr, "Failed to encode %s\n", prefix.c_str());
+      continue;
+    }
+
+    std::string uncompressed;
+    ImpuStore::Impu::decompress_data(record, uncompressed);
+
+    // Reuse the output buffer, as ImpuStore's callers can
+    std::string data;
+
+    bench.run(prefix + "/encode",
+              record.size(),
+              uncompressed.size(),
+              [&]() {
+                data.clear();
+                return corpus.impu->to_data(data,
+                                            encoding.format,
+                                            0,
+                                            encoding.policy) == Store::Status::OK;
+              });
+
+    bench.run(prefix + "/decode",
+              record.size(),
+              uncompressed.size(),
+              [&]() {
+                ImpuStore::Impu* impu =
+                  ImpuStore::Impu::from_data(corpus.impu->impu, record, 0, nullptr);
+                bool ok = (impu != nullptr);
+                delete impu;
+                return ok;
+              });
+
+    if ((encoding.format == ImpuStore::ImpuFormat::V2) &&
+        (corpus.impu->is_default_impu()))
+    {
+      // Version 2 only decompresses the service profile when it's read
+      bench.run(prefix + "/decode_profile",
+                record.size(),
+                uncompressed.size(),
+                [&]() {
+                  ImpuStore::Impu* impu =
+                    ImpuStore::Impu::from_data(corpus.impu->impu, record, 0, nullptr);
+                  bool ok = ((impu != nullptr) &&
+                             (!((ImpuStore::DefaultImpu*)impu)->service_profile.get().empty()));
+                  delete impu;
+                  return ok;
+                });
+    }
+  }
+
+  // The raw LZ4 compression that underlies the version 0 format
+  std::string json;
+  std::string compressed;
+  corpus.impu->to_data(compressed, ImpuStore::ImpuFormat::V0);
+  ImpuStore::Impu::decompress_data(compressed, json);
+  compressed.clear();
+  ImpuStore::Impu::compress_data_v0(json, compressed);
+  std::string data;
+
+  bench.run("impu/" + corpus.name + "/compress_data_v0",
+            compressed.size(),
+            json.size(),
+            [&]() {
+              data.clear();
+              return ImpuStore::Impu::compress_data_v0(json, data);
+            });
+}
+
+static void bench_mapping(Bench& bench, const Corpus& corpus)
+{
+  for (const Encoding& encoding : ENCODINGS)
+  {
+    // IMPI mappings are always written as version 1 in the binary formats
+    if (encoding.format == ImpuStore::ImpuFormat::V2)
+    {
+      continue;
+    }
+
+    // Version 0 mappings are plain JSON
+    std::string prefix = "mapping/" + corpus.name + "/" +
+                         ((encoding.format == ImpuStore::ImpuFormat::V0) ?
+                            "v0_json" : encoding.name);
+    std::string record;
+    corpus.mapping->to_data(record, encoding.format, 0, encoding.policy);
+
+    std::string json;
+    corpus.mapping->to_data(json);
+    std::string data;
+
+    bench.run(prefix + "/encode",
+              record.size(),
+              json.size(),
+              [&]() {
+                return corpus.mapping->to_data(data,
+                                               encoding.format,
+                                               0,
+                                               encoding.policy) == Store::Status::OK;
+              });
+
+    bench.run(prefix + "/decode",
+              record.size(),
+              json.size(),
+              [&]() {
+                ImpuStore::ImpiMapping* mapping =
+                  ImpuStore::ImpiMapping::from_data(corpus.mapping->impi, record, 0);
+                bool ok = (mapping != nullptr);
+                delete mapping;
+                return ok;
+              });
+  }
+}
+
+int main(int argc, char** argv)
+{
+  struct options options;
+  options.min_time_ms = 200;
+
+  if (init_options(argc, argv, options) != 0)
+  {
+    return 1;
+  }
+
+  Bench bench(options);
+  std::vector<Corpus> corpora = build_corpora();
+
+  bench_varbyte(bench);
+
+  for (const Corpus& corpus : corpora)
+  {
+    if (corpus.impu != nullptr)
+    {
+      bench_impu(bench, corpus);
+    }
+    else
+    {
+      bench_mapping(bench, corpus);
+    }
+
+    delete corpus.impu;
+    delete corpus.mapping;
+  }
+
+  std::string results;
+  int rc = bench.finish(results) ? 0 : 1;
+
+  if (options.output.empty())
+  {
+    std::cout << results << std::endl;
+  }
+  else
+  {
+    std::ofstream file(options.output.c_str(), std::ios::out | std::ios::trunc);
+    file << results << std::endl;
+
+    if (!file)
+    {
+      fprintf(stderr, "Failed to write results to %s\n", options.output.c_str());
+      rc = 1;
+    }
+  }
+
+  return rc;
+}
@@ -0,0 +1,64 @@
+/**
+ * @file impu_dictionary_test.cpp UT for IMPU dictionary training
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "impu_dictionary.h"
+#include "gtest/gtest.h"
+
+static const std::string COMMON = "<ServiceProfile><PublicIdentity><Identity>";
+
+class ImpuDictionaryTest : public testing::Test
+{
+};
+
+TEST_F(ImpuDictionaryTest, NoSamples)
+{
+  EXPECT_EQ("", ImpuDictionary::train({}, 1024));
+}
+
+TEST_F(ImpuDictionaryTest, SamplesTooShort)
+{
+  EXPECT_EQ("", ImpuDictionary::train({ "abc", "def" }, 1024));
+}
+
+TEST_F(ImpuDictionaryTest, CommonContent)
+{
+  // The content shared by every sample should make it into the dictionary,
+  // at the end, ahead of the content unique to each sample.
+  std::vector<std::string> samples;
+
+  for (int ii = 0; ii < 20; ii++)
+  {
+    samples.push_back("sip:" + std::to_string(ii * 7919) + "@example.com" +
+                      COMMON +
+                      std::to_string(ii * 104729));
+  }
+
+  std::string dictionary = ImpuDictionary::train(samples, 1024);
+
+  ASSERT_LE(64, dictionary.size());
+  EXPECT_GE(1024, dictionary.size());
+  EXPECT_NE(std::string::npos,
+            dictionary.substr(dictionary.size() - 64).find(COMMON));
+}
+
+TEST_F(ImpuDictionaryTest, MaxSize)
+{
+  std::vector<std::string> samples;
+
+  for (int ii = 0; ii < 20; ii++)
+  {
+    samples.push_back(std::string(1000, 'a' + ii));
+  }
+
+  std::string dictionary = ImpuDictionary::train(samples, 100);
+
+  EXPECT_EQ(100, dictionary.size());
+}
@@ -9,13 +9,22 @@
  * Metaswitch Networks in a separate written agreement.
  */
 
+#include <fstream>
+#include <unistd.h>
+
+#include "allocation_counter.hpp"
+#include "impu_codec.h"
 #include "impu_store.h"
+#include "json_parse_utils.h"
 #include "localstore.h"
 #include "test_interposer.hpp"
 #include "test_utils.hpp"
 
 static const std::string IMPU = "sip:impu@example.com";
+static const std::string IMPU_2 = "sip:impu2@example.com";
 static const std::string ASSOC_IMPU = "sip:assoc_impu@example.com";
+static const std::string ASSOC_IMPU_2 = "sip:assoc_impu2@example.com";
+static const std::string ASSOC_IMPU_3 = "sip:assoc_impu3@example.com";
 static const std::vector<std::string> NO_ASSOCIATED_IMPUS;
 static const std::vector<std::string> IMPUS = { IMPU };
 static const ChargingAddresses NO_CHARGING_ADDRESSES = ChargingAddresses({}, {});
@@ -199,7 +208,7 @@ TEST_F(ImpuStoreTest, GetDefaultImpu)
   ASSERT_EQ(NO_ASSOCIATED_IMPUS, got_default_impu->associated_impus);
   ASSERT_EQ(NO_CHARGING_ADDRESSES.ccfs, got_default_impu->charging_addresses.ccfs);
   ASSERT_EQ(NO_CHARGING_ADDRESSES.ecfs, got_default_impu->charging_addresses.ecfs);
-  ASSERT_EQ(SERVICE_PROFILE, got_default_impu->service_profile);
+  ASSERT_EQ(SERVICE_PROFILE, got_default_impu->service_profile.get());
 
   delete got_default_impu;
   delete impu_store;
@@ -341,6 +350,60 @@ TEST_F(ImpuStoreTest, GetAssociatedImpiMapping)
   delete local_store;
 }
 
+TEST_F(ImpuStoreTest, AddImpiMapping)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = new ImpuStore(local_store);
+
+  int expiry = time(0) + 1;
+
+  ImpuStore::ImpiMapping* mapping =
+    new ImpuStore::ImpiMapping(IMPI,
+                               IMPUS,
+                               0L,
+                               expiry);
+
+  ASSERT_EQ(Store::Status::OK,
+            impu_store->add_impi_mapping(mapping, 0));
+
+  // A second add fails, rather than overwriting the first
+  ASSERT_EQ(Store::Status::DATA_CONTENTION,
+            impu_store->add_impi_mapping(mapping, 0));
+
+  delete mapping;
+  delete impu_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, CloneImpus)
+{
+  ImpuStore::DefaultImpu default_impu(IMPU,
+                                      { ASSOC_IMPU },
+                                      IMPIS,
+                                      RegistrationState::REGISTERED,
+                                      NO_CHARGING_ADDRESSES,
+                                      SERVICE_PROFILE,
+                                      1L,
+                                      time(0) + 1,
+                                      nullptr);
+
+  ImpuStore::Impu* clone = default_impu.clone();
+  ASSERT_TRUE(clone->is_default_impu());
+  EXPECT_EQ(IMPU, clone->impu);
+  EXPECT_EQ(1L, clone->cas);
+  EXPECT_EQ(IMPIS, ((ImpuStore::DefaultImpu*)clone)->impis);
+  EXPECT_EQ(SERVICE_PROFILE,
+            ((ImpuStore::DefaultImpu*)clone)->service_profile.get());
+  delete clone;
+
+  ImpuStore::AssociatedImpu associated_impu(ASSOC_IMPU, IMPU, 1L, time(0) + 1, nullptr);
+
+  clone = associated_impu.clone();
+  ASSERT_FALSE(clone->is_default_impu());
+  EXPECT_EQ(IMPU, ((ImpuStore::AssociatedImpu*)clone)->default_impu);
+  delete clone;
+}
+
 TEST_F(ImpuStoreTest, ImpuFromDataEmpty)
 {
   std::string data;
@@ -399,11 +462,7 @@ TEST_F(ImpuStoreVersion0Test, InvalidCompressData)
 TEST_F(ImpuStoreVersion0Test, InvalidJson)
 {
   encode_varbyte(INVALID_JSON.size(), data);
-  char* buffer = nullptr;
-  int comp_size;
-  ImpuStore::Impu::compress_data_v0(INVALID_JSON, buffer, comp_size);
-  data.append(buffer, comp_size);
-  free(buffer);
+  ImpuStore::Impu::compress_data_v0(INVALID_JSON, data);
 
   ASSERT_EQ(nullptr, ImpuStore::Impu::from_data(IMPU, data, 0, nullptr));
 }
@@ -411,17 +470,15 @@ TEST_F(ImpuStoreVersion0Test, InvalidJson)
 TEST_F(ImpuStoreVersion0Test, NotJsonObject)
 {
   encode_varbyte(JSON_ARRAY.size(), data);
-  char* buffer;
-  int comp_size;
-  ImpuStore::Impu::compress_data_v0(JSON_ARRAY, buffer, comp_size);
-  data.append(buffer, comp_size);
+  ImpuStore::Impu::compress_data_v0(JSON_ARRAY, data);
 
   ASSERT_EQ(nullptr, ImpuStore::Impu::from_data(IMPU, data, 0, nullptr));
-  free(buffer);
 }
 
-TEST_F(ImpuStoreVersion0Test, BufferResize)
+TEST_F(ImpuStoreVersion0Test, CompressLargeData)
 {
+  // The compressed data is sized by the LZ4 compress bound up front, so even
+  // very large data compresses in one go.
   std::string data;
   int length = 126 /* ~ */ - 34 /* # */;
 
@@ -430,80 +487,108 @@ TEST_F(ImpuStoreVersion0Test, BufferResize)
     data.push_back((i % length) + 34);
   }
 
-  char* buffer = nullptr;
-  int comp_size;
-  ImpuStore::Impu::compress_data_v0(data, buffer, comp_size);
-  free(buffer);
-}
-
-TEST_F(ImpuStoreTest, ImpiMappingInvalidJson)
-{
-  ASSERT_EQ(nullptr,
-            ImpuStore::ImpiMapping::from_data(IMPI,
-                                              INVALID_JSON,
-                                              0L));
-}
+  std::string compressed;
+  ASSERT_TRUE(ImpuStore::Impu::compress_data_v0(data, compressed));
 
-TEST_F(ImpuStoreTest, ImpiMappingNotJsonObject)
-{
-  ASSERT_EQ(nullptr,
-            ImpuStore::ImpiMapping::from_data(IMPI,
-                                              JSON_ARRAY,
-                                              0L));
+  std::string uncompressed(data.size(), '\0');
+  ASSERT_TRUE(ImpuCodec::get(ImpuCodec::LZ4)->decompress(compressed.data(),
+                                                         compressed.size(),
+                                                         0,
+                                                         uncompressed));
+  ASSERT_EQ(data, uncompressed);
 }
 
-TEST_F(ImpuStoreTest, ImpuNotFound)
+TEST_F(ImpuStoreTest, GetDefaultImpuV1)
 {
   LocalStore* local_store = new LocalStore();
-  ImpuStore* impu_store = new ImpuStore(local_store);
+  ImpuStore* impu_store = new ImpuStore(local_store, ImpuStore::ImpuFormat::V1);
+
+  int expiry = time(0) + 1;
+
+  std::vector<std::string> assoc_impus = { ASSOC_IMPU,
+                                           "sip:assoc_impu_2@example.com",
+                                           "tel:+1234567890" };
+  ChargingAddresses charging_addresses = ChargingAddresses({ "ccf1", "ccf2" },
+                                                           { "ecf1" });
+
+  ImpuStore::DefaultImpu* default_impu =
+    new ImpuStore::DefaultImpu(IMPU,
+                               assoc_impus,
+                               IMPIS,
+                               RegistrationState::REGISTERED,
+                               charging_addresses,
+                               SERVICE_PROFILE,
+                               0L,
+                               expiry,
+                               impu_store);
+  impu_store->set_impu(default_impu, 0);
+
+  delete default_impu;
 
   ImpuStore::Impu* got_impu = nullptr;
   Store::Status status = impu_store->get_impu(IMPU, got_impu, 0L);
-  ASSERT_EQ(status, Store::Status::NOT_FOUND);
-  ASSERT_EQ(nullptr, got_impu);
 
-  delete impu_store;
-  delete local_store;
-}
+  ASSERT_EQ(status, Store::Status::OK);
+  ASSERT_NE(nullptr, got_impu);
+  ASSERT_EQ(IMPU, got_impu->impu);
+  ASSERT_TRUE(got_impu->is_default_impu());
+  ASSERT_EQ(expiry, got_impu->expiry);
 
-TEST_F(ImpuStoreTest, ImpiMappingNotFound)
-{
-  LocalStore* local_store = new LocalStore();
-  ImpuStore* impu_store = new ImpuStore(local_store);
+  ImpuStore::DefaultImpu* got_default_impu =
+    dynamic_cast<ImpuStore::DefaultImpu*>(got_impu);
 
-  ImpuStore::ImpiMapping* mapping = nullptr;
-  Store::Status status = impu_store->get_impi_mapping(IMPI, mapping, 0L);
-  ASSERT_EQ(nullptr, mapping);
-  ASSERT_EQ(status, Store::Status::NOT_FOUND);
+  ASSERT_NE(nullptr, got_default_impu);
+
+  ASSERT_EQ(RegistrationState::REGISTERED, got_default_impu->registration_state);
+  ASSERT_EQ(IMPIS, got_default_impu->impis);
+  ASSERT_EQ(assoc_impus, got_default_impu->associated_impus);
+  ASSERT_EQ(charging_addresses, got_default_impu->charging_addresses);
+  ASSERT_EQ(SERVICE_PROFILE, got_default_impu->service_profile.get());
 
+  delete got_default_impu;
   delete impu_store;
   delete local_store;
 }
 
-TEST_F(ImpuStoreTest, ImpiMappingBadJson)
+TEST_F(ImpuStoreTest, GetAssociatedImpuV1)
 {
   LocalStore* local_store = new LocalStore();
-  ImpuStore* impu_store = new ImpuStore(local_store);
-  local_store->set_data("impi_mapping",
-                        IMPI,
-                        INVALID_JSON,
-                        0,
-                        1,
-                        0L);
+  ImpuStore* impu_store = new ImpuStore(local_store, ImpuStore::ImpuFormat::V1);
 
-  ImpuStore::ImpiMapping* mapping = nullptr;
-  Store::Status status = impu_store->get_impi_mapping(IMPI, mapping, 0L);
-  ASSERT_EQ(nullptr, mapping);
-  ASSERT_EQ(status, Store::Status::ERROR);
+  int expiry = time(0) + 1;
+
+  ImpuStore::AssociatedImpu* assoc_impu =
+    new ImpuStore::AssociatedImpu(ASSOC_IMPU,
+                                  IMPU,
+                                  0L,
+                                  expiry,
+                                  impu_store);
+
+  impu_store->set_impu(assoc_impu, 0);
+
+  delete assoc_impu;
+
+  ImpuStore::Impu* got_impu = nullptr;
+  Store::Status status = impu_store->get_impu(ASSOC_IMPU, got_impu, 0);
+
+  ASSERT_EQ(status, Store::Status::OK);
+  ASSERT_NE(nullptr, got_impu);
+  ASSERT_FALSE(got_impu->is_default_impu());
+  ASSERT_EQ(expiry, got_impu->expiry);
+  ASSERT_EQ(IMPU, ((ImpuStore::AssociatedImpu*)got_impu)->default_impu);
 
+  delete got_impu;
   delete impu_store;
   delete local_store;
 }
 
-TEST_F(ImpuStoreTest, ImpuSetWithoutCas)
+TEST_F(ImpuStoreTest, ReadV0WithV1Store)
 {
+  // An IMPU written by a node using version 0 must be readable by a node that
+  // has moved on to writing version 1.
   LocalStore* local_store = new LocalStore();
-  ImpuStore* impu_store = new ImpuStore(local_store);
+  ImpuStore* v0_store = new ImpuStore(local_store);
+  ImpuStore* v1_store = new ImpuStore(local_store, ImpuStore::ImpuFormat::V1);
 
   int expiry = time(0) + 1;
 
@@ -512,34 +597,1523 @@ TEST_F(ImpuStoreTest, ImpuSetWithoutCas)
                                   IMPU,
                                   0L,
                                   expiry,
-                                  impu_store);
+                                  v0_store);
 
-  ASSERT_EQ(Store::Status::OK,
-            impu_store->set_impu_without_cas(assoc_impu, 0));
+  v0_store->set_impu(assoc_impu, 0);
 
   delete assoc_impu;
+
+  ImpuStore::Impu* got_impu = nullptr;
+  Store::Status status = v1_store->get_impu(ASSOC_IMPU, got_impu, 0);
+
+  ASSERT_EQ(status, Store::Status::OK);
+  ASSERT_NE(nullptr, got_impu);
+  ASSERT_EQ(IMPU, ((ImpuStore::AssociatedImpu*)got_impu)->default_impu);
+
+  delete got_impu;
+  delete v1_store;
+  delete v0_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, GetImpiMappingV1)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = new ImpuStore(local_store, ImpuStore::ImpuFormat::V1);
+
+  int expiry = time(0) + 1;
+  std::vector<std::string> impus = { IMPU, ASSOC_IMPU, "sip:impu2@example.com" };
+
+  ImpuStore::ImpiMapping* mapping =
+    new ImpuStore::ImpiMapping(IMPI, impus, 0L, expiry);
+
+  ASSERT_EQ(Store::Status::OK, impu_store->set_impi_mapping(mapping, 0));
+
+  // The binary record is smaller than the JSON one
+  std::string json_data;
+  std::string binary_data;
+  mapping->to_data(json_data);
+  mapping->to_data(binary_data, ImpuStore::ImpuFormat::V1);
+  EXPECT_EQ((char) 0, binary_data[0]);
+  EXPECT_LT(binary_data.size(), json_data.size());
+
+  delete mapping;
+
+  ImpuStore::ImpiMapping* got_mapping = nullptr;
+  Store::Status status = impu_store->get_impi_mapping(IMPI, got_mapping, 0);
+
+  ASSERT_EQ(status, Store::Status::OK);
+  ASSERT_NE(nullptr, got_mapping);
+  EXPECT_EQ(impus, got_mapping->get_default_impus());
+  EXPECT_EQ(expiry, got_mapping->get_expiry());
+
+  delete got_mapping;
   delete impu_store;
   delete local_store;
 }
 
-TEST_F(ImpuStoreTest, DeleteImpu)
+TEST_F(ImpuStoreTest, ImpiMappingV2WrittenAsV1)
+{
+  // IMPI mappings have no service profile, so a version 2 store writes them
+  // in version 1
+  ImpuStore::ImpiMapping mapping(IMPI, IMPU, 300);
+
+  std::string data;
+  ASSERT_EQ(Store::Status::OK,
+            mapping.to_data(data, ImpuStore::ImpuFormat::V2));
+  EXPECT_EQ((char) 1, data[2]);
+
+  ImpuStore::ImpiMapping* got_mapping =
+    ImpuStore::ImpiMapping::from_data(IMPI, data, 0L);
+  ASSERT_NE(nullptr, got_mapping);
+  EXPECT_EQ(IMPUS, got_mapping->get_default_impus());
+  EXPECT_EQ(300, got_mapping->get_expiry());
+
+  delete got_mapping;
+}
+
+TEST_F(ImpuStoreTest, ReadJsonImpiMappingWithV1Store)
 {
+  // A mapping written by a node using version 0 must be readable by a node
+  // that has moved on to writing binary mappings, and vice versa.
   LocalStore* local_store = new LocalStore();
-  ImpuStore* impu_store = new ImpuStore(local_store);
+  ImpuStore* v0_store = new ImpuStore(local_store);
+  ImpuStore* v1_store = new ImpuStore(local_store, ImpuStore::ImpuFormat::V1);
 
   int expiry = time(0) + 1;
 
-  ImpuStore::AssociatedImpu* assoc_impu =
-    new ImpuStore::AssociatedImpu(ASSOC_IMPU,
-                                  IMPU,
-                                  0L,
-                                  expiry,
-                                  impu_store);
+  ImpuStore::ImpiMapping* mapping =
+    new ImpuStore::ImpiMapping(IMPI, IMPU, expiry);
+
+  v0_store->set_impi_mapping(mapping, 0);
 
+  ImpuStore::ImpiMapping* got_mapping = nullptr;
   ASSERT_EQ(Store::Status::OK,
-            impu_store->delete_impu(assoc_impu, 0));
+            v1_store->get_impi_mapping(IMPI, got_mapping, 0));
+  ASSERT_NE(nullptr, got_mapping);
+  EXPECT_EQ(IMPUS, got_mapping->get_default_impus());
+  EXPECT_EQ(expiry, got_mapping->get_expiry());
 
-  delete assoc_impu;
+  // Write it back as a binary mapping, and read it with the version 0 store
+  got_mapping->add_default_impu(ASSOC_IMPU);
+  ASSERT_EQ(Store::Status::OK, v1_store->set_impi_mapping(got_mapping, 0));
+  delete got_mapping; got_mapping = nullptr;
+
+  ASSERT_EQ(Store::Status::OK,
+            v0_store->get_impi_mapping(IMPI, got_mapping, 0));
+  ASSERT_NE(nullptr, got_mapping);
+  EXPECT_TRUE(got_mapping->has_default_impu(IMPU));
+  EXPECT_TRUE(got_mapping->has_default_impu(ASSOC_IMPU));
+
+  delete got_mapping;
+  delete mapping;
+  delete v1_store;
+  delete v0_store;
+  delete local_store;
+}
+
+// A service profile big enough to be worth compressing
+static std::string large_service_profile()
+{
+  std::string service_profile = "<ServiceProfile>";
+
+  for (int ii = 0; ii < 20; ii++)
+  {
+    service_profile += "<InitialFilterCriteria><Priority>" +
+                       std::to_string(ii) +
+                       "</Priority><ApplicationServer><ServerName>"
+                       "sip:as.example.com</ServerName></ApplicationServer>"
+                       "</InitialFilterCriteria>";
+  }
+
+  service_profile += "</ServiceProfile>";
+  return service_profile;
+}
+
+TEST_F(ImpuStoreTest, GetDefaultImpuV2)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = new ImpuStore(local_store, ImpuStore::ImpuFormat::V2);
+
+  int expiry = time(0) + 1;
+  std::string service_profile = large_service_profile();
+  ChargingAddresses charging_addresses = ChargingAddresses({ "ccf1" },
+                                                           { "ecf1" });
+
+  ImpuStore::DefaultImpu* default_impu =
+    new ImpuStore::DefaultImpu(IMPU,
+                               { ASSOC_IMPU },
+                               IMPIS,
+                               RegistrationState::REGISTERED,
+                               charging_addresses,
+                               service_profile,
+                               0L,
+                               expiry,
+                               impu_store);
+  impu_store->set_impu(default_impu, 0);
+
+  delete default_impu;
+
+  ImpuStore::Impu* got_impu = nullptr;
+  Store::Status status = impu_store->get_impu(IMPU, got_impu, 0L);
+
+  ASSERT_EQ(status, Store::Status::OK);
+  ASSERT_NE(nullptr, got_impu);
+  ASSERT_TRUE(got_impu->is_default_impu());
+  ASSERT_EQ(expiry, got_impu->expiry);
+
+  ImpuStore::DefaultImpu* got_default_impu =
+    (ImpuStore::DefaultImpu*)got_impu;
+
+  ASSERT_EQ(RegistrationState::REGISTERED, got_default_impu->registration_state);
+  ASSERT_EQ(IMPIS, got_default_impu->impis);
+  ASSERT_EQ(std::vector<std::string>({ ASSOC_IMPU }),
+            got_default_impu->associated_impus);
+  ASSERT_EQ(charging_addresses, got_default_impu->charging_addresses);
+
+  // The service profile is only decompressed once it's asked for
+  EXPECT_FALSE(got_default_impu->service_profile.is_inflated());
+  EXPECT_EQ(service_profile, got_default_impu->service_profile.get());
+  EXPECT_TRUE(got_default_impu->service_profile.is_inflated());
+
+  delete got_default_impu;
+  delete impu_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, GetAssociatedImpuV2)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = new ImpuStore(local_store, ImpuStore::ImpuFormat::V2);
+
+  ImpuStore::AssociatedImpu assoc_impu(ASSOC_IMPU, IMPU, 0L, time(0) + 1, nullptr);
+  impu_store->set_impu(&assoc_impu, 0);
+
+  ImpuStore::Impu* got_impu = nullptr;
+  Store::Status status = impu_store->get_impu(ASSOC_IMPU, got_impu, 0);
+
+  ASSERT_EQ(status, Store::Status::OK);
+  ASSERT_NE(nullptr, got_impu);
+  ASSERT_FALSE(got_impu->is_default_impu());
+  ASSERT_EQ(IMPU, ((ImpuStore::AssociatedImpu*)got_impu)->default_impu);
+
+  delete got_impu;
   delete impu_store;
   delete local_store;
 }
+
+TEST_F(ImpuStoreTest, EmptyServiceProfileV2)
+{
+  ImpuStore::DefaultImpu default_impu(IMPU,
+                                      NO_ASSOCIATED_IMPUS,
+                                      IMPIS,
+                                      RegistrationState::UNREGISTERED,
+                                      NO_CHARGING_ADDRESSES,
+                                      std::string(),
+                                      0L,
+                                      time(0) + 1,
+                                      nullptr);
+
+  std::string data;
+  ASSERT_EQ(Store::Status::OK,
+            default_impu.to_data(data, ImpuStore::ImpuFormat::V2));
+
+  ImpuStore::Impu* got_impu = ImpuStore::Impu::from_data(IMPU, data, 0, nullptr);
+  ASSERT_NE(nullptr, got_impu);
+  ASSERT_TRUE(got_impu->is_default_impu());
+  EXPECT_EQ("", ((ImpuStore::DefaultImpu*)got_impu)->service_profile.get());
+
+  delete got_impu;
+}
+
+TEST_F(ImpuStoreTest, RewriteV2WithoutDecompressingServiceProfile)
+{
+  ImpuStore::DefaultImpu default_impu(IMPU,
+                                      NO_ASSOCIATED_IMPUS,
+                                      IMPIS,
+                                      RegistrationState::REGISTERED,
+                                      NO_CHARGING_ADDRESSES,
+                                      large_service_profile(),
+                                      0L,
+                                      time(0) + 1,
+                                      nullptr);
+
+  std::string data;
+  ASSERT_EQ(Store::Status::OK,
+            default_impu.to_data(data, ImpuStore::ImpuFormat::V2));
+
+  ImpuStore::Impu* got_impu = ImpuStore::Impu::from_data(IMPU, data, 0, nullptr);
+  ASSERT_NE(nullptr, got_impu);
+
+  // Writing the IMPU back out in the same format copies the compressed
+  // service profile across as is
+  std::string rewritten;
+  ASSERT_EQ(Store::Status::OK,
+            got_impu->to_data(rewritten, ImpuStore::ImpuFormat::V2));
+  EXPECT_EQ(data, rewritten);
+  EXPECT_FALSE(((ImpuStore::DefaultImpu*)got_impu)->service_profile.is_inflated());
+
+  // Writing it in an older format needs the profile itself
+  std::string v1_data;
+  ASSERT_EQ(Store::Status::OK,
+            got_impu->to_data(v1_data, ImpuStore::ImpuFormat::V1));
+  EXPECT_TRUE(((ImpuStore::DefaultImpu*)got_impu)->service_profile.is_inflated());
+
+  ImpuStore::Impu* v1_impu = ImpuStore::Impu::from_data(IMPU, v1_data, 0, nullptr);
+  ASSERT_NE(nullptr, v1_impu);
+  EXPECT_EQ(large_service_profile(),
+            ((ImpuStore::DefaultImpu*)v1_impu)->service_profile.get());
+
+  delete v1_impu;
+  delete got_impu;
+}
+
+TEST_F(ImpuStoreTest, CorruptServiceProfileV2)
+{
+  ImpuStore::DefaultImpu default_impu(IMPU,
+                                      NO_ASSOCIATED_IMPUS,
+                                      IMPIS,
+                                      RegistrationState::REGISTERED,
+                                      NO_CHARGING_ADDRESSES,
+                                      large_service_profile(),
+                                      0L,
+                                      time(0) + 1,
+                                      nullptr);
+
+  std::string data;
+  ASSERT_EQ(Store::Status::OK,
+            default_impu.to_data(data, ImpuStore::ImpuFormat::V2));
+
+  // Truncating the service profile section doesn't stop the rest of the IMPU
+  // being read, but the service profile reads as empty.
+  data.resize(data.size() - 10);
+  ImpuStore::Impu* got_impu = ImpuStore::Impu::from_data(IMPU, data, 0, nullptr);
+  ASSERT_NE(nullptr, got_impu);
+  EXPECT_EQ(IMPIS, ((ImpuStore::DefaultImpu*)got_impu)->impis);
+  EXPECT_EQ("", ((ImpuStore::DefaultImpu*)got_impu)->service_profile.get());
+
+  // Writing it back out copies the corrupt section across as it was, rather
+  // than losing the profile
+  std::string rewritten;
+  ASSERT_EQ(Store::Status::OK,
+            got_impu->to_data(rewritten, ImpuStore::ImpuFormat::V2));
+  EXPECT_EQ(data, rewritten);
+
+  // But it can't be written in a format that needs the profile itself
+  std::string v1_data;
+  EXPECT_EQ(Store::Status::ERROR,
+            got_impu->to_data(v1_data, ImpuStore::ImpuFormat::V1));
+  delete got_impu;
+
+  // An unknown service profile codec fails the whole read
+  std::string bad_codec;
+  ASSERT_EQ(Store::Status::OK,
+            default_impu.to_data(bad_codec, ImpuStore::ImpuFormat::V2));
+  size_t offset = 5;
+  decode_varbyte(bad_codec, offset);
+  offset += decode_varbyte(bad_codec, offset);
+  bad_codec[offset] = (char)0x7f;
+  ASSERT_EQ(nullptr, ImpuStore::Impu::from_data(IMPU, bad_codec, 0, nullptr));
+}
+
+TEST_F(ImpuStoreTest, DecompressDataV2)
+{
+  ImpuStore::DefaultImpu default_impu(IMPU,
+                                      NO_ASSOCIATED_IMPUS,
+                                      IMPIS,
+                                      RegistrationState::REGISTERED,
+                                      NO_CHARGING_ADDRESSES,
+                                      large_service_profile(),
+                                      0L,
+                                      time(0) + 1,
+                                      nullptr);
+
+  std::string data;
+  ASSERT_EQ(Store::Status::OK,
+            default_impu.to_data(data, ImpuStore::ImpuFormat::V2));
+
+  // The decompressed record includes the service profile
+  std::string uncompressed;
+  ASSERT_TRUE(ImpuStore::Impu::decompress_data(data, uncompressed));
+  EXPECT_NE(std::string::npos, uncompressed.find(large_service_profile()));
+}
+
+class ImpuStoreVersion1Test : public ImpuStoreTest
+{
+  void SetUp()
+  {
+    data.push_back((char) 0);
+    data.push_back((char) 0);
+    data.push_back((char) 1);
+    data.push_back((char) 0);
+    data.push_back((char) ImpuCodec::LZ4);
+  }
+
+  void TearDown()
+  {
+    data.clear();
+  }
+
+  // Append the compressed form of the given binary record to the data
+  void add_record(const std::string& record)
+  {
+    encode_varbyte(record.size(), data);
+    ImpuStore::Impu::compress_data_v0(record, data);
+  }
+
+  std::string data;
+};
+
+TEST_F(ImpuStoreVersion1Test, UnknownExtendedVersion)
+{
+  data[2] = (char) 0x7f;
+  encode_varbyte(1, data);
+
+  ASSERT_EQ(nullptr, ImpuStore::Impu::from_data(IMPU, data, 0, nullptr));
+}
+
+TEST_F(ImpuStoreVersion1Test, NoLengthOrData)
+{
+  ASSERT_EQ(nullptr, ImpuStore::Impu::from_data(IMPU, data, 0, nullptr));
+}
+
+TEST_F(ImpuStoreVersion1Test, NoDictionary)
+{
+  data.pop_back();
+  data.pop_back();
+
+  ASSERT_EQ(nullptr, ImpuStore::Impu::from_data(IMPU, data, 0, nullptr));
+}
+
+TEST_F(ImpuStoreVersion1Test, UnknownDictionary)
+{
+  data[3] = (char) 0xfe;
+  add_record("A");
+
+  ASSERT_EQ(nullptr, ImpuStore::Impu::from_data(IMPU, data, 0, nullptr));
+}
+
+TEST_F(ImpuStoreVersion1Test, NoCodec)
+{
+  data.pop_back();
+
+  ASSERT_EQ(nullptr, ImpuStore::Impu::from_data(IMPU, data, 0, nullptr));
+}
+
+TEST_F(ImpuStoreVersion1Test, UnknownCodec)
+{
+  data[4] = (char) 0x7f;
+  add_record("A");
+
+  ASSERT_EQ(nullptr, ImpuStore::Impu::from_data(IMPU, data, 0, nullptr));
+}
+
+TEST_F(ImpuStoreVersion1Test, RawWrongLength)
+{
+  data[4] = (char) ImpuCodec::RAW;
+  encode_varbyte(10, data);
+  data.append("A");
+
+  ASSERT_EQ(nullptr, ImpuStore::Impu::from_data(IMPU, data, 0, nullptr));
+}
+
+TEST_F(ImpuStoreVersion1Test, InvalidDeflateData)
+{
+  data[4] = (char) ImpuCodec::DEFLATE;
+  encode_varbyte(10, data);
+  data.push_back((char) 0xFF);
+  data.push_back((char) 0xFF);
+
+  ASSERT_EQ(nullptr, ImpuStore::Impu::from_data(IMPU, data, 0, nullptr));
+}
+
+TEST_F(ImpuStoreVersion1Test, UnknownRecordType)
+{
+  add_record("X");
+
+  ASSERT_EQ(nullptr, ImpuStore::Impu::from_data(IMPU, data, 0, nullptr));
+}
+
+TEST_F(ImpuStoreVersion1Test, TruncatedRecord)
+{
+  // An associated IMPU whose default IMPU claims to be longer than the record
+  std::string record;
+  record.push_back('A');
+  record.push_back((char) 1);
+  record.push_back((char) 10);
+  record.append("sip:");
+  add_record(record);
+
+  ASSERT_EQ(nullptr, ImpuStore::Impu::from_data(IMPU, data, 0, nullptr));
+}
+
+TEST_F(ImpuStoreVersion1Test, TrailingData)
+{
+  std::string record;
+  record.push_back('A');
+  record.push_back((char) 1);
+  record.push_back((char) 4);
+  record.append("sip:");
+  record.push_back((char) 0);
+  add_record(record);
+
+  ASSERT_EQ(nullptr, ImpuStore::Impu::from_data(IMPU, data, 0, nullptr));
+}
+
+TEST_F(ImpuStoreVersion1Test, InvalidFrontCoding)
+{
+  // A default IMPU whose first associated IMPU claims to share a prefix with
+  // a (non-existent) previous entry
+  std::string record;
+  record.push_back('D');
+  record.push_back((char) 1);
+  record.push_back((char) 1);
+  record.push_back((char) 0);
+  record.push_back((char) 1);
+  record.push_back((char) 3);
+  record.push_back((char) 0);
+  // No IMPIs, ECFs or CCFs
+  for (int ii = 0; ii < 3; ii++)
+  {
+    record.push_back((char) 0);
+  }
+  add_record(record);
+
+  ASSERT_EQ(nullptr, ImpuStore::Impu::from_data(IMPU, data, 0, nullptr));
+}
+
+TEST_F(ImpuStoreVersion1Test, ImpiMappingWrongRecordType)
+{
+  std::string record;
+  record.push_back('A');
+  record.push_back((char) 1);
+  record.push_back((char) 4);
+  record.append("sip:");
+  add_record(record);
+
+  ASSERT_EQ(nullptr, ImpuStore::ImpiMapping::from_data(IMPI, data, 0));
+}
+
+TEST_F(ImpuStoreVersion1Test, ImpiMappingTrailingData)
+{
+  std::string record;
+  record.push_back('M');
+  record.push_back((char) 1);
+  record.push_back((char) 0);
+  record.push_back((char) 0);
+  add_record(record);
+
+  ASSERT_EQ(nullptr, ImpuStore::ImpiMapping::from_data(IMPI, data, 0));
+}
+
+TEST_F(ImpuStoreVersion1Test, ImpiMappingNotVersion1)
+{
+  data[2] = (char) 2;
+  add_record("M");
+
+  ASSERT_EQ(nullptr, ImpuStore::ImpiMapping::from_data(IMPI, data, 0));
+}
+
+// Dictionaries are shared by all ImpuStores, and can't be removed once loaded,
+// so these tests use the same contents for each ID throughout.
+static const std::string DICTIONARY_1 = "{\"expiry\":\"default_impu\":\"sip:assoc_impu";
+static const std::string DICTIONARY_2 = "<ServiceProfile></ServiceProfile>sip:impu@example.com";
+
+TEST_F(ImpuStoreTest, AddDictionary)
+{
+  // Dictionary 0 is built in
+  EXPECT_NE(nullptr, ImpuStore::get_dictionary(0));
+  EXPECT_FALSE(ImpuStore::add_dictionary(0, DICTIONARY_1));
+
+  // Dictionaries must have some contents, and no more than LZ4 can use
+  EXPECT_FALSE(ImpuStore::add_dictionary(1, ""));
+  EXPECT_FALSE(ImpuStore::add_dictionary(1, std::string(ImpuStore::MAX_DICTIONARY_LEN + 1, 'x')));
+
+  EXPECT_TRUE(ImpuStore::add_dictionary(1, DICTIONARY_1));
+  ASSERT_NE(nullptr, ImpuStore::get_dictionary(1));
+  EXPECT_EQ(DICTIONARY_1, *ImpuStore::get_dictionary(1));
+
+  // Adding the same dictionary again is harmless, but an ID can't be reused
+  // for a different dictionary
+  EXPECT_TRUE(ImpuStore::add_dictionary(1, DICTIONARY_1));
+  EXPECT_FALSE(ImpuStore::add_dictionary(1, DICTIONARY_2));
+  EXPECT_EQ(DICTIONARY_1, *ImpuStore::get_dictionary(1));
+
+  EXPECT_EQ(nullptr, ImpuStore::get_dictionary(0xfe));
+}
+
+TEST_F(ImpuStoreTest, LoadDictionaries)
+{
+  char dir_template[] = "/tmp/impu_store_test_XXXXXX";
+  std::string dir = mkdtemp(dir_template);
+
+  std::ofstream(ImpuStore::dictionary_file(dir, 2).c_str()) << DICTIONARY_2;
+
+  EXPECT_TRUE(ImpuStore::load_dictionaries(dir));
+  ASSERT_NE(nullptr, ImpuStore::get_dictionary(2));
+  EXPECT_EQ(DICTIONARY_2, *ImpuStore::get_dictionary(2));
+
+  // A dictionary that clashes with one already loaded fails the load
+  ASSERT_TRUE(ImpuStore::add_dictionary(1, DICTIONARY_1));
+  std::ofstream(ImpuStore::dictionary_file(dir, 1).c_str()) << DICTIONARY_2;
+
+  EXPECT_FALSE(ImpuStore::load_dictionaries(dir));
+  EXPECT_EQ(DICTIONARY_1, *ImpuStore::get_dictionary(1));
+
+  unlink(ImpuStore::dictionary_file(dir, 1).c_str());
+  unlink(ImpuStore::dictionary_file(dir, 2).c_str());
+  rmdir(dir.c_str());
+}
+
+TEST_F(ImpuStoreTest, ReadOldAndNewDictionaries)
+{
+  // Records written with an old dictionary must still be readable by a node
+  // that has moved on to a new one, as long as both are loaded.
+  ASSERT_TRUE(ImpuStore::add_dictionary(1, DICTIONARY_1));
+  ASSERT_TRUE(ImpuStore::add_dictionary(2, DICTIONARY_2));
+
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* old_store = new ImpuStore(local_store, ImpuStore::ImpuFormat::V1, 1);
+  ImpuStore* new_store = new ImpuStore(local_store, ImpuStore::ImpuFormat::V1, 2);
+
+  int expiry = time(0) + 1;
+
+  ImpuStore::AssociatedImpu* assoc_impu =
+    new ImpuStore::AssociatedImpu(ASSOC_IMPU,
+                                  IMPU,
+                                  0L,
+                                  expiry,
+                                  old_store);
+  old_store->set_impu(assoc_impu, 0);
+  delete assoc_impu;
+
+  ImpuStore::DefaultImpu* default_impu =
+    new ImpuStore::DefaultImpu(IMPU,
+                               { ASSOC_IMPU },
+                               IMPIS,
+                               RegistrationState::REGISTERED,
+                               NO_CHARGING_ADDRESSES,
+                               SERVICE_PROFILE,
+                               0L,
+                               expiry,
+                               new_store);
+  new_store->set_impu(default_impu, 0);
+  delete default_impu;
+
+  // The records are tagged with the dictionary that they were written with
+  std::string data;
+  uint64_t cas;
+  local_store->get_data("impu", ASSOC_IMPU, data, cas, 0);
+  ASSERT_LT(3, data.size());
+  EXPECT_EQ(1, data[3]);
+  local_store->get_data("impu", IMPU, data, cas, 0);
+  ASSERT_LT(3, data.size());
+  EXPECT_EQ(2, data[3]);
+
+  ImpuStore::Impu* got_impu = nullptr;
+  Store::Status status = new_store->get_impu(ASSOC_IMPU, got_impu, 0);
+
+  ASSERT_EQ(status, Store::Status::OK);
+  ASSERT_NE(nullptr, got_impu);
+  ASSERT_EQ(IMPU, ((ImpuStore::AssociatedImpu*)got_impu)->default_impu);
+  delete got_impu; got_impu = nullptr;
+
+  status = old_store->get_impu(IMPU, got_impu, 0);
+
+  ASSERT_EQ(status, Store::Status::OK);
+  ASSERT_NE(nullptr, got_impu);
+  ASSERT_EQ(SERVICE_PROFILE,
+            ((ImpuStore::DefaultImpu*)got_impu)->service_profile.get());
+  delete got_impu;
+
+  delete new_store;
+  delete old_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, CodecPolicy)
+{
+  // By default, everything is LZ4 compressed
+  ImpuStore::CodecPolicy default_policy;
+  EXPECT_EQ(ImpuCodec::LZ4, default_policy.select_codec(1));
+  EXPECT_EQ(ImpuCodec::LZ4, default_policy.select_codec(100000));
+
+  ImpuStore::CodecPolicy policy(100, 1000);
+  EXPECT_EQ(ImpuCodec::RAW, policy.select_codec(1));
+  EXPECT_EQ(ImpuCodec::RAW, policy.select_codec(100));
+  EXPECT_EQ(ImpuCodec::LZ4, policy.select_codec(101));
+  EXPECT_EQ(ImpuCodec::LZ4, policy.select_codec(999));
+  EXPECT_EQ(ImpuCodec::DEFLATE, policy.select_codec(1000));
+}
+
+// Write the given IMPU with a version 1 store using the given policy, check
+// that it was written with the expected codec, and read it back.
+static ImpuStore::Impu* write_and_read(ImpuStore::Impu* impu,
+                                       const ImpuStore::CodecPolicy& policy,
+                                       uint8_t dictionary_id,
+                                       ImpuCodec::Id expected_codec)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = new ImpuStore(local_store,
+                                        ImpuStore::ImpuFormat::V1,
+                                        dictionary_id,
+                                        policy);
+
+  EXPECT_EQ(Store::Status::OK, impu_store->set_impu(impu, 0));
+
+  std::string data;
+  uint64_t cas;
+  local_store->get_data("impu", impu->impu, data, cas, 0);
+  EXPECT_LT(4, data.size());
+  EXPECT_EQ(expected_codec, data[4]);
+
+  ImpuStore::Impu* got_impu = nullptr;
+  EXPECT_EQ(Store::Status::OK, impu_store->get_impu(impu->impu, got_impu, 0));
+
+  delete impu_store;
+  delete local_store;
+
+  return got_impu;
+}
+
+TEST_F(ImpuStoreTest, RawSmallImpu)
+{
+  ImpuStore::AssociatedImpu assoc_impu(ASSOC_IMPU, IMPU, 0L, time(0) + 1, nullptr);
+
+  ImpuStore::Impu* got_impu = write_and_read(&assoc_impu,
+                                             ImpuStore::CodecPolicy(1000, 0),
+                                             0,
+                                             ImpuCodec::RAW);
+
+  ASSERT_NE(nullptr, got_impu);
+  EXPECT_EQ(IMPU, ((ImpuStore::AssociatedImpu*)got_impu)->default_impu);
+  delete got_impu;
+}
+
+TEST_F(ImpuStoreTest, IncompressibleImpuStoredRaw)
+{
+  // Even when LZ4 is chosen, a record that doesn't shrink is stored raw
+  ImpuStore::AssociatedImpu assoc_impu(ASSOC_IMPU, IMPU, 0L, time(0) + 1, nullptr);
+
+  ImpuStore::Impu* got_impu = write_and_read(&assoc_impu,
+                                             ImpuStore::CodecPolicy(),
+                                             0,
+                                             ImpuCodec::RAW);
+
+  ASSERT_NE(nullptr, got_impu);
+  EXPECT_EQ(IMPU, ((ImpuStore::AssociatedImpu*)got_impu)->default_impu);
+  delete got_impu;
+}
+
+TEST_F(ImpuStoreTest, LargeImpus)
+{
+  std::string service_profile = "<ServiceProfile>";
+
+  for (int ii = 0; ii < 50; ii++)
+  {
+    service_profile += "<InitialFilterCriteria><Priority>" +
+                       std::to_string(ii) +
+                       "</Priority></InitialFilterCriteria>";
+  }
+
+  service_profile += "</ServiceProfile>";
+
+  ImpuStore::DefaultImpu default_impu(IMPU,
+                                      { ASSOC_IMPU },
+                                      IMPIS,
+                                      RegistrationState::REGISTERED,
+                                      NO_CHARGING_ADDRESSES,
+                                      service_profile,
+                                      0L,
+                                      time(0) + 1,
+                                      nullptr);
+
+  // Large records are LZ4 compressed by default, and deflated if the policy
+  // says so, with either the built in or a trained dictionary.
+  ASSERT_TRUE(ImpuStore::add_dictionary(1, DICTIONARY_1));
+
+  std::vector<std::pair<ImpuStore::CodecPolicy, ImpuCodec::Id>> cases =
+    { { ImpuStore::CodecPolicy(), ImpuCodec::LZ4 },
+      { ImpuStore::CodecPolicy(100, 1000), ImpuCodec::DEFLATE } };
+
+  for (const std::pair<ImpuStore::CodecPolicy, ImpuCodec::Id>& c : cases)
+  {
+    for (uint8_t dictionary_id : { 0, 1 })
+    {
+      ImpuStore::Impu* got_impu = write_and_read(&default_impu,
+                                                 c.first,
+                                                 dictionary_id,
+                                                 c.second);
+
+      ASSERT_NE(nullptr, got_impu);
+      EXPECT_EQ(service_profile,
+                ((ImpuStore::DefaultImpu*)got_impu)->service_profile.get());
+      delete got_impu;
+    }
+  }
+}
+
+TEST_F(ImpuStoreTest, SteadyStateCodecDoesNotAllocate)
+{
+  std::string service_profile = "<ServiceProfile>";
+
+  for (int ii = 0; ii < 20; ii++)
+  {
+    service_profile += "<InitialFilterCriteria><Priority>" +
+                       std::to_string(ii) +
+                       "</Priority></InitialFilterCriteria>";
+  }
+
+  service_profile += "</ServiceProfile>";
+
+  ImpuStore::DefaultImpu default_impu(IMPU,
+                                      { ASSOC_IMPU, "tel:+1234567890" },
+                                      IMPIS,
+                                      RegistrationState::REGISTERED,
+                                      ChargingAddresses({ "ccf1" }, { "ecf1" }),
+                                      service_profile,
+                                      0L,
+                                      time(0) + 1,
+                                      nullptr);
+
+  std::vector<std::pair<ImpuStore::ImpuFormat, ImpuStore::CodecPolicy>> cases =
+    { { ImpuStore::ImpuFormat::V0, ImpuStore::CodecPolicy() },
+      { ImpuStore::ImpuFormat::V1, ImpuStore::CodecPolicy() },
+      { ImpuStore::ImpuFormat::V1, ImpuStore::CodecPolicy(0, 1) },
+      { ImpuStore::ImpuFormat::V1, ImpuStore::CodecPolicy(100000, 0) } };
+
+  for (const std::pair<ImpuStore::ImpuFormat, ImpuStore::CodecPolicy>& c : cases)
+  {
+    std::string data;
+    std::string uncompressed;
+
+    // The first time round grows the per-thread arenas and streams, and the
+    // caller's buffers. After that, encoding and decoding must not allocate.
+    for (int ii = 0; ii < 2; ii++)
+    {
+      data.clear();
+
+      AllocationCounter counter;
+      ASSERT_EQ(Store::Status::OK,
+                default_impu.to_data(data, c.first, 0, c.second));
+      ASSERT_TRUE(ImpuStore::Impu::decompress_data(data, uncompressed));
+
+      if (ii > 0)
+      {
+        EXPECT_EQ(0, counter.count());
+      }
+    }
+  }
+}
+
+// JSON records that the SAX and DOM decode paths must treat identically,
+// covering valid records, repeated members, members of the wrong type, nested
+// values, and JSON that isn't a valid object.
+static const std::vector<std::string> JSON_PARITY_CORPUS = {
+  "{\"registration_state\":true,\"service_profile\":\"<xml/>\",\"expiry\":300,"
+    "\"assoc_impu\":[\"sip:a@example.com\",\"sip:b@example.com\"],"
+    "\"impis\":[\"impi@example.com\"],\"ccfs\":[\"ccf1\",\"ccf2\"],"
+    "\"ecfs\":[\"ecf1\"]}",
+  "{\"registration_state\":false}",
+  "{\"default_impu\":\"sip:impu@example.com\",\"expiry\":300}",
+  "{\"default_impu\":5,\"expiry\":300}",
+  "{\"default_impu\":null}",
+  "{\"registration_state\":true,\"expiry\":1,\"expiry\":2,"
+    "\"impis\":[\"a\"],\"impis\":[\"b\"],\"service_profile\":\"x\","
+    "\"service_profile\":\"y\"}",
+  "{\"registration_state\":true,\"expiry\":\"300\",\"service_profile\":7,"
+    "\"impis\":\"impi\",\"ccfs\":{\"ccf\":\"ccf1\"}}",
+  "{\"registration_state\":true,\"expiry\":1.5}",
+  "{\"registration_state\":true,\"expiry\":-10}",
+  "{\"registration_state\":true,\"expiry\":4294967296}",
+  "{\"registration_state\":true,\"expiry\":18446744073709551615}",
+  "{\"registration_state\":true,\"impis\":[\"a\",1,[\"b\"],{\"c\":\"d\"},\"e\"],"
+    "\"extra\":{\"expiry\":5,\"impis\":[\"f\"],\"default_impu\":\"g\"}}",
+  "{\"registration_state\":true,\"expiry\":5,\"extra\":[[\"impis\"],{}]}",
+  "{\"registration_state\":true,\"default_impus\":[\"sip:impu@example.com\","
+    "\"sip:other@example.com\"],\"expiry\":60}",
+  "{\"registration_state\":true,\"service_profile\":\"a\\\"b\\\\c\\u0041\"}",
+  "{\"default_impus\":[\"sip:impu@example.com\"],\"expiry\":60}",
+  "{}",
+  "[]",
+  "[{\"registration_state\":true}]",
+  "\"string\"",
+  "5",
+  "",
+  "{",
+  "{\"registration_state\":true,\"impis\":[\"a\"",
+  "{\"registration_state\":true}}",
+};
+
+// Decode an IMPU with the DOM path. This returns nullptr if the JSON is
+// invalid, or if from_json throws because it doesn't like it.
+static ImpuStore::Impu* dom_impu_from_json(const std::string& json)
+{
+  rapidjson::Document doc;
+  doc.Parse<0>(json.c_str());
+
+  if (doc.HasParseError() || !doc.IsObject())
+  {
+    return nullptr;
+  }
+
+  try
+  {
+    if (doc.HasMember("default_impu"))
+    {
+      return ImpuStore::AssociatedImpu::from_json(IMPU, doc, 0L, nullptr);
+    }
+    else
+    {
+      return ImpuStore::DefaultImpu::from_json(IMPU, doc, 0L, nullptr);
+    }
+  }
+  catch (JsonFormatError err)
+  {
+    return nullptr;
+  }
+}
+
+static ImpuStore::ImpiMapping* dom_mapping_from_json(const std::string& json)
+{
+  rapidjson::Document doc;
+  doc.Parse<0>(json.c_str());
+
+  if (doc.HasParseError() || !doc.IsObject())
+  {
+    return nullptr;
+  }
+
+  return ImpuStore::ImpiMapping::from_json(IMPI, doc, 0L);
+}
+
+TEST_F(ImpuStoreTest, SaxMatchesDomImpu)
+{
+  for (const std::string& json : JSON_PARITY_CORPUS)
+  {
+    SCOPED_TRACE(json);
+    ImpuStore::Impu* dom = dom_impu_from_json(json);
+    ImpuStore::Impu* sax = ImpuStore::Impu::from_json(IMPU, json, 0L, nullptr);
+
+    ASSERT_EQ(dom == nullptr, sax == nullptr);
+
+    if (dom != nullptr)
+    {
+      ASSERT_EQ(dom->is_default_impu(), sax->is_default_impu());
+      EXPECT_EQ(dom->expiry, sax->expiry);
+
+      if (dom->is_default_impu())
+      {
+        ImpuStore::DefaultImpu* dom_default = (ImpuStore::DefaultImpu*)dom;
+        ImpuStore::DefaultImpu* sax_default = (ImpuStore::DefaultImpu*)sax;
+        EXPECT_EQ(dom_default->registration_state,
+                  sax_default->registration_state);
+        EXPECT_EQ(dom_default->service_profile.get(),
+                  sax_default->service_profile.get());
+        EXPECT_EQ(dom_default->associated_impus,
+                  sax_default->associated_impus);
+        EXPECT_EQ(dom_default->impis, sax_default->impis);
+        EXPECT_EQ(dom_default->charging_addresses,
+                  sax_default->charging_addresses);
+      }
+      else
+      {
+        EXPECT_EQ(((ImpuStore::AssociatedImpu*)dom)->default_impu,
+                  ((ImpuStore::AssociatedImpu*)sax)->default_impu);
+      }
+    }
+
+    delete dom;
+    delete sax;
+  }
+}
+
+TEST_F(ImpuStoreTest, SaxMatchesDomImpiMapping)
+{
+  for (const std::string& json : JSON_PARITY_CORPUS)
+  {
+    SCOPED_TRACE(json);
+    ImpuStore::ImpiMapping* dom = dom_mapping_from_json(json);
+    ImpuStore::ImpiMapping* sax = ImpuStore::ImpiMapping::from_data(IMPI,
+                                                                    json,
+                                                                    0L);
+
+    ASSERT_EQ(dom == nullptr, sax == nullptr);
+
+    if (dom != nullptr)
+    {
+      EXPECT_EQ(dom->get_expiry(), sax->get_expiry());
+      EXPECT_EQ(dom->get_default_impus(), sax->get_default_impus());
+    }
+
+    delete dom;
+    delete sax;
+  }
+}
+
+TEST_F(ImpuStoreTest, SaxDefaultImpuWithoutRegistrationState)
+{
+  // The DOM path throws for this, so it isn't in the parity corpus
+  ASSERT_EQ(nullptr,
+            ImpuStore::Impu::from_json(IMPU,
+                                       "{\"registration_state\":\"true\"}",
+                                       0L,
+                                       nullptr));
+  ASSERT_EQ(nullptr,
+            ImpuStore::Impu::from_json(IMPU,
+                                       "{\"expiry\":300}",
+                                       0L,
+                                       nullptr));
+}
+
+TEST_F(ImpuStoreTest, ImpiMappingInvalidJson)
+{
+  ASSERT_EQ(nullptr,
+            ImpuStore::ImpiMapping::from_data(IMPI,
+                                              INVALID_JSON,
+                                              0L));
+}
+
+TEST_F(ImpuStoreTest, ImpiMappingNotJsonObject)
+{
+  ASSERT_EQ(nullptr,
+            ImpuStore::ImpiMapping::from_data(IMPI,
+                                              JSON_ARRAY,
+                                              0L));
+}
+
+TEST_F(ImpuStoreTest, ImpuNotFound)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = new ImpuStore(local_store);
+
+  ImpuStore::Impu* got_impu = nullptr;
+  Store::Status status = impu_store->get_impu(IMPU, got_impu, 0L);
+  ASSERT_EQ(status, Store::Status::NOT_FOUND);
+  ASSERT_EQ(nullptr, got_impu);
+
+  delete impu_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, ImpiMappingNotFound)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = new ImpuStore(local_store);
+
+  ImpuStore::ImpiMapping* mapping = nullptr;
+  Store::Status status = impu_store->get_impi_mapping(IMPI, mapping, 0L);
+  ASSERT_EQ(nullptr, mapping);
+  ASSERT_EQ(status, Store::Status::NOT_FOUND);
+
+  delete impu_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, ImpiMappingBadJson)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = new ImpuStore(local_store);
+  local_store->set_data("impi_mapping",
+                        IMPI,
+                        INVALID_JSON,
+                        0,
+                        1,
+                        0L);
+
+  ImpuStore::ImpiMapping* mapping = nullptr;
+  Store::Status status = impu_store->get_impi_mapping(IMPI, mapping, 0L);
+  ASSERT_EQ(nullptr, mapping);
+  ASSERT_EQ(status, Store::Status::ERROR);
+
+  delete impu_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, GetImpus)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = new ImpuStore(local_store);
+
+  int expiry = time(0) + 1;
+
+  ImpuStore::AssociatedImpu* assoc_impu =
+    new ImpuStore::AssociatedImpu(ASSOC_IMPU,
+                                  IMPU,
+                                  0L,
+                                  expiry,
+                                  impu_store);
+
+  ASSERT_EQ(Store::Status::OK,
+            impu_store->set_impu_without_cas(assoc_impu, 0));
+
+  // IMPUs that aren't found are left out, and duplicates are only read once
+  std::map<std::string, ImpuStore::Impu*> impus;
+  Store::Status status = impu_store->get_impus({ ASSOC_IMPU, IMPU, ASSOC_IMPU },
+                                               impus,
+                                               0L);
+  ASSERT_EQ(Store::Status::OK, status);
+  ASSERT_EQ(1u, impus.size());
+  ASSERT_EQ(ASSOC_IMPU, impus[ASSOC_IMPU]->impu);
+  ASSERT_FALSE(impus[ASSOC_IMPU]->is_default_impu());
+
+  delete impus[ASSOC_IMPU];
+  delete assoc_impu;
+  delete impu_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, GetImpiMappings)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = new ImpuStore(local_store);
+
+  int expiry = time(0) + 1;
+
+  ImpuStore::ImpiMapping* mapping =
+    new ImpuStore::ImpiMapping(IMPI,
+                               IMPUS,
+                               0L,
+                               expiry);
+
+  ASSERT_EQ(Store::Status::OK,
+            impu_store->set_impi_mapping(mapping, 0));
+
+  std::map<std::string, ImpuStore::ImpiMapping*> mappings;
+  Store::Status status = impu_store->get_impi_mappings({ "other@example.com", IMPI },
+                                                       mappings,
+                                                       0L);
+  ASSERT_EQ(Store::Status::OK, status);
+  ASSERT_EQ(1u, mappings.size());
+  ASSERT_EQ(IMPUS, mappings[IMPI]->get_default_impus());
+
+  delete mappings[IMPI];
+  delete mapping;
+  delete impu_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, GetImpiMappingsBadJson)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = new ImpuStore(local_store);
+  local_store->set_data("impi_mapping",
+                        IMPI,
+                        INVALID_JSON,
+                        0,
+                        1,
+                        0L);
+
+  ImpuStore::ImpiMapping* mapping =
+    new ImpuStore::ImpiMapping("other@example.com",
+                               IMPUS,
+                               0L,
+                               time(0) + 1);
+
+  ASSERT_EQ(Store::Status::OK,
+            impu_store->set_impi_mapping(mapping, 0));
+
+  // The error is returned, but the mappings that were read are still there
+  std::map<std::string, ImpuStore::ImpiMapping*> mappings;
+  Store::Status status = impu_store->get_impi_mappings({ IMPI, "other@example.com" },
+                                                       mappings,
+                                                       0L);
+  ASSERT_EQ(Store::Status::ERROR, status);
+  ASSERT_EQ(1u, mappings.size());
+  ASSERT_EQ(1u, mappings.count("other@example.com"));
+
+  delete mappings["other@example.com"];
+  delete mapping;
+  delete impu_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, ImpuSetWithoutCas)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = new ImpuStore(local_store);
+
+  int expiry = time(0) + 1;
+
+  ImpuStore::AssociatedImpu* assoc_impu =
+    new ImpuStore::AssociatedImpu(ASSOC_IMPU,
+                                  IMPU,
+                                  0L,
+                                  expiry,
+                                  impu_store);
+
+  ASSERT_EQ(Store::Status::OK,
+            impu_store->set_impu_without_cas(assoc_impu, 0));
+
+  delete assoc_impu;
+  delete impu_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, SetAndDeleteImpus)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = new ImpuStore(local_store);
+
+  int expiry = time(0) + 1;
+  std::vector<std::string> keys;
+  std::vector<ImpuStore::Impu*> impus;
+
+  for (int ii = 0; ii < 3; ii++)
+  {
+    keys.push_back("sip:assoc_impu" + std::to_string(ii) + "@example.com");
+    impus.push_back(new ImpuStore::AssociatedImpu(keys.back(),
+                                                  IMPU,
+                                                  0L,
+                                                  expiry,
+                                                  impu_store));
+  }
+
+  std::map<std::string, Store::Status> statuses;
+  ASSERT_EQ(Store::Status::OK,
+            impu_store->set_impus_without_cas(impus, 0, statuses));
+  ASSERT_EQ(3u, statuses.size());
+  EXPECT_EQ(Store::Status::OK, statuses[keys[1]]);
+
+  std::map<std::string, ImpuStore::Impu*> got_impus;
+  impu_store->get_impus(keys, got_impus, 0L);
+  ASSERT_EQ(3u, got_impus.size());
+
+  for (std::pair<const std::string, ImpuStore::Impu*>& entry : got_impus)
+  {
+    delete entry.second;
+  }
+
+  // Delete two of them
+  statuses.clear();
+  ASSERT_EQ(Store::Status::OK,
+            impu_store->delete_impus({ impus[0], impus[2] }, 0, statuses));
+  ASSERT_EQ(2u, statuses.size());
+
+  got_impus.clear();
+  impu_store->get_impus(keys, got_impus, 0L);
+  ASSERT_EQ(1u, got_impus.size());
+  ASSERT_EQ(1u, got_impus.count(keys[1]));
+
+  delete got_impus[keys[1]];
+
+  for (ImpuStore::Impu* impu : impus)
+  {
+    delete impu;
+  }
+
+  delete impu_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, TouchImpus)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = new ImpuStore(local_store);
+
+  ImpuStore::AssociatedImpu* assoc_impu =
+    new ImpuStore::AssociatedImpu(ASSOC_IMPU,
+                                  IMPU,
+                                  0L,
+                                  time(0) + 1,
+                                  impu_store);
+
+  ASSERT_EQ(Store::Status::OK,
+            impu_store->set_impu_without_cas(assoc_impu, 0));
+
+  // Extending the lifetime also updates the expiry held in the record
+  int64_t expiry = time(0) + 100;
+  ImpuStore::AssociatedImpu* refreshed_impu =
+    new ImpuStore::AssociatedImpu(ASSOC_IMPU,
+                                  IMPU,
+                                  0L,
+                                  expiry,
+                                  impu_store);
+
+  std::map<std::string, Store::Status> statuses;
+  ASSERT_EQ(Store::Status::OK,
+            impu_store->touch_impus({ refreshed_impu }, 0, statuses));
+  EXPECT_EQ(Store::Status::OK, statuses[ASSOC_IMPU]);
+
+  ImpuStore::Impu* got_impu = nullptr;
+  ASSERT_EQ(Store::Status::OK, impu_store->get_impu(ASSOC_IMPU, got_impu, 0L));
+  EXPECT_EQ(expiry, got_impu->expiry);
+
+  delete got_impu;
+  delete refreshed_impu;
+  delete assoc_impu;
+  delete impu_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, TouchImpusSharesRecord)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = new ImpuStore(local_store,
+                                        ImpuStore::ImpuFormat::V1);
+
+  // Associated IMPUs of the same Default IMPU, and one of another
+  int64_t expiry = time(0) + 100;
+  ImpuStore::AssociatedImpu assoc_impu(ASSOC_IMPU, IMPU, 0L, expiry, impu_store);
+  ImpuStore::AssociatedImpu assoc_impu_2(ASSOC_IMPU_2, IMPU, 0L, expiry, impu_store);
+  ImpuStore::AssociatedImpu other_impu(ASSOC_IMPU_3, IMPU_2, 0L, expiry, impu_store);
+
+  std::map<std::string, Store::Status> statuses;
+  ASSERT_EQ(Store::Status::OK,
+            impu_store->touch_impus({ &assoc_impu, &assoc_impu_2, &other_impu },
+                                    0,
+                                    statuses));
+
+  // Each IMPU has its own record, as if written separately
+  for (ImpuStore::AssociatedImpu* impu : { &assoc_impu, &assoc_impu_2, &other_impu })
+  {
+    std::string expected;
+    ASSERT_EQ(Store::Status::OK,
+              impu->to_data(expected, ImpuStore::ImpuFormat::V1));
+
+    std::string data;
+    uint64_t cas;
+    ASSERT_EQ(Store::Status::OK,
+              local_store->get_data("impu", impu->impu, data, cas, 0));
+    EXPECT_EQ(expected, data);
+    EXPECT_EQ(Store::Status::OK, statuses[impu->impu]);
+  }
+
+  delete impu_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, DeleteImpu)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = new ImpuStore(local_store);
+
+  int expiry = time(0) + 1;
+
+  ImpuStore::AssociatedImpu* assoc_impu =
+    new ImpuStore::AssociatedImpu(ASSOC_IMPU,
+                                  IMPU,
+                                  0L,
+                                  expiry,
+                                  impu_store);
+
+  ASSERT_EQ(Store::Status::OK,
+            impu_store->delete_impu(assoc_impu, 0));
+
+  delete assoc_impu;
+  delete impu_store;
+  delete local_store;
+}
+
+// Create a store that shares service profiles
+static ImpuStore* shared_profile_store(LocalStore* local_store,
+                                       ImpuStore::ImpuFormat format = ImpuStore::ImpuFormat::V1)
+{
+  return new ImpuStore(local_store,
+                       format,
+                       0,
+                       ImpuStore::CodecPolicy(),
+                       true);
+}
+
+static ImpuStore::DefaultImpu* impu_with_profile(const std::string& impu,
+                                                 const std::string& service_profile)
+{
+  return new ImpuStore::DefaultImpu(impu,
+                                    NO_ASSOCIATED_IMPUS,
+                                    IMPIS,
+                                    RegistrationState::REGISTERED,
+                                    NO_CHARGING_ADDRESSES,
+                                    service_profile,
+                                    0L,
+                                    time(0) + 1,
+                                    nullptr);
+}
+
+TEST_F(ImpuStoreTest, SharedServiceProfile)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = shared_profile_store(local_store);
+  std::string service_profile = large_service_profile();
+  std::string reference = ImpuStore::shared_profile_reference(service_profile);
+
+  ImpuStore::DefaultImpu* default_impu = impu_with_profile(IMPU, service_profile);
+  ASSERT_EQ(Store::Status::OK, impu_store->set_impu_without_cas(default_impu, 0));
+  delete default_impu;
+
+  // The profile is stored under its reference, and the IMPU only holds the
+  // reference.
+  std::string data;
+  uint64_t cas;
+  ASSERT_EQ(Store::Status::OK,
+            local_store->get_data("service_profile", reference, data, cas, 0));
+  ASSERT_EQ(Store::Status::OK,
+            local_store->get_data("impu", IMPU, data, cas, 0));
+  std::string uncompressed;
+  ASSERT_TRUE(ImpuStore::Impu::decompress_data(data, uncompressed));
+  EXPECT_EQ(std::string::npos, uncompressed.find(service_profile));
+  EXPECT_NE(std::string::npos, uncompressed.find(reference));
+
+  ImpuStore::Impu* got_impu = nullptr;
+  ASSERT_EQ(Store::Status::OK, impu_store->get_impu(IMPU, got_impu, 0));
+  ASSERT_TRUE(got_impu->is_default_impu());
+  ImpuStore::DefaultImpu* got_default_impu = (ImpuStore::DefaultImpu*)got_impu;
+  EXPECT_EQ(reference, got_default_impu->service_profile.reference());
+  EXPECT_EQ(service_profile, got_default_impu->service_profile.get());
+  EXPECT_EQ(IMPIS, got_default_impu->impis);
+
+  delete got_impu;
+  delete impu_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, SharedServiceProfileV2)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = shared_profile_store(local_store,
+                                               ImpuStore::ImpuFormat::V2);
+  std::string service_profile = large_service_profile();
+
+  ImpuStore::DefaultImpu* default_impu = impu_with_profile(IMPU, service_profile);
+  ASSERT_EQ(Store::Status::OK, impu_store->set_impu_without_cas(default_impu, 0));
+  delete default_impu;
+
+  // Another store reads the profile from the store rather than its cache
+  ImpuStore* other_store = shared_profile_store(local_store,
+                                                ImpuStore::ImpuFormat::V2);
+  ImpuStore::Impu* got_impu = nullptr;
+  ASSERT_EQ(Store::Status::OK, other_store->get_impu(IMPU, got_impu, 0));
+  EXPECT_EQ(service_profile,
+            ((ImpuStore::DefaultImpu*)got_impu)->service_profile.get());
+
+  delete got_impu;
+  delete other_store;
+  delete impu_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, SharedServiceProfileWrittenOnce)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = shared_profile_store(local_store);
+  std::string service_profile = large_service_profile();
+  std::string reference = ImpuStore::shared_profile_reference(service_profile);
+
+  ImpuStore::DefaultImpu* default_impu = impu_with_profile(IMPU, service_profile);
+  ASSERT_EQ(Store::Status::OK, impu_store->set_impu_without_cas(default_impu, 0));
+  delete default_impu;
+
+  // Remove the profile from the store. Writing another IMPU with the same
+  // profile doesn't rewrite it, as the store knows it was written with a
+  // lease that outlives the IMPU.
+  local_store->delete_data("service_profile", reference, 0);
+
+  default_impu = impu_with_profile(ASSOC_IMPU, service_profile);
+  ASSERT_EQ(Store::Status::OK, impu_store->set_impu_without_cas(default_impu, 0));
+  delete default_impu;
+
+  std::string data;
+  uint64_t cas;
+  ASSERT_EQ(Store::Status::NOT_FOUND,
+            local_store->get_data("service_profile", reference, data, cas, 0));
+
+  // Reading an IMPU whose profile has gone (through another store, so its
+  // cache doesn't have the profile) finds nothing, and expires the IMPU.
+  ImpuStore* other_store = shared_profile_store(local_store);
+  ImpuStore::Impu* got_impu = nullptr;
+  ASSERT_EQ(Store::Status::NOT_FOUND, other_store->get_impu(IMPU, got_impu, 0));
+  ASSERT_EQ(nullptr, got_impu);
+  ASSERT_EQ(Store::Status::NOT_FOUND,
+            local_store->get_data("impu", IMPU, data, cas, 0));
+
+  delete other_store;
+  delete impu_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, SmallServiceProfileNotShared)
+{
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* impu_store = shared_profile_store(local_store);
+
+  ImpuStore::DefaultImpu* default_impu = impu_with_profile(IMPU, SERVICE_PROFILE);
+  ASSERT_EQ(Store::Status::OK, impu_store->set_impu_without_cas(default_impu, 0));
+  EXPECT_FALSE(default_impu->service_profile.is_shared());
+  delete default_impu;
+
+  ImpuStore::Impu* got_impu = nullptr;
+  ASSERT_EQ(Store::Status::OK, impu_store->get_impu(IMPU, got_impu, 0));
+  EXPECT_FALSE(((ImpuStore::DefaultImpu*)got_impu)->service_profile.is_shared());
+  EXPECT_EQ(SERVICE_PROFILE,
+            ((ImpuStore::DefaultImpu*)got_impu)->service_profile.get());
+
+  delete got_impu;
+  delete impu_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, SharedServiceProfileReadWithoutSharing)
+{
+  // A store that doesn't share profiles can still read IMPUs that do, and
+  // writes them back with their own copy.
+  LocalStore* local_store = new LocalStore();
+  ImpuStore* sharing_store = shared_profile_store(local_store);
+  ImpuStore* impu_store = new ImpuStore(local_store, ImpuStore::ImpuFormat::V1);
+  std::string service_profile = large_service_profile();
+
+  ImpuStore::DefaultImpu* default_impu = impu_with_profile(IMPU, service_profile);
+  ASSERT_EQ(Store::Status::OK, sharing_store->set_impu_without_cas(default_impu, 0));
+  delete default_impu;
+
+  ImpuStore::Impu* got_impu = nullptr;
+  ASSERT_EQ(Store::Status::OK, impu_store->get_impu(IMPU, got_impu, 0));
+  EXPECT_EQ(service_profile,
+            ((ImpuStore::DefaultImpu*)got_impu)->service_profile.get());
+
+  ASSERT_EQ(Store::Status::OK, impu_store->set_impu(got_impu, 0));
+  EXPECT_FALSE(((ImpuStore::DefaultImpu*)got_impu)->service_profile.is_shared());
+  delete got_impu;
+
+  std::string data;
+  uint64_t cas;
+  ASSERT_EQ(Store::Status::OK,
+            local_store->get_data("impu", IMPU, data, cas, 0));
+  std::string uncompressed;
+  ASSERT_TRUE(ImpuStore::Impu::decompress_data(data, uncompressed));
+  EXPECT_NE(std::string::npos, uncompressed.find(service_profile));
+
+  delete impu_store;
+  delete sharing_store;
+  delete local_store;
+}
+
+TEST_F(ImpuStoreTest, SharedProfileCache)
+{
+  SharedProfileCache cache(2);
+  std::string profile;
+
+  EXPECT_FALSE(cache.get("a", profile));
+  EXPECT_EQ(0, cache.lease_expiry("a"));
+
+  cache.put("a", "profile a", 100);
+  cache.put("b", "profile b", 0);
+  ASSERT_TRUE(cache.get("a", profile));
+  EXPECT_EQ("profile a", profile);
+
+  // Leases are only ever extended
+  cache.put("a", "profile a", 50);
+  EXPECT_EQ(100, cache.lease_expiry("a"));
+  cache.put("a", "profile a", 200);
+  EXPECT_EQ(200, cache.lease_expiry("a"));
+
+  // Adding a third profile evicts the least recently used one
+  cache.put("c", "profile c", 0);
+  EXPECT_EQ(2u, cache.size());
+  EXPECT_FALSE(cache.get("b", profile));
+  EXPECT_TRUE(cache.get("a", profile));
+  EXPECT_TRUE(cache.get("c", profile));
+
+  cache.remove("a");
+  EXPECT_FALSE(cache.get("a", profile));
+  EXPECT_EQ(1u, cache.size());
+}
@@ -0,0 +1,179 @@
+/**
+ * @file irs_cache_test.cpp UT for the in-memory IRS cache
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "irs_cache.h"
+#include "test_interposer.hpp"
+#include "test_utils.hpp"
+#include "fakelogger.h"
+#include "gtest/gtest.h"
+
+static const std::string IMPU = "sip:impu@example.com";
+static const std::string ASSOC_IMPU = "sip:assoc_impu@example.com";
+static const std::string IMPU_2 = "sip:impu2@example.com";
+static const std::vector<std::string> ASSOC_IMPUS = { ASSOC_IMPU };
+static const std::vector<std::string> NO_IMPIS = {};
+static const ChargingAddresses NO_CHARGING_ADDRESSES = ChargingAddresses({}, {});
+static const std::string SERVICE_PROFILE = "<ServiceProfile></ServiceProfile>";
+
+// A table that counts what it's told, so tests can check it
+class CountingCounterTable : public SNMP::CounterTable
+{
+public:
+  void increment() { count++; }
+  uint64_t count = 0;
+};
+
+class IrsCacheTest : public ControlTimeTest
+{
+public:
+  // Create a Default IMPU that expires well after anything in these tests
+  static ImpuStore::DefaultImpu* default_impu(const std::string& impu,
+                                              uint64_t cas = 0L)
+  {
+    return new ImpuStore::DefaultImpu(impu,
+                                      ASSOC_IMPUS,
+                                      NO_IMPIS,
+                                      RegistrationState::REGISTERED,
+                                      NO_CHARGING_ADDRESSES,
+                                      SERVICE_PROFILE,
+                                      cas,
+                                      time(0) + 3600,
+                                      nullptr);
+  }
+};
+
+TEST_F(IrsCacheTest, HitAndMiss)
+{
+  IrsCache cache(100, 1000);
+  uint64_t ticket;
+
+  EXPECT_EQ(nullptr, cache.get(IMPU, ticket));
+
+  ImpuStore::DefaultImpu* impu = default_impu(IMPU, 5L);
+  cache.add(IMPU, impu, ticket);
+  cache.add(ASSOC_IMPU, impu, ticket);
+  delete impu;
+
+  // The snapshot is a copy, with the CAS it was read with
+  IrsCache::Snapshot snapshot = cache.get(ASSOC_IMPU, ticket);
+  ASSERT_NE(nullptr, snapshot);
+  EXPECT_EQ(IMPU, snapshot->impu);
+  EXPECT_EQ(5L, snapshot->cas);
+
+  IrsCache::Stats stats = cache.get_stats();
+  EXPECT_EQ(1u, stats.hits);
+  EXPECT_EQ(1u, stats.misses);
+  EXPECT_EQ(2u, stats.entries);
+}
+
+TEST_F(IrsCacheTest, Expiry)
+{
+  IrsCache cache(100, 1000);
+  uint64_t ticket;
+
+  cache.get(IMPU, ticket);
+  ImpuStore::DefaultImpu* impu = default_impu(IMPU);
+  cache.add(IMPU, impu, ticket);
+  delete impu;
+
+  cwtest_advance_time_ms(999);
+  EXPECT_NE(nullptr, cache.get(IMPU, ticket));
+
+  cwtest_advance_time_ms(1);
+  EXPECT_EQ(nullptr, cache.get(IMPU, ticket));
+
+  IrsCache::Stats stats = cache.get_stats();
+  EXPECT_EQ(1u, stats.expiries);
+  EXPECT_EQ(0u, stats.entries);
+}
+
+TEST_F(IrsCacheTest, LeastRecentlyUsedEvicted)
+{
+  // A single shard, with room for two entries
+  IrsCache cache(2, 1000, 1);
+  uint64_t ticket;
+
+  for (const std::string& key : { IMPU, ASSOC_IMPU })
+  {
+    cache.get(key, ticket);
+    ImpuStore::DefaultImpu* impu = default_impu(IMPU);
+    cache.add(key, impu, ticket);
+    delete impu;
+  }
+
+  // Use the first entry, so that the second is evicted to make space
+  EXPECT_NE(nullptr, cache.get(IMPU, ticket));
+
+  cache.get(IMPU_2, ticket);
+  ImpuStore::DefaultImpu* impu = default_impu(IMPU_2);
+  cache.add(IMPU_2, impu, ticket);
+  delete impu;
+
+  EXPECT_NE(nullptr, cache.get(IMPU, ticket));
+  EXPECT_EQ(nullptr, cache.get(ASSOC_IMPU, ticket));
+  EXPECT_NE(nullptr, cache.get(IMPU_2, ticket));
+
+  IrsCache::Stats stats = cache.get_stats();
+  EXPECT_EQ(1u, stats.evictions);
+  EXPECT_EQ(2u, stats.entries);
+}
+
+TEST_F(IrsCacheTest, Invalidate)
+{
+  IrsCache cache(100, 1000);
+  uint64_t ticket;
+
+  cache.get(IMPU, ticket);
+  ImpuStore::DefaultImpu* impu = default_impu(IMPU);
+  cache.add(IMPU, impu, ticket);
+
+  cache.invalidate({ IMPU, ASSOC_IMPU });
+  EXPECT_EQ(nullptr, cache.get(IMPU, ticket));
+  EXPECT_EQ(1u, cache.get_stats().invalidations);
+
+  // An IMPU read before it was invalidated isn't cached
+  uint64_t old_ticket = ticket;
+  cache.invalidate({ IMPU });
+  cache.add(IMPU, impu, old_ticket);
+  EXPECT_EQ(nullptr, cache.get(IMPU, ticket));
+
+  // But one read after is
+  cache.add(IMPU, impu, ticket);
+  EXPECT_NE(nullptr, cache.get(IMPU, ticket));
+
+  delete impu;
+}
+
+TEST_F(IrsCacheTest, ReportsToStatsTables)
+{
+  CountingCounterTable hits;
+  CountingCounterTable misses;
+  CountingCounterTable evictions;
+
+  // A single shard, with room for one entry
+  IrsCache cache(1, 1000, 1);
+  cache.configure_stats_tables(&hits, &misses, &evictions);
+  uint64_t ticket;
+
+  for (const std::string& key : { IMPU, IMPU_2 })
+  {
+    EXPECT_EQ(nullptr, cache.get(key, ticket));
+    ImpuStore::DefaultImpu* impu = default_impu(key);
+    cache.add(key, impu, ticket);
+    delete impu;
+  }
+
+  EXPECT_NE(nullptr, cache.get(IMPU_2, ticket));
+
+  EXPECT_EQ(1u, hits.count);
+  EXPECT_EQ(2u, misses.count);
+  EXPECT_EQ(1u, evictions.count);
+}
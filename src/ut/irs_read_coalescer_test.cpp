@@ -0,0 +1,146 @@
+/**
+ * @file irs_read_coalescer_test.cpp UT for sharing concurrent reads of an IRS
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "irs_read_coalescer.h"
+#include "fake_implicit_reg_set.h"
+#include "test_utils.hpp"
+#include "fakelogger.h"
+#include "gtest/gtest.h"
+
+static const std::string IMPU = "sip:impu@example.com";
+static const std::string IMPU_2 = "sip:impu2@example.com";
+
+// A table that counts what it's told, so tests can check it
+class CountingCounterTable : public SNMP::CounterTable
+{
+public:
+  void increment() { count++; }
+  uint64_t count = 0;
+};
+
+class IrsReadCoalescerTest : public ::testing::Test
+{
+public:
+  virtual void TearDown() override
+  {
+    for (ImplicitRegistrationSet* irs : _irss)
+    {
+      delete irs;
+    }
+  }
+
+  // Join or start a read, recording what it's answered with
+  std::shared_ptr<IrsReadCoalescer::Read> get(const std::string& impu)
+  {
+    return _coalescer.join_or_start(
+      impu,
+      [this](ImplicitRegistrationSet* irs) { _irss.push_back(irs); },
+      [this](Store::Status status) { _failures.push_back(status); });
+  }
+
+private:
+  IrsReadCoalescer _coalescer;
+
+  // The IRSs and failures that requests have been answered with
+  std::vector<ImplicitRegistrationSet*> _irss;
+  std::vector<Store::Status> _failures;
+};
+
+TEST_F(IrsReadCoalescerTest, JoinsReadInProgress)
+{
+  std::shared_ptr<IrsReadCoalescer::Read> read = get(IMPU);
+  ASSERT_NE(nullptr, read);
+  EXPECT_EQ(IMPU, read->impu());
+
+  // Requests for the same IMPU join the read, but those for another don't
+  std::shared_ptr<IrsReadCoalescer::Read> other_read = get(IMPU_2);
+  EXPECT_NE(nullptr, other_read);
+  EXPECT_EQ(nullptr, get(IMPU));
+  EXPECT_EQ(nullptr, get(IMPU));
+  EXPECT_EQ(2u, _coalescer.get_coalesced_gets());
+
+  // Each request gets its own copy of the IRS
+  read->complete(Store::Status::OK, new FakeImplicitRegistrationSet(IMPU));
+  ASSERT_EQ(3u, _irss.size());
+  EXPECT_NE(_irss[0], _irss[1]);
+  EXPECT_NE(_irss[1], _irss[2]);
+  EXPECT_NE(_irss[0], _irss[2]);
+  EXPECT_EQ(IMPU, _irss[0]->get_default_impu());
+  EXPECT_TRUE(_failures.empty());
+
+  // Once the read has completed, the next request starts another
+  EXPECT_NE(nullptr, get(IMPU));
+
+  other_read->complete(Store::Status::NOT_FOUND, nullptr);
+}
+
+TEST_F(IrsReadCoalescerTest, WriteStopsJoining)
+{
+  std::shared_ptr<IrsReadCoalescer::Read> read = get(IMPU);
+  EXPECT_EQ(nullptr, get(IMPU));
+
+  // After a write, requests can't join the read from before it, so start
+  // another, which later requests join instead
+  _coalescer.irss_written();
+  std::shared_ptr<IrsReadCoalescer::Read> new_read = get(IMPU);
+  ASSERT_NE(nullptr, new_read);
+  EXPECT_EQ(nullptr, get(IMPU));
+
+  // The first read only answers the requests that joined it
+  read->complete(Store::Status::OK, new FakeImplicitRegistrationSet(IMPU));
+  EXPECT_EQ(2u, _irss.size());
+
+  // And completing it doesn't stop requests joining the new read
+  EXPECT_EQ(nullptr, get(IMPU));
+
+  new_read->complete(Store::Status::OK, new FakeImplicitRegistrationSet(IMPU));
+  EXPECT_EQ(5u, _irss.size());
+}
+
+TEST_F(IrsReadCoalescerTest, FailedReadFailsWaiters)
+{
+  std::shared_ptr<IrsReadCoalescer::Read> read = get(IMPU);
+  EXPECT_EQ(nullptr, get(IMPU));
+
+  read->complete(Store::Status::NOT_FOUND, nullptr);
+  EXPECT_TRUE(_irss.empty());
+  EXPECT_EQ(std::vector<Store::Status>({ Store::Status::NOT_FOUND,
+                                         Store::Status::NOT_FOUND }),
+            _failures);
+}
+
+TEST_F(IrsReadCoalescerTest, UncompletedReadFailsWaiters)
+{
+  // The read is dropped without completing (e.g. because it threw)
+  get(IMPU);
+  EXPECT_EQ(std::vector<Store::Status>({ Store::Status::ERROR }), _failures);
+
+  std::shared_ptr<IrsReadCoalescer::Read> read = get(IMPU);
+  ASSERT_NE(nullptr, read);
+  EXPECT_EQ(nullptr, get(IMPU));
+  read.reset();
+  EXPECT_EQ(3u, _failures.size());
+
+  // Nothing is left behind for later requests to join
+  EXPECT_NE(nullptr, get(IMPU));
+}
+
+TEST_F(IrsReadCoalescerTest, ReportsToStatsTable)
+{
+  CountingCounterTable coalesced_gets;
+  _coalescer.configure_stats_tables(&coalesced_gets);
+
+  std::shared_ptr<IrsReadCoalescer::Read> read = get(IMPU);
+  EXPECT_EQ(nullptr, get(IMPU));
+  EXPECT_EQ(1u, coalesced_gets.count);
+
+  read->complete(Store::Status::ERROR, nullptr);
+}
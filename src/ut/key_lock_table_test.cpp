@@ -0,0 +1,75 @@
+/**
+ * @file key_lock_table_test.cpp UT for the striped locks for IMPU store keys
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <thread>
+
+#include "key_lock_table.h"
+#include "test_utils.hpp"
+#include "fakelogger.h"
+#include "gtest/gtest.h"
+
+static const std::string IMPI = "impi@example.com";
+static const std::string IMPI_2 = "impi2@example.com";
+static const int STORE = 0;
+static const int OTHER_STORE = 1;
+
+class KeyLockTableTest : public ::testing::Test
+{
+};
+
+TEST_F(KeyLockTableTest, SharedStripesLockedOnce)
+{
+  // With a single stripe, every key shares it
+  KeyLockTable table(1);
+
+  {
+    KeyLockTable::Locks locks = table.lock(&STORE, { IMPI, IMPI_2, IMPI });
+    EXPECT_EQ(1u, locks.size());
+  }
+
+  // And it's released again
+  KeyLockTable::Locks locks = table.lock(&OTHER_STORE, IMPI);
+  EXPECT_EQ(1u, locks.size());
+
+  KeyLockTable::Stats stats = table.get_stats();
+  EXPECT_EQ(2u, stats.acquisitions);
+  EXPECT_EQ(0u, stats.waits);
+}
+
+TEST_F(KeyLockTableTest, UpdatesTakeTurns)
+{
+  KeyLockTable table(16);
+  int value = 0;
+  std::vector<std::thread> threads;
+
+  // Each thread reads the value, and writes it back incremented. They only
+  // all count if no two threads do so at once.
+  for (int ii = 0; ii < 4; ii++)
+  {
+    threads.push_back(std::thread([&table, &value]()
+    {
+      for (int jj = 0; jj < 1000; jj++)
+      {
+        KeyLockTable::Locks locks = table.lock(&STORE, { IMPI_2, IMPI });
+        int read = value;
+        std::this_thread::yield();
+        value = read + 1;
+      }
+    }));
+  }
+
+  for (std::thread& thread : threads)
+  {
+    thread.join();
+  }
+
+  EXPECT_EQ(4000, value);
+}
@@ -9,6 +9,8 @@
  * Metaswitch Networks in a separate written agreement.
  */
 
+#include <future>
+
 #include "memcached_cache.h"
 #include "test_interposer.hpp"
 #include "test_utils.hpp"
@@ -20,6 +22,7 @@ using ::testing::_;
 using ::testing::DoAll;
 using ::testing::InvokeWithoutArgs;
 using ::testing::Return;
+using ::testing::SetArgReferee;
 using ::testing::StrictMock;
 
 static LocalStore LOCAL_STORE;
@@ -397,7 +400,7 @@ TEST_F(MemcachedImplicitRegistrationSetTest, GetImpu)
   EXPECT_EQ(got_impu->registration_state, RegistrationState::REGISTERED);
   EXPECT_EQ(got_impu->charging_addresses, CHARGING_ADDRESSES);
   EXPECT_EQ(got_impu->impis, IMPIS);
-  EXPECT_EQ(got_impu->service_profile, SERVICE_PROFILE);
+  EXPECT_EQ(got_impu->service_profile.get(), SERVICE_PROFILE);
   EXPECT_EQ(got_impu->cas, 0L);
   EXPECT_EQ(got_impu->expiry, expiry);
   EXPECT_EQ(got_impu->store, nullptr);
@@ -439,7 +442,7 @@ TEST_F(MemcachedImplicitRegistrationSetTest, GetImpuFromImpu)
   EXPECT_EQ(got_impu->registration_state, RegistrationState::REGISTERED);
   EXPECT_EQ(got_impu->charging_addresses, CHARGING_ADDRESSES);
   EXPECT_EQ(got_impu->impis, IMPIS);
-  EXPECT_EQ(got_impu->service_profile, SERVICE_PROFILE);
+  EXPECT_EQ(got_impu->service_profile.get(), SERVICE_PROFILE);
   EXPECT_EQ(got_impu->cas, CAS_2);
   EXPECT_EQ(got_impu->store, &IMPU_STORE_2);
   EXPECT_EQ(got_impu->expiry, expiry);
@@ -471,7 +474,7 @@ TEST_F(MemcachedImplicitRegistrationSetTest, GetImpuForCorrectStore)
   EXPECT_EQ(got_impu->registration_state, RegistrationState::REGISTERED);
   EXPECT_EQ(got_impu->charging_addresses, CHARGING_ADDRESSES);
   EXPECT_EQ(got_impu->impis, IMPIS);
-  EXPECT_EQ(got_impu->service_profile, SERVICE_PROFILE);
+  EXPECT_EQ(got_impu->service_profile.get(), SERVICE_PROFILE);
   EXPECT_EQ(got_impu->cas, CAS);
   EXPECT_EQ(got_impu->expiry, expiry);
   EXPECT_EQ(got_impu->store, &IMPU_STORE);
@@ -755,6 +758,136 @@ TEST_F(MemcachedCacheTest, GetIrsForImpis)
   }
 }
 
+TEST_F(MemcachedCacheTest, GetIrsForImpisLocalAndRemote)
+{
+  const std::string OTHER_IMPU = "sip:other@example.com";
+  const std::string OTHER_IMPI = "other@example.com";
+
+  ImpuStore::DefaultImpu* di =
+    new ImpuStore::DefaultImpu(IMPU,
+                               ASSOC_IMPUS,
+                               IMPIS,
+                               RegistrationState::REGISTERED,
+                               CHARGING_ADDRESSES,
+                               SERVICE_PROFILE,
+                               0L,
+                               time(0) + 1,
+                               _local_store);
+
+  _local_store->set_impu(di, 0L);
+
+  delete di;
+
+  di = new ImpuStore::DefaultImpu(OTHER_IMPU,
+                                  {},
+                                  { OTHER_IMPI },
+                                  RegistrationState::REGISTERED,
+                                  CHARGING_ADDRESSES,
+                                  SERVICE_PROFILE,
+                                  0L,
+                                  time(0) + 1,
+                                  _local_store);
+
+  _local_store->set_impu(di, 0L);
+
+  delete di;
+
+  // One mapping is only found locally, and the other only at a remote site
+  ImpuStore::ImpiMapping* mapping =
+    new ImpuStore::ImpiMapping(IMPI, {IMPU}, time(0) + 1);
+
+  _local_store->set_impi_mapping(mapping, 0L);
+
+  delete mapping;
+
+  mapping = new ImpuStore::ImpiMapping(OTHER_IMPI, {OTHER_IMPU}, time(0) + 1);
+
+  _remote_store_2->set_impi_mapping(mapping, 0L);
+
+  delete mapping;
+
+  std::vector<ImplicitRegistrationSet*> irss;
+
+  Store::Status status =
+    _memcached_cache->get_implicit_registration_sets_for_impis({IMPI, "unknown@example.com", OTHER_IMPI, IMPI},
+                                                               0L,
+                                                               nullptr,
+                                                               irss);
+
+  EXPECT_EQ(Store::Status::OK, status);
+  ASSERT_EQ(3, irss.size());
+  EXPECT_EQ(IMPU, irss[0]->get_default_impu());
+  EXPECT_EQ(OTHER_IMPU, irss[1]->get_default_impu());
+  EXPECT_EQ(IMPU, irss[2]->get_default_impu());
+
+  for (ImplicitRegistrationSet* irs : irss)
+  {
+    delete irs;
+  }
+}
+
+TEST_F(MemcachedCacheTest, GetIrsFromIrsCache)
+{
+  MemcachedCache::Options options;
+  options.irs_cache_size = 100;
+  options.irs_cache_ttl_ms = 1000;
+
+  MemcachedCache cache(_local_store,
+                       {},
+                       1,
+                       nullptr,
+                       options);
+
+  ImpuStore::DefaultImpu* di =
+    new ImpuStore::DefaultImpu(IMPU,
+                               ASSOC_IMPUS,
+                               IMPIS,
+                               RegistrationState::REGISTERED,
+                               CHARGING_ADDRESSES,
+                               SERVICE_PROFILE,
+                               0L,
+                               time(0) + 1,
+                               _local_store);
+
+  _local_store->set_impu(di, 0L);
+
+  ImplicitRegistrationSet* irs = nullptr;
+  ASSERT_EQ(Store::Status::OK,
+            cache.get_implicit_registration_set_for_impu(IMPU, 0L, nullptr, irs));
+  delete irs;
+
+  // Once cached, the IRS is found even if it's gone from the store
+  _local_store->delete_impu(di, 0L);
+  delete di;
+
+  ASSERT_EQ(Store::Status::OK,
+            cache.get_implicit_registration_set_for_impu(IMPU, 0L, nullptr, irs));
+  EXPECT_EQ(IMPU, irs->get_default_impu());
+  EXPECT_EQ(RegistrationState::REGISTERED, irs->get_reg_state());
+
+  IrsCache::Stats stats = cache.get_irs_cache_stats();
+  EXPECT_EQ(1u, stats.hits);
+  EXPECT_EQ(1u, stats.misses);
+
+  // Writing the IRS removes it from the cache, so the next read sees what was
+  // written
+  irs->set_reg_state(RegistrationState::UNREGISTERED);
+
+  EXPECT_CALL(*_mock_progress_cb, progress_callback());
+  EXPECT_EQ(Store::Status::OK,
+            cache.put_implicit_registration_set(irs, _progress_callback, 0L, nullptr));
+  delete irs;
+
+  ASSERT_EQ(Store::Status::OK,
+            cache.get_implicit_registration_set_for_impu(IMPU, 0L, nullptr, irs));
+  EXPECT_EQ(RegistrationState::UNREGISTERED, irs->get_reg_state());
+  delete irs;
+
+  stats = cache.get_irs_cache_stats();
+  EXPECT_EQ(1u, stats.invalidations);
+  EXPECT_EQ(2u, stats.misses);
+}
+
 TEST_F(MemcachedCacheTest, GetIrsForImpisNotFound)
 {
   std::vector<ImplicitRegistrationSet*> irss;
@@ -993,6 +1126,55 @@ TEST_F(MemcachedCacheTest, GetIrsForImpuRemoteStore)
   delete irs;
 }
 
+TEST_F(MemcachedCacheTest, GetIrsForImpuRemoteStoreReadRepair)
+{
+  MemcachedCache::Options options;
+  options.read_repair = true;
+
+  MemcachedCache cache(_local_store,
+                       _remote_stores,
+                       _remote_stores.size(),
+                       nullptr,
+                       options);
+
+  ImpuStore::DefaultImpu* di =
+    new ImpuStore::DefaultImpu(IMPU,
+                               ASSOC_IMPUS,
+                               IMPIS,
+                               RegistrationState::REGISTERED,
+                               CHARGING_ADDRESSES,
+                               SERVICE_PROFILE,
+                               0L,
+                               time(0) + 1,
+                               _remote_store);
+
+  _remote_store->set_impu(di, 0L);
+
+  delete di;
+
+  ImplicitRegistrationSet* irs = nullptr;
+  Store::Status status =
+    cache.get_implicit_registration_set_for_impu(IMPU, 0L, nullptr, irs);
+  ASSERT_EQ(Store::Status::OK, status);
+  delete irs;
+
+  // The IMPU is added to the local store in the background
+  ImpuStore::Impu* impu = nullptr;
+
+  for (int ii = 0; (ii < 1000) && (impu == nullptr); ii++)
+  {
+    if (_local_store->get_impu(IMPU, impu, 0L) != Store::Status::OK)
+    {
+      usleep(1000);
+    }
+  }
+
+  ASSERT_NE(nullptr, impu);
+  EXPECT_TRUE(impu->is_default_impu());
+  EXPECT_EQ(IMPIS, ((ImpuStore::DefaultImpu*)impu)->impis);
+  delete impu;
+}
+
 TEST_F(MemcachedCacheTest, GetIrsForImpuSecondRemoteStore)
 {
   ImpuStore::DefaultImpu* di =
@@ -1117,6 +1299,77 @@ TEST_F(MemcachedCacheTest, PutIrsWithExistingUnrefreshed)
   delete irs;
 }
 
+TEST_F(MemcachedCacheTest, PutIrsOnlyWritesChangedRecords)
+{
+  MemcachedCache cache(_local_store, {}, 1, nullptr);
+
+  ImpuStore::DefaultImpu* di =
+    new ImpuStore::DefaultImpu(IMPU,
+                               ASSOC_IMPUS,
+                               NO_IMPIS,
+                               RegistrationState::REGISTERED,
+                               CHARGING_ADDRESSES,
+                               SERVICE_PROFILE,
+                               0L,
+                               time(0) + 1,
+                               _local_store);
+
+  _local_store->set_impu(di, 0L);
+
+  delete di;
+
+  // Only the Default IMPU needs writing when the registration state changes
+  ImplicitRegistrationSet* irs;
+  cache.get_implicit_registration_set_for_impu(IMPU, 0L, nullptr, irs);
+  irs->set_reg_state(RegistrationState::UNREGISTERED);
+
+  EXPECT_CALL(*_mock_progress_cb, progress_callback());
+  EXPECT_EQ(Store::Status::OK,
+            cache.put_implicit_registration_set(irs, _progress_callback, 0L, nullptr));
+  delete irs;
+
+  MemcachedCache::WriteStats stats = cache.get_write_stats();
+  EXPECT_EQ(1u, stats.planned);
+  EXPECT_EQ(1u, stats.executed);
+  EXPECT_EQ(2u, stats.skipped);
+
+  // Adding an IMPI also needs its mapping writing, but the associated IMPUs
+  // are still left alone
+  cache.get_implicit_registration_set_for_impu(IMPU, 0L, nullptr, irs);
+  irs->add_associated_impi(IMPI);
+
+  EXPECT_CALL(*_mock_progress_cb, progress_callback());
+  EXPECT_EQ(Store::Status::OK,
+            cache.put_implicit_registration_set(irs, _progress_callback, 0L, nullptr));
+  delete irs;
+
+  stats = cache.get_write_stats();
+  EXPECT_EQ(3u, stats.planned);
+  EXPECT_EQ(3u, stats.executed);
+  EXPECT_EQ(3u, stats.skipped);
+  EXPECT_EQ(0u, stats.retried);
+
+  // Setting the registration state to what it already is doesn't need
+  // anything writing
+  cache.get_implicit_registration_set_for_impu(IMPU, 0L, nullptr, irs);
+  irs->set_reg_state(RegistrationState::UNREGISTERED);
+
+  EXPECT_CALL(*_mock_progress_cb, progress_callback());
+  EXPECT_EQ(Store::Status::OK,
+            cache.put_implicit_registration_set(irs, _progress_callback, 0L, nullptr));
+  delete irs;
+
+  stats = cache.get_write_stats();
+  EXPECT_EQ(3u, stats.planned);
+  EXPECT_EQ(3u, stats.executed);
+  EXPECT_EQ(6u, stats.skipped);
+
+  ImpuStore::ImpiMapping* mapping = nullptr;
+  ASSERT_EQ(Store::Status::OK, _local_store->get_impi_mapping(IMPI, mapping, 0L));
+  EXPECT_TRUE(mapping->has_default_impu(IMPU));
+  delete mapping;
+}
+
 TEST_F(MemcachedCacheTest, PutIrsWithExistingNotRefreshedConflictAssociated)
 {
   int expiry = time(0) + 1;
@@ -1271,104 +1524,363 @@ TEST_F(MemcachedCacheTest, PutIrsRemoteError)
   delete irs;
 }
 
-TEST_F(MemcachedCacheTest, PutIrsUnchanged)
+TEST_F(MemcachedCacheTest, PutIrsRemoteErrorReconciled)
 {
-  MemcachedImplicitRegistrationSet* mirs =
-    (MemcachedImplicitRegistrationSet*)_memcached_cache->create_implicit_registration_set();
+  MemcachedCache::Options options;
+  options.reconcile_log_len = 100;
+  options.reconcile_settle_ms = 1000;
+  options.reconcile_keys_per_sec = 100;
 
-  mirs->_existing = true;
-  mirs->_refreshed = false;
+  MemcachedCache cache(_local_store,
+                       _remote_stores,
+                       _remote_stores.size(),
+                       nullptr,
+                       options);
+
+  // Check the written keys from the test, rather than in the background
+  cache._reconciler->stop();
+
+  ImplicitRegistrationSet* irs = cache.create_implicit_registration_set();
+
+  irs->set_ttl(1);
+  irs->set_ims_sub_xml(SERVICE_PROFILE);
+  irs->set_reg_state(RegistrationState::REGISTERED);
+
+  // The write to the first remote site fails
+  _rls->force_error();
 
-  // Expect that we still report success and call the progress callback
   EXPECT_CALL(*_mock_progress_cb, progress_callback());
-  Store::Status status = _memcached_cache->put_implicit_registration_set(mirs, _progress_callback, 0L, nullptr);
+  Store::Status status = cache.put_implicit_registration_set(irs, _progress_callback, 0L, nullptr);
   EXPECT_EQ(Store::Status::OK, status);
+  delete irs;
 
-  delete mirs;
+  ImpuStore::Impu* impu = nullptr;
+  EXPECT_EQ(Store::Status::NOT_FOUND, _remote_store->get_impu(IMPU, impu, 0L));
+
+  // Once the write has settled, the reconciler repairs it
+  cwtest_advance_time_ms(1000);
+  while (cache._reconciler->reconcile_next());
+
+  ASSERT_EQ(Store::Status::OK, _remote_store->get_impu(IMPU, impu, 0L));
+  delete impu;
+
+  std::vector<Reconciler::Stats> stats = cache.get_reconciler_stats();
+  ASSERT_EQ(2u, stats.size());
+  EXPECT_LE(1u, stats[0].missing);
+  EXPECT_EQ(stats[0].missing, stats[0].repaired);
+  EXPECT_EQ(0u, stats[1].missing + stats[1].stale + stats[1].extra);
+  EXPECT_EQ(0u, cache.get_reconciler_log_stats().pending);
 }
 
-TEST_F(MemcachedCacheTest, PutIrsWithExistingRefreshed)
+TEST_F(MemcachedCacheTest, PutIrsReplicatedAsynchronously)
 {
-  int expiry = time(0) + 1;
+  MemcachedCache::Options options;
+  options.replication_writers = 1;
 
-  for (ImpuStore* store : { _local_store, _remote_store })
-  {
-    ImpuStore::DefaultImpu* di =
-      new ImpuStore::DefaultImpu(IMPU,
-                                 {ASSOC_IMPU, ASSOC_IMPU_2, ASSOC_IMPU_5},
-                                 {IMPI, IMPI_2, IMPI_4},
-                                 RegistrationState::REGISTERED,
-                                 CHARGING_ADDRESSES,
-                                 SERVICE_PROFILE,
-                                 0L,
-                                 expiry,
-                                 store);
+  MemcachedCache cache(_local_store,
+                       _remote_stores,
+                       _remote_stores.size(),
+                       nullptr,
+                       options);
+  ImplicitRegistrationSet* irs = cache.create_implicit_registration_set();
 
-    store->set_impu(di, 0L);
+  irs->set_ttl(1);
+  irs->set_ims_sub_xml(SERVICE_PROFILE);
+  irs->set_reg_state(RegistrationState::REGISTERED);
 
-    delete di;
-  }
+  EXPECT_CALL(*_mock_progress_cb, progress_callback());
+  Store::Status status = cache.put_implicit_registration_set(irs, _progress_callback, 0L, nullptr);
+  EXPECT_EQ(Store::Status::OK, status);
 
-  // IMPI is deleted entirely
-  // IMPI 2 we remove a single mapping from
-  // IMPI 3 is added, but already has an entry
-  // IMPI 4 is unchanged, but missing the mapping
-  // IMPI 5 is added, but already has an entry, with the IMPU
+  // Once the replication queue has drained, both remote sites have the IRS
+  cache._replication_queue->wait_until_idle();
 
+  for (ImpuStore* store : _remote_stores)
   {
-    ImpuStore::ImpiMapping* mapping =
-      new ImpuStore::ImpiMapping(IMPI, {IMPU}, 0L, expiry);
-
-    _local_store->set_impi_mapping(mapping, 0L);
-
-    delete mapping;
+    ImpuStore::Impu* impu = nullptr;
+    EXPECT_EQ(Store::Status::OK, store->get_impu(IMPU, impu, 0L));
+    delete impu;
   }
 
-  {
-    ImpuStore::ImpiMapping* mapping =
-      new ImpuStore::ImpiMapping(IMPI_2, { IMPU, IMPU_2 }, 0L, expiry);
+  std::vector<ReplicationQueue::Stats> stats = cache.get_replication_stats();
+  ASSERT_EQ(2u, stats.size());
+  EXPECT_EQ(1u, stats[0].completed);
+  EXPECT_EQ(1u, stats[1].completed);
 
-    _local_store->set_impi_mapping(mapping, 0L);
+  delete irs;
+}
 
-    delete mapping;
-  }
+TEST_F(MemcachedCacheTest, PutIrsRemoteErrorReplicatedAsynchronously)
+{
+  MemcachedCache::Options options;
+  options.replication_writers = 1;
 
-  {
-    ImpuStore::ImpiMapping* mapping =
-      new ImpuStore::ImpiMapping(IMPI_3, { }, 0L, expiry);
+  MemcachedCache cache(_local_store,
+                       _remote_stores,
+                       _remote_stores.size(),
+                       nullptr,
+                       options);
+  ImplicitRegistrationSet* irs = cache.create_implicit_registration_set();
 
-    _local_store->set_impi_mapping(mapping, 0L);
+  irs->set_ttl(1);
+  irs->set_ims_sub_xml(SERVICE_PROFILE);
+  irs->set_reg_state(RegistrationState::REGISTERED);
 
-    delete mapping;
-  }
+  _rls->force_error();
 
-  {
-    ImpuStore::ImpiMapping* mapping =
-      new ImpuStore::ImpiMapping(IMPI_4, { }, 0L, expiry);
+  // The caller isn't told about the remote error, but it's counted against
+  // the failing site only
+  EXPECT_CALL(*_mock_progress_cb, progress_callback());
+  Store::Status status = cache.put_implicit_registration_set(irs, _progress_callback, 0L, nullptr);
+  EXPECT_EQ(Store::Status::OK, status);
 
-    _local_store->set_impi_mapping(mapping, 0L);
+  cache._replication_queue->wait_until_idle();
 
-    delete mapping;
-  }
+  std::vector<ReplicationQueue::Stats> stats = cache.get_replication_stats();
+  ASSERT_EQ(2u, stats.size());
+  EXPECT_EQ(1u, stats[0].failed);
+  EXPECT_EQ(1u, stats[1].completed);
 
-  {
-    ImpuStore::ImpiMapping* mapping =
-      new ImpuStore::ImpiMapping(IMPI_5, { IMPU }, 0L, expiry);
+  delete irs;
+}
 
-    _local_store->set_impi_mapping(mapping, 0L);
+TEST_F(MemcachedCacheTest, DeleteIrsReplicatedAsynchronously)
+{
+  MemcachedCache::Options options;
+  options.replication_writers = 1;
 
-    delete mapping;
-  }
+  MemcachedCache cache(_local_store,
+                       _remote_stores,
+                       _remote_stores.size(),
+                       nullptr,
+                       options);
 
-  // IMPU is deleted and present
-  // IMPU 2 is deleted but not present
-  // IMPU 3 is added and not present
-  // IMPU 4 is added and not present
-  // IMPU 5 is unchanged and not present
+  ImpuStore::DefaultImpu* di =
+    new ImpuStore::DefaultImpu(IMPU,
+                               ASSOC_IMPUS,
+                               IMPIS,
+                               RegistrationState::REGISTERED,
+                               CHARGING_ADDRESSES,
+                               SERVICE_PROFILE,
+                               0L,
+                               time(0) + 1,
+                               _remote_store);
 
-  {
-    ImpuStore::AssociatedImpu* ai =
-      new ImpuStore::AssociatedImpu(ASSOC_IMPU_2, IMPU, 0L, expiry, _local_store);
+  _remote_store->set_impu(di, 0L);
+
+  delete di;
+
+  ImplicitRegistrationSet* irs;
+  cache.get_implicit_registration_set_for_impu(IMPU, 0L, nullptr, irs);
+
+  EXPECT_CALL(*_mock_progress_cb, progress_callback());
+  Store::Status status = cache.delete_implicit_registration_set(irs, _progress_callback, 0L, nullptr);
+  EXPECT_EQ(Store::Status::OK, status);
+
+  cache._replication_queue->wait_until_idle();
+
+  ImpuStore::Impu* impu = nullptr;
+  EXPECT_EQ(Store::Status::NOT_FOUND, _remote_store->get_impu(IMPU, impu, 0L));
+
+  delete irs;
+}
+
+TEST_F(MemcachedCacheTest, PutIrsCoalescedKeepsUnreplicatedAdds)
+{
+  MemcachedCache::Options options;
+  options.replication_writers = 1;
+
+  MemcachedCache cache(_local_store,
+                       _remote_stores,
+                       _remote_stores.size(),
+                       nullptr,
+                       options);
+
+  // Hold the writes in a queue that hasn't started, so the second write is
+  // coalesced with the first
+  delete cache._replication_queue;
+  cache._replication_queue = new ReplicationQueue(_remote_stores, 10, 1);
+
+  // Every site has the subscriber, without any associated IMPUs
+  int expiry = time(0) + 10;
+
+  for (ImpuStore* store : { _local_store, _remote_store, _remote_store_2 })
+  {
+    ImpuStore::DefaultImpu* di =
+      new ImpuStore::DefaultImpu(IMPU,
+                                 NO_ASSOC_IMPUS,
+                                 IMPIS,
+                                 RegistrationState::REGISTERED,
+                                 CHARGING_ADDRESSES,
+                                 EMPTY_SERVICE_PROFILE,
+                                 0L,
+                                 expiry,
+                                 store);
+    store->set_impu(di, 0L);
+    delete di;
+  }
+
+  // The first write (e.g. a PPR) adds associated IMPUs and an IMPI, without
+  // refreshing the IRS
+  ImplicitRegistrationSet* irs = nullptr;
+  cache.get_implicit_registration_set_for_impu(IMPU, 0L, nullptr, irs);
+  ASSERT_NE(nullptr, irs);
+  irs->set_ims_sub_xml(SERVICE_PROFILE);
+  irs->add_associated_impi(IMPI_2);
+
+  EXPECT_CALL(*_mock_progress_cb, progress_callback()).Times(2);
+  EXPECT_EQ(Store::Status::OK,
+            cache.put_implicit_registration_set(irs, _progress_callback, 0L, nullptr));
+  delete irs;
+
+  // The second reads them back from the local store, so has them unchanged
+  irs = nullptr;
+  cache.get_implicit_registration_set_for_impu(IMPU, 0L, nullptr, irs);
+  ASSERT_NE(nullptr, irs);
+  irs->set_charging_addresses(CHARGING_ADDRESSES_2);
+  EXPECT_EQ(Store::Status::OK,
+            cache.put_implicit_registration_set(irs, _progress_callback, 0L, nullptr));
+  delete irs;
+
+  cache._replication_queue->start();
+  cache._replication_queue->wait_until_idle();
+
+  std::vector<ReplicationQueue::Stats> stats = cache.get_replication_stats();
+  ASSERT_EQ(2u, stats.size());
+  EXPECT_EQ(1u, stats[0].coalesced);
+  EXPECT_EQ(1u, stats[0].completed);
+
+  // Each remote site still gets the associated IMPUs and the IMPI mapping
+  // the first write added, as well as the second write's changes
+  for (ImpuStore* store : _remote_stores)
+  {
+    ImpuStore::Impu* impu = nullptr;
+    ASSERT_EQ(Store::Status::OK, store->get_impu(IMPU, impu, 0L));
+    ASSERT_TRUE(impu->is_default_impu());
+    EXPECT_EQ(CHARGING_ADDRESSES_2.ccfs,
+              ((ImpuStore::DefaultImpu*)impu)->charging_addresses.ccfs);
+    delete impu;
+
+    for (const std::string& assoc_impu : ASSOC_IMPUS)
+    {
+      impu = nullptr;
+      ASSERT_EQ(Store::Status::OK, store->get_impu(assoc_impu, impu, 0L));
+      ASSERT_FALSE(impu->is_default_impu());
+      EXPECT_EQ(IMPU, ((ImpuStore::AssociatedImpu*)impu)->default_impu);
+      delete impu;
+    }
+
+    ImpuStore::ImpiMapping* mapping = nullptr;
+    ASSERT_EQ(Store::Status::OK, store->get_impi_mapping(IMPI_2, mapping, 0L));
+    EXPECT_TRUE(mapping->has_default_impu(IMPU));
+    delete mapping;
+  }
+}
+
+TEST_F(MemcachedCacheTest, NoReplicationQueueWithoutWriters)
+{
+  EXPECT_EQ(nullptr, _memcached_cache->_replication_queue);
+  EXPECT_TRUE(_memcached_cache->get_replication_stats().empty());
+}
+
+TEST_F(MemcachedCacheTest, PutIrsUnchanged)
+{
+  MemcachedImplicitRegistrationSet* mirs =
+    (MemcachedImplicitRegistrationSet*)_memcached_cache->create_implicit_registration_set();
+
+  mirs->_existing = true;
+  mirs->_refreshed = false;
+
+  // Expect that we still report success and call the progress callback
+  EXPECT_CALL(*_mock_progress_cb, progress_callback());
+  Store::Status status = _memcached_cache->put_implicit_registration_set(mirs, _progress_callback, 0L, nullptr);
+  EXPECT_EQ(Store::Status::OK, status);
+
+  delete mirs;
+}
+
+TEST_F(MemcachedCacheTest, PutIrsWithExistingRefreshed)
+{
+  int expiry = time(0) + 1;
+
+  for (ImpuStore* store : { _local_store, _remote_store })
+  {
+    ImpuStore::DefaultImpu* di =
+      new ImpuStore::DefaultImpu(IMPU,
+                                 {ASSOC_IMPU, ASSOC_IMPU_2, ASSOC_IMPU_5},
+                                 {IMPI, IMPI_2, IMPI_4},
+                                 RegistrationState::REGISTERED,
+                                 CHARGING_ADDRESSES,
+                                 SERVICE_PROFILE,
+                                 0L,
+                                 expiry,
+                                 store);
+
+    store->set_impu(di, 0L);
+
+    delete di;
+  }
+
+  // IMPI is deleted entirely
+  // IMPI 2 we remove a single mapping from
+  // IMPI 3 is added, but already has an entry
+  // IMPI 4 is unchanged, but missing the mapping
+  // IMPI 5 is added, but already has an entry, with the IMPU
+
+  {
+    ImpuStore::ImpiMapping* mapping =
+      new ImpuStore::ImpiMapping(IMPI, {IMPU}, 0L, expiry);
+
+    _local_store->set_impi_mapping(mapping, 0L);
+
+    delete mapping;
+  }
+
+  {
+    ImpuStore::ImpiMapping* mapping =
+      new ImpuStore::ImpiMapping(IMPI_2, { IMPU, IMPU_2 }, 0L, expiry);
+
+    _local_store->set_impi_mapping(mapping, 0L);
+
+    delete mapping;
+  }
+
+  {
+    ImpuStore::ImpiMapping* mapping =
+      new ImpuStore::ImpiMapping(IMPI_3, { }, 0L, expiry);
+
+    _local_store->set_impi_mapping(mapping, 0L);
+
+    delete mapping;
+  }
+
+  {
+    ImpuStore::ImpiMapping* mapping =
+      new ImpuStore::ImpiMapping(IMPI_4, { }, 0L, expiry);
+
+    _local_store->set_impi_mapping(mapping, 0L);
+
+    delete mapping;
+  }
+
+  {
+    ImpuStore::ImpiMapping* mapping =
+      new ImpuStore::ImpiMapping(IMPI_5, { IMPU }, 0L, expiry);
+
+    _local_store->set_impi_mapping(mapping, 0L);
+
+    delete mapping;
+  }
+
+  // IMPU is deleted and present
+  // IMPU 2 is deleted but not present
+  // IMPU 3 is added and not present
+  // IMPU 4 is added and not present
+  // IMPU 5 is unchanged and not present
+
+  {
+    ImpuStore::AssociatedImpu* ai =
+      new ImpuStore::AssociatedImpu(ASSOC_IMPU_2, IMPU, 0L, expiry, _local_store);
 
     _local_store->set_impu(ai, 0L);
     delete ai;
@@ -1534,6 +2046,177 @@ TEST_F(MemcachedCacheTest, GetIrsForImpus)
   }
 }
 
+TEST_F(MemcachedCacheTest, BaseGetIrsForImpusReturnsEveryIrs)
+{
+  // Two IRSs, and an IMPU that's in neither
+  for (const std::string& impu : { IMPU, IMPU_2 })
+  {
+    ImpuStore::DefaultImpu* di =
+      new ImpuStore::DefaultImpu(impu,
+                                 {},
+                                 IMPIS,
+                                 RegistrationState::REGISTERED,
+                                 CHARGING_ADDRESSES,
+                                 SERVICE_PROFILE,
+                                 0L,
+                                 time(0) + 1,
+                                 _local_store);
+    _local_store->set_impu(di, 0L);
+    delete di;
+  }
+
+  std::vector<ImplicitRegistrationSet*> irss;
+
+  Store::Status status =
+    _memcached_cache->BaseHssCache::get_implicit_registration_sets_for_impus(
+      {IMPU, "sip:unknown@example.com", IMPU_2},
+      0L,
+      nullptr,
+      irss);
+
+  // The unknown IMPU is skipped, but we get the IRS for each of the others
+  EXPECT_EQ(Store::Status::OK, status);
+  ASSERT_EQ(2, irss.size());
+  EXPECT_EQ(IMPU, irss[0]->get_default_impu());
+  EXPECT_EQ(IMPU_2, irss[1]->get_default_impu());
+
+  for (ImplicitRegistrationSet* irs : irss)
+  {
+    delete irs;
+  }
+}
+
+TEST_F(MemcachedCacheTest, GetIrssInBatches)
+{
+  MemcachedCache::Options options;
+  options.batch_threads = 2;
+
+  MemcachedCache cache(_local_store,
+                       _remote_stores,
+                       _remote_stores.size(),
+                       nullptr,
+                       options);
+
+  // One IRS is only found locally, and the other only at a remote site
+  ImpuStore::DefaultImpu* di =
+    new ImpuStore::DefaultImpu(IMPU,
+                               ASSOC_IMPUS,
+                               IMPIS,
+                               RegistrationState::REGISTERED,
+                               CHARGING_ADDRESSES,
+                               SERVICE_PROFILE,
+                               0L,
+                               time(0) + 1,
+                               _local_store);
+
+  _local_store->set_impu(di, 0L);
+
+  delete di;
+
+  di = new ImpuStore::DefaultImpu(IMPU_2,
+                                  ASSOC_IMPUS_2,
+                                  { IMPI, IMPI_2 },
+                                  RegistrationState::REGISTERED,
+                                  CHARGING_ADDRESSES,
+                                  SERVICE_PROFILE,
+                                  0L,
+                                  time(0) + 1,
+                                  _remote_store);
+
+  _remote_store->set_impu(di, 0L);
+
+  delete di;
+
+  ImpuStore::ImpiMapping* mapping =
+    new ImpuStore::ImpiMapping(IMPI, {IMPU, IMPU_2}, 0L, time(0) + 1);
+
+  _local_store->set_impi_mapping(mapping, 0L);
+
+  delete mapping;
+
+  mapping = new ImpuStore::ImpiMapping(IMPI_2, {IMPU_2}, time(0) + 1);
+
+  _remote_store_2->set_impi_mapping(mapping, 0L);
+
+  delete mapping;
+
+  // Every IRS is returned, in order, and each IMPU that's asked for more than
+  // once gets its own copy
+  std::vector<ImplicitRegistrationSet*> irss;
+
+  EXPECT_EQ(Store::Status::OK,
+            cache.get_implicit_registration_sets_for_impus({IMPU, IMPU_2, "sip:unknown@example.com", IMPU},
+                                                           0L,
+                                                           nullptr,
+                                                           irss));
+  ASSERT_EQ(3, irss.size());
+  EXPECT_EQ(IMPU, irss[0]->get_default_impu());
+  EXPECT_EQ(IMPU_2, irss[1]->get_default_impu());
+  EXPECT_EQ(IMPU, irss[2]->get_default_impu());
+  EXPECT_NE(irss[0], irss[2]);
+
+  for (ImplicitRegistrationSet* irs : irss)
+  {
+    delete irs;
+  }
+
+  irss.clear();
+
+  EXPECT_EQ(Store::Status::OK,
+            cache.get_implicit_registration_sets_for_impis({IMPI, IMPI_2, "unknown@example.com"},
+                                                           0L,
+                                                           nullptr,
+                                                           irss));
+  ASSERT_EQ(3, irss.size());
+  EXPECT_EQ(IMPU, irss[0]->get_default_impu());
+  EXPECT_EQ(IMPU_2, irss[1]->get_default_impu());
+  EXPECT_EQ(IMPU_2, irss[2]->get_default_impu());
+
+  for (ImplicitRegistrationSet* irs : irss)
+  {
+    delete irs;
+  }
+}
+
+TEST_F(MemcachedCacheTest, GetImpiMappingRemoteStoreReadRepair)
+{
+  MemcachedCache::Options options;
+  options.read_repair = true;
+
+  MemcachedCache cache(_local_store,
+                       _remote_stores,
+                       _remote_stores.size(),
+                       nullptr,
+                       options);
+
+  ImpuStore::ImpiMapping* mapping =
+    new ImpuStore::ImpiMapping(IMPI, {IMPU}, time(0) + 1);
+
+  _remote_store_2->set_impi_mapping(mapping, 0L);
+
+  delete mapping;
+
+  std::vector<std::string> impus;
+  Store::Status status = cache.get_impus_for_impi(IMPI, 0L, nullptr, impus);
+  ASSERT_EQ(Store::Status::OK, status);
+  EXPECT_EQ(std::vector<std::string>({ IMPU }), impus);
+
+  // The mapping is added to the local store in the background
+  mapping = nullptr;
+
+  for (int ii = 0; (ii < 1000) && (mapping == nullptr); ii++)
+  {
+    if (_local_store->get_impi_mapping(IMPI, mapping, 0L) != Store::Status::OK)
+    {
+      usleep(1000);
+    }
+  }
+
+  ASSERT_NE(nullptr, mapping);
+  EXPECT_TRUE(mapping->has_default_impu(IMPU));
+  delete mapping;
+}
+
 TEST_F(MemcachedCacheTest, GetImsSubscriptionNotFound)
 {
   ImsSubscription* subscription = nullptr;
@@ -1670,6 +2353,150 @@ TEST_F(MemcachedCacheTest, PutImsSubscription)
   delete subscription;
 }
 
+TEST_F(MemcachedCacheTest, PutImsSubscriptionInBatches)
+{
+  MemcachedCache::Options options;
+  options.batch_threads = 2;
+  options.batch_write_parallelism = 2;
+
+  MemcachedCache cache(_local_store,
+                       {},
+                       1,
+                       nullptr,
+                       options);
+
+  // Two IRSs that share an IMPI
+  for (const std::string& impu : {IMPU, IMPU_2})
+  {
+    ImpuStore::DefaultImpu* di =
+      new ImpuStore::DefaultImpu(impu,
+                                 NO_ASSOC_IMPUS,
+                                 IMPIS,
+                                 RegistrationState::REGISTERED,
+                                 CHARGING_ADDRESSES,
+                                 SERVICE_PROFILE,
+                                 0L,
+                                 time(0) + 1,
+                                 _local_store);
+
+    _local_store->set_impu(di, 0L);
+
+    delete di;
+  }
+
+  ImpuStore::ImpiMapping* mapping =
+    new ImpuStore::ImpiMapping(IMPI, {IMPU, IMPU_2}, 0L, time(0) + 1);
+
+  _local_store->set_impi_mapping(mapping, 0L);
+
+  delete mapping;
+
+  ImsSubscription* subscription = nullptr;
+
+  ASSERT_EQ(Store::Status::OK,
+            cache.get_ims_subscription(IMPI, 0L, nullptr, subscription));
+
+  // Refresh both IRSs, so that both update the IMPI mapping
+  subscription->set_charging_addrs(CHARGING_ADDRESSES_2);
+
+  for (BaseImsSubscription::Irs::value_type& irs :
+         ((BaseImsSubscription*)subscription)->get_irs())
+  {
+    irs.second->set_ttl(3600);
+  }
+
+  EXPECT_CALL(*_mock_progress_cb, progress_callback());
+  EXPECT_EQ(Store::Status::OK,
+            cache.put_ims_subscription(subscription, _progress_callback, 0L, nullptr));
+
+  delete subscription;
+
+  // Both IRSs were written, and neither lost the other's mapping
+  for (const std::string& impu : {IMPU, IMPU_2})
+  {
+    ImplicitRegistrationSet* irs = nullptr;
+    ASSERT_EQ(Store::Status::OK,
+              cache.get_implicit_registration_set_for_impu(impu, 0L, nullptr, irs));
+    EXPECT_EQ(CCFS_2, irs->get_charging_addresses().ccfs);
+    delete irs;
+  }
+
+  ASSERT_EQ(Store::Status::OK, _local_store->get_impi_mapping(IMPI, mapping, 0L));
+  EXPECT_TRUE(mapping->has_default_impu(IMPU));
+  EXPECT_TRUE(mapping->has_default_impu(IMPU_2));
+  EXPECT_LT(time(0) + 1, mapping->get_expiry());
+  delete mapping;
+}
+
+TEST_F(MemcachedCacheTest, PutImsSubscriptionWithKeyLocks)
+{
+  MemcachedCache::Options options;
+  options.batch_threads = 2;
+  options.batch_write_parallelism = 2;
+  options.key_lock_stripes = 16;
+
+  MemcachedCache cache(_local_store,
+                       {},
+                       1,
+                       nullptr,
+                       options);
+
+  // Two IRSs that share an IMPI
+  for (const std::string& impu : {IMPU, IMPU_2})
+  {
+    ImpuStore::DefaultImpu* di =
+      new ImpuStore::DefaultImpu(impu,
+                                 NO_ASSOC_IMPUS,
+                                 IMPIS,
+                                 RegistrationState::REGISTERED,
+                                 CHARGING_ADDRESSES,
+                                 SERVICE_PROFILE,
+                                 0L,
+                                 time(0) + 1,
+                                 _local_store);
+
+    _local_store->set_impu(di, 0L);
+
+    delete di;
+  }
+
+  ImpuStore::ImpiMapping* mapping =
+    new ImpuStore::ImpiMapping(IMPI, {IMPU, IMPU_2}, 0L, time(0) + 1);
+
+  _local_store->set_impi_mapping(mapping, 0L);
+
+  delete mapping;
+
+  ImsSubscription* subscription = nullptr;
+
+  ASSERT_EQ(Store::Status::OK,
+            cache.get_ims_subscription(IMPI, 0L, nullptr, subscription));
+
+  subscription->set_charging_addrs(CHARGING_ADDRESSES_2);
+
+  for (BaseImsSubscription::Irs::value_type& irs :
+         ((BaseImsSubscription*)subscription)->get_irs())
+  {
+    irs.second->set_ttl(3600);
+  }
+
+  EXPECT_CALL(*_mock_progress_cb, progress_callback());
+  EXPECT_EQ(Store::Status::OK,
+            cache.put_ims_subscription(subscription, _progress_callback, 0L, nullptr));
+
+  delete subscription;
+
+  // The IRSs took turns updating the IMPI mapping, so neither hit contention
+  // or lost the other's update
+  EXPECT_EQ(0u, cache.get_contention_stats(CasRetryPolicy::IMPI_MAPPING).contentions);
+  EXPECT_LT(0u, cache.get_key_lock_stats().acquisitions);
+
+  ASSERT_EQ(Store::Status::OK, _local_store->get_impi_mapping(IMPI, mapping, 0L));
+  EXPECT_TRUE(mapping->has_default_impu(IMPU));
+  EXPECT_TRUE(mapping->has_default_impu(IMPU_2));
+  delete mapping;
+}
+
 // Tests that use a MockImpuStore rather than a real ImpuStore backed by LocalStores
 class MemcachedCacheMockStoreTest : public ControlTimeTest
 {
@@ -1717,6 +2544,41 @@ private:
     usleep(5000);
     cwtest_advance_time_ms(50);
   }
+
+  // Wait for the given number of remote reads to have finished, as the
+  // reads that don't win carry on after the cache has returned
+  void wait_for_remote_reads(MemcachedCache* cache, uint64_t count)
+  {
+    for (int ii = 0; ii < 1000; ii++)
+    {
+      uint64_t finished = 0;
+
+      for (const RemoteReadStats::Stats& stats : cache->get_remote_read_stats())
+      {
+        finished += stats.won + stats.lost + stats.failed + stats.abandoned;
+      }
+
+      if (finished >= count)
+      {
+        return;
+      }
+
+      usleep(1000);
+    }
+  }
+
+  static ImpuStore::DefaultImpu* default_impu()
+  {
+    return new ImpuStore::DefaultImpu(IMPU,
+                                      ASSOC_IMPUS,
+                                      IMPIS,
+                                      RegistrationState::REGISTERED,
+                                      CHARGING_ADDRESSES,
+                                      SERVICE_PROFILE,
+                                      0L,
+                                      time(0) + 1,
+                                      nullptr);
+  }
 };
 
 TEST_F(MemcachedCacheMockStoreTest, UpdateIrsImpiMappingsDataContention)
@@ -1769,6 +2631,105 @@ TEST_F(MemcachedCacheMockStoreTest, UpdateIrsImpiMappingsDataContentionError)
   delete mirs;
 }
 
+TEST_F(MemcachedCacheMockStoreTest, UpdateIrsImpiMappingsDeleteDataContentionResolved)
+{
+  // Tests that if removing our IMPU from an ImpiMapping hits DATA_CONTENTION,
+  // and the reread mapping no longer has our IMPU, we're done, rather than
+  // retrying and reporting contention
+  ImpuStore::DefaultImpu* impu = default_impu();
+  MemcachedImplicitRegistrationSet* mirs = new MemcachedImplicitRegistrationSet(impu);
+  delete impu;
+
+  mirs->delete_associated_impi(IMPI);
+
+  ImpuStore::ImpiMapping* mapping =
+    new ImpuStore::ImpiMapping(IMPI, {IMPU}, 1L, time(0) + 1);
+  ImpuStore::ImpiMapping* reread_mapping =
+    new ImpuStore::ImpiMapping(IMPI, {IMPU_2}, 2L, time(0) + 1);
+
+  EXPECT_CALL(*_local_mock_store, get_impi_mapping(IMPI, _, _))
+    .WillOnce(DoAll(SetArgReferee<1>(mapping), Return(Store::Status::OK)))
+    .WillOnce(DoAll(SetArgReferee<1>(reread_mapping), Return(Store::Status::OK)));
+
+  // Our IMPU was the only one, so the mapping is deleted, which hits
+  // contention
+  EXPECT_CALL(*_local_mock_store, delete_impi_mapping(_, _))
+    .WillOnce(Return(Store::Status::DATA_CONTENTION));
+
+  Store::Status status = _memcached_cache->update_irs_impi_mappings(mirs, 0L, _local_mock_store, nullptr);
+  EXPECT_EQ(Store::Status::OK, status);
+
+  CasRetryPolicy::Stats stats =
+    _memcached_cache->get_contention_stats(CasRetryPolicy::IMPI_MAPPING);
+  EXPECT_EQ(1u, stats.contentions);
+  EXPECT_EQ(0u, stats.exhausted);
+
+  delete mirs;
+}
+
+TEST_F(MemcachedCacheMockStoreTest, UpdateIrsImpiMappingsDataContentionGivesUp)
+{
+  // Tests that if setting an ImpiMapping keeps hitting DATA_CONTENTION, we
+  // give up once we've retried it the maximum number of times
+  MemcachedImplicitRegistrationSet* mirs = new MemcachedImplicitRegistrationSet();
+
+  mirs->set_ttl(1);
+  mirs->set_ims_sub_xml(SERVICE_PROFILE);
+  mirs->set_reg_state(RegistrationState::REGISTERED);
+  mirs->add_associated_impi(IMPI);
+
+  EXPECT_CALL(*_local_mock_store, set_impi_mapping(_, _))
+    .Times(CasRetryPolicy::DEFAULT_MAX_RETRIES + 1)
+    .WillRepeatedly(Return(Store::Status::DATA_CONTENTION));
+  EXPECT_CALL(*_local_mock_store, get_impi_mapping(_, _, _))
+    .Times(CasRetryPolicy::DEFAULT_MAX_RETRIES + 1)
+    .WillRepeatedly(Return(Store::Status::NOT_FOUND));
+
+  Store::Status status = _memcached_cache->update_irs_impi_mappings(mirs, 0L, _local_mock_store, nullptr);
+  EXPECT_EQ(Store::Status::DATA_CONTENTION, status);
+
+  CasRetryPolicy::Stats stats =
+    _memcached_cache->get_contention_stats(CasRetryPolicy::IMPI_MAPPING);
+  EXPECT_EQ((uint64_t)CasRetryPolicy::DEFAULT_MAX_RETRIES + 1, stats.contentions);
+  EXPECT_EQ(1u, stats.exhausted);
+
+  std::vector<CasRetryPolicy::HotKey> hot_keys = _memcached_cache->get_contended_keys();
+  ASSERT_EQ(1u, hot_keys.size());
+  EXPECT_EQ(IMPI, hot_keys[0].key);
+
+  delete mirs;
+}
+
+TEST_F(MemcachedCacheMockStoreTest, UpdateIrsImpiMappingsCountsRetries)
+{
+  // Tests that a write made again after hitting DATA_CONTENTION is counted
+  // as a retry, rather than as another write
+  MemcachedImplicitRegistrationSet* mirs = new MemcachedImplicitRegistrationSet();
+
+  mirs->set_ttl(1);
+  mirs->set_ims_sub_xml(SERVICE_PROFILE);
+  mirs->set_reg_state(RegistrationState::REGISTERED);
+  mirs->add_associated_impi(IMPI);
+
+  EXPECT_CALL(*_local_mock_store, set_impi_mapping(_, _))
+    .WillOnce(Return(Store::Status::DATA_CONTENTION))
+    .WillOnce(Return(Store::Status::OK));
+  EXPECT_CALL(*_local_mock_store, get_impi_mapping(_, _, _))
+    .WillOnce(Return(Store::Status::NOT_FOUND));
+
+  MemcachedCache::WriteCounts writes = { 0, 0 };
+  Store::Status status = _memcached_cache->update_irs_impi_mappings(mirs,
+                                                                    0L,
+                                                                    _local_mock_store,
+                                                                    nullptr,
+                                                                    &writes);
+  EXPECT_EQ(Store::Status::OK, status);
+  EXPECT_EQ(1u, writes.executed);
+  EXPECT_EQ(1u, writes.retried);
+
+  delete mirs;
+}
+
 TEST_F(MemcachedCacheMockStoreTest, StopWatchGetImpuForImpuGR)
 {
   ImpuStore::Impu* result = nullptr;
@@ -1794,3 +2755,217 @@ TEST_F(MemcachedCacheMockStoreTest, StopWatchGetImpuForImpuGR)
   EXPECT_TRUE(stopwatch.read(time));
   EXPECT_EQ(time, 85000);
 }
+
+TEST_F(MemcachedCacheMockStoreTest, GetImpuForImpuGRFirstResponseWins)
+{
+  ImpuStore::Impu* result = nullptr;
+
+  // Both remote stores are read, but the second doesn't answer until we've
+  // returned the first remote store's answer
+  std::promise<void> start;
+  std::shared_future<void> started = start.get_future().share();
+  std::promise<void> release;
+  std::shared_future<void> released = release.get_future().share();
+
+  EXPECT_CALL(*_local_mock_store, get_impu(_, _, _))
+    .WillOnce(Return(Store::Status::NOT_FOUND));
+  EXPECT_CALL(*_remote_mock_store1, get_impu(_, _, _))
+    .WillOnce(DoAll(InvokeWithoutArgs([started]() { started.wait(); }),
+                    SetArgReferee<1>(default_impu()),
+                    Return(Store::Status::OK)));
+  EXPECT_CALL(*_remote_mock_store2, get_impu(_, _, _))
+    .WillOnce(DoAll(InvokeWithoutArgs([&start]() { start.set_value(); }),
+                    InvokeWithoutArgs([released]() { released.wait(); }),
+                    SetArgReferee<1>(default_impu()),
+                    Return(Store::Status::OK)));
+
+  EXPECT_EQ(Store::Status::OK,
+            _memcached_cache->get_impu_for_impu_gr(IMPU, result, 0L, nullptr));
+  ASSERT_NE(nullptr, result);
+  EXPECT_EQ(IMPU, result->impu);
+  delete result;
+
+  // The late answer is thrown away
+  release.set_value();
+  wait_for_remote_reads(_memcached_cache, 2);
+
+  std::vector<RemoteReadStats::Stats> stats =
+    _memcached_cache->get_remote_read_stats();
+  ASSERT_EQ(2u, stats.size());
+  EXPECT_EQ(1u, stats[0].won);
+  EXPECT_EQ(1u, stats[1].lost);
+}
+
+TEST_F(MemcachedCacheMockStoreTest, GetImpuForImpuGRHedged)
+{
+  MemcachedCache::Options options;
+  options.max_hedge_delay_us = 10000000;
+
+  MemcachedCache cache(_local_mock_store,
+                       {_remote_mock_store1, _remote_mock_store2},
+                       2,
+                       nullptr,
+                       options);
+
+  // The second remote store has been much faster than the first
+  cache._gr_reader.stats().record(0, RemoteReadStats::WON, 2000000);
+  cache._gr_reader.stats().record(1, RemoteReadStats::WON, 1000000);
+
+  ImpuStore::Impu* result = nullptr;
+
+  // The second remote store is read first. It answers well within its
+  // hedging delay, so the first remote store is never read.
+  EXPECT_CALL(*_local_mock_store, get_impu(_, _, _))
+    .WillOnce(Return(Store::Status::NOT_FOUND));
+  EXPECT_CALL(*_remote_mock_store2, get_impu(_, _, _))
+    .WillOnce(DoAll(SetArgReferee<1>(default_impu()), Return(Store::Status::OK)));
+
+  EXPECT_EQ(Store::Status::OK, cache.get_impu_for_impu_gr(IMPU, result, 0L, nullptr));
+  delete result; result = nullptr;
+
+  wait_for_remote_reads(&cache, 4);
+  EXPECT_EQ(1u, cache.get_remote_read_stats()[0].abandoned);
+
+  // If the second remote store doesn't find the IMPU, we go straight on to
+  // the first rather than waiting out the hedging delay
+  EXPECT_CALL(*_local_mock_store, get_impu(_, _, _))
+    .WillOnce(Return(Store::Status::NOT_FOUND));
+  EXPECT_CALL(*_remote_mock_store2, get_impu(_, _, _))
+    .WillOnce(Return(Store::Status::NOT_FOUND));
+  EXPECT_CALL(*_remote_mock_store1, get_impu(_, _, _))
+    .WillOnce(DoAll(SetArgReferee<1>(default_impu()), Return(Store::Status::OK)));
+
+  EXPECT_EQ(Store::Status::OK, cache.get_impu_for_impu_gr(IMPU, result, 0L, nullptr));
+  delete result;
+
+  wait_for_remote_reads(&cache, 6);
+  EXPECT_EQ(2u, cache.get_remote_read_stats()[0].won);
+  EXPECT_EQ(1u, cache.get_remote_read_stats()[1].failed);
+}
+
+TEST_F(MemcachedCacheMockStoreTest, GetImpiMappingGRFirstResponseWins)
+{
+  ImpuStore::ImpiMapping* result = nullptr;
+
+  // Both remote stores are read at once. The first doesn't answer until
+  // we've returned the second remote store's answer
+  std::promise<void> start;
+  std::shared_future<void> started = start.get_future().share();
+  std::promise<void> release;
+  std::shared_future<void> released = release.get_future().share();
+
+  EXPECT_CALL(*_local_mock_store, get_impi_mapping(_, _, _))
+    .WillOnce(Return(Store::Status::NOT_FOUND));
+  EXPECT_CALL(*_remote_mock_store1, get_impi_mapping(_, _, _))
+    .WillOnce(DoAll(InvokeWithoutArgs([&start]() { start.set_value(); }),
+                    InvokeWithoutArgs([released]() { released.wait(); }),
+                    Return(Store::Status::NOT_FOUND)));
+  EXPECT_CALL(*_remote_mock_store2, get_impi_mapping(_, _, _))
+    .WillOnce(DoAll(InvokeWithoutArgs([started]() { started.wait(); }),
+                    SetArgReferee<1>(new ImpuStore::ImpiMapping(IMPI, IMPU, time(0) + 1)),
+                    Return(Store::Status::OK)));
+
+  EXPECT_EQ(Store::Status::OK,
+            _memcached_cache->get_impi_mapping_gr(IMPI, result, 0L, nullptr));
+  ASSERT_NE(nullptr, result);
+  EXPECT_TRUE(result->has_default_impu(IMPU));
+  delete result;
+
+  release.set_value();
+  wait_for_remote_reads(_memcached_cache, 2);
+
+  std::vector<RemoteReadStats::Stats> stats =
+    _memcached_cache->get_remote_read_stats();
+  EXPECT_EQ(1u, stats[0].failed);
+  EXPECT_EQ(1u, stats[1].won);
+}
+
+TEST_F(MemcachedCacheMockStoreTest, GetImpiMappingGRNotFound)
+{
+  ImpuStore::ImpiMapping* result = nullptr;
+
+  EXPECT_CALL(*_local_mock_store, get_impi_mapping(_, _, _))
+    .WillOnce(Return(Store::Status::NOT_FOUND));
+  EXPECT_CALL(*_remote_mock_store1, get_impi_mapping(_, _, _))
+    .WillOnce(Return(Store::Status::ERROR));
+  EXPECT_CALL(*_remote_mock_store2, get_impi_mapping(_, _, _))
+    .WillOnce(Return(Store::Status::NOT_FOUND));
+
+  // The remote errors aren't reported, as the local store didn't have the
+  // mapping
+  EXPECT_EQ(Store::Status::NOT_FOUND,
+            _memcached_cache->get_impi_mapping_gr(IMPI, result, 0L, nullptr));
+  EXPECT_EQ(nullptr, result);
+}
+
+TEST_F(MemcachedCacheMockStoreTest, GetImpuForImpuGRNotFoundCached)
+{
+  MemcachedCache::Options options;
+  options.not_found_cache_size = 100;
+  options.not_found_cache_ttl_ms = 500;
+
+  MemcachedCache cache(_local_mock_store,
+                       {_remote_mock_store1, _remote_mock_store2},
+                       2,
+                       nullptr,
+                       options);
+  ImpuStore::Impu* result = nullptr;
+
+  EXPECT_CALL(*_local_mock_store, get_impu(IMPU, _, _))
+    .Times(3)
+    .WillRepeatedly(Return(Store::Status::NOT_FOUND));
+  EXPECT_CALL(*_remote_mock_store1, get_impu(IMPU, _, _))
+    .Times(2)
+    .WillRepeatedly(Return(Store::Status::NOT_FOUND));
+  EXPECT_CALL(*_remote_mock_store2, get_impu(IMPU, _, _))
+    .Times(2)
+    .WillRepeatedly(Return(Store::Status::NOT_FOUND));
+
+  // No site has the IMPU, so the second read doesn't go to the remote sites
+  EXPECT_EQ(Store::Status::NOT_FOUND,
+            cache.get_impu_for_impu_gr(IMPU, result, 0L, nullptr));
+  EXPECT_EQ(Store::Status::NOT_FOUND,
+            cache.get_impu_for_impu_gr(IMPU, result, 0L, nullptr));
+  EXPECT_EQ(nullptr, result);
+
+  NotFoundCache::Stats stats = cache.get_not_found_cache_stats();
+  EXPECT_EQ(1u, stats.hits);
+  EXPECT_EQ(1u, stats.entries);
+
+  // Once it's expired, the remote sites are read again
+  cwtest_advance_time_ms(500);
+  EXPECT_EQ(Store::Status::NOT_FOUND,
+            cache.get_impu_for_impu_gr(IMPU, result, 0L, nullptr));
+  EXPECT_EQ(1u, cache.get_not_found_cache_stats().expiries);
+}
+
+TEST_F(MemcachedCacheMockStoreTest, GetImpuForImpuGRRemoteErrorNotCached)
+{
+  MemcachedCache::Options options;
+  options.not_found_cache_size = 100;
+  options.not_found_cache_ttl_ms = 500;
+
+  MemcachedCache cache(_local_mock_store,
+                       {_remote_mock_store1, _remote_mock_store2},
+                       2,
+                       nullptr,
+                       options);
+  ImpuStore::Impu* result = nullptr;
+
+  EXPECT_CALL(*_local_mock_store, get_impu(IMPU, _, _))
+    .Times(2)
+    .WillRepeatedly(Return(Store::Status::NOT_FOUND));
+  EXPECT_CALL(*_remote_mock_store1, get_impu(IMPU, _, _))
+    .Times(2)
+    .WillRepeatedly(Return(Store::Status::ERROR));
+  EXPECT_CALL(*_remote_mock_store2, get_impu(IMPU, _, _))
+    .Times(2)
+    .WillRepeatedly(Return(Store::Status::NOT_FOUND));
+
+  // We can't tell whether the failed site has the IMPU, so keep asking
+  EXPECT_EQ(Store::Status::NOT_FOUND,
+            cache.get_impu_for_impu_gr(IMPU, result, 0L, nullptr));
+  EXPECT_EQ(Store::Status::NOT_FOUND,
+            cache.get_impu_for_impu_gr(IMPU, result, 0L, nullptr));
+  EXPECT_EQ(0u, cache.get_not_found_cache_stats().entries);
+}
@@ -27,6 +27,7 @@ public:
   MOCK_METHOD3(get_impu, Store::Status(const std::string& impu, Impu*& out_impu, SAS::TrailId trail));
   MOCK_METHOD2(delete_impu, Store::Status(Impu* impu, SAS::TrailId trail));
   MOCK_METHOD2(set_impi_mapping, Store::Status(ImpiMapping* mapping, SAS::TrailId trail));
+  MOCK_METHOD2(add_impi_mapping, Store::Status(ImpiMapping* mapping, SAS::TrailId trail));
   MOCK_METHOD3(get_impi_mapping, Store::Status(const std::string impi, ImpiMapping*& out_mapping, SAS::TrailId trail));
   MOCK_METHOD2(delete_impi_mapping, Store::Status(ImpiMapping* mapping, SAS::TrailId trail));
 };
@@ -0,0 +1,108 @@
+/**
+ * @file not_found_cache_test.cpp UT for the in-memory cache of IMPUs that no
+ * site has
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "not_found_cache.h"
+#include "test_interposer.hpp"
+#include "test_utils.hpp"
+#include "fakelogger.h"
+#include "gtest/gtest.h"
+
+static const std::string IMPU = "sip:impu@example.com";
+static const std::string IMPU_2 = "sip:impu2@example.com";
+static const std::string IMPU_3 = "sip:impu3@example.com";
+
+// A table that counts what it's told, so tests can check it
+class CountingCounterTable : public SNMP::CounterTable
+{
+public:
+  void increment() { count++; }
+  uint64_t count = 0;
+};
+
+class NotFoundCacheTest : public ControlTimeTest
+{
+};
+
+TEST_F(NotFoundCacheTest, AddAndExpire)
+{
+  NotFoundCache cache(100, 500);
+
+  EXPECT_FALSE(cache.contains(IMPU));
+  cache.add(IMPU);
+
+  cwtest_advance_time_ms(499);
+  EXPECT_TRUE(cache.contains(IMPU));
+  EXPECT_FALSE(cache.contains(IMPU_2));
+
+  cwtest_advance_time_ms(1);
+  EXPECT_FALSE(cache.contains(IMPU));
+
+  NotFoundCache::Stats stats = cache.get_stats();
+  EXPECT_EQ(1u, stats.hits);
+  EXPECT_EQ(3u, stats.misses);
+  EXPECT_EQ(1u, stats.expiries);
+  EXPECT_EQ(0u, stats.entries);
+}
+
+TEST_F(NotFoundCacheTest, OldestEvicted)
+{
+  // A single shard, with room for two entries
+  NotFoundCache cache(2, 500, 1);
+
+  cache.add(IMPU);
+  cache.add(IMPU_2);
+
+  // Looking an entry up doesn't stop it being the oldest
+  EXPECT_TRUE(cache.contains(IMPU));
+  cache.add(IMPU_3);
+
+  EXPECT_FALSE(cache.contains(IMPU));
+  EXPECT_TRUE(cache.contains(IMPU_2));
+  EXPECT_TRUE(cache.contains(IMPU_3));
+
+  NotFoundCache::Stats stats = cache.get_stats();
+  EXPECT_EQ(1u, stats.evictions);
+  EXPECT_EQ(2u, stats.entries);
+}
+
+TEST_F(NotFoundCacheTest, Invalidate)
+{
+  NotFoundCache cache(100, 500);
+
+  cache.add(IMPU);
+  cache.add(IMPU_2);
+  cache.invalidate({ IMPU, IMPU_3 });
+
+  EXPECT_FALSE(cache.contains(IMPU));
+  EXPECT_TRUE(cache.contains(IMPU_2));
+  EXPECT_EQ(1u, cache.get_stats().invalidations);
+}
+
+TEST_F(NotFoundCacheTest, ReportsToStatsTables)
+{
+  CountingCounterTable hits;
+  CountingCounterTable misses;
+  CountingCounterTable evictions;
+
+  // A single shard, with room for one entry
+  NotFoundCache cache(1, 500, 1);
+  cache.configure_stats_tables(&hits, &misses, &evictions);
+
+  EXPECT_FALSE(cache.contains(IMPU));
+  cache.add(IMPU);
+  cache.add(IMPU_2);
+  EXPECT_TRUE(cache.contains(IMPU_2));
+
+  EXPECT_EQ(1u, hits.count);
+  EXPECT_EQ(1u, misses.count);
+  EXPECT_EQ(1u, evictions.count);
+}
@@ -0,0 +1,287 @@
+/**
+ * @file reconciler_test.cpp UT for the background repair of remote IMPU stores
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "reconciler.h"
+#include "localstore.h"
+#include "test_interposer.hpp"
+#include "test_utils.hpp"
+#include "fakelogger.h"
+#include "gtest/gtest.h"
+
+static const std::string IMPU = "sip:impu@example.com";
+static const std::string IMPU_2 = "sip:impu2@example.com";
+static const std::string IMPI = "impi@example.com";
+static const std::vector<std::string> NO_ASSOC_IMPUS = {};
+static const std::vector<std::string> IMPIS = { IMPI };
+static const ChargingAddresses NO_CHARGING_ADDRESSES = ChargingAddresses({}, {});
+static const std::string SERVICE_PROFILE = "<ServiceProfile></ServiceProfile>";
+static const std::string SERVICE_PROFILE_2 =
+  "<ServiceProfile><InitialFilterCriteria></InitialFilterCriteria></ServiceProfile>";
+
+// A table that counts what it's told, so tests can check it
+class CountingCounterTable : public SNMP::CounterTable
+{
+public:
+  void increment() { count++; }
+  uint64_t count = 0;
+};
+
+class ReconcilerTest : public ControlTimeTest
+{
+public:
+  virtual void SetUp() override
+  {
+    _lls = new LocalStore();
+    _local_store = new ImpuStore(_lls);
+    _rls = new LocalStore();
+    _remote_store = new ImpuStore(_rls);
+    _rls_2 = new LocalStore();
+    _remote_store_2 = new ImpuStore(_rls_2);
+
+    // Keys are checked 1s after being written
+    _reconciler = new Reconciler(_local_store,
+                                 { _remote_store, _remote_store_2 },
+                                 100,
+                                 1000,
+                                 100);
+  }
+
+  virtual void TearDown() override
+  {
+    delete _reconciler;
+    delete _remote_store_2;
+    delete _rls_2;
+    delete _remote_store;
+    delete _rls;
+    delete _local_store;
+    delete _lls;
+  }
+
+  static void set_impu(ImpuStore* store,
+                       const std::string& impu,
+                       int ttl,
+                       const std::string& service_profile = SERVICE_PROFILE)
+  {
+    ImpuStore::DefaultImpu* default_impu =
+      new ImpuStore::DefaultImpu(impu,
+                                 NO_ASSOC_IMPUS,
+                                 IMPIS,
+                                 RegistrationState::REGISTERED,
+                                 NO_CHARGING_ADDRESSES,
+                                 service_profile,
+                                 0L,
+                                 time(0) + ttl,
+                                 store);
+    store->set_impu_without_cas(default_impu, 0L);
+    delete default_impu;
+  }
+
+  static int64_t expiry(ImpuStore* store, const std::string& impu)
+  {
+    ImpuStore::Impu* stored = nullptr;
+    int64_t expiry = 0;
+
+    if (store->get_impu(impu, stored, 0L) == Store::Status::OK)
+    {
+      expiry = stored->expiry;
+      delete stored;
+    }
+
+    return expiry;
+  }
+
+private:
+  LocalStore* _lls;
+  ImpuStore* _local_store;
+  LocalStore* _rls;
+  ImpuStore* _remote_store;
+  LocalStore* _rls_2;
+  ImpuStore* _remote_store_2;
+  Reconciler* _reconciler;
+};
+
+TEST_F(ReconcilerTest, RepairsMissingAndStale)
+{
+  // The first remote site missed the write, and the second has an older copy
+  set_impu(_local_store, IMPU, 3600);
+  set_impu(_remote_store_2, IMPU, 60);
+  _reconciler->key_written(Reconciler::IMPU, IMPU);
+
+  // Nothing is checked until the write has settled
+  EXPECT_FALSE(_reconciler->reconcile_next());
+  cwtest_advance_time_ms(1000);
+  EXPECT_TRUE(_reconciler->reconcile_next());
+  EXPECT_FALSE(_reconciler->reconcile_next());
+
+  EXPECT_EQ(expiry(_local_store, IMPU), expiry(_remote_store, IMPU));
+  EXPECT_EQ(expiry(_local_store, IMPU), expiry(_remote_store_2, IMPU));
+
+  Reconciler::Stats stats = _reconciler->get_stats(0);
+  EXPECT_EQ(1u, stats.checked);
+  EXPECT_EQ(1u, stats.missing);
+  EXPECT_EQ(1u, stats.repaired);
+
+  stats = _reconciler->get_stats(1);
+  EXPECT_EQ(1u, stats.stale);
+  EXPECT_EQ(1u, stats.repaired);
+
+  // Checking it again finds it in sync
+  _reconciler->key_written(Reconciler::IMPU, IMPU);
+  cwtest_advance_time_ms(1000);
+  EXPECT_TRUE(_reconciler->reconcile_next());
+  EXPECT_EQ(1u, _reconciler->get_stats(0).in_sync);
+  EXPECT_EQ(1u, _reconciler->get_stats(1).in_sync);
+}
+
+TEST_F(ReconcilerTest, RepairsChangedWithSameExpiry)
+{
+  // A write that didn't change the expiry (e.g. a PPR) reached the second
+  // remote site, but not the first
+  set_impu(_local_store, IMPU, 3600, SERVICE_PROFILE_2);
+  set_impu(_remote_store, IMPU, 3600, SERVICE_PROFILE);
+  set_impu(_remote_store_2, IMPU, 3600, SERVICE_PROFILE_2);
+  _reconciler->key_written(Reconciler::IMPU, IMPU);
+
+  ImpuStore::ImpiMapping mapping(IMPI, { IMPU, IMPU_2 }, 0L, time(0) + 3600);
+  _local_store->set_impi_mapping(&mapping, 0L);
+  _remote_store_2->set_impi_mapping(&mapping, 0L);
+  ImpuStore::ImpiMapping old_mapping(IMPI, { IMPU }, 0L, time(0) + 3600);
+  _remote_store->set_impi_mapping(&old_mapping, 0L);
+  _reconciler->key_written(Reconciler::IMPI_MAPPING, IMPI);
+
+  cwtest_advance_time_ms(1000);
+  EXPECT_TRUE(_reconciler->reconcile_next());
+  EXPECT_TRUE(_reconciler->reconcile_next());
+
+  ImpuStore::Impu* repaired = nullptr;
+  ASSERT_EQ(Store::Status::OK, _remote_store->get_impu(IMPU, repaired, 0L));
+  EXPECT_EQ(SERVICE_PROFILE_2,
+            ((ImpuStore::DefaultImpu*)repaired)->service_profile.get());
+  delete repaired;
+
+  ImpuStore::ImpiMapping* repaired_mapping = nullptr;
+  ASSERT_EQ(Store::Status::OK,
+            _remote_store->get_impi_mapping(IMPI, repaired_mapping, 0L));
+  EXPECT_TRUE(repaired_mapping->has_default_impu(IMPU_2));
+  delete repaired_mapping;
+
+  Reconciler::Stats stats = _reconciler->get_stats(0);
+  EXPECT_EQ(2u, stats.stale);
+  EXPECT_EQ(2u, stats.repaired);
+  EXPECT_EQ(2u, _reconciler->get_stats(1).in_sync);
+}
+
+TEST_F(ReconcilerTest, DeletesExtra)
+{
+  // The key was deleted locally, but a remote site still has it
+  set_impu(_remote_store, IMPU, 3600);
+  _reconciler->key_deleted(Reconciler::IMPU, IMPU, time(0) + 3600);
+
+  cwtest_advance_time_ms(1000);
+  EXPECT_TRUE(_reconciler->reconcile_next());
+
+  EXPECT_EQ(0, expiry(_remote_store, IMPU));
+  EXPECT_EQ(1u, _reconciler->get_stats(0).extra);
+  EXPECT_EQ(1u, _reconciler->get_stats(0).repaired);
+  EXPECT_EQ(1u, _reconciler->get_stats(1).in_sync);
+}
+
+TEST_F(ReconcilerTest, LeavesKeysRewrittenSinceDelete)
+{
+  // The key was deleted locally, but has been written at a remote site since,
+  // so its copy there expires later than any copy from before the delete
+  _reconciler->key_deleted(Reconciler::IMPU, IMPU, time(0) + 60);
+  set_impu(_remote_store, IMPU, 3600);
+
+  ImpuStore::ImpiMapping mapping(IMPI, { IMPU }, 0L, time(0) + 3600);
+  _remote_store->set_impi_mapping(&mapping, 0L);
+  _reconciler->key_deleted(Reconciler::IMPI_MAPPING, IMPI, time(0) + 60);
+
+  cwtest_advance_time_ms(1000);
+  EXPECT_TRUE(_reconciler->reconcile_next());
+  EXPECT_TRUE(_reconciler->reconcile_next());
+
+  EXPECT_NE(0, expiry(_remote_store, IMPU));
+
+  ImpuStore::ImpiMapping* kept = nullptr;
+  EXPECT_EQ(Store::Status::OK, _remote_store->get_impi_mapping(IMPI, kept, 0L));
+  delete kept;
+
+  Reconciler::Stats stats = _reconciler->get_stats(0);
+  EXPECT_EQ(2u, stats.rewritten);
+  EXPECT_EQ(0u, stats.extra);
+  EXPECT_EQ(0u, stats.repaired);
+
+  // And they aren't retried
+  EXPECT_EQ(0u, _reconciler->get_log_stats().pending);
+}
+
+TEST_F(ReconcilerTest, RepairsImpiMappings)
+{
+  ImpuStore::ImpiMapping mapping(IMPI, { IMPU, IMPU_2 }, 0L, time(0) + 3600);
+  _local_store->set_impi_mapping(&mapping, 0L);
+  _reconciler->key_written(Reconciler::IMPI_MAPPING, IMPI);
+
+  cwtest_advance_time_ms(1000);
+  EXPECT_TRUE(_reconciler->reconcile_next());
+
+  ImpuStore::ImpiMapping* repaired = nullptr;
+  ASSERT_EQ(Store::Status::OK, _remote_store->get_impi_mapping(IMPI, repaired, 0L));
+  EXPECT_TRUE(repaired->has_default_impu(IMPU_2));
+  delete repaired;
+
+  EXPECT_EQ(1u, _reconciler->get_stats(0).missing);
+}
+
+TEST_F(ReconcilerTest, LogIsCompact)
+{
+  Reconciler reconciler(_local_store, { _remote_store }, 2, 1000, 100);
+
+  // Writing a key again doesn't add another entry for it
+  reconciler.key_written(Reconciler::IMPU, IMPU);
+  reconciler.key_written(Reconciler::IMPU, IMPU);
+  reconciler.key_written(Reconciler::IMPI_MAPPING, IMPI);
+  EXPECT_EQ(2u, reconciler.get_log_stats().pending);
+  EXPECT_EQ(0u, reconciler.get_log_stats().dropped);
+
+  // But once it's full, the oldest key is dropped
+  reconciler.key_written(Reconciler::IMPU, IMPU_2);
+  EXPECT_EQ(2u, reconciler.get_log_stats().pending);
+  EXPECT_EQ(1u, reconciler.get_log_stats().dropped);
+}
+
+TEST_F(ReconcilerTest, ReportsToStatsTables)
+{
+  CountingCounterTable diverged;
+  CountingCounterTable repaired;
+  CountingCounterTable repair_failed;
+  CountingCounterTable errors;
+  CountingCounterTable dropped;
+  _reconciler->configure_stats_tables(&diverged,
+                                      &repaired,
+                                      &repair_failed,
+                                      &errors,
+                                      &dropped);
+
+  // The key is missing from one site and in sync at the other
+  set_impu(_local_store, IMPU, 3600);
+  set_impu(_remote_store_2, IMPU, 3600);
+  _reconciler->key_written(Reconciler::IMPU, IMPU);
+
+  cwtest_advance_time_ms(1000);
+  EXPECT_TRUE(_reconciler->reconcile_next());
+
+  EXPECT_EQ(1u, diverged.count);
+  EXPECT_EQ(1u, repaired.count);
+  EXPECT_EQ(0u, repair_failed.count);
+  EXPECT_EQ(0u, errors.count);
+  EXPECT_EQ(0u, dropped.count);
+}
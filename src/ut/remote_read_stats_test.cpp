@@ -0,0 +1,155 @@
+/**
+ * @file remote_read_stats_test.cpp UT for remote read statistics
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "remote_read_stats.h"
+#include "gtest/gtest.h"
+
+// A table that counts what it's told, so tests can check it
+class CountingCounterTable : public SNMP::CounterTable
+{
+public:
+  void increment() { count++; }
+  uint64_t count = 0;
+};
+
+// A table that records the samples it's given, so tests can check them
+class RecordingAccumulatorTable : public SNMP::EventAccumulatorTable
+{
+public:
+  void accumulate(uint32_t sample) { samples.push_back(sample); }
+  std::vector<uint32_t> samples;
+};
+
+class RemoteReadStatsTest : public testing::Test
+{
+};
+
+TEST_F(RemoteReadStatsTest, NoSamples)
+{
+  RemoteReadStats stats(3, 50000);
+
+  // With nothing to go on, sites are tried in order, without waiting
+  EXPECT_EQ(std::vector<size_t>({ 0, 1, 2 }), stats.order());
+  EXPECT_EQ(0u, stats.hedge_delay_us(0));
+
+  RemoteReadStats::Stats site = stats.get_stats(0);
+  EXPECT_EQ(0u, site.won);
+  EXPECT_EQ(0u, site.p99_us);
+}
+
+TEST_F(RemoteReadStatsTest, FastestFirst)
+{
+  RemoteReadStats stats(3, 50000);
+
+  stats.record(0, RemoteReadStats::WON, 3000);
+  stats.record(1, RemoteReadStats::FAILED, 1000);
+  stats.record(2, RemoteReadStats::LOST, 2000);
+
+  EXPECT_EQ(std::vector<size_t>({ 1, 2, 0 }), stats.order());
+}
+
+TEST_F(RemoteReadStatsTest, UnknownSitesFirst)
+{
+  RemoteReadStats stats(2, 50000);
+
+  stats.record(0, RemoteReadStats::WON, 1000);
+
+  EXPECT_EQ(std::vector<size_t>({ 1, 0 }), stats.order());
+}
+
+TEST_F(RemoteReadStatsTest, HedgeDelay)
+{
+  RemoteReadStats stats(1, 50000);
+
+  // A steady latency converges on a delay just above it
+  for (int ii = 0; ii < 100; ii++)
+  {
+    stats.record(0, RemoteReadStats::WON, 1000);
+  }
+
+  EXPECT_GE(stats.hedge_delay_us(0), 1000u);
+  EXPECT_LT(stats.hedge_delay_us(0), 1100u);
+
+  // A jittery one pushes the delay up, but no further than the cap
+  for (int ii = 0; ii < 100; ii++)
+  {
+    stats.record(0, RemoteReadStats::WON, (ii % 2) ? 1000 : 100000);
+  }
+
+  EXPECT_EQ(50000u, stats.hedge_delay_us(0));
+}
+
+TEST_F(RemoteReadStatsTest, Outcomes)
+{
+  RemoteReadStats stats(1, 50000);
+
+  stats.record(0, RemoteReadStats::WON, 1000);
+  stats.record(0, RemoteReadStats::LOST, 2000);
+  stats.record(0, RemoteReadStats::FAILED, 3000);
+  stats.record(0, RemoteReadStats::ABANDONED, 4000);
+
+  RemoteReadStats::Stats site = stats.get_stats(0);
+  EXPECT_EQ(1u, site.won);
+  EXPECT_EQ(1u, site.lost);
+  EXPECT_EQ(1u, site.failed);
+  EXPECT_EQ(1u, site.abandoned);
+
+  // Abandoned reads don't count towards the latency
+  EXPECT_EQ(2000u, site.p50_us);
+  EXPECT_EQ(3000u, site.max_us);
+}
+
+TEST_F(RemoteReadStatsTest, Percentiles)
+{
+  RemoteReadStats stats(1, 50000);
+
+  // Only the most recent latencies count
+  for (size_t ii = 0; ii < RemoteReadStats::LATENCY_SAMPLES; ii++)
+  {
+    stats.record(0, RemoteReadStats::WON, 1000000);
+  }
+
+  for (size_t ii = 1; ii <= RemoteReadStats::LATENCY_SAMPLES; ii++)
+  {
+    stats.record(0, RemoteReadStats::WON, ii);
+  }
+
+  RemoteReadStats::Stats site = stats.get_stats(0);
+  EXPECT_EQ(RemoteReadStats::LATENCY_SAMPLES / 2, site.p50_us);
+  EXPECT_EQ(RemoteReadStats::LATENCY_SAMPLES * 99 / 100, site.p99_us);
+  EXPECT_EQ(RemoteReadStats::LATENCY_SAMPLES, site.max_us);
+}
+
+TEST_F(RemoteReadStatsTest, ReportsToStatsTables)
+{
+  CountingCounterTable won;
+  CountingCounterTable lost;
+  CountingCounterTable failed;
+  CountingCounterTable abandoned;
+  RecordingAccumulatorTable latency;
+
+  RemoteReadStats stats(2, 50000);
+  stats.configure_stats_tables(&won, &lost, &failed, &abandoned, &latency);
+
+  // Every site reports to the same tables
+  stats.record(0, RemoteReadStats::WON, 1000);
+  stats.record(1, RemoteReadStats::LOST, 2000);
+  stats.record(0, RemoteReadStats::FAILED, 3000);
+  stats.record(1, RemoteReadStats::ABANDONED, 0);
+
+  EXPECT_EQ(1u, won.count);
+  EXPECT_EQ(1u, lost.count);
+  EXPECT_EQ(1u, failed.count);
+  EXPECT_EQ(1u, abandoned.count);
+
+  // Abandoned reads have no latency
+  EXPECT_EQ(std::vector<uint32_t>({ 1000, 2000, 3000 }), latency.samples);
+}
@@ -0,0 +1,274 @@
+/**
+ * @file replication_queue_test.cpp UT for the GR replication queue
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+#include <map>
+
+#include "replication_queue.h"
+#include "gtest/gtest.h"
+
+// Records the writes applied to each site, and lets the test hold writers up
+// until it's ready for them to continue.
+class WriteLog
+{
+public:
+  WriteLog() : _blocked(false) {}
+
+  void block()
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    _blocked = true;
+  }
+
+  void unblock()
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    _blocked = false;
+    _cond.notify_all();
+  }
+
+  void apply(ImpuStore* store, const std::string& value)
+  {
+    std::unique_lock<std::mutex> lock(_lock);
+    _started++;
+    _cond.notify_all();
+    _cond.wait(lock, [this]() { return !_blocked; });
+    _applied[store].push_back(value);
+  }
+
+  // Wait for the given number of writes to have started
+  void wait_for_started(int count)
+  {
+    std::unique_lock<std::mutex> lock(_lock);
+    _cond.wait(lock, [this, count]() { return _started >= count; });
+  }
+
+  std::vector<std::string> applied(ImpuStore* store)
+  {
+    std::lock_guard<std::mutex> lock(_lock);
+    return _applied[store];
+  }
+
+private:
+  std::mutex _lock;
+  std::condition_variable _cond;
+  bool _blocked;
+  int _started = 0;
+  std::map<ImpuStore*, std::vector<std::string>> _applied;
+};
+
+class FakeWrite : public ReplicationQueue::Write
+{
+public:
+  FakeWrite(WriteLog* log,
+            const std::string& value,
+            Store::Status status = Store::Status::OK) :
+    _log(log), _value(value), _status(status)
+  {
+  }
+
+  Store::Status apply(ImpuStore* store) override
+  {
+    _log->apply(store, _value);
+    return _status;
+  }
+
+  ReplicationQueue::Write* clone() const override
+  {
+    return new FakeWrite(*this);
+  }
+
+  // Keep track of the writes this one replaced
+  void absorb(const ReplicationQueue::Write& older) override
+  {
+    _value = ((const FakeWrite&)older)._value + "+" + _value;
+  }
+
+private:
+  WriteLog* _log;
+  std::string _value;
+  Store::Status _status;
+};
+
+// Tables that remember what they're told, so tests can check it
+class CountingCounterTable : public SNMP::CounterTable
+{
+public:
+  void increment() { count++; }
+  uint64_t count = 0;
+};
+
+class RecordingAccumulatorTable : public SNMP::EventAccumulatorTable
+{
+public:
+  void accumulate(uint32_t sample) { samples.push_back(sample); }
+  std::vector<uint32_t> samples;
+};
+
+class ReplicationQueueTest : public testing::Test
+{
+public:
+  ReplicationQueueTest()
+  {
+    // The stores are never dereferenced, so any distinct pointers will do
+    _stores.push_back((ImpuStore*)&_site_a);
+    _stores.push_back((ImpuStore*)&_site_b);
+  }
+
+  WriteLog _log;
+  std::vector<ImpuStore*> _stores;
+  int _site_a;
+  int _site_b;
+};
+
+TEST_F(ReplicationQueueTest, WritesReachEverySite)
+{
+  ReplicationQueue queue(_stores, 10, 2);
+  queue.start();
+
+  queue.replicate("key1", new FakeWrite(&_log, "1"));
+  queue.replicate("key2", new FakeWrite(&_log, "2", Store::Status::ERROR));
+  queue.wait_until_idle();
+
+  for (size_t ii = 0; ii < _stores.size(); ii++)
+  {
+    std::vector<std::string> applied = _log.applied(_stores[ii]);
+    std::sort(applied.begin(), applied.end());
+    EXPECT_EQ(std::vector<std::string>({ "1", "2" }), applied);
+
+    ReplicationQueue::Stats stats = queue.get_stats(ii);
+    EXPECT_EQ(0u, stats.queued);
+    EXPECT_EQ(0u, stats.in_flight);
+    EXPECT_EQ(1u, stats.completed);
+    EXPECT_EQ(1u, stats.failed);
+    EXPECT_EQ(0u, stats.dropped);
+    EXPECT_LE(stats.lag_us, stats.max_lag_us);
+  }
+}
+
+TEST_F(ReplicationQueueTest, WritesToSameKeyCoalesced)
+{
+  ReplicationQueue queue(_stores, 10, 1);
+  queue.start();
+
+  // Hold up the first write to each site, so that the later writes queue up
+  // behind it.
+  _log.block();
+  queue.replicate("key", new FakeWrite(&_log, "1"));
+  _log.wait_for_started(2);
+
+  queue.replicate("key", new FakeWrite(&_log, "2"));
+  queue.replicate("other", new FakeWrite(&_log, "3"));
+  queue.replicate("key", new FakeWrite(&_log, "4"));
+
+  _log.unblock();
+  queue.wait_until_idle();
+
+  // The second and fourth writes were merged, but kept their place ahead of
+  // the write to the other key.
+  EXPECT_EQ(std::vector<std::string>({ "1", "2+4", "3" }),
+            _log.applied(_stores[0]));
+  EXPECT_EQ(_log.applied(_stores[0]), _log.applied(_stores[1]));
+
+  ReplicationQueue::Stats stats = queue.get_stats(0);
+  EXPECT_EQ(3u, stats.completed);
+  EXPECT_EQ(1u, stats.coalesced);
+}
+
+TEST_F(ReplicationQueueTest, WritesToSameKeyNotConcurrent)
+{
+  ReplicationQueue queue({ _stores[0] }, 10, 2);
+  queue.start();
+
+  // With the first write to the key held up, the second writer must skip the
+  // next write to the same key and apply the one to the other key.
+  _log.block();
+  queue.replicate("key", new FakeWrite(&_log, "1"));
+  _log.wait_for_started(1);
+  queue.replicate("key", new FakeWrite(&_log, "2"));
+  queue.replicate("other", new FakeWrite(&_log, "3"));
+  _log.wait_for_started(2);
+
+  ReplicationQueue::Stats stats = queue.get_stats(0);
+  EXPECT_EQ(1u, stats.queued);
+  EXPECT_EQ(2u, stats.in_flight);
+
+  _log.unblock();
+  queue.wait_until_idle();
+
+  std::vector<std::string> applied = _log.applied(_stores[0]);
+  ASSERT_EQ(3u, applied.size());
+  EXPECT_LT(std::find(applied.begin(), applied.end(), "1"),
+            std::find(applied.begin(), applied.end(), "2"));
+}
+
+TEST_F(ReplicationQueueTest, QueueFull)
+{
+  ReplicationQueue queue({ _stores[0] }, 1, 1);
+  queue.start();
+
+  _log.block();
+  queue.replicate("key1", new FakeWrite(&_log, "1"));
+  _log.wait_for_started(1);
+
+  // The first write is in flight, so only one more fits in the queue
+  queue.replicate("key2", new FakeWrite(&_log, "2"));
+  queue.replicate("key3", new FakeWrite(&_log, "3"));
+
+  _log.unblock();
+  queue.wait_until_idle();
+
+  EXPECT_EQ(std::vector<std::string>({ "1", "2" }), _log.applied(_stores[0]));
+  EXPECT_EQ(1u, queue.get_stats(0).dropped);
+}
+
+TEST_F(ReplicationQueueTest, QueuedWritesDroppedOnStop)
+{
+  ReplicationQueue queue({ _stores[0] }, 10, 1);
+
+  // Nothing is applied before the queue is started
+  queue.replicate("key1", new FakeWrite(&_log, "1"));
+  queue.replicate("key2", new FakeWrite(&_log, "2"));
+  EXPECT_EQ(2u, queue.get_stats(0).queued);
+
+  queue.stop();
+  queue.replicate("key3", new FakeWrite(&_log, "3"));
+
+  EXPECT_TRUE(_log.applied(_stores[0]).empty());
+  EXPECT_EQ(0u, queue.get_stats(0).queued);
+  EXPECT_EQ(3u, queue.get_stats(0).dropped);
+}
+
+TEST_F(ReplicationQueueTest, ReportsToStatsTables)
+{
+  RecordingAccumulatorTable lag;
+  CountingCounterTable dropped;
+  CountingCounterTable failed;
+
+  ReplicationQueue queue({ _stores[0] }, 1, 1);
+  queue.configure_stats_tables(&lag, &dropped, &failed);
+  queue.start();
+
+  _log.block();
+  queue.replicate("key1", new FakeWrite(&_log, "1", Store::Status::ERROR));
+  _log.wait_for_started(1);
+
+  // The first write is in flight, so the third doesn't fit in the queue
+  queue.replicate("key2", new FakeWrite(&_log, "2"));
+  queue.replicate("key3", new FakeWrite(&_log, "3"));
+
+  _log.unblock();
+  queue.wait_until_idle();
+
+  EXPECT_EQ(2u, lag.samples.size());
+  EXPECT_EQ(1u, dropped.count);
+  EXPECT_EQ(1u, failed.count);
+}